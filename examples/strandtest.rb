@@ -31,7 +31,7 @@ module StrandTest
     wait_ms = opts.fetch(:wait_ms, self.wait_ms)
 
     self.length.times do |num|
-      self[num] = color
+      self.effect(:color_wipe, :color => color, :count => num+1)
       self.show
       sleep(wait_ms / 1000.0)
     end
@@ -55,8 +55,7 @@ module StrandTest
 
     iterations.times do
       spacing.times do |sp|
-        self.clear
-        (sp...self.length).step(spacing) { |ii| self[ii] = color }
+        self.effect(:theater_chase, :color => color, :step => sp, :spacing => spacing)
         self.show
         sleep(wait_ms / 1000.0)
       end
@@ -71,16 +70,7 @@ module StrandTest
   #
   # Returns a 24-bit RGB color value.
   def wheel( pos )
-    pos = pos & 0xff
-    if pos < 85
-      return PixelPi::Color(pos * 3, 255 - pos * 3, 0)
-    elsif pos < 170
-      pos -= 85
-      return PixelPi::Color(255 - pos * 3, 0, pos * 3)
-    else
-      pos -= 170
-      return PixelPi::Color(0, pos * 3, 255 - pos * 3)
-    end
+    PixelPi::Wheel(pos)
   end
 
   # Draw rainbow that fades across all pixels at once.
@@ -95,7 +85,7 @@ module StrandTest
     iterations = opts.fetch(:iterations, 1)
 
     (0...256*iterations).each do |jj|
-      self.fill { |ii| wheel(ii+jj) }
+      self.effect(:rainbow, :offset => jj)
       self.show
       sleep(wait_ms / 1000.0)
     end
@@ -115,7 +105,7 @@ module StrandTest
     iterations = opts.fetch(:iterations, 5)
 
     (0...256*iterations).each do |jj|
-      self.fill { |ii| wheel((ii * 256 / self.length) + jj) }
+      self.effect(:rainbow_cycle, :offset => jj)
       self.show
       sleep(wait_ms / 1000.0)
     end
@@ -136,8 +126,7 @@ module StrandTest
 
     256.times do |jj|
       spacing.times do |sp|
-        self.clear
-        (sp...self.length).step(spacing) { |ii| self[ii] = wheel((ii+jj) % 255) }
+        self.effect(:theater_chase_rainbow, :offset => jj, :step => sp, :spacing => spacing)
         self.show
         sleep(wait_ms / 1000.0)
       end
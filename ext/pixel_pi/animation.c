@@ -0,0 +1,966 @@
+#include "pixel_pi.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A PixelPi::Animation is a pre-rendered show stored in a file that is
+ * memory-mapped for playback. Frames are decoded straight from the mapping
+ * into the LED buffer, so a show of any length plays with constant memory use
+ * and without creating any Ruby objects per frame.
+ *
+ * All values are little-endian. The file begins with a 64 byte header:
+ *
+ *    offset  size  field
+ *         0     8  magic "PXPIANIM"
+ *         8     2  version (1)
+ *        10     2  pixel format; 0 = rgb (3 bytes per LED), 1 = rgbw (one
+ *                  0xWWRRGGBB word per LED)
+ *        12     4  number of LEDs in each frame
+ *        16     4  number of frames
+ *        20     4  frames per second in thousandths
+ *        24     8  offset of the frame index
+ *        32     2  codec; 0 = none, 1 = delta (see codec.c)
+ *        34     2  reserved, zero
+ *        36     4  keyframe interval of the delta codec
+ *        40    24  reserved, zero
+ *
+ * The frame index holds one 16 byte entry per frame - the 8 byte offset of
+ * the frame data, its 4 byte length, and the 4 byte time the frame is shown
+ * in milliseconds after the first frame. The frames follow the header and the
+ * index comes last, so a file can be written in a single pass without knowing
+ * the number of frames up front.
+ *
+ * With the delta codec every frame whose number is a multiple of the keyframe
+ * interval is a keyframe. Seeking to a frame decodes forward from the
+ * keyframe before it.
+ */
+
+#define PP_ANIM_MAGIC        "PXPIANIM"
+#define PP_ANIM_VERSION      1
+#define PP_ANIM_HEADER_SIZE  64
+#define PP_ANIM_ENTRY_SIZE   16
+
+/* Number of frames the kernel is asked to read ahead during playback */
+#define PP_ANIM_READAHEAD    16
+
+/* Keyframe interval of the delta codec unless one is given */
+#define PP_ANIM_KEYFRAME     60
+
+static const char *pp_anim_format_names[] = { "rgb", "rgbw" };
+static const long  pp_anim_format_bytes[] = { 3, 4 };
+static const char *pp_anim_codec_names[]  = { "none", "delta" };
+
+typedef struct {
+  uint8_t *map;           /* the mapped file, NULL once closed */
+  size_t   size;          /* size of the mapping in bytes */
+  int      format;        /* pixel format of the frames */
+  long     led_count;     /* number of LEDs in each frame */
+  long     frame_count;   /* number of frames */
+  uint32_t fps;           /* frames per second in thousandths */
+  int      codec;         /* how the frames are encoded */
+  long     keyframe;      /* keyframe interval of the delta codec */
+  const uint8_t *index;   /* the frame index inside the mapping */
+} pp_anim_t;
+
+/* Decoding state of a delta coded animation. The frames are decoded into a
+ * buffer of their own since the LED buffer can be changed between frames.
+ */
+typedef struct {
+  ws2811_led_t *ref;      /* the last frame decoded */
+  long          next;     /* the frame that follows it, -1 if there is none */
+} pp_anim_cursor_t;
+
+VALUE cAnimation;
+
+static ID id_each;
+static VALUE sym_fps, sym_format, sym_loop, sym_codec, sym_keyframe;
+
+/* ======================================================================= */
+
+static inline uint32_t
+pp_get_le32( const uint8_t *p )
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t
+pp_get_le64( const uint8_t *p )
+{
+  return (uint64_t) pp_get_le32( p ) | ((uint64_t) pp_get_le32( p + 4 ) << 32);
+}
+
+static inline void
+pp_put_le32( uint8_t *p, uint32_t v )
+{
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static inline void
+pp_put_le64( uint8_t *p, uint64_t v )
+{
+  pp_put_le32( p, (uint32_t) v );
+  pp_put_le32( p + 4, (uint32_t) (v >> 32) );
+}
+
+static void
+pp_anim_unmap( pp_anim_t *anim )
+{
+  if (anim->map) munmap( anim->map, anim->size );
+  anim->map   = NULL;
+  anim->index = NULL;
+}
+
+static void
+pp_anim_free( void *ptr )
+{
+  pp_anim_t *anim;
+  if (NULL == ptr) return;
+
+  anim = (pp_anim_t*) ptr;
+  pp_anim_unmap( anim );
+  xfree( anim );
+}
+
+static VALUE
+pp_anim_allocate( VALUE klass )
+{
+  pp_anim_t *anim;
+
+  anim = ALLOC_N( pp_anim_t, 1 );
+  if (!anim) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::Animation instance");
+  }
+
+  anim->map         = NULL;
+  anim->size        = 0;
+  anim->format      = PP_ANIM_RGB;
+  anim->led_count   = 0;
+  anim->frame_count = 0;
+  anim->fps         = 0;
+  anim->codec       = PP_ANIM_CODEC_NONE;
+  anim->keyframe    = 0;
+  anim->index       = NULL;
+
+  return Data_Wrap_Struct( klass, NULL, pp_anim_free, anim );
+}
+
+/* Returns the animation struct; raises a PixelPi::Error if it has been closed */
+static pp_anim_t*
+pp_anim_struct( VALUE self )
+{
+  pp_anim_t *anim;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_anim_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::Animation object" );
+  }
+  Data_Get_Struct( self, pp_anim_t, anim );
+
+  if (!anim->map) {
+    rb_raise( ePixelPiError, "Animation is closed" );
+  }
+
+  return anim;
+}
+
+int
+pp_parse_anim_format( VALUE value )
+{
+  const char *name;
+  int ii;
+
+  if (NIL_P(value)) return PP_ANIM_RGB;
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "pixel format must be a Symbol: %s", rb_obj_classname(value) );
+  }
+
+  name = rb_id2name( SYM2ID(value) );
+  for (ii=0; ii<=PP_ANIM_RGBW; ii++) {
+    if (strcmp( name, pp_anim_format_names[ii] ) == 0) return ii;
+  }
+
+  rb_raise( rb_eArgError, "unknown pixel format: %s", name );
+  return 0;
+}
+
+/* Parse a frame rate into thousandths of a frame per second */
+static uint32_t
+pp_parse_fps( VALUE value )
+{
+  double fps = NUM2DBL(value);
+
+  if (!(fps > 0.0 && fps <= 1000000.0)) {
+    rb_raise( rb_eArgError, "fps must be greater than zero: %g", fps );
+  }
+  return (uint32_t) (fps * 1000.0 + 0.5);
+}
+
+/* Parse the `:codec` and `:keyframe` options given to Animation.write and
+ * Leds#record.
+ */
+void
+pp_parse_anim_codec( VALUE opts, int *codec, long *keyframe )
+{
+  VALUE value;
+  const char *name;
+  int ii;
+
+  *codec    = PP_ANIM_CODEC_NONE;
+  *keyframe = PP_ANIM_KEYFRAME;
+  if (NIL_P(opts)) return;
+
+  value = rb_hash_lookup( opts, sym_codec );
+  if (!NIL_P(value)) {
+    if (TYPE(value) != T_SYMBOL) {
+      rb_raise( rb_eTypeError, "codec must be a Symbol: %s", rb_obj_classname(value) );
+    }
+    name = rb_id2name( SYM2ID(value) );
+    for (ii=0; ii<=PP_ANIM_CODEC_DELTA; ii++) {
+      if (strcmp( name, pp_anim_codec_names[ii] ) == 0) break;
+    }
+    if (ii > PP_ANIM_CODEC_DELTA) rb_raise( rb_eArgError, "unknown codec: %s", name );
+    *codec = ii;
+  }
+
+  value = rb_hash_lookup( opts, sym_keyframe );
+  if (!NIL_P(value)) {
+    *keyframe = NUM2LONG(value);
+    if (*keyframe < 1 || *keyframe > 0x7fffffff) {
+      rb_raise( rb_eArgError, "keyframe interval must be positive: %ld", *keyframe );
+    }
+  }
+}
+
+/* Returns the frame data of frame `n` */
+static inline const uint8_t*
+pp_anim_frame( const pp_anim_t *anim, long n )
+{
+  return anim->map + pp_get_le64( anim->index + n * PP_ANIM_ENTRY_SIZE );
+}
+
+/* Returns the length of frame `n` in bytes */
+static inline long
+pp_anim_frame_length( const pp_anim_t *anim, long n )
+{
+  return pp_get_le32( anim->index + n * PP_ANIM_ENTRY_SIZE + 8 );
+}
+
+/* Decode frame `n` into the first `count` colors of `leds`. Delta coded
+ * frames are decoded into the `cursor` first; when `n` does not follow the
+ * frame decoded last, decoding starts again from the keyframe before `n`.
+ */
+static void
+pp_anim_decode( const pp_anim_t *anim, long n, ws2811_led_t *leds, long count,
+                pp_anim_cursor_t *cursor )
+{
+  const uint8_t *p = pp_anim_frame( anim, n );
+  long ii;
+
+  if (count > anim->led_count) count = anim->led_count;
+
+  if (anim->codec == PP_ANIM_CODEC_DELTA) {
+    int bpp = pp_anim_format_bytes[anim->format];
+
+    ii = n;
+    if (n != cursor->next || n % anim->keyframe == 0) {
+      ii = n - n % anim->keyframe;
+      memset( cursor->ref, 0, anim->led_count * sizeof(ws2811_led_t) );
+    }
+
+    for (; ii<=n; ii++) {
+      if (pp_delta_decode( pp_anim_frame( anim, ii ), pp_anim_frame_length( anim, ii ),
+                           cursor->ref, anim->led_count, bpp ) < 0) {
+        cursor->next = -1;
+        rb_raise( ePixelPiError, "animation frame %ld is corrupt", ii );
+      }
+    }
+    cursor->next = n + 1;
+    memcpy( leds, cursor->ref, count * sizeof(ws2811_led_t) );
+
+  } else if (anim->format == PP_ANIM_RGBW) {
+    for (ii=0; ii<count; ii++, p+=4) leds[ii] = pp_get_le32( p );
+  } else {
+    for (ii=0; ii<count; ii++, p+=3) leds[ii] = RGB2COLOR(p[0], p[1], p[2]);
+  }
+}
+
+/* Give the kernel a hint about which pages of the mapping are needed next.
+ * The frames from `n` onward are read ahead, and the pages holding only the
+ * frame before `n` are dropped from this process so memory use stays
+ * constant. The page cache still holds them if the animation loops.
+ */
+static void
+pp_anim_advise( const pp_anim_t *anim, long n )
+{
+  uintptr_t page = (uintptr_t) sysconf( _SC_PAGESIZE );
+  uintptr_t beg, end, prev;
+  long last;
+
+  if (n >= anim->frame_count) return;
+
+  beg  = (uintptr_t) pp_anim_frame( anim, n ) & ~(page - 1);
+  last = MIN(n + PP_ANIM_READAHEAD, anim->frame_count) - 1;
+  end  = (uintptr_t) pp_anim_frame( anim, last ) + pp_anim_frame_length( anim, last );
+  if (end > beg) madvise( (void*) beg, end - beg, MADV_WILLNEED );
+
+  if (n > 0) {
+    prev = (uintptr_t) pp_anim_frame( anim, n - 1 ) & ~(page - 1);
+    if (beg > prev) madvise( (void*) prev, beg - prev, MADV_DONTNEED );
+  }
+}
+
+/* Check the header and the frame index of the mapped file */
+static void
+pp_anim_check( pp_anim_t *anim, VALUE path )
+{
+  const uint8_t *map = anim->map;
+  uint64_t index, offset, length, frame_size;
+  int version;
+  long ii;
+
+  if (anim->size < PP_ANIM_HEADER_SIZE || memcmp( map, PP_ANIM_MAGIC, 8 ) != 0) {
+    rb_raise( ePixelPiError, "not a PixelPi animation: %s", StringValueCStr(path) );
+  }
+
+  version = map[8] | (map[9] << 8);
+  if (version != PP_ANIM_VERSION) {
+    rb_raise( ePixelPiError, "unsupported animation version: %d", version );
+  }
+
+  anim->format = map[10] | (map[11] << 8);
+  if (anim->format > PP_ANIM_RGBW) {
+    rb_raise( ePixelPiError, "unsupported pixel format: %d", anim->format );
+  }
+
+  anim->led_count   = pp_get_le32( map + 12 );
+  anim->frame_count = pp_get_le32( map + 16 );
+  anim->fps         = pp_get_le32( map + 20 );
+  index             = pp_get_le64( map + 24 );
+  anim->codec       = map[32] | (map[33] << 8);
+  anim->keyframe    = pp_get_le32( map + 36 );
+
+  if (anim->fps == 0) {
+    rb_raise( ePixelPiError, "animation frame rate is zero" );
+  }
+  if (anim->codec > PP_ANIM_CODEC_DELTA) {
+    rb_raise( ePixelPiError, "unsupported codec: %d", anim->codec );
+  }
+  if (anim->codec == PP_ANIM_CODEC_DELTA && (anim->keyframe < 1 || anim->keyframe > 0x7fffffff)) {
+    rb_raise( ePixelPiError, "animation keyframe interval is invalid: %ld", anim->keyframe );
+  }
+  if (index > anim->size || (anim->size - index) / PP_ANIM_ENTRY_SIZE < (uint64_t) anim->frame_count) {
+    rb_raise( ePixelPiError, "animation frame index is truncated" );
+  }
+  anim->index = map + index;
+
+  frame_size = (uint64_t) anim->led_count * pp_anim_format_bytes[anim->format];
+  for (ii=0; ii<anim->frame_count; ii++) {
+    const uint8_t *entry = anim->index + ii * PP_ANIM_ENTRY_SIZE;
+    offset = pp_get_le64( entry );
+    length = pp_get_le32( entry + 8 );
+    if ((anim->codec == PP_ANIM_CODEC_NONE && length != frame_size)
+    ||  offset > anim->size || anim->size - offset < length) {
+      rb_raise( ePixelPiError, "animation frame %ld is corrupt", ii );
+    }
+  }
+}
+
+/* ======================================================================= */
+/* Writing animation files. These functions do not touch any Ruby objects, so
+ * the frame recorder calls them from its writer thread; on failure they
+ * return -1 with `errno` set.
+ */
+
+/* Create the animation file at `path` and reserve space for the header. The
+ * header is written by pp_anim_writer_close once the frames are known.
+ */
+int
+pp_anim_writer_open( pp_anim_writer_t *writer, const char *path, int format, int codec, long keyframe )
+{
+  uint8_t header[PP_ANIM_HEADER_SIZE];
+
+  memset( writer, 0, sizeof(*writer) );
+  writer->format    = format;
+  writer->codec     = codec;
+  writer->keyframe  = keyframe;
+  writer->led_count = -1;
+  writer->offset    = PP_ANIM_HEADER_SIZE;
+
+  writer->fd = fopen( path, "wbe" );
+  if (!writer->fd) return -1;
+
+  memset( header, 0, sizeof(header) );
+  return fwrite( header, sizeof(header), 1, writer->fd ) == 1 ? 0 : -1;
+}
+
+/* Append a frame of `len` colors shown `time` milliseconds after the first
+ * frame. The first frame sets the number of LEDs; the caller makes sure the
+ * other frames have the same length.
+ */
+int
+pp_anim_writer_frame( pp_anim_writer_t *writer, const uint32_t *colors, long len, uint32_t time )
+{
+  uint8_t *p, *entry, *data;
+  long ii, size;
+
+  if (writer->led_count < 0) {
+    size = len * pp_anim_format_bytes[writer->format];
+    writer->frame = malloc( size + 1 );
+    if (!writer->frame) return -1;
+    if (writer->codec == PP_ANIM_CODEC_DELTA) {
+      writer->prev = calloc( size + 1, 1 );
+      writer->out  = malloc( pp_delta_bound( size ) );
+      if (!writer->prev || !writer->out) return -1;
+    }
+    writer->led_count = len;
+  }
+
+  p = writer->frame;
+  if (writer->format == PP_ANIM_RGBW) {
+    for (ii=0; ii<len; ii++, p+=4) pp_put_le32( p, colors[ii] );
+  } else {
+    for (ii=0; ii<len; ii++, p+=3) {
+      p[0] = colors[ii] >> 16; p[1] = colors[ii] >> 8; p[2] = colors[ii];
+    }
+  }
+
+  data = writer->frame;
+  size = p - writer->frame;
+  if (writer->codec == PP_ANIM_CODEC_DELTA) {
+    if (writer->frame_count % writer->keyframe == 0) memset( writer->prev, 0, size );
+    size = pp_delta_encode( writer->frame, writer->prev, size, writer->out );
+    data = writer->out;
+  }
+  if (size && fwrite( data, size, 1, writer->fd ) != 1) return -1;
+
+  if (writer->frame_count == writer->index_size) {
+    long n = writer->index_size ? writer->index_size * 2 : 256;
+    uint8_t *index = realloc( writer->index, n * PP_ANIM_ENTRY_SIZE );
+    if (!index) return -1;
+    writer->index = index;
+    writer->index_size = n;
+  }
+
+  entry = writer->index + writer->frame_count * PP_ANIM_ENTRY_SIZE;
+  pp_put_le64( entry, writer->offset );
+  pp_put_le32( entry + 8, (uint32_t) size );
+  pp_put_le32( entry + 12, time );
+
+  writer->offset += size;
+  writer->frame_count += 1;
+  return 0;
+}
+
+/* Close the file without writing the header and release the buffers. The
+ * file is left unreadable as an animation.
+ */
+void
+pp_anim_writer_abort( pp_anim_writer_t *writer )
+{
+  if (writer->fd) fclose( writer->fd );
+  free( writer->index );
+  free( writer->frame );
+  free( writer->prev );
+  free( writer->out );
+  writer->fd    = NULL;
+  writer->index = NULL;
+  writer->frame = NULL;
+  writer->prev  = NULL;
+  writer->out   = NULL;
+}
+
+/* Write the frame index and then the header, and close the file. The header
+ * is written last so a partial file is never mistaken for a complete one.
+ * The writer is released even when an error is returned.
+ */
+int
+pp_anim_writer_close( pp_anim_writer_t *writer, uint32_t fps )
+{
+  uint8_t header[PP_ANIM_HEADER_SIZE];
+  int rv = 0, err = 0;
+
+  if (writer->led_count < 0) writer->led_count = 0;
+
+  memset( header, 0, sizeof(header) );
+  memcpy( header, PP_ANIM_MAGIC, 8 );
+  header[8]  = PP_ANIM_VERSION;
+  header[10] = writer->format;
+  pp_put_le32( header + 12, (uint32_t) writer->led_count );
+  pp_put_le32( header + 16, (uint32_t) writer->frame_count );
+  pp_put_le32( header + 20, fps );
+  pp_put_le64( header + 24, writer->offset );
+  if (writer->codec == PP_ANIM_CODEC_DELTA) {
+    header[32] = writer->codec;
+    pp_put_le32( header + 36, (uint32_t) writer->keyframe );
+  }
+
+  if ((writer->frame_count &&
+       fwrite( writer->index, writer->frame_count * PP_ANIM_ENTRY_SIZE, 1, writer->fd ) != 1)
+  ||  fseek( writer->fd, 0, SEEK_SET ) != 0
+  ||  fwrite( header, sizeof(header), 1, writer->fd ) != 1) {
+    rv = -1; err = errno;
+  }
+
+  if (fclose( writer->fd ) != 0 && rv == 0) {
+    rv = -1; err = errno;
+  }
+  writer->fd = NULL;
+  pp_anim_writer_abort( writer );
+
+  errno = err;
+  return rv;
+}
+
+static VALUE
+pp_anim_close_m( VALUE self );
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::Animation.open( path )                  #=> animation
+ *    PixelPi::Animation.open( path ) { |anim| block } #=> result of block
+ *
+ * Memory-map the animation file at `path`. The frames are not read until
+ * they are played. With a block the animation is passed to the block and
+ * closed when the block returns.
+ *
+ * Examples:
+ *    PixelPi::Animation.open( "show.pxa" ) do |anim|
+ *      leds.play( anim, :loop => true )
+ *    end
+ *
+ * Returns the new PixelPi::Animation or the result of the block.
+ */
+static VALUE
+pp_anim_s_open( VALUE klass, VALUE path )
+{
+  VALUE self = pp_anim_allocate( klass );
+  pp_anim_t *anim;
+  struct stat st;
+  void *map;
+  int fd;
+
+  Data_Get_Struct( self, pp_anim_t, anim );
+  FilePathValue( path );
+
+  fd = open( StringValueCStr(path), O_RDONLY | O_CLOEXEC );
+  if (fd < 0) rb_sys_fail( StringValueCStr(path) );
+
+  if (fstat( fd, &st ) < 0) {
+    int err = errno;
+    close( fd );
+    errno = err;
+    rb_sys_fail( StringValueCStr(path) );
+  }
+  if (st.st_size < PP_ANIM_HEADER_SIZE) {
+    close( fd );
+    rb_raise( ePixelPiError, "not a PixelPi animation: %s", StringValueCStr(path) );
+  }
+
+  map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+  close( fd );
+  if (map == MAP_FAILED) rb_sys_fail( StringValueCStr(path) );
+
+  anim->map  = (uint8_t*) map;
+  anim->size = st.st_size;
+  madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+  /* an invalid file is unmapped when the instance is garbage collected */
+  pp_anim_check( anim, path );
+
+  if (rb_block_given_p()) {
+    return rb_ensure( rb_yield, self, pp_anim_close_m, self );
+  }
+  return self;
+}
+
+static VALUE
+pp_anim_write_frame( RB_BLOCK_CALL_FUNC_ARGLIST(frame, data) )
+{
+  VALUE *args = (VALUE*) data;
+  pp_anim_writer_t *writer = (pp_anim_writer_t*) args[1];
+  uint32_t fps = (uint32_t) args[2];
+  const uint32_t *colors;
+  long len;
+  VALUE store;
+  int rv;
+
+  colors = pp_uint32_list( frame, &len, &store );
+
+  if (writer->led_count >= 0 && len != writer->led_count) {
+    if (store) rb_free_tmp_buffer( &store );
+    rb_raise( rb_eArgError, "frame %ld has %ld LEDs but the first frame has %ld",
+              writer->frame_count, len, writer->led_count );
+  }
+
+  rv = pp_anim_writer_frame( writer, colors, len,
+                             (uint32_t) ((uint64_t) writer->frame_count * 1000000 / fps) );
+  if (store) rb_free_tmp_buffer( &store );
+  if (rv < 0) rb_sys_fail( StringValueCStr(args[3]) );
+
+  return Qnil;
+}
+
+static VALUE
+pp_anim_write_frames( VALUE arg )
+{
+  VALUE *args = (VALUE*) arg;
+  pp_anim_writer_t *writer = (pp_anim_writer_t*) args[1];
+
+  rb_block_call( args[0], id_each, 0, NULL, pp_anim_write_frame, arg );
+
+  if (pp_anim_writer_close( writer, (uint32_t) args[2] ) < 0) {
+    rb_sys_fail( StringValueCStr(args[3]) );
+  }
+  return LONG2NUM(writer->frame_count);
+}
+
+static VALUE
+pp_anim_write_cleanup( VALUE arg )
+{
+  pp_anim_writer_abort( (pp_anim_writer_t*) arg );
+  return Qnil;
+}
+
+/* call-seq:
+ *    PixelPi::Animation.write( path, frames, options = {} )   #=> frame count
+ *
+ * Write an animation file at `path`. The `frames` can be any object that
+ * responds to `each` - an Array or an Enumerator - and each frame is an Array
+ * of colors or a packed String of 32-bit colors (`ary.pack("L*")`). All the
+ * frames must have the same number of LEDs. Frames are written as they are
+ * generated, so very long shows never need to be held in memory.
+ *
+ * options - Hash of arguments
+ *   :fps      - frames per second, defaults to 30
+ *   :format   - `:rgb` (default) stores three bytes per LED; `:rgbw` keeps
+ *               the white byte as well
+ *   :codec    - `:none` (default) stores every frame as is; `:delta` stores
+ *               only the bytes that changed from the previous frame,
+ *               run-length encoded, which makes most shows many times smaller
+ *   :keyframe - with the `:delta` codec every this many frames are stored
+ *               whole so playback can seek; defaults to 60
+ *
+ * Returns the number of frames written.
+ */
+static VALUE
+pp_anim_s_write( int argc, VALUE* argv, VALUE klass )
+{
+  pp_anim_writer_t writer;
+  VALUE path, frames, opts, args[4];
+  uint32_t fps = 30000;
+  int format = PP_ANIM_RGB, codec;
+  long keyframe;
+
+  rb_scan_args( argc, argv, "21", &path, &frames, &opts );
+  FilePathValue( path );
+
+  if (!NIL_P(opts)) {
+    VALUE value;
+    Check_Type( opts, T_HASH );
+    format = pp_parse_anim_format( rb_hash_lookup( opts, sym_format ) );
+    value = rb_hash_lookup( opts, sym_fps );
+    if (!NIL_P(value)) fps = pp_parse_fps( value );
+  }
+  pp_parse_anim_codec( opts, &codec, &keyframe );
+
+  if (pp_anim_writer_open( &writer, StringValueCStr(path), format, codec, keyframe ) < 0) {
+    int err = errno;
+    pp_anim_writer_abort( &writer );
+    rb_syserr_fail( err, StringValueCStr(path) );
+  }
+
+  args[0] = frames;
+  args[1] = (VALUE) &writer;
+  args[2] = (VALUE) fps;
+  args[3] = path;
+  return rb_ensure( pp_anim_write_frames, (VALUE) args, pp_anim_write_cleanup, (VALUE) &writer );
+}
+
+/* call-seq:
+ *    length
+ *
+ * Returns the number of frames in the animation.
+ */
+static VALUE
+pp_anim_length( VALUE self )
+{
+  return LONG2NUM(pp_anim_struct( self )->frame_count);
+}
+
+/* call-seq:
+ *    led_count
+ *
+ * Returns the number of LEDs in each frame.
+ */
+static VALUE
+pp_anim_led_count( VALUE self )
+{
+  return LONG2NUM(pp_anim_struct( self )->led_count);
+}
+
+/* call-seq:
+ *    fps
+ *
+ * Returns the frame rate the animation was rendered for as a Float.
+ */
+static VALUE
+pp_anim_fps( VALUE self )
+{
+  return rb_float_new( pp_anim_struct( self )->fps / 1000.0 );
+}
+
+/* call-seq:
+ *    format
+ *
+ * Returns the pixel format of the frames, `:rgb` or `:rgbw`.
+ */
+static VALUE
+pp_anim_format( VALUE self )
+{
+  return ID2SYM(rb_intern( pp_anim_format_names[pp_anim_struct( self )->format] ));
+}
+
+/* call-seq:
+ *    codec
+ *
+ * Returns how the frames are stored, `:none` or `:delta`.
+ */
+static VALUE
+pp_anim_codec( VALUE self )
+{
+  return ID2SYM(rb_intern( pp_anim_codec_names[pp_anim_struct( self )->codec] ));
+}
+
+/* call-seq:
+ *    keyframe
+ *
+ * Returns the keyframe interval of a delta coded animation, or `nil` if the
+ * frames are not delta coded.
+ */
+static VALUE
+pp_anim_keyframe( VALUE self )
+{
+  pp_anim_t *anim = pp_anim_struct( self );
+  return anim->codec == PP_ANIM_CODEC_DELTA ? LONG2NUM(anim->keyframe) : Qnil;
+}
+
+/* call-seq:
+ *    anim[num]   #=> Array
+ *
+ * Returns the colors of frame `num` as an Array. A negative `num` counts back
+ * from the last frame.
+ */
+static VALUE
+pp_anim_aref( VALUE self, VALUE num )
+{
+  pp_anim_t *anim = pp_anim_struct( self );
+  long n = NUM2LONG(num);
+  pp_anim_cursor_t cursor;
+  ws2811_led_t *leds;
+  VALUE ary, store = 0;
+  long ii;
+
+  if (n < 0) n += anim->frame_count;
+  if (n < 0 || n >= anim->frame_count) {
+    rb_raise( rb_eIndexError, "index %ld is outside of frame range: 0...%ld", NUM2LONG(num), anim->frame_count-1 );
+  }
+
+  /* a delta coded frame is decoded in place from the keyframe before it */
+  leds = ALLOCV_N( ws2811_led_t, store, anim->led_count + 1 );
+  cursor.ref  = leds;
+  cursor.next = -1;
+  pp_anim_decode( anim, n, leds, anim->led_count, &cursor );
+
+  ary = rb_ary_new2( anim->led_count );
+  for (ii=0; ii<anim->led_count; ii++) {
+    rb_ary_store( ary, ii, UINT2NUM(leds[ii]) );
+  }
+
+  ALLOCV_END( store );
+  return ary;
+}
+
+/* call-seq:
+ *    time( num )   #=> Float
+ *
+ * Returns the time frame `num` is shown, in seconds after the first frame.
+ * Recorded animations keep the time each frame was actually shown.
+ */
+static VALUE
+pp_anim_time( VALUE self, VALUE num )
+{
+  pp_anim_t *anim = pp_anim_struct( self );
+  long n = NUM2LONG(num);
+
+  if (n < 0) n += anim->frame_count;
+  if (n < 0 || n >= anim->frame_count) {
+    rb_raise( rb_eIndexError, "index %ld is outside of frame range: 0...%ld", NUM2LONG(num), anim->frame_count-1 );
+  }
+  return rb_float_new( pp_get_le32( anim->index + n * PP_ANIM_ENTRY_SIZE + 12 ) / 1000.0 );
+}
+
+/* call-seq:
+ *    close
+ *
+ * Unmap the animation file. The animation can no longer be played.
+ *
+ * Returns `nil`.
+ */
+static VALUE
+pp_anim_close_m( VALUE self )
+{
+  pp_anim_t *anim;
+
+  Data_Get_Struct( self, pp_anim_t, anim );
+  pp_anim_unmap( anim );
+  return Qnil;
+}
+
+/* call-seq:
+ *    closed?
+ *
+ * Returns `true` if the animation has been closed.
+ */
+static VALUE
+pp_anim_closed_p( VALUE self )
+{
+  pp_anim_t *anim;
+
+  Data_Get_Struct( self, pp_anim_t, anim );
+  return anim->map ? Qfalse : Qtrue;
+}
+
+/* Returns the time on the monotonic clock in nanoseconds */
+static int64_t
+pp_monotonic_ns( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* call-seq:
+ *    play( animation, options = {} )
+ *    play( animation, options = {} ) { |frame| block }
+ *
+ * Play the `animation` at its frame rate. Each frame is decoded from the
+ * memory-mapped file into the LED buffer and shown; the kernel is told to
+ * read the next frames ahead and to drop the ones already played, so shows
+ * far larger than memory play straight from flash. Frames are timed against
+ * the clock so rendering time does not add up as drift. Other Ruby threads
+ * run while waiting for the next frame.
+ *
+ * If the animation has more LEDs than the strip the extra colors are ignored;
+ * if it has fewer only those LEDs are changed. Attached layers are composited
+ * over every frame.
+ *
+ * With a block, the block is called with the frame number after the frame is
+ * decoded and before it is shown. Use `break` to stop playing early.
+ *
+ * options - Hash of arguments
+ *   :loop - `true` to play the animation over and over
+ *   :fps  - play at this frame rate instead of the recorded one
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_play( int argc, VALUE* argv, VALUE self )
+{
+  VALUE animation, opts, store = 0;
+  pp_anim_cursor_t cursor;
+  pp_anim_t *anim;
+  uint32_t fps;
+  int64_t period, start;
+  long n, played = 0;
+  int loop = 0;
+
+  rb_scan_args( argc, argv, "11", &animation, &opts );
+  anim = pp_anim_struct( animation );
+  pp_leds_struct( self );
+  fps = anim->fps;
+
+  if (!NIL_P(opts)) {
+    VALUE value;
+    Check_Type( opts, T_HASH );
+    loop  = RTEST(rb_hash_lookup( opts, sym_loop ));
+    value = rb_hash_lookup( opts, sym_fps );
+    if (!NIL_P(value)) fps = pp_parse_fps( value );
+  }
+
+  if (anim->frame_count == 0) return self;
+  cursor.ref  = ALLOCV_N( ws2811_led_t, store, anim->led_count + 1 );
+  cursor.next = -1;
+
+  period = (int64_t) 1000000000000LL / fps;
+  start  = pp_monotonic_ns();
+
+  for (n=0;; n++, played++) {
+    ws2811_led_t *leds;
+    int64_t wait;
+    long count;
+
+    if (n == anim->frame_count) {
+      if (!loop) break;
+      n = 0;
+    }
+
+    /* the block or another thread may have closed either one */
+    anim = pp_anim_struct( animation );
+    leds = pp_leds_buffer( self, &count );
+
+    pp_anim_decode( anim, n, leds, count, &cursor );
+    pp_anim_advise( anim, n + 1 );
+
+    if (rb_block_given_p()) rb_yield( LONG2NUM(n) );
+    pp_leds_show( self );
+
+    /* wait for the next frame; when running late start counting again from
+     * now instead of rushing through the frames to catch up */
+    wait = start + (played + 1) * period - pp_monotonic_ns();
+    if (wait < -period) {
+      start  = pp_monotonic_ns();
+      played = -1;
+    } else if (wait > 0) {
+      struct timeval tv;
+      tv.tv_sec  = wait / 1000000000;
+      tv.tv_usec = (wait % 1000000000) / 1000;
+      rb_thread_wait_for( tv );
+    }
+  }
+
+  ALLOCV_END( store );
+  return self;
+}
+
+void Init_animation( )
+{
+  id_each      = rb_intern( "each" );
+  sym_fps      = ID2SYM(rb_intern( "fps" ));
+  sym_format   = ID2SYM(rb_intern( "format" ));
+  sym_loop     = ID2SYM(rb_intern( "loop" ));
+  sym_codec    = ID2SYM(rb_intern( "codec" ));
+  sym_keyframe = ID2SYM(rb_intern( "keyframe" ));
+
+  cAnimation = rb_define_class_under( mPixelPi, "Animation", rb_cObject );
+  rb_undef_alloc_func( cAnimation );
+
+  rb_define_singleton_method( cAnimation, "open",  pp_anim_s_open,   1 );
+  rb_define_singleton_method( cAnimation, "write", pp_anim_s_write, -1 );
+
+  rb_define_method( cAnimation, "length",    pp_anim_length,    0 );
+  rb_define_method( cAnimation, "led_count", pp_anim_led_count, 0 );
+  rb_define_method( cAnimation, "fps",       pp_anim_fps,       0 );
+  rb_define_method( cAnimation, "format",    pp_anim_format,    0 );
+  rb_define_method( cAnimation, "codec",     pp_anim_codec,     0 );
+  rb_define_method( cAnimation, "keyframe",  pp_anim_keyframe,  0 );
+  rb_define_method( cAnimation, "[]",        pp_anim_aref,      1 );
+  rb_define_method( cAnimation, "time",      pp_anim_time,      1 );
+  rb_define_method( cAnimation, "close",     pp_anim_close_m,   0 );
+  rb_define_method( cAnimation, "closed?",   pp_anim_closed_p,  0 );
+
+  rb_define_method( cLeds, "play", pp_leds_play, -1 );
+}
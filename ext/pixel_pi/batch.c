@@ -0,0 +1,427 @@
+#include "pixel_pi.h"
+
+#include <limits.h>
+
+/* Sentinel length meaning "through the end of the LED string" */
+#define PP_TO_END LONG_MIN
+
+enum pp_batch_op {
+  PP_OP_CLEAR,
+  PP_OP_FILL,
+  PP_OP_FILL_RANGE,
+  PP_OP_SET,
+  PP_OP_ROTATE,
+  PP_OP_REVERSE,
+  PP_OP_BLEND,
+  PP_OP_BLEND_RANGE
+};
+
+typedef struct {
+  int          op;
+  int          alpha;
+  ws2811_led_t color;
+  long         arg1;           /* start, index, or rotate count */
+  long         arg2;           /* length or range end */
+} pp_command_t;
+
+typedef struct {
+  pp_command_t *cmds;
+  long          length;
+  long          capacity;
+} pp_batch_t;
+
+VALUE cBatch;
+
+/* ======================================================================= */
+
+static void
+pp_batch_free( void *ptr )
+{
+  pp_batch_t *batch;
+  if (NULL == ptr) return;
+
+  batch = (pp_batch_t*) ptr;
+  if (batch->cmds) xfree( batch->cmds );
+  xfree( batch );
+}
+
+static VALUE
+pp_batch_allocate( VALUE klass )
+{
+  pp_batch_t *batch;
+
+  batch = ALLOC_N( pp_batch_t, 1 );
+  if (!batch) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::Batch instance");
+  }
+
+  batch->cmds     = NULL;
+  batch->length   = 0;
+  batch->capacity = 0;
+
+  return Data_Wrap_Struct( klass, NULL, pp_batch_free, batch );
+}
+
+static pp_batch_t*
+pp_batch_struct( VALUE self )
+{
+  pp_batch_t *batch;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_batch_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::Batch object" );
+  }
+  Data_Get_Struct( self, pp_batch_t, batch );
+
+  return batch;
+}
+
+/* Append a new command to the end of the batch and return it. The command
+ * list grows geometrically so recording is amortized constant time.
+ */
+static pp_command_t*
+pp_batch_push( pp_batch_t *batch, int op )
+{
+  pp_command_t *cmd;
+
+  if (batch->length == batch->capacity) {
+    batch->capacity = batch->capacity ? batch->capacity * 2 : 16;
+    REALLOC_N( batch->cmds, pp_command_t, batch->capacity );
+  }
+
+  cmd = &batch->cmds[batch->length++];
+  cmd->op    = op;
+  cmd->alpha = 0;
+  cmd->color = 0;
+  cmd->arg1  = 0;
+  cmd->arg2  = PP_TO_END;
+
+  return cmd;
+}
+
+/* Record the optional `start, length` or `range` arguments of a fill or blend
+ * command. The values are resolved against the LED count when the batch is
+ * applied.
+ */
+static void
+pp_batch_range_args( pp_command_t *cmd, int argc, VALUE arg1, VALUE arg2, int range_op )
+{
+  VALUE beg, end;
+  int excl;
+
+  if (argc == 1 && rb_range_values( arg1, &beg, &end, &excl )) {
+    cmd->op   = range_op;
+    cmd->arg1 = NIL_P(beg) ? 0 : NUM2LONG(beg);
+    if (NIL_P(end)) {
+      cmd->arg2 = PP_TO_END;
+    } else {
+      cmd->arg2 = NUM2LONG(end);
+      if (!excl) cmd->arg2 += 1;
+      /* an end of -1 inclusive means the very end of the LEDs */
+      if (cmd->arg2 == 0 && !excl) cmd->arg2 = PP_TO_END;
+    }
+    return;
+  }
+
+  if (argc >= 1) cmd->arg1 = NIL_P(arg1) ? 0 : NUM2LONG(arg1);
+  if (argc >= 2 && !NIL_P(arg2)) {
+    cmd->arg2 = NUM2LONG(arg2);
+  }
+}
+
+/* Resolve the start and length of a recorded fill or blend command against the
+ * number of LEDs `count`. Returns the number of LEDs to modify and stores the
+ * first LED index in `beg`.
+ */
+static long
+pp_command_span( const pp_command_t *cmd, long count, long *beg )
+{
+  long b = cmd->arg1, e;
+
+  if (b < 0) {
+    b += count;
+    if (b < 0) b = 0;
+  }
+  if (b > count) b = count;
+
+  if (cmd->arg2 == PP_TO_END) {
+    e = count;
+  } else if (cmd->op == PP_OP_FILL_RANGE || cmd->op == PP_OP_BLEND_RANGE) {
+    e = cmd->arg2 < 0 ? cmd->arg2 + count : cmd->arg2;
+  } else {
+    if (cmd->arg2 < 0) return 0;
+    e = b + cmd->arg2;
+  }
+  e = MIN(e, count);
+
+  *beg = b;
+  return (e > b) ? e - b : 0;
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::Batch.new
+ *
+ * Create a new, empty PixelPi::Batch. A batch records a sequence of LED buffer
+ * operations into a compact native command list. The whole list is executed
+ * with a single call to `PixelPi::Leds#apply`, and the same batch can be
+ * applied again on every frame.
+ *
+ * Examples:
+ *    batch = PixelPi::Batch.new
+ *    batch.clear.fill( 0x0000FF, 0, 10 ).set( 12, 0xFF0000 ).rotate( 1 )
+ *
+ *    loop { leds.apply( batch ).show }
+ */
+static VALUE
+pp_batch_initialize( VALUE self )
+{
+  pp_batch_struct( self );
+  return self;
+}
+
+/* call-seq:
+ *    length
+ *
+ * Returns the number of recorded commands.
+ */
+static VALUE
+pp_batch_length( VALUE self )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  return LONG2NUM(batch->length);
+}
+
+/* call-seq:
+ *    reset
+ *
+ * Remove all the recorded commands from this batch. The command storage is
+ * kept so the batch can be refilled without allocating.
+ *
+ * Returns this PixelPi::Batch instance.
+ */
+static VALUE
+pp_batch_reset( VALUE self )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  batch->length = 0;
+  return self;
+}
+
+/* call-seq:
+ *    clear
+ *
+ * Record a command that sets all LEDs to zero.
+ *
+ * Returns this PixelPi::Batch instance.
+ */
+static VALUE
+pp_batch_clear( VALUE self )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  pp_batch_push( batch, PP_OP_CLEAR );
+  return self;
+}
+
+/* call-seq:
+ *    fill( color )
+ *    fill( color, start [, length] )
+ *    fill( color, range )
+ *
+ * Record a command that sets the selected LEDs to the given 24-bit RGB
+ * `color`. The arguments have the same meaning as `PixelPi::Leds#fill`.
+ *
+ * Returns this PixelPi::Batch instance.
+ */
+static VALUE
+pp_batch_fill( int argc, VALUE* argv, VALUE self )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  pp_command_t *cmd;
+  VALUE color, arg1, arg2;
+
+  rb_scan_args( argc, argv, "12", &color, &arg1, &arg2 );
+
+  cmd = pp_batch_push( batch, PP_OP_FILL );
+  cmd->color = NUM2UINT(color);
+  pp_batch_range_args( cmd, argc-1, arg1, arg2, PP_OP_FILL_RANGE );
+
+  return self;
+}
+
+/* call-seq:
+ *    set( num, color )
+ *
+ * Record a command that sets the LED at position `num` to the given 24-bit RGB
+ * `color`. Applying the batch raises an IndexError if `num` is outside the LED
+ * range.
+ *
+ * Returns this PixelPi::Batch instance.
+ */
+static VALUE
+pp_batch_set( VALUE self, VALUE num, VALUE color )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  pp_command_t *cmd;
+
+  cmd = pp_batch_push( batch, PP_OP_SET );
+  cmd->arg1  = NUM2LONG(num);
+  cmd->color = NUM2UINT(color);
+
+  return self;
+}
+
+/* call-seq:
+ *    rotate( count = 1 )
+ *
+ * Record a command that rotates the LED colors so that the color at `count`
+ * comes first. See `PixelPi::Leds#rotate`.
+ *
+ * Returns this PixelPi::Batch instance.
+ */
+static VALUE
+pp_batch_rotate( int argc, VALUE* argv, VALUE self )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  pp_command_t *cmd;
+  VALUE count;
+
+  rb_scan_args( argc, argv, "01", &count );
+
+  cmd = pp_batch_push( batch, PP_OP_ROTATE );
+  cmd->arg1 = NIL_P(count) ? 1 : NUM2INT(count);
+
+  return self;
+}
+
+/* call-seq:
+ *    reverse
+ *
+ * Record a command that reverses the order of the LED colors.
+ *
+ * Returns this PixelPi::Batch instance.
+ */
+static VALUE
+pp_batch_reverse( VALUE self )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  pp_batch_push( batch, PP_OP_REVERSE );
+  return self;
+}
+
+/* call-seq:
+ *    blend( color, alpha )
+ *    blend( color, alpha, start [, length] )
+ *    blend( color, alpha, range )
+ *
+ * Record a command that blends the selected LEDs towards the given 24-bit RGB
+ * `color`. The `alpha` is a value between 0 (LEDs are unchanged) and 255 (LEDs
+ * are set to `color`). The selection arguments have the same meaning as
+ * `PixelPi::Leds#fill`.
+ *
+ * Returns this PixelPi::Batch instance.
+ */
+static VALUE
+pp_batch_blend( int argc, VALUE* argv, VALUE self )
+{
+  pp_batch_t *batch = pp_batch_struct( self );
+  pp_command_t *cmd;
+  VALUE color, alpha, arg1, arg2;
+  int a;
+
+  rb_scan_args( argc, argv, "22", &color, &alpha, &arg1, &arg2 );
+
+  a = NUM2INT(alpha);
+  if (a < 0 || a > 255) {
+    rb_raise( rb_eArgError, "alpha must be between 0 and 255: %d", a );
+  }
+
+  cmd = pp_batch_push( batch, PP_OP_BLEND );
+  cmd->color = NUM2UINT(color);
+  cmd->alpha = a;
+  pp_batch_range_args( cmd, argc-2, arg1, arg2, PP_OP_BLEND_RANGE );
+
+  return self;
+}
+
+/* call-seq:
+ *    apply( batch )
+ *
+ * Execute all the commands recorded in the PixelPi::Batch in a single call.
+ * The batch is not modified and can be applied again. All `set` indices are
+ * checked before any command is executed; an IndexError is raised and the LED
+ * buffer is left untouched if any index is outside the LED range.
+ *
+ * You must call `show` for the new colors to be displayed.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_apply( VALUE self, VALUE obj )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_buffer( self, &count );
+  pp_batch_t *batch = pp_batch_struct( obj );
+  long ii, jj, beg, len;
+
+  for (ii=0; ii<batch->length; ii++) {
+    const pp_command_t *cmd = &batch->cmds[ii];
+    if (cmd->op == PP_OP_SET && (cmd->arg1 < 0 || cmd->arg1 >= count)) {
+      rb_raise( rb_eIndexError, "index %ld is outside of LED range: 0...%ld", cmd->arg1, count-1 );
+    }
+  }
+
+  for (ii=0; ii<batch->length; ii++) {
+    const pp_command_t *cmd = &batch->cmds[ii];
+
+    switch (cmd->op) {
+      case PP_OP_CLEAR:
+        memset( leds, 0, count * sizeof(ws2811_led_t) );
+        break;
+
+      case PP_OP_FILL:
+      case PP_OP_FILL_RANGE:
+        len = pp_command_span( cmd, count, &beg );
+        for (jj=beg; jj<beg+len; jj++) leds[jj] = cmd->color;
+        break;
+
+      case PP_OP_SET:
+        leds[cmd->arg1] = cmd->color;
+        break;
+
+      case PP_OP_ROTATE:
+        pp_leds_rotate_buffer( leds, count, (int) cmd->arg1 );
+        break;
+
+      case PP_OP_REVERSE:
+        if (count > 1) pp_leds_reverse( leds, leds + count - 1 );
+        break;
+
+      case PP_OP_BLEND:
+      case PP_OP_BLEND_RANGE:
+        len = pp_command_span( cmd, count, &beg );
+        pp_leds_blend_range( leds + beg, len, cmd->color, cmd->alpha );
+        break;
+    }
+  }
+
+  return self;
+}
+
+void Init_batch( )
+{
+  cBatch = rb_define_class_under( mPixelPi, "Batch", rb_cObject );
+  rb_define_alloc_func( cBatch, pp_batch_allocate );
+  rb_define_method( cBatch, "initialize", pp_batch_initialize,  0 );
+
+  rb_define_method( cBatch, "length",     pp_batch_length,      0 );
+  rb_define_method( cBatch, "reset",      pp_batch_reset,       0 );
+  rb_define_method( cBatch, "clear",      pp_batch_clear,       0 );
+  rb_define_method( cBatch, "fill",       pp_batch_fill,       -1 );
+  rb_define_method( cBatch, "set",        pp_batch_set,         2 );
+  rb_define_method( cBatch, "rotate",     pp_batch_rotate,     -1 );
+  rb_define_method( cBatch, "reverse",    pp_batch_reverse,     0 );
+  rb_define_method( cBatch, "blend",      pp_batch_blend,      -1 );
+
+  rb_define_method( cLeds,  "apply",      pp_leds_apply,        1 );
+}
@@ -0,0 +1,272 @@
+#include "pixel_pi.h"
+
+/* The whole buffer operations below are defined on PixelPi::Leds,
+ * PixelPi::Layer, and PixelPi::Slice. They work in place, never allocate, and
+ * treat each color as four independent bytes so the white value of RGBW strips
+ * is included.
+ */
+
+/* ======================================================================= */
+
+static ws2811_led_t*
+pp_buffer_self( VALUE self, long *len )
+{
+  ws2811_led_t *ptr = pp_buffer( self, len );
+  if (!ptr) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::Leds or PixelPi::Layer object" );
+  }
+  return ptr;
+}
+
+/* Returns the colors of the `other` buffer - a PixelPi::Leds, a PixelPi::Layer,
+ * a PixelPi::Slice, or a packed String of native 32-bit unsigned values.
+ */
+static const ws2811_led_t*
+pp_buffer_other( VALUE other, long *len )
+{
+  const ws2811_led_t *ptr = pp_buffer( other, len );
+  if (ptr) return ptr;
+
+  if (TYPE(other) == T_STRING) {
+    if (RSTRING_LEN(other) % sizeof(uint32_t)) {
+      rb_raise( rb_eArgError, "packed String length must be a multiple of 4: %ld", RSTRING_LEN(other) );
+    }
+    *len = RSTRING_LEN(other) / sizeof(uint32_t);
+    return (const ws2811_led_t*) RSTRING_PTR(other);
+  }
+
+  rb_raise( rb_eTypeError, "expecting a PixelPi::Leds, a PixelPi::Layer, or a packed String: %s",
+            rb_obj_classname(other) );
+  return NULL;
+}
+
+/* Convert a value that must be between 0 and 255 */
+static int
+pp_byte_arg( VALUE num )
+{
+  int n = NUM2INT(num);
+  if (n < 0 || n > 255) {
+    rb_raise( rb_eArgError, "value must be between 0 and 255: %d", n );
+  }
+  return n;
+}
+
+/* Scale all four bytes by the 1..256 fixed-point factor `f` */
+static inline uint32_t
+pp_scale( uint32_t c, uint32_t f )
+{
+  return ((((c & 0x00ff00ff) * f) >> 8) & 0x00ff00ff)
+       | (((c >> 8) & 0x00ff00ff) * f & 0xff00ff00);
+}
+
+/* Move each byte of `d` toward the matching byte of `t` by at most `rate` */
+static inline uint32_t
+pp_lerp_toward( uint32_t d, uint32_t t, uint32_t rate )
+{
+  uint32_t out = 0;
+  int shift;
+
+  for (shift=0; shift<32; shift+=8) {
+    int a = (d >> shift) & 0xff;
+    int b = (t >> shift) & 0xff;
+    if (a < b) a = (b - a > (int) rate) ? a + (int) rate : b;
+    else       a = (a - b > (int) rate) ? a - (int) rate : b;
+    out |= (uint32_t) a << shift;
+  }
+  return out;
+}
+
+/* One pass of the [1 2 1] / 4 binomial filter. Only the original value of the
+ * previous pixel needs to be kept, so the pass runs in place. The ends of the
+ * buffer are extended by repeating the first and last colors.
+ */
+static void
+pp_blur_pass( ws2811_led_t *ptr, long len )
+{
+  uint32_t prev = ptr[0];
+  long ii;
+
+  for (ii=0; ii<len; ii++) {
+    uint32_t cur  = ptr[ii];
+    uint32_t next = (ii+1 < len) ? ptr[ii+1] : cur;
+
+    ptr[ii] = ((((prev & 0x00ff00ff) + ((cur & 0x00ff00ff) << 1) + (next & 0x00ff00ff) + 0x00020002) >> 2) & 0x00ff00ff)
+            | (((((prev >> 8) & 0x00ff00ff) + (((cur >> 8) & 0x00ff00ff) << 1) + ((next >> 8) & 0x00ff00ff) + 0x00020002) << 6) & 0xff00ff00);
+    prev = cur;
+  }
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    scale( factor )
+ *
+ * Scale every color by `factor / 256`. The factor is a value between 0 and
+ * 255; a factor of 255 leaves the colors unchanged and 0 turns them off.
+ *
+ * Returns this instance.
+ */
+static VALUE
+pp_buffer_scale( VALUE self, VALUE factor )
+{
+  long ii, len;
+  ws2811_led_t *ptr = pp_buffer_self( self, &len );
+  uint32_t f = pp_byte_arg( factor ) + 1;
+
+  if (f == 256) return self;
+  for (ii=0; ii<len; ii++) ptr[ii] = pp_scale( ptr[ii], f );
+
+  return self;
+}
+
+/* call-seq:
+ *    fade_by( amount )
+ *
+ * Fade every color toward black by `amount`, a value between 0 (unchanged)
+ * and 255 (off). This is the same as `scale(255 - amount)`.
+ *
+ * Returns this instance.
+ */
+static VALUE
+pp_buffer_fade_by( VALUE self, VALUE amount )
+{
+  return pp_buffer_scale( self, INT2FIX(255 - pp_byte_arg( amount )) );
+}
+
+/* call-seq:
+ *    add( other )
+ *
+ * Add the colors of the `other` buffer to these colors. Each color component
+ * saturates at 255. The `other` buffer can be a PixelPi::Leds, a
+ * PixelPi::Layer, or a packed String of 32-bit colors; only the overlapping
+ * length is changed.
+ *
+ * Returns this instance.
+ */
+static VALUE
+pp_buffer_add( VALUE self, VALUE other )
+{
+  long ii, len, olen;
+  ws2811_led_t *ptr = pp_buffer_self( self, &len );
+  const ws2811_led_t *src = pp_buffer_other( other, &olen );
+
+  len = MIN(len, olen);
+  for (ii=0; ii<len; ii++) ptr[ii] = pp_add_sat( ptr[ii], src[ii] );
+
+  return self;
+}
+
+/* call-seq:
+ *    subtract( other )
+ *
+ * Subtract the colors of the `other` buffer from these colors. Each color
+ * component stops at 0.
+ *
+ * Returns this instance.
+ */
+static VALUE
+pp_buffer_subtract( VALUE self, VALUE other )
+{
+  long ii, len, olen;
+  ws2811_led_t *ptr = pp_buffer_self( self, &len );
+  const ws2811_led_t *src = pp_buffer_other( other, &olen );
+
+  len = MIN(len, olen);
+  for (ii=0; ii<len; ii++) ptr[ii] = pp_sub_sat( ptr[ii], src[ii] );
+
+  return self;
+}
+
+/* call-seq:
+ *    blend( other, alpha )
+ *
+ * Blend the colors of the `other` buffer into these colors. The `alpha` is a
+ * value between 0 (these colors are kept) and 255 (the other colors replace
+ * these colors).
+ *
+ * Returns this instance.
+ */
+static VALUE
+pp_buffer_blend( VALUE self, VALUE other, VALUE alpha )
+{
+  long ii, len, olen;
+  ws2811_led_t *ptr = pp_buffer_self( self, &len );
+  const ws2811_led_t *src = pp_buffer_other( other, &olen );
+  uint32_t w = pp_byte_arg( alpha );
+
+  len = MIN(len, olen);
+  w += w >> 7;
+  for (ii=0; ii<len; ii++) ptr[ii] = pp_mix( ptr[ii], src[ii], w );
+
+  return self;
+}
+
+/* call-seq:
+ *    lerp_toward( other, rate )
+ *
+ * Move each color component toward the matching component of the `other`
+ * buffer by at most `rate` steps. Unlike `blend` the colors reach the target
+ * after a fixed number of calls: at most `255 / rate` rounded up.
+ *
+ * Returns this instance.
+ */
+static VALUE
+pp_buffer_lerp_toward( VALUE self, VALUE other, VALUE rate )
+{
+  long ii, len, olen;
+  ws2811_led_t *ptr = pp_buffer_self( self, &len );
+  const ws2811_led_t *src = pp_buffer_other( other, &olen );
+  int r = pp_byte_arg( rate );
+
+  len = MIN(len, olen);
+  for (ii=0; ii<len; ii++) ptr[ii] = pp_lerp_toward( ptr[ii], src[ii], r );
+
+  return self;
+}
+
+/* call-seq:
+ *    blur( radius = 1 )
+ *
+ * Blur the colors along the buffer. Each unit of `radius` is one pass of a
+ * [1 2 1] smoothing filter, so larger values spread the colors further. The
+ * ends of the buffer are treated as repeating the first and last colors.
+ *
+ * Returns this instance.
+ */
+static VALUE
+pp_buffer_blur( int argc, VALUE* argv, VALUE self )
+{
+  long ii, len, radius = 1;
+  ws2811_led_t *ptr = pp_buffer_self( self, &len );
+  VALUE num;
+
+  rb_scan_args( argc, argv, "01", &num );
+  if (!NIL_P(num)) radius = NUM2LONG(num);
+  if (radius < 0) {
+    rb_raise( rb_eArgError, "radius cannot be negative: %ld", radius );
+  }
+
+  if (len > 1) {
+    for (ii=0; ii<radius; ii++) pp_blur_pass( ptr, len );
+  }
+
+  return self;
+}
+
+static void
+pp_define_buffer_methods( VALUE klass )
+{
+  rb_define_method( klass, "scale",       pp_buffer_scale,        1 );
+  rb_define_method( klass, "fade_by",     pp_buffer_fade_by,      1 );
+  rb_define_method( klass, "add",         pp_buffer_add,          1 );
+  rb_define_method( klass, "subtract",    pp_buffer_subtract,     1 );
+  rb_define_method( klass, "blend",       pp_buffer_blend,        2 );
+  rb_define_method( klass, "lerp_toward", pp_buffer_lerp_toward,  2 );
+  rb_define_method( klass, "blur",        pp_buffer_blur,        -1 );
+}
+
+void Init_buffer( )
+{
+  pp_define_buffer_methods( cLeds );
+  pp_define_buffer_methods( cLayer );
+  pp_define_buffer_methods( cSlice );
+}
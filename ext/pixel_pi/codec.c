@@ -0,0 +1,129 @@
+#include "pixel_pi.h"
+
+/* The delta codec stores each frame of an animation as the XOR of its bytes
+ * with the bytes of the previous frame, run-length encoded. Unchanged bytes
+ * XOR to zero, so a frame where only a few spans of LEDs changed becomes a
+ * handful of short runs. Keyframes are encoded against a frame of zeros and
+ * need no previous frame to decode.
+ *
+ * The encoded frame is a sequence of runs. Each run starts with a varint -
+ * seven bits per byte, least significant first, the top bit set on all but
+ * the last byte - holding the run length shifted left by one. The low bit is
+ * 0 for a run of unchanged bytes and 1 for a run of literal XOR bytes, which
+ * follow the varint. Unchanged bytes at the end of the frame are left out.
+ * Zero runs shorter than PP_DELTA_MIN_SKIP bytes are folded into the
+ * surrounding literal runs; they cost more as a run of their own.
+ */
+
+#define PP_DELTA_MIN_SKIP  4
+
+/* Byte shift within a color of each stored byte for the rgb and rgbw formats */
+static const int pp_rgb_shift[]  = { 16, 8, 0 };
+static const int pp_rgbw_shift[] = { 0, 8, 16, 24 };
+
+static inline uint8_t*
+pp_put_varint( uint8_t *out, unsigned long value )
+{
+  while (value >= 0x80) {
+    *out++ = (uint8_t) (value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t) value;
+  return out;
+}
+
+/* Returns the largest size pp_delta_encode can produce for `len` bytes */
+long
+pp_delta_bound( long len )
+{
+  /* every literal run is followed by at least PP_DELTA_MIN_SKIP unchanged
+   * bytes, so each run pair costs at most two 5 byte varints */
+  return len * 3 + 16;
+}
+
+/* Encode the `len` bytes of `frame` against the previous frame held in
+ * `prev`, and then copy the frame into `prev` for the next call. Clear `prev`
+ * to zero before encoding a keyframe. The output buffer must hold at least
+ * `pp_delta_bound( len )` bytes.
+ *
+ * Returns the number of bytes written to `out`.
+ */
+long
+pp_delta_encode( const uint8_t *frame, uint8_t *prev, long len, uint8_t *out )
+{
+  uint8_t *start = out;
+  long pos = 0, end, zero, ii;
+
+  while (pos < len) {
+    /* run of unchanged bytes */
+    zero = pos;
+    while (zero < len && frame[zero] == prev[zero]) zero++;
+    if (zero == len) break;
+    if (zero > pos) out = pp_put_varint( out, (unsigned long) (zero - pos) << 1 );
+    pos = zero;
+
+    /* run of changed bytes, including any short unchanged gaps */
+    end = pos;
+    for (;;) {
+      while (end < len && frame[end] != prev[end]) end++;
+      zero = end;
+      while (zero < len && frame[zero] == prev[zero]) zero++;
+      if (zero == len || zero - end >= PP_DELTA_MIN_SKIP) break;
+      end = zero;
+    }
+
+    out = pp_put_varint( out, ((unsigned long) (end - pos) << 1) | 1 );
+    for (ii=pos; ii<end; ii++) *out++ = frame[ii] ^ prev[ii];
+    pos = end;
+  }
+
+  memcpy( prev, frame, len );
+  return out - start;
+}
+
+/* Apply the `size` bytes of an encoded frame to the `count` colors in `leds`,
+ * which must hold the previous frame - or zeros for a keyframe. The changes
+ * are XORed straight into the colors; unchanged runs are skipped without
+ * touching them. `bpp` is the number of stored bytes per LED, 3 for rgb and 4
+ * for rgbw.
+ *
+ * Returns 0, or -1 if the encoded data is corrupt.
+ */
+int
+pp_delta_decode( const uint8_t *data, long size, ws2811_led_t *leds, long count, int bpp )
+{
+  const uint8_t *end = data + size;
+  const int *shift = bpp == 4 ? pp_rgbw_shift : pp_rgb_shift;
+  uint64_t total = (uint64_t) count * bpp;
+  uint64_t pos = 0;
+
+  while (data < end) {
+    uint64_t value = 0, len;
+    int bits = 0;
+
+    do {
+      if (data == end || bits > 28) return -1;
+      value |= (uint64_t) (*data & 0x7f) << bits;
+      bits += 7;
+    } while (*data++ & 0x80);
+
+    len = value >> 1;
+    if (len > total - pos) return -1;
+
+    if (value & 1) {
+      ws2811_led_t *led = leds + pos / bpp;
+      int k = pos % bpp;
+
+      if (len > (uint64_t) (end - data)) return -1;
+      pos += len;
+      while (len--) {
+        *led ^= (ws2811_led_t) *data++ << shift[k];
+        if (++k == bpp) { k = 0; led++; }
+      }
+    } else {
+      pos += len;
+    }
+  }
+
+  return 0;
+}
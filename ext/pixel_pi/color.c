@@ -0,0 +1,279 @@
+#include "pixel_pi.h"
+
+/* Fully saturated, full value colors for each of the 256 hues. The "rainbow"
+ * table gives equal space to all the primary and secondary colors (yellow and
+ * orange are widened); the "spectrum" table is an even three way ramp between
+ * red, green, and blue.
+ */
+static ws2811_led_t rainbow_table[256];
+static ws2811_led_t spectrum_table[256];
+
+static VALUE sym_mode, sym_rainbow, sym_spectrum, sym_start;
+
+/* ======================================================================= */
+
+static int
+scale8( int i, int scale )
+{
+  return (i * (scale + 1)) >> 8;
+}
+
+static ws2811_led_t
+pp_rainbow_color( int hue )
+{
+  int offset8   = (hue & 0x1f) << 3;
+  int third     = scale8( offset8, 85 );
+  int twothirds = scale8( offset8, 170 );
+  int r, g, b;
+
+  switch (hue >> 5) {
+    case 0:  r = 255 - third;        g = third;              b = 0;                break;
+    case 1:  r = 171;                g = 85 + third;         b = 0;                break;
+    case 2:  r = 171 - twothirds;    g = 170 + third;        b = 0;                break;
+    case 3:  r = 0;                  g = 255 - third;        b = third;            break;
+    case 4:  r = 0;                  g = 171 - twothirds;    b = 85 + twothirds;   break;
+    case 5:  r = third;              g = 0;                  b = 255 - third;      break;
+    case 6:  r = 85 + third;         g = 0;                  b = 171 - third;      break;
+    default: r = 170 + third;        g = 0;                  b = 85 - third;       break;
+  }
+
+  return RGB2COLOR(r, g, b);
+}
+
+static ws2811_led_t
+pp_spectrum_color( int hue )
+{
+  int h      = (hue * 192) >> 8;
+  int rampup = ((h & 0x3f) * 255) / 63;
+  int rampdn = 255 - rampup;
+
+  switch (h >> 6) {
+    case 0:  return RGB2COLOR(rampdn, rampup, 0);
+    case 1:  return RGB2COLOR(0, rampdn, rampup);
+    default: return RGB2COLOR(rampup, 0, rampdn);
+  }
+}
+
+/* Apply saturation and value to a fully saturated hue color. Both `sat` and
+ * `val` are 0..256 fixed-point factors. The red and blue bytes are scaled
+ * together in one 32-bit multiply and the green byte in another.
+ */
+static inline ws2811_led_t
+pp_hsv_scale( ws2811_led_t color, uint32_t sat, uint32_t val )
+{
+  uint32_t base = 256 - sat;
+  uint32_t rb = ((((color & 0x00ff00ff) * sat + 0x00ff00ff * base) >> 8) & 0x00ff00ff);
+  uint32_t g  = ((((color >> 8) & 0xff) * sat + 0xff * base) >> 8);
+
+  rb = ((rb * val) >> 8) & 0x00ff00ff;
+  g  = ((g * val) >> 8) & 0xff;
+
+  return rb | (g << 8);
+}
+
+static const ws2811_led_t*
+pp_hue_table( VALUE opts )
+{
+  VALUE mode;
+
+  if (NIL_P(opts)) return rainbow_table;
+  Check_Type( opts, T_HASH );
+
+  mode = rb_hash_lookup( opts, sym_mode );
+  if (NIL_P(mode) || mode == sym_rainbow) return rainbow_table;
+  if (mode == sym_spectrum) return spectrum_table;
+
+  rb_raise( rb_eArgError, "unknown HSV mode: %s", RSTRING_PTR(rb_inspect(mode)) );
+  return NULL;
+}
+
+/* Convert an 8-bit saturation or value into a 0..256 fixed-point factor */
+static uint32_t
+pp_hsv_factor( VALUE num )
+{
+  uint32_t n = NUM2UINT(num) & 0xff;
+  return n + (n >> 7);
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    fill_hsv( hue, saturation, value, options = {} )
+ *
+ * Set all the LEDs to the color given by `hue`, `saturation` and `value`. Each
+ * component is a value between 0 and 255.
+ *
+ * options - Hash of arguments
+ *   :mode - `:rainbow` (default) or `:spectrum` hue mapping
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_fill_hsv( int argc, VALUE* argv, VALUE self )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_buffer( self, &count );
+  const ws2811_led_t *table;
+  ws2811_led_t color;
+  VALUE hue, sat, val, opts;
+  int ii;
+
+  rb_scan_args( argc, argv, "31", &hue, &sat, &val, &opts );
+  table = pp_hue_table( opts );
+
+  color = pp_hsv_scale( table[NUM2UINT(hue) & 0xff], pp_hsv_factor(sat), pp_hsv_factor(val) );
+  for (ii=0; ii<count; ii++) {
+    leds[ii] = color;
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    fill_hue_gradient( start_hue, end_hue, saturation = 255, value = 255, options = {} )
+ *
+ * Fill the LEDs with a gradient that runs from `start_hue` on the first LED to
+ * `end_hue` on the last LED. Hues are between 0 and 255 and wrap around, so an
+ * `end_hue` of 256 draws one complete rainbow and an `end_hue` smaller than the
+ * `start_hue` runs the gradient backwards.
+ *
+ * options - Hash of arguments
+ *   :mode - `:rainbow` (default) or `:spectrum` hue mapping
+ *
+ * Examples:
+ *    leds.fill_hue_gradient( 0, 256 )
+ *    leds.fill_hue_gradient( 160, 96, 255, 64, :mode => :spectrum )
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_fill_hue_gradient( int argc, VALUE* argv, VALUE self )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_buffer( self, &count );
+  const ws2811_led_t *table;
+  VALUE hue1, hue2, sat, val, opts;
+  uint32_t s = 256, v = 256;
+  uint32_t hue, step;
+  int ii;
+
+  rb_scan_args( argc, argv, "23", &hue1, &hue2, &sat, &val, &opts );
+  if (TYPE(sat) == T_HASH) { opts = sat; sat = Qnil; }
+  if (TYPE(val) == T_HASH) { opts = val; val = Qnil; }
+
+  table = pp_hue_table( opts );
+  if (!NIL_P(sat)) s = pp_hsv_factor( sat );
+  if (!NIL_P(val)) v = pp_hsv_factor( val );
+
+  /* hues are stepped in 16.16 fixed-point; wrapping keeps the low hue bits */
+  hue  = (uint32_t) NUM2INT(hue1) * 65536;
+  step = 0;
+  if (count > 1) {
+    int64_t span = ((int64_t) NUM2INT(hue2) - NUM2INT(hue1)) * 65536;
+    step = (uint32_t) (int32_t) (span / (count - 1));
+  }
+
+  for (ii=0; ii<count; ii++) {
+    leds[ii] = pp_hsv_scale( table[(hue >> 16) & 0xff], s, v );
+    hue += step;
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    set_hsv_pixels( packed_hsv, options = {} )
+ *
+ * Convert packed HSV colors into the LED buffer. The `packed_hsv` String holds
+ * three bytes - hue, saturation, and value - for each LED as created by
+ * `ary.pack("C*")`. Colors that would extend past the end of the LED string
+ * are ignored.
+ *
+ * options - Hash of arguments
+ *   :start - the first LED to set defaults to 0
+ *   :mode  - `:rainbow` (default) or `:spectrum` hue mapping
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_set_hsv_pixels( int argc, VALUE* argv, VALUE self )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_buffer( self, &count );
+  const ws2811_led_t *table;
+  const uint8_t *hsv;
+  VALUE str, opts, tmp;
+  long ii, beg = 0, len;
+
+  rb_scan_args( argc, argv, "11", &str, &opts );
+  StringValue( str );
+  table = pp_hue_table( opts );
+
+  if (!NIL_P(opts) && !NIL_P(tmp = rb_hash_lookup( opts, sym_start ))) {
+    beg = NUM2LONG(tmp);
+    if (beg < 0) beg += count;
+    if (beg < 0 || beg > count) {
+      rb_raise( rb_eIndexError, "index %ld is outside of LED range: 0...%ld", NUM2LONG(tmp), count-1 );
+    }
+  }
+
+  if (RSTRING_LEN(str) % 3) {
+    rb_raise( rb_eArgError, "packed HSV String length must be a multiple of 3: %ld", RSTRING_LEN(str) );
+  }
+
+  hsv = (const uint8_t*) RSTRING_PTR(str);
+  len = MIN(RSTRING_LEN(str) / 3, count - beg);
+
+  for (ii=0; ii<len; ii++, hsv+=3) {
+    uint32_t s = hsv[1] + (hsv[1] >> 7);
+    uint32_t v = hsv[2] + (hsv[2] >> 7);
+    leds[beg+ii] = pp_hsv_scale( table[hsv[0]], s, v );
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    PixelPi::HSV(hue, saturation, value)  #=> 24-bit color
+ *    PixelPi::HSV(hue, saturation, value, :mode => :spectrum)  #=> 24-bit color
+ *
+ * Given a set of HSV values return a single 24-bit color value. The HSV values
+ * are numbers in the range 0..255.
+ *
+ * Returns a 24-bit RGB color value.
+ */
+static VALUE
+pp_hsv( int argc, VALUE* argv, VALUE klass )
+{
+  const ws2811_led_t *table;
+  VALUE hue, sat, val, opts;
+
+  rb_scan_args( argc, argv, "31", &hue, &sat, &val, &opts );
+  table = pp_hue_table( opts );
+
+  return INT2FIX(pp_hsv_scale( table[NUM2UINT(hue) & 0xff], pp_hsv_factor(sat), pp_hsv_factor(val) ));
+}
+
+void Init_color( )
+{
+  int ii;
+
+  for (ii=0; ii<256; ii++) {
+    rainbow_table[ii]  = pp_rainbow_color( ii );
+    spectrum_table[ii] = pp_spectrum_color( ii );
+  }
+
+  sym_mode     = ID2SYM(rb_intern( "mode" ));
+  sym_rainbow  = ID2SYM(rb_intern( "rainbow" ));
+  sym_spectrum = ID2SYM(rb_intern( "spectrum" ));
+  sym_start    = ID2SYM(rb_intern( "start" ));
+
+  rb_define_method( cLeds, "fill_hsv",          pp_leds_fill_hsv,          -1 );
+  rb_define_method( cLeds, "fill_hue_gradient", pp_leds_fill_hue_gradient, -1 );
+  rb_define_method( cLeds, "set_hsv_pixels",    pp_leds_set_hsv_pixels,    -1 );
+
+  rb_define_method( cSlice, "fill_hsv",          pp_leds_fill_hsv,          -1 );
+  rb_define_method( cSlice, "fill_hue_gradient", pp_leds_fill_hue_gradient, -1 );
+  rb_define_method( cSlice, "set_hsv_pixels",    pp_leds_set_hsv_pixels,    -1 );
+
+  rb_define_module_function( mPixelPi, "HSV", pp_hsv, -1 );
+}
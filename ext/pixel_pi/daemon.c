@@ -0,0 +1,1022 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* accept4, memfd_create */
+#endif
+#include "pixel_pi.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <ruby/thread.h>
+
+/* An output daemon that owns the LEDs so other processes can show frames on
+ * them without setting up the DMA and PWM hardware themselves. The strip
+ * keeps showing the last frame when a client exits or crashes, and clients
+ * connect in a few microseconds instead of paying for `ws2811_init`.
+ *
+ * Clients connect to a Unix sequenced-packet socket. On accept the daemon
+ * creates a memfd for the client, maps it, and sends a hello message with the
+ * settings of the LEDs and the memfd attached as SCM_RIGHTS. The memfd is
+ * sealed against resizing first, so a client cannot truncate it under the
+ * mapping of the daemon. The shared memory holds one frame: the 32-bit colors of every LED followed, when the LEDs
+ * dither, by their 16-bit red, green, and blue values.
+ *
+ * To show a frame the client copies its LED buffer into the shared memory and
+ * sends a show message with the brightness, and the gamma and white balance
+ * when they have changed. The daemon copies the frame into its own LEDs,
+ * calls `show`, and replies with a status word - 0, or a negated errno value
+ * when the frame was not shown; the client waits for the reply, so the shared
+ * memory is never written while the daemon reads it. A client that gives up
+ * waiting disconnects, so a late reply is never taken for the next one.
+ */
+
+#define PP_DAEMON_PATH        "/run/pixel_pi.sock"
+#define PP_DAEMON_MAGIC       "PXPIDMN"
+#define PP_DAEMON_VERSION     1
+#define PP_DAEMON_MODE        0660
+#define PP_DAEMON_EVENTS      32
+#define PP_DAEMON_TIMEOUT     2     /* seconds a client waits for a reply */
+
+#define PP_DAEMON_SHOW        1
+#define PP_DAEMON_CORRECTION  1     /* show message flag: gamma and white balance follow */
+
+/* Sent by the daemon to each new client along with the memfd */
+typedef struct {
+  char      magic[8];
+  char      strip_type[8];         /* strip type name such as "grb" */
+  uint32_t  version;
+  uint32_t  count;
+  uint32_t  gpionum;
+  uint32_t  dmanum;
+  uint32_t  freq;
+  uint32_t  invert;
+  uint32_t  brightness;
+  uint32_t  dither;                /* 16-bit colors follow the frame */
+  int32_t   white_balance[3];
+  uint32_t  reserved;
+  double    gamma[3];
+  uint64_t  shm_size;
+} pp_daemon_hello_t;
+
+/* Sent by a client to show the frame in its shared memory */
+typedef struct {
+  uint32_t  type;
+  uint32_t  brightness;
+  uint32_t  flags;
+  int32_t   white_balance[3];
+  double    gamma[3];
+} pp_daemon_show_t;
+
+typedef struct pp_daemon_conn {
+  struct pp_daemon_conn *next;
+  int       fd;
+  uint8_t  *shm;                   /* frame shared with the client */
+  size_t    shm_size;
+} pp_daemon_conn_t;
+
+typedef struct {
+  VALUE              leds;         /* PixelPi::Leds the frames are shown on */
+  VALUE              path;         /* path of the socket */
+  int                fd;           /* listening socket, -1 once closed */
+  int                epfd;         /* epoll set of the daemon and its clients */
+  pp_daemon_conn_t  *clients;
+  long               client_count;
+  uint64_t           connections;  /* clients accepted */
+  uint64_t           frames;       /* frames shown */
+  uint64_t           ignored;      /* malformed messages */
+} pp_daemon_t;
+
+typedef struct {
+  int                 epfd;
+  int                 timeout;     /* milliseconds, -1 to wait forever */
+  int                 result;
+  int                 error;
+  struct epoll_event  events[PP_DAEMON_EVENTS];
+} pp_daemon_wait_t;
+
+/* The daemon connection of a PixelPi::Leds returned by `Leds.connect` */
+typedef struct {
+  pp_output_t    output;
+  int            fd;               /* connection to the daemon, -1 once closed */
+  uint8_t       *shm;
+  size_t         shm_size;
+  double         gamma[3];         /* correction the daemon was last sent */
+  int            white_balance[3];
+} pp_daemon_client_t;
+
+/* One request and reply between a client and the daemon */
+typedef struct {
+  int                fd;
+  struct msghdr      msg;
+  pp_daemon_show_t  *show;         /* NULL to only receive */
+  ssize_t            result;
+  int                error;
+} pp_daemon_io_t;
+
+VALUE cDaemon;
+
+static VALUE sym_path, sym_mode, sym_connections, sym_clients, sym_frames, sym_ignored;
+static ID id_gamma, id_white_balance, id_gamma_set, id_white_balance_set, id_strip_type;
+
+/* ======================================================================= */
+
+static size_t
+pp_daemon_shm_size( long count, int dither )
+{
+  size_t size = count * sizeof(ws2811_led_t);
+  long page = sysconf( _SC_PAGESIZE );
+
+  if (dither) size += count * 3 * sizeof(uint16_t);
+  if (page <= 0) page = 4096;
+  return size ? (size + page - 1) & ~(size_t) (page - 1) : (size_t) page;
+}
+
+static void
+pp_daemon_disconnect( pp_daemon_t *daemon, pp_daemon_conn_t *conn )
+{
+  pp_daemon_conn_t **ptr;
+
+  for (ptr = &daemon->clients; *ptr; ptr = &(*ptr)->next) {
+    if (*ptr == conn) {
+      *ptr = conn->next;
+      break;
+    }
+  }
+  epoll_ctl( daemon->epfd, EPOLL_CTL_DEL, conn->fd, NULL );
+  close( conn->fd );
+  munmap( conn->shm, conn->shm_size );
+  xfree( conn );
+  daemon->client_count -= 1;
+}
+
+/* Returns 1 if the client is still connected to the daemon */
+static int
+pp_daemon_connected( pp_daemon_t *daemon, pp_daemon_conn_t *conn )
+{
+  pp_daemon_conn_t *ptr;
+
+  for (ptr = daemon->clients; ptr; ptr = ptr->next) {
+    if (ptr == conn) return 1;
+  }
+  return 0;
+}
+
+/* Close the listening socket, the clients, and the epoll set. The socket
+ * file is removed. */
+static void
+pp_daemon_shutdown( pp_daemon_t *daemon )
+{
+  while (daemon->clients) pp_daemon_disconnect( daemon, daemon->clients );
+  if (daemon->epfd >= 0) close( daemon->epfd );
+  if (daemon->fd >= 0) {
+    close( daemon->fd );
+    unlink( RSTRING_PTR(daemon->path) );
+  }
+  daemon->epfd = -1;
+  daemon->fd   = -1;
+}
+
+static void
+pp_daemon_mark( void *ptr )
+{
+  pp_daemon_t *daemon = (pp_daemon_t*) ptr;
+  rb_gc_mark( daemon->leds );
+  rb_gc_mark( daemon->path );
+}
+
+static void
+pp_daemon_free( void *ptr )
+{
+  pp_daemon_t *daemon;
+  if (NULL == ptr) return;
+
+  daemon = (pp_daemon_t*) ptr;
+  pp_daemon_shutdown( daemon );
+  xfree( daemon );
+}
+
+static VALUE
+pp_daemon_allocate( VALUE klass )
+{
+  pp_daemon_t *daemon;
+
+  daemon = ALLOC_N( pp_daemon_t, 1 );
+  if (!daemon) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::Daemon instance");
+  }
+  memset( daemon, 0, sizeof(pp_daemon_t) );
+  daemon->leds = Qnil;
+  daemon->path = Qnil;
+  daemon->fd   = -1;
+  daemon->epfd = -1;
+
+  return Data_Wrap_Struct( klass, pp_daemon_mark, pp_daemon_free, daemon );
+}
+
+static pp_daemon_t*
+pp_daemon_struct( VALUE self )
+{
+  pp_daemon_t *daemon;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_daemon_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::Daemon object" );
+  }
+  Data_Get_Struct( self, pp_daemon_t, daemon );
+
+  if (daemon->fd < 0) {
+    rb_raise( ePixelPiError, "Daemon is closed" );
+  }
+  return daemon;
+}
+
+/* Fill in a Unix socket address; raises an ArgumentError if the path is too
+ * long. */
+static void
+pp_daemon_address( VALUE path, struct sockaddr_un *addr )
+{
+  memset( addr, 0, sizeof(*addr) );
+  addr->sun_family = AF_UNIX;
+  if (RSTRING_LEN(path) == 0 || RSTRING_LEN(path) >= (long) sizeof(addr->sun_path)) {
+    rb_raise( rb_eArgError, "invalid socket path: %s", RSTRING_PTR(path) );
+  }
+  memcpy( addr->sun_path, RSTRING_PTR(path), RSTRING_LEN(path) );
+}
+
+/* Bind the socket, replacing a socket file left behind by a daemon that
+ * exited; nothing accepts connections on a stale socket. */
+static int
+pp_daemon_bind( int fd, const struct sockaddr_un *addr )
+{
+  int probe, stale;
+
+  if (bind( fd, (const struct sockaddr*) addr, sizeof(*addr) ) == 0) return 0;
+  if (errno != EADDRINUSE) return -1;
+
+  probe = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if (probe < 0) return -1;
+  stale = connect( probe, (const struct sockaddr*) addr, sizeof(*addr) ) < 0 && errno == ECONNREFUSED;
+  close( probe );
+
+  if (!stale) {
+    errno = EADDRINUSE;
+    return -1;
+  }
+  unlink( addr->sun_path );
+  return bind( fd, (const struct sockaddr*) addr, sizeof(*addr) );
+}
+
+/* Send the hello message and the memfd of a new client */
+static int
+pp_daemon_hello( pp_daemon_t *daemon, int fd, int memfd, size_t shm_size )
+{
+  ws2811_t *ledstring = pp_leds_struct( daemon->leds );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  pp_daemon_hello_t hello;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct cmsghdr *cmsg;
+  struct msghdr msg;
+  struct iovec iov;
+  VALUE strip_type;
+  ssize_t n;
+
+  memset( &hello, 0, sizeof(hello) );
+  memcpy( hello.magic, PP_DAEMON_MAGIC, sizeof(PP_DAEMON_MAGIC) );
+  strip_type = rb_funcall( daemon->leds, id_strip_type, 0 );
+  if (SYMBOL_P(strip_type)) {
+    strncpy( hello.strip_type, rb_id2name( SYM2ID(strip_type) ), sizeof(hello.strip_type) - 1 );
+  }
+  hello.version    = PP_DAEMON_VERSION;
+  hello.count      = channel->count;
+  hello.gpionum    = channel->gpionum;
+  hello.dmanum     = ledstring->dmanum;
+  hello.freq       = ledstring->freq;
+  hello.invert     = channel->invert;
+  hello.brightness = channel->brightness & 0xff;
+  hello.dither     = channel->leds16 ? 1 : 0;
+  hello.shm_size   = shm_size;
+  pp_parse_gamma( rb_ivar_get( daemon->leds, id_gamma ), hello.gamma );
+  pp_parse_white_balance( rb_ivar_get( daemon->leds, id_white_balance ), hello.white_balance );
+
+  iov.iov_base = &hello;
+  iov.iov_len  = sizeof(hello);
+  memset( &msg, 0, sizeof(msg) );
+  memset( &control, 0, sizeof(control) );
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  cmsg = CMSG_FIRSTHDR( &msg );
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy( CMSG_DATA(cmsg), &memfd, sizeof(int) );
+
+  do {
+    n = sendmsg( fd, &msg, MSG_NOSIGNAL );
+  } while (n < 0 && errno == EINTR);
+
+  return n == (ssize_t) sizeof(hello) ? 0 : -1;
+}
+
+/* Accept every pending connection and hand each client its shared memory */
+static void
+pp_daemon_accept( pp_daemon_t *daemon )
+{
+  ws2811_channel_t *channel = &pp_leds_struct( daemon->leds )->channel[0];
+  size_t shm_size = pp_daemon_shm_size( channel->count, channel->leds16 != NULL );
+
+  for (;;) {
+    pp_daemon_conn_t *conn;
+    struct epoll_event ev;
+    uint8_t *shm;
+    int memfd, fd = accept4( daemon->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+
+    memfd = memfd_create( "pixel_pi", MFD_CLOEXEC | MFD_ALLOW_SEALING );
+    if (memfd < 0 || ftruncate( memfd, shm_size ) < 0
+    ||  fcntl( memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL ) < 0) {
+      if (memfd >= 0) close( memfd );
+      close( fd );
+      continue;
+    }
+
+    shm = mmap( NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+    if (shm == MAP_FAILED) {
+      close( memfd );
+      close( fd );
+      continue;
+    }
+
+    /* the client keeps its own descriptor; the mapping is all the daemon needs */
+    if (pp_daemon_hello( daemon, fd, memfd, shm_size ) < 0) {
+      close( memfd );
+      munmap( shm, shm_size );
+      close( fd );
+      continue;
+    }
+    close( memfd );
+
+    conn = ALLOC( pp_daemon_conn_t );
+    conn->fd       = fd;
+    conn->shm      = shm;
+    conn->shm_size = shm_size;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl( daemon->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0) {
+      munmap( shm, shm_size );
+      close( fd );
+      xfree( conn );
+      continue;
+    }
+
+    conn->next      = daemon->clients;
+    daemon->clients = conn;
+    daemon->client_count += 1;
+    daemon->connections  += 1;
+  }
+}
+
+/* Returns the gamma as a Float when it is the same for all three colors, or
+ * as an Array of red, green, and blue values. */
+static VALUE
+pp_daemon_gamma_value( const double gamma[3] )
+{
+  if (gamma[0] == gamma[1] && gamma[1] == gamma[2]) return rb_float_new( gamma[0] );
+  return rb_ary_new3( 3, rb_float_new( gamma[0] ), rb_float_new( gamma[1] ), rb_float_new( gamma[2] ) );
+}
+
+static VALUE
+pp_daemon_show_leds( VALUE leds )
+{
+  return pp_leds_show( leds );
+}
+
+/* Set the gamma and white balance of a show message on the LEDs */
+static VALUE
+pp_daemon_correction( VALUE arg )
+{
+  VALUE leds = ((VALUE*) arg)[0];
+  const pp_daemon_show_t *show = (const pp_daemon_show_t*) ((VALUE*) arg)[1];
+
+  rb_funcall( leds, id_gamma_set, 1, pp_daemon_gamma_value( show->gamma ) );
+  rb_funcall( leds, id_white_balance_set, 1,
+              INT2FIX(RGB2COLOR(show->white_balance[0], show->white_balance[1], show->white_balance[2])) );
+  return Qtrue;
+}
+
+static VALUE
+pp_daemon_rejected( VALUE arg, VALUE error )
+{
+  return Qfalse;
+}
+
+/* Set the correction of a show message, rescuing the StandardError raised
+ * when the LEDs do not accept it.
+ *
+ * Returns Qtrue if the correction was set or Qfalse if it was rejected.
+ */
+static VALUE
+pp_daemon_correction_rescue( VALUE arg )
+{
+  return rb_rescue2( pp_daemon_correction, arg, pp_daemon_rejected, Qnil, rb_eStandardError, (VALUE) 0 );
+}
+
+/* Copy the frame of the client into the LEDs and show it. A gamma or white
+ * balance the LEDs do not accept is a malformed message; any other exception,
+ * from `show` or an interrupt, is left in `state` for the caller.
+ *
+ * Returns 0 on success, -EINVAL if the message is malformed, or -EIO if an
+ * exception was raised.
+ */
+static int
+pp_daemon_frame( pp_daemon_t *daemon, pp_daemon_conn_t *conn, const pp_daemon_show_t *show, int *state )
+{
+  ws2811_channel_t *channel;
+  ws2811_led_t *leds;
+  long count;
+  int ii;
+
+  if (show->type != PP_DAEMON_SHOW) return -EINVAL;
+
+  if (show->flags & PP_DAEMON_CORRECTION) {
+    VALUE args[2];
+
+    for (ii=0; ii<3; ii++) {
+      if (!(show->gamma[ii] > 0.0) || show->white_balance[ii] < 0 || show->white_balance[ii] > 255) return -EINVAL;
+    }
+    args[0] = daemon->leds;
+    args[1] = (VALUE) show;
+    if (!RTEST(rb_protect( pp_daemon_correction_rescue, (VALUE) args, state ))) {
+      return *state ? -EIO : -EINVAL;
+    }
+    /* the daemon may have been closed by the Ruby code that ran */
+    if (!pp_daemon_connected( daemon, conn )) return -EIO;
+  }
+
+  channel = &pp_leds_struct( daemon->leds )->channel[0];
+  leds = pp_leds_buffer( daemon->leds, &count );
+  if (count * sizeof(ws2811_led_t) > conn->shm_size) return -EINVAL;
+  memcpy( leds, conn->shm, count * sizeof(ws2811_led_t) );
+  if (channel->leds16 && count * (sizeof(ws2811_led_t) + 3 * sizeof(uint16_t)) <= conn->shm_size) {
+    memcpy( channel->leds16, conn->shm + count * sizeof(ws2811_led_t), count * 3 * sizeof(uint16_t) );
+  }
+  channel->brightness = show->brightness & 0xff;
+
+  rb_protect( pp_daemon_show_leds, daemon->leds, state );
+  return *state ? -EIO : 0;
+}
+
+/* Handle the messages the client has sent. The client is closed when it
+ * disconnects or the read fails. An exception raised by `show` is passed on
+ * once the client has its reply.
+ *
+ * Returns the number of frames shown.
+ */
+static long
+pp_daemon_read( pp_daemon_t *daemon, pp_daemon_conn_t *conn )
+{
+  pp_daemon_show_t show;
+  long frames = 0;
+  int32_t status;
+  ssize_t n;
+  int state = 0;
+
+  for (;;) {
+    n = recv( conn->fd, &show, sizeof(show), MSG_DONTWAIT | MSG_TRUNC );
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return frames;
+    if (n <= 0) {
+      pp_daemon_disconnect( daemon, conn );
+      return frames;
+    }
+
+    status = n != (ssize_t) sizeof(show) ? -EINVAL : pp_daemon_frame( daemon, conn, &show, &state );
+    if (status < 0) {
+      if (!state) daemon->ignored += 1;
+    } else {
+      daemon->frames += 1;
+      frames += 1;
+    }
+
+    /* `show` can run Ruby code, and another thread may have closed the
+     * daemon and freed its clients in the meantime */
+    if (!pp_daemon_connected( daemon, conn )) {
+      if (state) rb_jump_tag( state );
+      return frames;
+    }
+
+    do {
+      n = send( conn->fd, &status, sizeof(status), MSG_NOSIGNAL | MSG_DONTWAIT );
+    } while (n < 0 && errno == EINTR);
+
+    if (state) rb_jump_tag( state );
+    if (n < 0) {
+      pp_daemon_disconnect( daemon, conn );
+      return frames;
+    }
+  }
+}
+
+static void*
+pp_daemon_wait( void *ptr )
+{
+  pp_daemon_wait_t *wait = (pp_daemon_wait_t*) ptr;
+
+  wait->result = epoll_wait( wait->epfd, wait->events, PP_DAEMON_EVENTS, wait->timeout );
+  wait->error  = errno;
+  return NULL;
+}
+
+/* Send the request, if any, and receive the reply. Interrupted calls are
+ * restarted; the socket timeouts bound how long this can take. */
+static void*
+pp_daemon_io( void *ptr )
+{
+  pp_daemon_io_t *io = (pp_daemon_io_t*) ptr;
+
+  if (io->show) {
+    do {
+      io->result = send( io->fd, io->show, sizeof(*io->show), MSG_NOSIGNAL );
+    } while (io->result < 0 && errno == EINTR);
+    if (io->result < 0) {
+      io->error = errno;
+      return NULL;
+    }
+  }
+
+  do {
+    io->result = recvmsg( io->fd, &io->msg, MSG_CMSG_CLOEXEC );
+  } while (io->result < 0 && errno == EINTR);
+  io->error = io->result < 0 ? errno : (io->result == 0 ? ECONNRESET : 0);
+  return NULL;
+}
+
+/* Disconnect a PixelPi::Leds from its daemon. The LEDs keep showing the last
+ * frame. */
+static void
+pp_daemon_client_close( pp_output_t *output )
+{
+  pp_daemon_client_t *client = (pp_daemon_client_t*) output;
+
+  if (client->fd >= 0) close( client->fd );
+  if (client->shm) munmap( client->shm, client->shm_size );
+  client->fd  = -1;
+  client->shm = NULL;
+}
+
+static void
+pp_daemon_client_free( pp_output_t *output )
+{
+  pp_daemon_client_close( output );
+  xfree( output );
+}
+
+/* Show the LED buffer of a PixelPi::Leds connected to a daemon. The buffer is
+ * copied to the shared memory in strip order and the daemon is asked to show
+ * it. The connection is closed when the request or the reply fails. Raises
+ * nothing, so `show` can restore its buffers first.
+ *
+ * Returns 0 on success or a negated errno value.
+ */
+static int
+pp_daemon_render( pp_output_t *output, VALUE self, ws2811_channel_t *channel )
+{
+  pp_daemon_client_t *client = (pp_daemon_client_t*) output;
+  pp_daemon_show_t show;
+  pp_daemon_io_t io;
+  struct iovec iov;
+  int32_t status = 0;
+  size_t size = channel->count * sizeof(ws2811_led_t);
+
+  if (client->fd < 0) return -ENOTCONN;
+
+  pp_leds_normalize( channel );
+  memcpy( client->shm, channel->leds, size );
+  if (channel->leds16) memcpy( client->shm + size, channel->leds16, channel->count * 3 * sizeof(uint16_t) );
+
+  memset( &show, 0, sizeof(show) );
+  show.type       = PP_DAEMON_SHOW;
+  show.brightness = channel->brightness & 0xff;
+  pp_parse_gamma( rb_ivar_get( self, id_gamma ), show.gamma );
+  pp_parse_white_balance( rb_ivar_get( self, id_white_balance ), show.white_balance );
+  if (memcmp( show.gamma, client->gamma, sizeof(show.gamma) ) != 0
+  ||  memcmp( show.white_balance, client->white_balance, sizeof(show.white_balance) ) != 0) {
+    show.flags |= PP_DAEMON_CORRECTION;
+  }
+
+  memset( &io, 0, sizeof(io) );
+  iov.iov_base = &status;
+  iov.iov_len  = sizeof(status);
+  io.fd   = client->fd;
+  io.show = &show;
+  io.msg.msg_iov    = &iov;
+  io.msg.msg_iovlen = 1;
+  rb_thread_call_without_gvl( pp_daemon_io, &io, RUBY_UBF_IO, NULL );
+
+  /* the reply may still arrive; it must not be read as the reply to the
+   * next frame */
+  if (io.error) {
+    pp_daemon_client_close( output );
+    if (io.error == EAGAIN || io.error == EWOULDBLOCK) return -ETIMEDOUT;
+    return -io.error;
+  }
+  if (io.result != (ssize_t) sizeof(status)) {
+    pp_daemon_client_close( output );
+    return -EIO;
+  }
+  if (status != 0) return status < 0 ? status : -EIO;
+
+  if (show.flags & PP_DAEMON_CORRECTION) {
+    memcpy( client->gamma, show.gamma, sizeof(show.gamma) );
+    memcpy( client->white_balance, show.white_balance, sizeof(show.white_balance) );
+  }
+  return 0;
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::Daemon.new( leds, options = {} )
+ *
+ * Serve the `leds` to other processes over a Unix socket. Clients connect
+ * with `PixelPi::Leds.connect` and get a PixelPi::Leds that shows its frames
+ * here; the daemon process keeps the DMA channel set up and the strip keeps
+ * the last frame when a client goes away. Connections are accepted and frames
+ * shown each time `poll` is called.
+ *
+ * A client that changes the gamma or white balance changes them for these
+ * LEDs as well.
+ *
+ * options - Hash of arguments
+ *   :path - path of the socket; defaults to "/run/pixel_pi.sock". A stale
+ *           socket left behind by a daemon that exited is replaced.
+ *   :mode - permissions of the socket; defaults to 0660
+ *
+ * Examples:
+ *    leds   = PixelPi::Leds.new( 300, 18, :gamma => 2.2 )
+ *    daemon = PixelPi::Daemon.new( leds )
+ *    loop { daemon.poll }
+ */
+static VALUE
+pp_daemon_initialize( int argc, VALUE* argv, VALUE self )
+{
+  pp_daemon_t *daemon;
+  VALUE leds, opts, tmp, path = Qnil;
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  long mode = PP_DAEMON_MODE;
+  int fd, err;
+
+  rb_scan_args( argc, argv, "11", &leds, &opts );
+
+  Data_Get_Struct( self, pp_daemon_t, daemon );
+  if (daemon->fd >= 0) rb_raise( ePixelPiError, "Daemon is already initialized" );
+  if (!pp_leds_struct( leds )->device) {
+    rb_raise( rb_eArgError, "LEDs without a DMA channel cannot be served" );
+  }
+
+  if (!NIL_P(opts)) {
+    Check_Type( opts, T_HASH );
+
+    path = rb_hash_lookup( opts, sym_path );
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_mode ))) mode = NUM2LONG(tmp);
+  }
+
+  if (NIL_P(path)) path = rb_str_new2( PP_DAEMON_PATH );
+  path = rb_str_new4( rb_get_path( path ) );
+  pp_daemon_address( path, &addr );
+
+  fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if (fd < 0) rb_sys_fail( "socket" );
+
+  if (pp_daemon_bind( fd, &addr ) < 0) {
+    err = errno;
+    close( fd );
+    rb_syserr_fail_str( err, path );
+  }
+
+  daemon->fd   = fd;
+  daemon->path = path;
+  daemon->leds = leds;
+
+  if (listen( fd, 16 ) < 0 || chmod( addr.sun_path, (mode_t) mode ) < 0) {
+    err = errno;
+    pp_daemon_shutdown( daemon );
+    rb_syserr_fail_str( err, path );
+  }
+
+  daemon->epfd = epoll_create1( EPOLL_CLOEXEC );
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (daemon->epfd < 0 || epoll_ctl( daemon->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0) {
+    err = errno;
+    pp_daemon_shutdown( daemon );
+    rb_syserr_fail( err, "epoll" );
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    poll( timeout = nil )   #=> frame count
+ *
+ * Wait up to `timeout` seconds for clients to connect or send frames, then
+ * accept the new connections and show the frames that have arrived. With a
+ * `nil` timeout this waits until something happens; a timeout of 0 never
+ * waits. Other Ruby threads run while waiting.
+ *
+ * Returns the number of frames shown.
+ */
+static VALUE
+pp_daemon_poll( int argc, VALUE* argv, VALUE self )
+{
+  pp_daemon_t *daemon = pp_daemon_struct( self );
+  pp_daemon_wait_t wait;
+  VALUE timeout;
+  long total = 0;
+  int ii;
+
+  rb_scan_args( argc, argv, "01", &timeout );
+
+  wait.epfd    = daemon->epfd;
+  wait.timeout = -1;
+  if (!NIL_P(timeout)) {
+    double secs = NUM2DBL(timeout);
+    if (secs < 0.0) rb_raise( rb_eArgError, "timeout cannot be negative: %g", secs );
+    wait.timeout = secs > 2000000.0 ? 2000000000 : (int) (secs * 1000.0 + 0.5);
+  }
+
+  for (;;) {
+    rb_thread_call_without_gvl( pp_daemon_wait, &wait, RUBY_UBF_IO, NULL );
+    if (wait.result >= 0) break;
+    if (wait.error != EINTR) rb_syserr_fail( wait.error, "epoll_wait" );
+    rb_thread_check_ints();
+    daemon = pp_daemon_struct( self );
+  }
+
+  /* the listening socket is handled last so a client accepted now is not
+   * confused with one that was reported ready */
+  for (ii=0; ii<wait.result; ii++) {
+    pp_daemon_conn_t *conn = (pp_daemon_conn_t*) wait.events[ii].data.ptr;
+    if (!conn) continue;
+
+    if (daemon->fd < 0) return LONG2NUM(total);
+    if (pp_daemon_connected( daemon, conn )) total += pp_daemon_read( daemon, conn );
+  }
+  if (daemon->fd < 0) return LONG2NUM(total);
+  for (ii=0; ii<wait.result; ii++) {
+    if (!wait.events[ii].data.ptr) pp_daemon_accept( daemon );
+  }
+
+  return LONG2NUM(total);
+}
+
+/* call-seq:
+ *    stats   #=> Hash
+ *
+ * Returns the counters of the daemon as a Hash:
+ *
+ *   :connections - clients accepted
+ *   :clients     - clients connected now
+ *   :frames      - frames shown
+ *   :ignored     - malformed messages
+ */
+static VALUE
+pp_daemon_stats( VALUE self )
+{
+  pp_daemon_t *daemon = pp_daemon_struct( self );
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset( hash, sym_connections, ULL2NUM(daemon->connections) );
+  rb_hash_aset( hash, sym_clients,     LONG2NUM(daemon->client_count) );
+  rb_hash_aset( hash, sym_frames,      ULL2NUM(daemon->frames) );
+  rb_hash_aset( hash, sym_ignored,     ULL2NUM(daemon->ignored) );
+
+  return hash;
+}
+
+/* call-seq:
+ *    path
+ *
+ * Returns the path of the socket.
+ */
+static VALUE
+pp_daemon_path( VALUE self )
+{
+  pp_daemon_t *daemon = pp_daemon_struct( self );
+  return daemon->path;
+}
+
+/* call-seq:
+ *    close
+ *
+ * Disconnect all the clients, stop listening, and remove the socket. The LEDs
+ * keep showing the last frame.
+ *
+ * Returns `nil`.
+ */
+static VALUE
+pp_daemon_close( VALUE self )
+{
+  pp_daemon_t *daemon;
+
+  Data_Get_Struct( self, pp_daemon_t, daemon );
+  pp_daemon_shutdown( daemon );
+  daemon->leds = Qnil;
+  return Qnil;
+}
+
+/* call-seq:
+ *    closed?
+ *
+ * Returns `true` if the daemon has been closed.
+ */
+static VALUE
+pp_daemon_closed_p( VALUE self )
+{
+  pp_daemon_t *daemon;
+
+  Data_Get_Struct( self, pp_daemon_t, daemon );
+  return daemon->fd < 0 ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+ *    PixelPi::Leds.connect( path = "/run/pixel_pi.sock" )
+ *
+ * Connect to the PixelPi::Daemon listening on `path`. The PixelPi::Leds
+ * returned works like one created with `new` - it has its own LED buffer,
+ * layers, and brightness - but `show` hands the frame to the daemon instead
+ * of driving the DMA channel. The length, GPIO, strip type, and the other
+ * settings of the strip are those of the daemon. Calling `close` disconnects
+ * and leaves the last frame on the strip. A `show` that the daemon does not
+ * answer in time raises Errno::ETIMEDOUT and disconnects as well.
+ *
+ * Examples:
+ *    leds = PixelPi::Leds.connect
+ *    leds.fill( 0xFF0000 ).show
+ *
+ * Returns the new PixelPi::Leds.
+ */
+static VALUE
+pp_leds_connect( int argc, VALUE* argv, VALUE klass )
+{
+  VALUE self, obj, path;
+  pp_daemon_client_t *client;
+  pp_daemon_hello_t hello;
+  pp_daemon_io_t io;
+  ws2811_t *ledstring;
+  ws2811_channel_t *channel;
+  struct sockaddr_un addr;
+  struct timeval tv;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  int memfd = -1, ii;
+
+  rb_scan_args( argc, argv, "01", &path );
+  if (NIL_P(path)) path = rb_str_new2( PP_DAEMON_PATH );
+  path = rb_get_path( path );
+  pp_daemon_address( path, &addr );
+
+  self = rb_obj_alloc( klass );
+  Data_Get_Struct( self, ws2811_t, ledstring );
+  channel = &ledstring->channel[0];
+
+  obj = Data_Make_Struct( 0, pp_daemon_client_t, NULL, pp_output_free, client );
+  client->output.name   = "PixelPi::Daemon";
+  client->output.render = pp_daemon_render;
+  client->output.close  = pp_daemon_client_close;
+  client->output.free   = pp_daemon_client_free;
+  client->fd = -1;
+
+  client->fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if (client->fd < 0) rb_sys_fail( "socket" );
+  if (connect( client->fd, (struct sockaddr*) &addr, sizeof(addr) ) < 0) {
+    int err = errno;
+    pp_daemon_client_close( &client->output );
+    rb_syserr_fail_str( err, path );
+  }
+
+  /* a daemon that stops answering makes `show` fail instead of hang */
+  tv.tv_sec  = PP_DAEMON_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt( client->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+  setsockopt( client->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+
+  memset( &io, 0, sizeof(io) );
+  memset( &control, 0, sizeof(control) );
+  iov.iov_base = &hello;
+  iov.iov_len  = sizeof(hello);
+  io.fd = client->fd;
+  io.msg.msg_iov        = &iov;
+  io.msg.msg_iovlen     = 1;
+  io.msg.msg_control    = control.buf;
+  io.msg.msg_controllen = sizeof(control.buf);
+  rb_thread_call_without_gvl( pp_daemon_io, &io, RUBY_UBF_IO, NULL );
+
+  for (cmsg = io.error ? NULL : CMSG_FIRSTHDR( &io.msg ); cmsg; cmsg = CMSG_NXTHDR( &io.msg, cmsg )) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy( &memfd, CMSG_DATA(cmsg), sizeof(int) );
+    }
+  }
+
+  if (io.error) {
+    pp_daemon_client_close( &client->output );
+    rb_syserr_fail_str( io.error == EAGAIN ? ETIMEDOUT : io.error, path );
+  }
+  if (io.result != (ssize_t) sizeof(hello) || memfd < 0
+  ||  memcmp( hello.magic, PP_DAEMON_MAGIC, sizeof(PP_DAEMON_MAGIC) ) != 0) {
+    if (memfd >= 0) close( memfd );
+    pp_daemon_client_close( &client->output );
+    rb_raise( ePixelPiError, "not a PixelPi daemon: %s", RSTRING_PTR(path) );
+  }
+  if (hello.version != PP_DAEMON_VERSION) {
+    close( memfd );
+    pp_daemon_client_close( &client->output );
+    rb_raise( ePixelPiError, "unsupported daemon version: %u", hello.version );
+  }
+  if (hello.shm_size < pp_daemon_shm_size( hello.count, hello.dither )) {
+    close( memfd );
+    pp_daemon_client_close( &client->output );
+    rb_raise( ePixelPiError, "daemon frame is truncated: %s", RSTRING_PTR(path) );
+  }
+
+  client->shm = mmap( NULL, hello.shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0 );
+  close( memfd );
+  if (client->shm == MAP_FAILED) {
+    int err = errno;
+    client->shm = NULL;
+    pp_daemon_client_close( &client->output );
+    rb_syserr_fail( err, "mmap" );
+  }
+  client->shm_size = hello.shm_size;
+
+  hello.strip_type[sizeof(hello.strip_type) - 1] = '\0';
+  ledstring->freq     = hello.freq;
+  ledstring->dmanum   = hello.dmanum;
+  channel->count      = hello.count;
+  channel->gpionum    = hello.gpionum;
+  channel->invert     = hello.invert;
+  channel->brightness = hello.brightness & 0xff;
+  channel->strip_type = pp_parse_strip_type( ID2SYM(rb_intern( hello.strip_type )) );
+  channel->dither     = hello.dither ? 1 : 0;
+
+  pp_leds_output( self, obj );
+
+  /* start out with the correction of the daemon so nothing is sent until it
+   * changes */
+  for (ii=0; ii<3; ii++) {
+    client->gamma[ii] = hello.gamma[ii];
+    client->white_balance[ii] = hello.white_balance[ii];
+  }
+  rb_funcall( self, id_gamma_set, 1, pp_daemon_gamma_value( hello.gamma ) );
+  rb_funcall( self, id_white_balance_set, 1,
+              INT2FIX(RGB2COLOR(hello.white_balance[0], hello.white_balance[1], hello.white_balance[2])) );
+
+  return self;
+}
+
+void Init_daemon( )
+{
+  sym_path        = ID2SYM(rb_intern( "path" ));
+  sym_mode        = ID2SYM(rb_intern( "mode" ));
+  sym_connections = ID2SYM(rb_intern( "connections" ));
+  sym_clients     = ID2SYM(rb_intern( "clients" ));
+  sym_frames      = ID2SYM(rb_intern( "frames" ));
+  sym_ignored     = ID2SYM(rb_intern( "ignored" ));
+
+  id_gamma             = rb_intern( "@gamma" );
+  id_white_balance     = rb_intern( "@white_balance" );
+  id_gamma_set         = rb_intern( "gamma=" );
+  id_white_balance_set = rb_intern( "white_balance=" );
+  id_strip_type        = rb_intern( "strip_type" );
+
+  cDaemon = rb_define_class_under( mPixelPi, "Daemon", rb_cObject );
+  rb_define_alloc_func( cDaemon, pp_daemon_allocate );
+  rb_define_method( cDaemon, "initialize", pp_daemon_initialize, -1 );
+  rb_define_const( cDaemon, "PATH", rb_obj_freeze( rb_str_new2( PP_DAEMON_PATH ) ) );
+
+  rb_define_method( cDaemon, "poll",    pp_daemon_poll,     -1 );
+  rb_define_method( cDaemon, "stats",   pp_daemon_stats,     0 );
+  rb_define_method( cDaemon, "path",    pp_daemon_path,      0 );
+  rb_define_method( cDaemon, "close",   pp_daemon_close,     0 );
+  rb_define_method( cDaemon, "closed?", pp_daemon_closed_p,  0 );
+
+  rb_define_singleton_method( cLeds, "connect", pp_leds_connect, -1 );
+}
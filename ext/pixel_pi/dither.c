@@ -0,0 +1,169 @@
+#include "pixel_pi.h"
+
+/* ======================================================================= */
+
+/* Returns the 16-bit LED buffer of the channel or raises an error if the LEDs
+ * were not created with the `:dither` option. A pending `rotate` or `reverse`
+ * is applied first so both buffers are in order.
+ */
+static uint16_t*
+pp_leds16( ws2811_channel_t *channel )
+{
+  if (!channel->leds16) {
+    rb_raise( ePixelPiError, "16-bit LEDs are not enabled; use the :dither option" );
+  }
+  pp_leds_normalize( channel );
+  return channel->leds16;
+}
+
+/* Store a 16-bit color in the 16-bit buffer and its high bytes in the 8-bit
+ * buffer. The encoder only uses the 16-bit value while the two agree.
+ */
+static inline void
+pp_leds16_store( ws2811_channel_t *channel, long n, uint16_t r, uint16_t g, uint16_t b )
+{
+  uint16_t *led16 = &channel->leds16[n * 3];
+  led16[0] = r;
+  led16[1] = g;
+  led16[2] = b;
+  channel->leds[n] = RGB2COLOR(r >> 8, g >> 8, b >> 8);
+}
+
+/* Returns the 16-bit color value of `value` or raises an ArgumentError if it
+ * is outside of 0 to 65535.
+ */
+static uint16_t
+pp_color16( VALUE value )
+{
+  long v = NUM2LONG(value);
+
+  if (v < 0 || v > 0xffff) {
+    rb_raise( rb_eArgError, "16-bit color value must be between 0 and 65535: %ld", v );
+  }
+  return (uint16_t) v;
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    set_pixel16( num, red, green, blue )
+ *
+ * Set the LED at position `num` to the given 16-bit color values. Each color
+ * is a value between 0 and 65535. The LEDs must have been created with the
+ * `:dither` option; the extra precision is shown by temporally dithering the
+ * colors over successive calls to `show`.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_set_pixel16( VALUE self, VALUE num, VALUE red, VALUE green, VALUE blue )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+
+  int n = NUM2INT(num);
+  pp_leds16( channel );
+  if (n < 0 || n >= channel->count) {
+    rb_raise( rb_eIndexError, "index %d is outside of LED range: 0...%d", n, channel->count-1 );
+  }
+
+  pp_leds16_store( channel, n, pp_color16( red ), pp_color16( green ), pp_color16( blue ) );
+  return self;
+}
+
+/* call-seq:
+ *    get_pixel16( num )
+ *
+ * Get the 16-bit color values for the LED at position `num`. If the LED was
+ * last changed with one of the 8-bit methods then the 8-bit color is returned
+ * scaled up to 16 bits.
+ *
+ * Returns an Array of red, green, and blue values.
+ */
+static VALUE
+pp_leds_get_pixel16( VALUE self, VALUE num )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  uint16_t *led16;
+  uint32_t led;
+
+  int n = NUM2INT(num);
+  pp_leds16( channel );
+  if (n < 0 || n >= channel->count) {
+    rb_raise( rb_eIndexError, "index %d is outside of LED range: 0...%d", n, channel->count-1 );
+  }
+
+  led16 = &channel->leds16[n * 3];
+  led   = channel->leds[n] & 0xffffff;
+  if (RGB2COLOR(led16[0] >> 8, led16[1] >> 8, led16[2] >> 8) != led) {
+    return rb_ary_new3( 3, INT2FIX((led >> 8) & 0xff00), INT2FIX(led & 0xff00), INT2FIX((led << 8) & 0xff00) );
+  }
+
+  return rb_ary_new3( 3, INT2FIX(led16[0]), INT2FIX(led16[1]), INT2FIX(led16[2]) );
+}
+
+/* call-seq:
+ *    fill16( red, green, blue )
+ *
+ * Set all the LEDs to the given 16-bit color values. Each color is a value
+ * between 0 and 65535.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_fill16( VALUE self, VALUE red, VALUE green, VALUE blue )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  uint16_t r = pp_color16( red ), g = pp_color16( green ), b = pp_color16( blue );
+  long ii;
+
+  pp_leds16( channel );
+  for (ii=0; ii<channel->count; ii++) {
+    pp_leds16_store( channel, ii, r, g, b );
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    replace16( packed )
+ *
+ * Replace the LED colors with the 16-bit color values in the `packed` String.
+ * The String holds red, green, and blue native 16-bit unsigned values for each
+ * LED as created by `ary.pack("S*")`. Colors that would extend past the end of
+ * the LED string are ignored.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_replace16( VALUE self, VALUE packed )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  const uint16_t *rgb;
+  long ii, len;
+
+  pp_leds16( channel );
+  StringValue( packed );
+  if (RSTRING_LEN(packed) % (3 * sizeof(uint16_t))) {
+    rb_raise( rb_eArgError, "packed String length must be a multiple of 6: %ld", RSTRING_LEN(packed) );
+  }
+
+  rgb = (const uint16_t*) RSTRING_PTR(packed);
+  len = MIN(RSTRING_LEN(packed) / (long) (3 * sizeof(uint16_t)), (long) channel->count);
+
+  for (ii=0; ii<len; ii++, rgb+=3) {
+    pp_leds16_store( channel, ii, rgb[0], rgb[1], rgb[2] );
+  }
+
+  return self;
+}
+
+void Init_dither( )
+{
+  rb_define_method( cLeds, "set_pixel16", pp_leds_set_pixel16, 4 );
+  rb_define_method( cLeds, "get_pixel16", pp_leds_get_pixel16, 1 );
+  rb_define_method( cLeds, "fill16",      pp_leds_fill16,      3 );
+  rb_define_method( cLeds, "replace16",   pp_leds_replace16,   1 );
+}
@@ -0,0 +1,219 @@
+#include "pixel_pi.h"
+
+static ws2811_led_t wheel_table[256];
+
+static ID id_color_wipe, id_theater_chase, id_rainbow, id_rainbow_cycle,
+          id_theater_chase_rainbow;
+static VALUE sym_color, sym_offset, sym_count, sym_spacing, sym_step;
+
+typedef struct {
+  ws2811_led_t color;
+  long offset;
+  long count;
+  long spacing;
+  long step;
+} pp_effect_opts_t;
+
+/* ======================================================================= */
+
+/* Generate rainbow colors across 0-255 positions. The colors transition from
+ * red to green to blue and back to red.
+ */
+static ws2811_led_t
+pp_wheel_color( int pos )
+{
+  pos &= 0xff;
+  if (pos < 85) {
+    return RGB2COLOR(pos * 3, 255 - pos * 3, 0);
+  } else if (pos < 170) {
+    pos -= 85;
+    return RGB2COLOR(255 - pos * 3, 0, pos * 3);
+  } else {
+    pos -= 170;
+    return RGB2COLOR(0, pos * 3, 255 - pos * 3);
+  }
+}
+
+static void
+pp_effect_color_wipe( ws2811_led_t *leds, long len, const pp_effect_opts_t *opts )
+{
+  long ii, n = MIN(opts->count, len);
+  for (ii=0; ii<n; ii++) leds[ii] = opts->color;
+}
+
+static void
+pp_effect_theater_chase( ws2811_led_t *leds, long len, const pp_effect_opts_t *opts )
+{
+  long ii;
+  memset( leds, 0, len * sizeof(ws2811_led_t) );
+  for (ii=opts->step % opts->spacing; ii<len; ii+=opts->spacing) {
+    leds[ii] = opts->color;
+  }
+}
+
+static void
+pp_effect_rainbow( ws2811_led_t *leds, long len, const pp_effect_opts_t *opts )
+{
+  long ii;
+  unsigned int pos = (unsigned int) opts->offset;
+  for (ii=0; ii<len; ii++) {
+    leds[ii] = wheel_table[(pos + ii) & 0xff];
+  }
+}
+
+static void
+pp_effect_rainbow_cycle( ws2811_led_t *leds, long len, const pp_effect_opts_t *opts )
+{
+  long ii;
+  unsigned int pos = (unsigned int) opts->offset;
+  for (ii=0; ii<len; ii++) {
+    leds[ii] = wheel_table[((ii * 256 / len) + pos) & 0xff];
+  }
+}
+
+static void
+pp_effect_theater_chase_rainbow( ws2811_led_t *leds, long len, const pp_effect_opts_t *opts )
+{
+  long ii;
+  memset( leds, 0, len * sizeof(ws2811_led_t) );
+  for (ii=opts->step % opts->spacing; ii<len; ii+=opts->spacing) {
+    leds[ii] = wheel_table[(ii + opts->offset) % 255];
+  }
+}
+
+static long
+pp_effect_long_opt( VALUE opts, VALUE key, long dflt )
+{
+  VALUE tmp;
+  if (NIL_P(opts)) return dflt;
+  tmp = rb_hash_lookup( opts, key );
+  return NIL_P(tmp) ? dflt : NUM2LONG(tmp);
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    effect( name, options = {} )
+ *
+ * Render a single frame of the named effect into the LED buffer. The effects
+ * are computed natively in a single pass over the LEDs; animate them by
+ * changing the `:offset` or `:step` on each frame and calling `show`.
+ *
+ * name    - the effect name as a Symbol
+ *   :color_wipe            - sets the first `:count` LEDs to `:color`
+ *   :theater_chase         - clears the LEDs and lights every `:spacing` LED
+ *                            with `:color` starting at `:step`
+ *   :rainbow               - rainbow colors across the LEDs starting at the
+ *                            wheel position `:offset`
+ *   :rainbow_cycle         - rainbow uniformly distributed across all the LEDs
+ *                            starting at the wheel position `:offset`
+ *   :theater_chase_rainbow - theater chase using rainbow colors
+ * options - Hash of arguments
+ *   :color   - 24-bit RGB color value defaults to 0
+ *   :offset  - wheel position offset defaults to 0
+ *   :count   - number of LEDs to wipe defaults to all LEDs
+ *   :spacing - spacing between lights defaults to 3
+ *   :step    - chase position defaults to 0
+ *
+ * Examples:
+ *    256.times { |jj| leds.effect( :rainbow_cycle, :offset => jj ).show }
+ *    3.times { |sp| leds.effect( :theater_chase, :color => 0xFF0000, :step => sp ).show }
+ *
+ * You must call `show` for the new colors to be displayed.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_effect( int argc, VALUE* argv, VALUE self )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_write_buffer( self, &count );
+  void (*effect)( ws2811_led_t *leds, long len, const pp_effect_opts_t *opts );
+  pp_effect_opts_t opts;
+  VALUE name, hash, tmp;
+  ID id;
+
+  rb_scan_args( argc, argv, "11", &name, &hash );
+
+  Check_Type( name, T_SYMBOL );
+  if (!NIL_P(hash)) Check_Type( hash, T_HASH );
+
+  opts.color   = 0;
+  if (!NIL_P(hash) && !NIL_P(tmp = rb_hash_lookup( hash, sym_color ))) {
+    opts.color = NUM2UINT(tmp);
+  }
+  opts.offset  = pp_effect_long_opt( hash, sym_offset, 0 );
+  opts.count   = pp_effect_long_opt( hash, sym_count, count );
+  opts.spacing = pp_effect_long_opt( hash, sym_spacing, 3 );
+  opts.step    = pp_effect_long_opt( hash, sym_step, 0 );
+
+  if (opts.spacing <= 0) {
+    rb_raise( rb_eArgError, "spacing must be positive: %ld", opts.spacing );
+  }
+  /* 65280 is a multiple of both 255 and 256 so the wheel positions are kept */
+  opts.offset %= 65280;
+  if (opts.offset < 0) opts.offset += 65280;
+  if (opts.step < 0)   opts.step   = (opts.step % opts.spacing) + opts.spacing;
+
+  if (count == 0) return self;
+
+  id = SYM2ID(name);
+  if (id == id_color_wipe) {
+    effect = pp_effect_color_wipe;
+  } else if (id == id_theater_chase) {
+    effect = pp_effect_theater_chase;
+  } else if (id == id_rainbow) {
+    effect = pp_effect_rainbow;
+  } else if (id == id_rainbow_cycle) {
+    effect = pp_effect_rainbow_cycle;
+  } else if (id == id_theater_chase_rainbow) {
+    effect = pp_effect_theater_chase_rainbow;
+  } else {
+    rb_raise( rb_eArgError, "unknown effect: %s", rb_id2name(id) );
+  }
+
+  /* only the color wipe leaves some of the LEDs as they were */
+  pp_leds_write_range( self, 0, effect == pp_effect_color_wipe ? opts.count : count );
+  effect( leds, count, &opts );
+
+  return self;
+}
+
+/* call-seq:
+ *    PixelPi::Wheel(pos)  #=> 24-bit color
+ *
+ * Generate rainbow colors across 0-255 positions. The colors transition from
+ * red to green to blue and back to red.
+ *
+ * Returns a 24-bit RGB color value.
+ */
+static VALUE
+pp_wheel( VALUE klass, VALUE pos )
+{
+  return INT2FIX(wheel_table[NUM2LONG(pos) & 0xff]);
+}
+
+void Init_effects( )
+{
+  int ii;
+
+  for (ii=0; ii<256; ii++) {
+    wheel_table[ii] = pp_wheel_color( ii );
+  }
+
+  id_color_wipe            = rb_intern( "color_wipe" );
+  id_theater_chase         = rb_intern( "theater_chase" );
+  id_rainbow               = rb_intern( "rainbow" );
+  id_rainbow_cycle         = rb_intern( "rainbow_cycle" );
+  id_theater_chase_rainbow = rb_intern( "theater_chase_rainbow" );
+
+  sym_color   = ID2SYM(rb_intern( "color" ));
+  sym_offset  = ID2SYM(rb_intern( "offset" ));
+  sym_count   = ID2SYM(rb_intern( "count" ));
+  sym_spacing = ID2SYM(rb_intern( "spacing" ));
+  sym_step    = ID2SYM(rb_intern( "step" ));
+
+  rb_define_method( cLeds, "effect", pp_leds_effect, -1 );
+  rb_define_method( cSlice, "effect", pp_leds_effect, -1 );
+
+  rb_define_module_function( mPixelPi, "Wheel", pp_wheel, 1 );
+}
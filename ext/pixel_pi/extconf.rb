@@ -18,6 +18,8 @@ if RbConfig::CONFIG["arch"].to_s =~ /\Aarm-linux/i
   ws2811_files.map! { |name| "#{ws2811_path}/#{name}" }
   FileUtils.cp(ws2811_files, pixel_pi_path)
 
+  have_library("pthread")
+  have_library("rt")
   create_makefile("pixel_pi/leds")
 else
   File.open("#{pixel_pi_path}/Makefile", "w") do |fd|
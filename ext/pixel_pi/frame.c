@@ -0,0 +1,411 @@
+#include "pixel_pi.h"
+
+/* Frames of packed RGB pixels - raw or binary PPM - are resampled onto the
+ * matrix positions of the PixelPi::Layout attached to the LEDs. Each frame is
+ * read once; the per-column sample positions are computed up front so the
+ * inner loop is only table lookups and integer arithmetic.
+ */
+
+enum pp_filter {
+  PP_FILTER_NEAREST,
+  PP_FILTER_BOX,
+  PP_FILTER_BILINEAR
+};
+
+static const char *pp_filter_names[] = { "nearest", "box", "bilinear" };
+
+/* The first and last source pixel of each output column or row, and for the
+ * bilinear filter the weight of the last one in 1/256ths.
+ */
+typedef struct {
+  long     p0;
+  long     p1;
+  uint32_t f;
+} pp_span_t;
+
+/* Reads the next byte of a PPM header; returns -1 at the end of the input */
+typedef int (*pp_getbyte_t)( void *ctx );
+
+typedef struct {
+  const uint8_t *ptr;
+  long           len;
+  long           pos;
+} pp_string_src_t;
+
+static ID id_read, id_getbyte, id_frame_buffer;
+static VALUE sym_filter, sym_width, sym_height;
+
+/* ======================================================================= */
+
+static int
+pp_parse_filter( VALUE opts )
+{
+  const char *name;
+  VALUE value;
+  int ii;
+
+  if (NIL_P(opts)) return PP_FILTER_NEAREST;
+  Check_Type( opts, T_HASH );
+  value = rb_hash_lookup( opts, sym_filter );
+  if (NIL_P(value)) return PP_FILTER_NEAREST;
+
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "filter must be a Symbol: %s", rb_obj_classname(value) );
+  }
+
+  name = rb_id2name( SYM2ID(value) );
+  for (ii=0; ii<=PP_FILTER_BILINEAR; ii++) {
+    if (strcmp( name, pp_filter_names[ii] ) == 0) return ii;
+  }
+
+  rb_raise( rb_eArgError, "unknown filter: %s", name );
+  return 0;
+}
+
+/* Compute the source span of each of the `out` output pixels along an axis of
+ * `in` source pixels. Output pixel centers are mapped onto the source so the
+ * image is scaled about its center.
+ */
+static void
+pp_frame_spans( pp_span_t *spans, long out, long in, int filter )
+{
+  long ii;
+
+  for (ii=0; ii<out; ii++) {
+    pp_span_t *s = &spans[ii];
+
+    switch (filter) {
+      case PP_FILTER_BOX:
+        s->p0 = ii * in / out;
+        s->p1 = (ii + 1) * in / out - 1;
+        if (s->p1 < s->p0) s->p1 = s->p0;
+        s->f  = 0;
+        break;
+
+      case PP_FILTER_BILINEAR: {
+        long pos = (2 * ii + 1) * in * 128 / out - 128;
+        if (pos < 0) pos = 0;
+        s->p0 = pos >> 8;
+        s->p1 = s->p0 + 1 < in ? s->p0 + 1 : in - 1;
+        s->f  = pos & 0xff;
+        break;
+      }
+
+      default:
+        s->p0 = s->p1 = (2 * ii + 1) * in / (2 * out);
+        s->f  = 0;
+    }
+  }
+}
+
+/* Resample the `iw` by `ih` packed RGB image onto the layout positions and
+ * store the colors in the LED buffer.
+ */
+static void
+pp_frame_resample( const pp_layout_t *layout, ws2811_led_t *leds, long count,
+                   const uint8_t *rgb, long iw, long ih, int filter )
+{
+  long w = layout->width, h = layout->height;
+  long x, y, ii, jj;
+  pp_span_t *xs, *ys;
+  VALUE store = 0;
+
+  if (w == 0 || h == 0) return;
+
+  xs = ALLOCV_N( pp_span_t, store, w + h );
+  ys = xs + w;
+  pp_frame_spans( xs, w, iw, filter );
+  pp_frame_spans( ys, h, ih, filter );
+
+  for (y=0; y<h; y++) {
+    const pp_span_t *sy = &ys[y];
+    const uint32_t *row = layout->map + y * w;
+
+    for (x=0; x<w; x++) {
+      const pp_span_t *sx = &xs[x];
+      uint32_t r, g, b;
+
+      if (row[x] >= (uint32_t) count) continue;
+
+      if (filter == PP_FILTER_BILINEAR) {
+        const uint8_t *p00 = rgb + (sy->p0 * iw + sx->p0) * 3;
+        const uint8_t *p01 = rgb + (sy->p0 * iw + sx->p1) * 3;
+        const uint8_t *p10 = rgb + (sy->p1 * iw + sx->p0) * 3;
+        const uint8_t *p11 = rgb + (sy->p1 * iw + sx->p1) * 3;
+        uint32_t fx = sx->f, fy = sy->f;
+        uint32_t c[3];
+        int k;
+
+        for (k=0; k<3; k++) {
+          uint32_t top = p00[k] * (256 - fx) + p01[k] * fx;
+          uint32_t bot = p10[k] * (256 - fx) + p11[k] * fx;
+          c[k] = (top * (256 - fy) + bot * fy + 32768) >> 16;
+        }
+        r = c[0]; g = c[1]; b = c[2];
+
+      } else if (filter == PP_FILTER_BOX) {
+        uint32_t n = (sx->p1 - sx->p0 + 1) * (sy->p1 - sy->p0 + 1);
+        r = g = b = 0;
+        for (jj=sy->p0; jj<=sy->p1; jj++) {
+          const uint8_t *p = rgb + (jj * iw + sx->p0) * 3;
+          for (ii=sx->p0; ii<=sx->p1; ii++, p+=3) {
+            r += p[0]; g += p[1]; b += p[2];
+          }
+        }
+        r = (r + n/2) / n;
+        g = (g + n/2) / n;
+        b = (b + n/2) / n;
+
+      } else {
+        const uint8_t *p = rgb + (sy->p0 * iw + sx->p0) * 3;
+        r = p[0]; g = p[1]; b = p[2];
+      }
+
+      leds[row[x]] = RGB2COLOR(r, g, b);
+    }
+  }
+
+  ALLOCV_END( store );
+}
+
+static void
+pp_frame_check_size( long iw, long ih )
+{
+  if (iw <= 0 || ih <= 0) {
+    rb_raise( rb_eArgError, "image size must be positive: %ldx%ld", iw, ih );
+  }
+}
+
+static int
+pp_string_getbyte( void *ctx )
+{
+  pp_string_src_t *src = (pp_string_src_t*) ctx;
+  return src->pos < src->len ? src->ptr[src->pos++] : -1;
+}
+
+static int
+pp_io_getbyte( void *ctx )
+{
+  VALUE byte = rb_funcall( *(VALUE*) ctx, id_getbyte, 0 );
+  return NIL_P(byte) ? -1 : NUM2INT(byte);
+}
+
+/* Read one number of a PPM header, skipping whitespace and comments */
+static long
+pp_ppm_number( pp_getbyte_t getbyte, void *ctx )
+{
+  long num = 0;
+  int c = getbyte( ctx );
+
+  for (;;) {
+    if (c == '#') {
+      while (c != '\n' && c != -1) c = getbyte( ctx );
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      c = getbyte( ctx );
+    } else {
+      break;
+    }
+  }
+
+  if (c < '0' || c > '9') {
+    rb_raise( rb_eArgError, "malformed PPM header" );
+  }
+  while (c >= '0' && c <= '9') {
+    num = num * 10 + (c - '0');
+    if (num > 0xffff) rb_raise( rb_eArgError, "malformed PPM header" );
+    c = getbyte( ctx );
+  }
+
+  /* a single whitespace byte ends each number */
+  if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+    rb_raise( rb_eArgError, "malformed PPM header" );
+  }
+  return num;
+}
+
+/* Parse the header of a binary PPM (P6) image and store its size. Returns 0
+ * if the input ends before the first byte.
+ */
+static int
+pp_ppm_header( pp_getbyte_t getbyte, void *ctx, long *iw, long *ih )
+{
+  int c = getbyte( ctx );
+  long maxval;
+
+  if (c == -1) return 0;
+  if (c != 'P' || getbyte( ctx ) != '6') {
+    rb_raise( rb_eArgError, "not a binary PPM image" );
+  }
+
+  *iw = pp_ppm_number( getbyte, ctx );
+  *ih = pp_ppm_number( getbyte, ctx );
+  maxval = pp_ppm_number( getbyte, ctx );
+
+  if (maxval != 255) {
+    rb_raise( rb_eArgError, "only 8-bit PPM images with a maxval of 255 are supported: %ld", maxval );
+  }
+  pp_frame_check_size( *iw, *ih );
+  return 1;
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    draw_frame( packed_rgb, width, height, options = {} )
+ *
+ * Scale a `width` by `height` image to the size of the matrix and store it in
+ * the LEDs. The `packed_rgb` String holds three bytes - red, green, and blue -
+ * for each pixel, row by row, as produced by `ffmpeg -pix_fmt rgb24`. A
+ * PixelPi::Layout must be attached to the LEDs.
+ *
+ * options - Hash of arguments
+ *   :filter - `:nearest` (default), `:box` to average all the image pixels
+ *             covered by each LED, or `:bilinear`
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_draw_frame( int argc, VALUE* argv, VALUE self )
+{
+  ws2811_led_t *leds;
+  pp_layout_t *layout;
+  VALUE str, wv, hv, opts;
+  long count, iw, ih;
+  int filter;
+
+  rb_scan_args( argc, argv, "31", &str, &wv, &hv, &opts );
+  StringValue( str );
+  filter = pp_parse_filter( opts );
+  layout = pp_leds_layout( self, &leds, &count );
+
+  iw = NUM2LONG(wv);
+  ih = NUM2LONG(hv);
+  pp_frame_check_size( iw, ih );
+  if (RSTRING_LEN(str) != iw * ih * 3) {
+    rb_raise( rb_eArgError, "packed RGB String must be %ld bytes for a %ldx%ld image: %ld",
+              iw * ih * 3, iw, ih, RSTRING_LEN(str) );
+  }
+
+  pp_frame_resample( layout, leds, count, (const uint8_t*) RSTRING_PTR(str), iw, ih, filter );
+  return self;
+}
+
+/* call-seq:
+ *    draw_ppm( ppm, options = {} )
+ *
+ * Scale a binary PPM (P6) image of any size to the size of the matrix and
+ * store it in the LEDs. Takes the same options as `draw_frame`.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_draw_ppm( int argc, VALUE* argv, VALUE self )
+{
+  ws2811_led_t *leds;
+  pp_layout_t *layout;
+  pp_string_src_t src;
+  VALUE str, opts;
+  long count, iw, ih;
+  int filter;
+
+  rb_scan_args( argc, argv, "11", &str, &opts );
+  StringValue( str );
+  filter = pp_parse_filter( opts );
+  layout = pp_leds_layout( self, &leds, &count );
+
+  src.ptr = (const uint8_t*) RSTRING_PTR(str);
+  src.len = RSTRING_LEN(str);
+  src.pos = 0;
+  if (!pp_ppm_header( pp_string_getbyte, &src, &iw, &ih )) {
+    rb_raise( rb_eArgError, "not a binary PPM image" );
+  }
+  if (src.len - src.pos < iw * ih * 3) {
+    rb_raise( rb_eArgError, "PPM image data is too short: %ld bytes for a %ldx%ld image",
+              src.len - src.pos, iw, ih );
+  }
+
+  pp_frame_resample( layout, leds, count, src.ptr + src.pos, iw, ih, filter );
+  return self;
+}
+
+/* call-seq:
+ *    read_frame( io, options = {} )   #=> leds or nil
+ *
+ * Read the next frame from the `io` and store it in the LEDs like
+ * `draw_frame`. This works with pipes, so the output of a video decoder can
+ * be streamed straight onto a matrix. Without a size the stream is read as a
+ * sequence of binary PPM images (`ffmpeg -f image2pipe -c:v ppm -`); with
+ * `:width` and `:height` it is read as raw frames of packed RGB pixels
+ * (`ffmpeg -f rawvideo -pix_fmt rgb24 -`). The read buffer is kept with the
+ * LEDs and reused for every frame.
+ *
+ * options - Hash of arguments
+ *   :width  - width of raw frames
+ *   :height - height of raw frames
+ *   :filter - `:nearest` (default), `:box`, or `:bilinear`
+ *
+ * Examples:
+ *    io = IO.popen( %w[ffmpeg -i clip.mp4 -f image2pipe -c:v ppm -] )
+ *    while leds.read_frame( io, :filter => :box )
+ *      leds.show
+ *    end
+ *
+ * Returns this PixelPi::Leds instance or `nil` at the end of the stream.
+ */
+static VALUE
+pp_leds_read_frame( int argc, VALUE* argv, VALUE self )
+{
+  ws2811_led_t *leds;
+  pp_layout_t *layout;
+  VALUE io, opts, wv = Qnil, hv = Qnil, buf, data;
+  long count, iw, ih, len;
+  int filter;
+
+  rb_scan_args( argc, argv, "11", &io, &opts );
+  filter = pp_parse_filter( opts );
+  layout = pp_leds_layout( self, &leds, &count );
+
+  if (!NIL_P(opts)) {
+    wv = rb_hash_lookup( opts, sym_width );
+    hv = rb_hash_lookup( opts, sym_height );
+  }
+
+  if (NIL_P(wv) != NIL_P(hv)) {
+    rb_raise( rb_eArgError, "raw frames need both a :width and a :height" );
+  }
+  if (NIL_P(wv)) {
+    if (!pp_ppm_header( pp_io_getbyte, &io, &iw, &ih )) return Qnil;
+  } else {
+    iw = NUM2LONG(wv);
+    ih = NUM2LONG(hv);
+    pp_frame_check_size( iw, ih );
+  }
+  len = iw * ih * 3;
+
+  buf = rb_ivar_get( self, id_frame_buffer );
+  if (NIL_P(buf)) {
+    buf = rb_str_buf_new( len );
+    rb_ivar_set( self, id_frame_buffer, buf );
+  }
+
+  data = rb_funcall( io, id_read, 2, LONG2NUM(len), buf );
+  if (NIL_P(data) || RSTRING_LEN(data) < len) return Qnil;
+
+  /* other threads can run during the read, so look up the LEDs again */
+  layout = pp_leds_layout( self, &leds, &count );
+  pp_frame_resample( layout, leds, count, (const uint8_t*) RSTRING_PTR(data), iw, ih, filter );
+  return self;
+}
+
+void Init_frame( )
+{
+  id_read         = rb_intern( "read" );
+  id_getbyte      = rb_intern( "getbyte" );
+  id_frame_buffer = rb_intern( "frame_buffer" );  /* hidden from Ruby */
+  sym_filter      = ID2SYM(rb_intern( "filter" ));
+  sym_width       = ID2SYM(rb_intern( "width" ));
+  sym_height      = ID2SYM(rb_intern( "height" ));
+
+  rb_define_method( cLeds, "draw_frame", pp_leds_draw_frame, -1 );
+  rb_define_method( cLeds, "draw_ppm",   pp_leds_draw_ppm,   -1 );
+  rb_define_method( cLeds, "read_frame", pp_leds_read_frame, -1 );
+}
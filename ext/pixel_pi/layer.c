@@ -0,0 +1,598 @@
+#include "pixel_pi.h"
+
+enum pp_blend_mode {
+  PP_BLEND_NORMAL,
+  PP_BLEND_ADD,
+  PP_BLEND_MULTIPLY,
+  PP_BLEND_SCREEN,
+  PP_BLEND_MAX
+};
+
+static const char *pp_blend_names[] = { "normal", "add", "multiply", "screen", "max" };
+
+typedef struct {
+  ws2811_led_t *leds;
+  long          count;
+  long          offset;        /* LED position of the first layer pixel */
+  int           z;
+  int           opacity;
+  int           mode;
+} pp_layer_t;
+
+VALUE cLayer;
+
+static ID id_layers;
+static VALUE sym_z, sym_opacity, sym_blend_mode, sym_offset;
+
+/* ======================================================================= */
+
+static void
+pp_layer_free( void *ptr )
+{
+  pp_layer_t *layer;
+  if (NULL == ptr) return;
+
+  layer = (pp_layer_t*) ptr;
+  if (layer->leds) xfree( layer->leds );
+  xfree( layer );
+}
+
+static VALUE
+pp_layer_allocate( VALUE klass )
+{
+  pp_layer_t *layer;
+
+  layer = ALLOC_N( pp_layer_t, 1 );
+  if (!layer) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::Layer instance");
+  }
+
+  layer->leds    = NULL;
+  layer->count   = 0;
+  layer->offset  = 0;
+  layer->z       = 0;
+  layer->opacity = 255;
+  layer->mode    = PP_BLEND_NORMAL;
+
+  return Data_Wrap_Struct( klass, NULL, pp_layer_free, layer );
+}
+
+static pp_layer_t*
+pp_layer_struct( VALUE self )
+{
+  pp_layer_t *layer;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_layer_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::Layer object" );
+  }
+  Data_Get_Struct( self, pp_layer_t, layer );
+
+  return layer;
+}
+
+static int
+pp_parse_blend_mode( VALUE value )
+{
+  const char *name;
+  int ii;
+
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "blend mode must be a Symbol: %s", rb_obj_classname(value) );
+  }
+
+  name = rb_id2name( SYM2ID(value) );
+  for (ii=0; ii<=PP_BLEND_MAX; ii++) {
+    if (strcmp( name, pp_blend_names[ii] ) == 0) return ii;
+  }
+
+  rb_raise( rb_eArgError, "unknown blend mode: %s", name );
+  return 0;
+}
+
+/* Per byte blend operations; all four bytes of the color are blended so the
+ * white value of RGBW strips is composited along with red, green, and blue.
+ */
+static inline uint32_t
+pp_mul8( uint32_t a, uint32_t b )
+{
+  uint32_t t = a * b + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+#define PP_PER_BYTE(d, s, op)                                               \
+  ( (op(((d) >> 24) & 0xff, ((s) >> 24) & 0xff) << 24)                     \
+  | (op(((d) >> 16) & 0xff, ((s) >> 16) & 0xff) << 16)                     \
+  | (op(((d) >>  8) & 0xff, ((s) >>  8) & 0xff) <<  8)                     \
+  |  op( (d)        & 0xff,  (s)        & 0xff) )
+
+#define PP_OP_MULTIPLY(a, b) pp_mul8( (a), (b) )
+#define PP_OP_SCREEN(a, b)   (255 - pp_mul8( 255 - (a), 255 - (b) ))
+#define PP_OP_MAX(a, b)      ((a) > (b) ? (a) : (b))
+
+/* Generate the composite loop for one blend mode; the mode and full opacity
+ * checks are made once per layer instead of once per pixel.
+ */
+#define PP_COMPOSITE_LOOP(blend)                                            \
+  if (w == 256) {                                                           \
+    for (ii=0; ii<len; ii++) {                                              \
+      uint32_t d = dst[ii], s = src[ii];                                    \
+      (void) d;                                                             \
+      dst[ii] = (blend);                                                    \
+    }                                                                       \
+  } else {                                                                  \
+    for (ii=0; ii<len; ii++) {                                              \
+      uint32_t d = dst[ii], s = src[ii];                                    \
+      dst[ii] = pp_mix( d, (blend), w );                                    \
+    }                                                                       \
+  }
+
+static void
+pp_layer_composite( const pp_layer_t *layer, ws2811_led_t *leds, long count )
+{
+  const ws2811_led_t *src = layer->leds;
+  ws2811_led_t *dst;
+  uint32_t w = layer->opacity + (layer->opacity >> 7);
+  long ii, beg = layer->offset, len = layer->count;
+
+  if (w == 0) return;
+
+  /* clip the layer to the LED string */
+  if (beg < 0) {
+    src -= beg;
+    len += beg;
+    beg  = 0;
+  }
+  if (beg >= count || len <= 0) return;
+  len = MIN(len, count - beg);
+  dst = leds + beg;
+
+  switch (layer->mode) {
+    case PP_BLEND_NORMAL:   PP_COMPOSITE_LOOP( s );                               break;
+    case PP_BLEND_ADD:      PP_COMPOSITE_LOOP( pp_add_sat( d, s ) );              break;
+    case PP_BLEND_MULTIPLY: PP_COMPOSITE_LOOP( PP_PER_BYTE( d, s, PP_OP_MULTIPLY ) ); break;
+    case PP_BLEND_SCREEN:   PP_COMPOSITE_LOOP( PP_PER_BYTE( d, s, PP_OP_SCREEN ) );   break;
+    case PP_BLEND_MAX:      PP_COMPOSITE_LOOP( PP_PER_BYTE( d, s, PP_OP_MAX ) );      break;
+  }
+}
+
+/* Returns the pixel buffer of a PixelPi::Layer and stores its length in
+ * `len`. Returns NULL if `obj` is not a layer.
+ */
+ws2811_led_t*
+pp_layer_buffer( VALUE obj, long *len )
+{
+  pp_layer_t *layer;
+
+  if (TYPE(obj) != T_DATA
+  ||  RDATA(obj)->dfree != (RUBY_DATA_FUNC) pp_layer_free) {
+    return NULL;
+  }
+  Data_Get_Struct( obj, pp_layer_t, layer );
+
+  *len = layer->count;
+  return layer->leds;
+}
+
+/* Returns the Array of layers attached to the PixelPi::Leds or `nil`. */
+VALUE
+pp_leds_layers( VALUE self )
+{
+  return rb_ivar_get( self, id_layers );
+}
+
+/* Composite the `layers` onto the `leds` buffer from the lowest to the highest
+ * z-order. Layers with the same z-order are composited in the order they were
+ * added.
+ */
+void
+pp_layers_composite( VALUE layers, ws2811_led_t *leds, long count )
+{
+  long ii, jj, n = RARRAY_LEN(layers);
+  pp_layer_t **stack;
+  VALUE store;
+
+  stack = ALLOCV_N( pp_layer_t*, store, n );
+  for (ii=0; ii<n; ii++) {
+    pp_layer_t *layer = pp_layer_struct( RARRAY_AREF( layers, ii ) );
+    for (jj=ii; jj>0 && stack[jj-1]->z > layer->z; jj--) stack[jj] = stack[jj-1];
+    stack[jj] = layer;
+  }
+
+  for (ii=0; ii<n; ii++) {
+    pp_layer_composite( stack[ii], leds, count );
+  }
+
+  ALLOCV_END( store );
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::Layer.new( length, options = {} )
+ *
+ * Create a new PixelPi::Layer with its own buffer of `length` 24-bit RGB
+ * colors. Once attached to a PixelPi::Leds instance with `add_layer`, the
+ * layer is composited over the LED buffer every time `show` is called. The
+ * LED buffer itself is not changed by the layers.
+ *
+ * length  - the number of pixels in the layer
+ * options - Hash of arguments
+ *   :z          - z-order; higher layers are composited last defaults to 0
+ *   :opacity    - opacity between 0 and 255 defaults to 255
+ *   :blend_mode - blend mode defaults to `:normal`; one of `:normal`, `:add`,
+ *                 `:multiply`, `:screen`, or `:max`
+ *   :offset     - LED position of the first layer pixel defaults to 0
+ *
+ * Examples:
+ *    sprite = PixelPi::Layer.new( 5, :z => 1, :blend_mode => :add )
+ *    sprite.fill( 0xFF0000 )
+ *    leds.add_layer( sprite )
+ *    leds.length.times { |ii| sprite.offset = ii; leds.show }
+ */
+static VALUE
+pp_layer_initialize( int argc, VALUE* argv, VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  VALUE length, opts, tmp;
+  long count;
+
+  rb_scan_args( argc, argv, "11", &length, &opts );
+
+  count = NUM2LONG(length);
+  if (count < 0) {
+    rb_raise( rb_eArgError, "length cannot be negative: %ld", count );
+  }
+
+  if (!NIL_P(opts)) {
+    Check_Type( opts, T_HASH );
+
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_z )))          layer->z       = NUM2INT(tmp);
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_opacity )))    layer->opacity = NUM2INT(tmp) & 0xff;
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_blend_mode ))) layer->mode    = pp_parse_blend_mode( tmp );
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_offset )))     layer->offset  = NUM2LONG(tmp);
+  }
+
+  if (layer->leds) xfree( layer->leds );
+  layer->leds  = ALLOC_N( ws2811_led_t, count ? count : 1 );
+  layer->count = count;
+  memset( layer->leds, 0, count * sizeof(ws2811_led_t) );
+
+  return self;
+}
+
+/* call-seq:
+ *    length
+ *
+ * Returns the number of pixels in the layer.
+ */
+static VALUE
+pp_layer_length( VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  return LONG2NUM(layer->count);
+}
+
+/* call-seq:
+ *    z
+ *
+ * Returns the z-order of the layer.
+ */
+static VALUE
+pp_layer_z_get( VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  return INT2NUM(layer->z);
+}
+
+/* call-seq:
+ *    z = value
+ *
+ * Set the z-order of the layer. Layers with a higher z-order are composited
+ * on top of layers with a lower z-order.
+ *
+ * Returns the new z-order.
+ */
+static VALUE
+pp_layer_z_set( VALUE self, VALUE value )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  layer->z = NUM2INT(value);
+  return value;
+}
+
+/* call-seq:
+ *    opacity
+ *
+ * Returns the opacity of the layer.
+ */
+static VALUE
+pp_layer_opacity_get( VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  return INT2FIX(layer->opacity);
+}
+
+/* call-seq:
+ *    opacity = value
+ *
+ * Set the opacity of the layer. This is a value between 0 (the layer is not
+ * shown) and 255 (the blended colors replace the colors below).
+ *
+ * Returns the new opacity.
+ */
+static VALUE
+pp_layer_opacity_set( VALUE self, VALUE value )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  layer->opacity = NUM2INT(value) & 0xff;
+  return value;
+}
+
+/* call-seq:
+ *    blend_mode
+ *
+ * Returns the blend mode of the layer as a Symbol.
+ */
+static VALUE
+pp_layer_blend_get( VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  return ID2SYM(rb_intern( pp_blend_names[layer->mode] ));
+}
+
+/* call-seq:
+ *    blend_mode = mode
+ *
+ * Set the blend mode of the layer - one of `:normal`, `:add`, `:multiply`,
+ * `:screen`, or `:max`.
+ *
+ * Returns the new blend mode.
+ */
+static VALUE
+pp_layer_blend_set( VALUE self, VALUE value )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  layer->mode = pp_parse_blend_mode( value );
+  return value;
+}
+
+/* call-seq:
+ *    offset
+ *
+ * Returns the LED position of the first layer pixel.
+ */
+static VALUE
+pp_layer_offset_get( VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  return LONG2NUM(layer->offset);
+}
+
+/* call-seq:
+ *    offset = position
+ *
+ * Set the LED position of the first layer pixel. The layer can be moved
+ * partially or completely off either end of the LED string; pixels outside
+ * the LED string are not shown.
+ *
+ * Returns the new offset.
+ */
+static VALUE
+pp_layer_offset_set( VALUE self, VALUE value )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  layer->offset = NUM2LONG(value);
+  return value;
+}
+
+/* call-seq:
+ *    layer[num]
+ *
+ * Get the 24-bit RGB color value for the layer pixel at position `num`.
+ *
+ * Returns a 24-bit RGB color value.
+ */
+static VALUE
+pp_layer_get_pixel_color( VALUE self, VALUE num )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+
+  long n = NUM2LONG(num);
+  if (n < 0 || n >= layer->count) {
+    rb_raise( rb_eIndexError, "index %ld is outside of layer range: 0...%ld", n, layer->count-1 );
+  }
+
+  return UINT2NUM(layer->leds[n]);
+}
+
+/* call-seq:
+ *    layer[num] = color
+ *
+ * Set the layer pixel at position `num` to the provided 24-bit RGB color
+ * value. An IndexError is raised if `num` is outside the layer range.
+ *
+ * Returns the 24-bit RGB color value.
+ */
+static VALUE
+pp_layer_set_pixel_color( VALUE self, VALUE num, VALUE color )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+
+  long n = NUM2LONG(num);
+  if (n < 0 || n >= layer->count) {
+    rb_raise( rb_eIndexError, "index %ld is outside of layer range: 0...%ld", n, layer->count-1 );
+  }
+
+  layer->leds[n] = NUM2UINT(color);
+  return color;
+}
+
+/* call-seq:
+ *    fill( color )
+ *
+ * Set all the layer pixels to the given 24-bit RGB `color`.
+ *
+ * Returns this PixelPi::Layer instance.
+ */
+static VALUE
+pp_layer_fill( VALUE self, VALUE color )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  ws2811_led_t c = NUM2UINT(color);
+  long ii;
+
+  for (ii=0; ii<layer->count; ii++) layer->leds[ii] = c;
+  return self;
+}
+
+/* call-seq:
+ *    clear
+ *
+ * Set all the layer pixels to zero.
+ *
+ * Returns this PixelPi::Layer instance.
+ */
+static VALUE
+pp_layer_clear( VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  memset( layer->leds, 0, layer->count * sizeof(ws2811_led_t) );
+  return self;
+}
+
+/* call-seq:
+ *    replace( colors )
+ *
+ * Replace the layer pixels with the 24-bit RGB color values found in
+ * `colors` - an Array of Integers or a packed String of native 32-bit
+ * unsigned values. Colors past the end of the layer are ignored.
+ *
+ * Returns this PixelPi::Layer instance.
+ */
+static VALUE
+pp_layer_replace( VALUE self, VALUE colors )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  const uint32_t *list;
+  long len;
+  VALUE store;
+
+  list = pp_uint32_list( colors, &len, &store );
+  memcpy( layer->leds, list, MIN(len, layer->count) * sizeof(ws2811_led_t) );
+  ALLOCV_END( store );
+
+  return self;
+}
+
+/* call-seq:
+ *    to_a
+ *
+ * Returns an Array of the 24-bit RGB values of the layer pixels.
+ */
+static VALUE
+pp_layer_to_a( VALUE self )
+{
+  pp_layer_t *layer = pp_layer_struct( self );
+  VALUE ary = rb_ary_new2( layer->count );
+  long ii;
+
+  for (ii=0; ii<layer->count; ii++) {
+    rb_ary_push( ary, UINT2NUM(layer->leds[ii]) );
+  }
+  return ary;
+}
+
+/* call-seq:
+ *    add_layer( layer )
+ *
+ * Attach the PixelPi::Layer to these LEDs. Attached layers are composited
+ * over the LED buffer by their z-order every time `show` is called. Adding a
+ * layer that is already attached does nothing.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_add_layer( VALUE self, VALUE obj )
+{
+  VALUE layers;
+
+  pp_leds_struct( self );
+  pp_layer_struct( obj );
+
+  layers = rb_ivar_get( self, id_layers );
+  if (NIL_P(layers)) {
+    layers = rb_ary_new();
+    rb_ivar_set( self, id_layers, layers );
+  }
+  if (!RTEST(rb_ary_includes( layers, obj ))) rb_ary_push( layers, obj );
+
+  return self;
+}
+
+/* call-seq:
+ *    remove_layer( layer )
+ *
+ * Detach the PixelPi::Layer from these LEDs.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_remove_layer( VALUE self, VALUE obj )
+{
+  VALUE layers;
+
+  pp_leds_struct( self );
+  layers = rb_ivar_get( self, id_layers );
+  if (!NIL_P(layers)) rb_ary_delete( layers, obj );
+
+  return self;
+}
+
+/* call-seq:
+ *    layers
+ *
+ * Returns an Array of the layers attached to these LEDs in the order they
+ * were added.
+ */
+static VALUE
+pp_leds_layers_get( VALUE self )
+{
+  VALUE layers;
+
+  pp_leds_struct( self );
+  layers = rb_ivar_get( self, id_layers );
+  return NIL_P(layers) ? rb_ary_new() : rb_ary_dup( layers );
+}
+
+void Init_layer( )
+{
+  id_layers      = rb_intern( "@layers" );
+  sym_z          = ID2SYM(rb_intern( "z" ));
+  sym_opacity    = ID2SYM(rb_intern( "opacity" ));
+  sym_blend_mode = ID2SYM(rb_intern( "blend_mode" ));
+  sym_offset     = ID2SYM(rb_intern( "offset" ));
+
+  cLayer = rb_define_class_under( mPixelPi, "Layer", rb_cObject );
+  rb_define_alloc_func( cLayer, pp_layer_allocate );
+  rb_define_method( cLayer, "initialize", pp_layer_initialize, -1 );
+
+  rb_define_method( cLayer, "length",   pp_layer_length,          0 );
+  rb_define_method( cLayer, "z",        pp_layer_z_get,           0 );
+  rb_define_method( cLayer, "z=",       pp_layer_z_set,           1 );
+  rb_define_method( cLayer, "opacity",  pp_layer_opacity_get,     0 );
+  rb_define_method( cLayer, "opacity=", pp_layer_opacity_set,     1 );
+  rb_define_method( cLayer, "blend_mode",  pp_layer_blend_get,    0 );
+  rb_define_method( cLayer, "blend_mode=", pp_layer_blend_set,    1 );
+  rb_define_method( cLayer, "offset",   pp_layer_offset_get,      0 );
+  rb_define_method( cLayer, "offset=",  pp_layer_offset_set,      1 );
+  rb_define_method( cLayer, "[]",       pp_layer_get_pixel_color, 1 );
+  rb_define_method( cLayer, "[]=",      pp_layer_set_pixel_color, 2 );
+  rb_define_method( cLayer, "fill",     pp_layer_fill,            1 );
+  rb_define_method( cLayer, "clear",    pp_layer_clear,           0 );
+  rb_define_method( cLayer, "replace",  pp_layer_replace,         1 );
+  rb_define_method( cLayer, "to_a",     pp_layer_to_a,            0 );
+
+  rb_define_method( cLeds, "add_layer",    pp_leds_add_layer,    1 );
+  rb_define_method( cLeds, "remove_layer", pp_leds_remove_layer, 1 );
+  rb_define_method( cLeds, "layers",       pp_leds_layers_get,   0 );
+}
@@ -0,0 +1,531 @@
+#include "pixel_pi.h"
+
+enum pp_layout_order {
+  PP_ORDER_ROW_MAJOR,
+  PP_ORDER_SERPENTINE,
+  PP_ORDER_COLUMN_MAJOR,
+  PP_ORDER_COLUMN_SERPENTINE
+};
+
+static const char *pp_order_names[] = { "row_major", "serpentine", "column_major", "column_serpentine" };
+
+VALUE cLayout;
+
+static ID id_layout;
+static VALUE sym_order, sym_panel, sym_map;
+
+/* ======================================================================= */
+
+static void
+pp_layout_free( void *ptr )
+{
+  pp_layout_t *layout;
+  if (NULL == ptr) return;
+
+  layout = (pp_layout_t*) ptr;
+  if (layout->map) xfree( layout->map );
+  xfree( layout );
+}
+
+static VALUE
+pp_layout_allocate( VALUE klass )
+{
+  pp_layout_t *layout;
+
+  layout = ALLOC_N( pp_layout_t, 1 );
+  if (!layout) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::Layout instance");
+  }
+
+  layout->map    = NULL;
+  layout->width  = 0;
+  layout->height = 0;
+
+  return Data_Wrap_Struct( klass, NULL, pp_layout_free, layout );
+}
+
+static pp_layout_t*
+pp_layout_struct( VALUE self )
+{
+  pp_layout_t *layout;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_layout_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::Layout object" );
+  }
+  Data_Get_Struct( self, pp_layout_t, layout );
+
+  return layout;
+}
+
+static int
+pp_parse_order( VALUE value )
+{
+  const char *name;
+  int ii;
+
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "layout order must be a Symbol: %s", rb_obj_classname(value) );
+  }
+
+  name = rb_id2name( SYM2ID(value) );
+  for (ii=0; ii<=PP_ORDER_COLUMN_SERPENTINE; ii++) {
+    if (strcmp( name, pp_order_names[ii] ) == 0) return ii;
+  }
+
+  rb_raise( rb_eArgError, "unknown layout order: %s", name );
+  return 0;
+}
+
+/* Returns the position of (x, y) along the wiring of a `w` by `h` panel */
+static long
+pp_order_index( int order, long x, long y, long w, long h )
+{
+  switch (order) {
+    case PP_ORDER_SERPENTINE:        return y * w + ((y & 1) ? w - 1 - x : x);
+    case PP_ORDER_COLUMN_MAJOR:      return x * h + y;
+    case PP_ORDER_COLUMN_SERPENTINE: return x * h + ((x & 1) ? h - 1 - y : y);
+    default:                         return y * w + x;
+  }
+}
+
+/* Returns the LED buffer of the PixelPi::Leds along with the layout attached
+ * to it. Raises a PixelPi::Error if no layout is attached.
+ */
+pp_layout_t*
+pp_leds_layout( VALUE self, ws2811_led_t **leds, long *count )
+{
+  VALUE obj;
+
+  *leds = pp_leds_buffer( self, count );
+  obj = rb_ivar_get( self, id_layout );
+  if (NIL_P(obj)) {
+    rb_raise( ePixelPiError, "no layout has been set for these LEDs" );
+  }
+  return pp_layout_struct( obj );
+}
+
+/* Returns the layout attached to the PixelPi::Leds or NULL if there is none */
+pp_layout_t*
+pp_leds_find_layout( VALUE self )
+{
+  VALUE obj = rb_ivar_get( self, id_layout );
+  return NIL_P(obj) ? NULL : pp_layout_struct( obj );
+}
+
+/* Clip the rectangle at (*x, *y) of `*w` by `*h` to the layout. The offsets of
+ * the clipped rectangle inside the original one are stored in `sx` and `sy`.
+ * Returns zero if nothing is left.
+ */
+static int
+pp_layout_clip( const pp_layout_t *layout, long *x, long *y, long *w, long *h, long *sx, long *sy )
+{
+  *sx = *x < 0 ? -*x : 0;
+  *sy = *y < 0 ? -*y : 0;
+  *x += *sx;  *w -= *sx;
+  *y += *sy;  *h -= *sy;
+  if (*x + *w > layout->width)  *w = layout->width - *x;
+  if (*y + *h > layout->height) *h = layout->height - *y;
+  return *w > 0 && *h > 0;
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::Layout.new( width, height, options = {} )
+ *
+ * Create a mapping from the (x, y) positions of a `width` by `height` matrix
+ * to LED indices. The index map is computed once; the 2D methods of
+ * PixelPi::Leds look positions up in it. Position (0, 0) is the top left.
+ *
+ * options - Hash of arguments
+ *   :order - how the LEDs are wired defaults to `:row_major`; one of
+ *            `:row_major`, `:serpentine` (every other row runs right to left),
+ *            `:column_major`, or `:column_serpentine`
+ *   :panel - `[width, height]` of the panels when the matrix is tiled from
+ *            smaller panels; panels are chained left to right, then top to
+ *            bottom, and each is wired in the given `:order`
+ *   :map   - an Array or packed String of `width * height` LED indices given
+ *            row by row; -1 marks a position without an LED. The other
+ *            options are ignored.
+ *
+ * Examples:
+ *    PixelPi::Layout.new( 32, 8, :order => :serpentine )
+ *    PixelPi::Layout.new( 32, 16, :order => :serpentine, :panel => [16, 16] )
+ */
+static VALUE
+pp_layout_initialize( int argc, VALUE* argv, VALUE self )
+{
+  pp_layout_t *layout = pp_layout_struct( self );
+  VALUE width, height, opts, tmp, map = Qnil, store = 0;
+  long w, h, pw, ph, x, y, len;
+  int order = PP_ORDER_ROW_MAJOR;
+  const uint32_t *src = NULL;
+  uint32_t *ptr;
+
+  rb_scan_args( argc, argv, "21", &width, &height, &opts );
+
+  w = NUM2LONG(width);
+  h = NUM2LONG(height);
+  if (w < 0 || h < 0) {
+    rb_raise( rb_eArgError, "layout size cannot be negative: %ldx%ld", w, h );
+  }
+  pw = w;
+  ph = h;
+
+  if (!NIL_P(opts)) {
+    Check_Type( opts, T_HASH );
+
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_order ))) order = pp_parse_order( tmp );
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_panel ))) {
+      Check_Type( tmp, T_ARRAY );
+      if (RARRAY_LEN(tmp) != 2) {
+        rb_raise( rb_eArgError, "panel must be given as [width, height]" );
+      }
+      pw = NUM2LONG(RARRAY_AREF( tmp, 0 ));
+      ph = NUM2LONG(RARRAY_AREF( tmp, 1 ));
+      if (pw <= 0 || ph <= 0 || w % pw || h % ph) {
+        rb_raise( rb_eArgError, "panel size %ldx%ld does not tile the %ldx%ld layout", pw, ph, w, h );
+      }
+    }
+    map = rb_hash_lookup( opts, sym_map );
+  }
+
+  if (!NIL_P(map)) {
+    src = pp_uint32_list( map, &len, &store );
+    if (len != w * h) {
+      if (store) rb_free_tmp_buffer( &store );
+      rb_raise( rb_eArgError, "map must have %ld entries: %ld", w * h, len );
+    }
+  }
+
+  ptr = ALLOC_N( uint32_t, (w && h) ? w * h : 1 );
+
+  if (src) {
+    memcpy( ptr, src, len * sizeof(uint32_t) );
+    if (store) rb_free_tmp_buffer( &store );
+  } else {
+    for (y=0; y<h; y++) {
+      for (x=0; x<w; x++) {
+        long panel = (y / ph) * (w / pw) + (x / pw);
+        ptr[y * w + x] = panel * pw * ph + pp_order_index( order, x % pw, y % ph, pw, ph );
+      }
+    }
+  }
+
+  if (layout->map) xfree( layout->map );
+  layout->map    = ptr;
+  layout->width  = w;
+  layout->height = h;
+
+  return self;
+}
+
+/* call-seq:
+ *    width
+ *
+ * Returns the width of the matrix.
+ */
+static VALUE
+pp_layout_width( VALUE self )
+{
+  return LONG2NUM(pp_layout_struct( self )->width);
+}
+
+/* call-seq:
+ *    height
+ *
+ * Returns the height of the matrix.
+ */
+static VALUE
+pp_layout_height( VALUE self )
+{
+  return LONG2NUM(pp_layout_struct( self )->height);
+}
+
+/* call-seq:
+ *    index( x, y )   #=> Integer or nil
+ *
+ * Returns the LED index at position (x, y) or `nil` if there is no LED at
+ * that position. Raises an IndexError if the position is outside the matrix.
+ */
+static VALUE
+pp_layout_index( VALUE self, VALUE xv, VALUE yv )
+{
+  pp_layout_t *layout = pp_layout_struct( self );
+  long x = NUM2LONG(xv), y = NUM2LONG(yv);
+  uint32_t idx;
+
+  if (x < 0 || x >= layout->width || y < 0 || y >= layout->height) {
+    rb_raise( rb_eIndexError, "position (%ld, %ld) is outside of layout: %ldx%ld",
+              x, y, layout->width, layout->height );
+  }
+
+  idx = layout->map[y * layout->width + x];
+  return idx == PP_NO_LED ? Qnil : UINT2NUM(idx);
+}
+
+/* call-seq:
+ *    to_a
+ *
+ * Returns an Array of the LED index of each position, row by row. Positions
+ * without an LED are `nil`.
+ */
+static VALUE
+pp_layout_to_a( VALUE self )
+{
+  pp_layout_t *layout = pp_layout_struct( self );
+  long ii, len = layout->width * layout->height;
+  VALUE ary = rb_ary_new2( len );
+
+  for (ii=0; ii<len; ii++) {
+    uint32_t idx = layout->map[ii];
+    rb_ary_push( ary, idx == PP_NO_LED ? Qnil : UINT2NUM(idx) );
+  }
+  return ary;
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    layout = PixelPi::Layout
+ *
+ * Attach the matrix layout used by `set_xy`, `get_xy`, `fill_rect`, `blit`,
+ * and `scroll`. Every LED index of the layout must be inside the LED range.
+ * Pass `nil` to remove the layout.
+ */
+static VALUE
+pp_leds_layout_set( VALUE self, VALUE obj )
+{
+  long ii, count, len;
+
+  pp_leds_buffer( self, &count );
+
+  if (!NIL_P(obj)) {
+    pp_layout_t *layout = pp_layout_struct( obj );
+    len = layout->width * layout->height;
+    for (ii=0; ii<len; ii++) {
+      uint32_t idx = layout->map[ii];
+      if (idx != PP_NO_LED && idx >= (uint32_t) count) {
+        rb_raise( rb_eArgError, "layout index %u is outside of LED range: 0...%ld", idx, count-1 );
+      }
+    }
+  }
+
+  rb_ivar_set( self, id_layout, obj );
+  return obj;
+}
+
+/* call-seq:
+ *    layout
+ *
+ * Returns the PixelPi::Layout attached to these LEDs or `nil`.
+ */
+static VALUE
+pp_leds_layout_get( VALUE self )
+{
+  pp_leds_struct( self );
+  return rb_ivar_get( self, id_layout );
+}
+
+/* call-seq:
+ *    set_xy( x, y, color )
+ *
+ * Set the LED at matrix position (x, y) to the given `color`. Positions
+ * without an LED are ignored. Raises an IndexError if the position is outside
+ * the matrix.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_set_xy( VALUE self, VALUE xv, VALUE yv, VALUE color )
+{
+  ws2811_led_t *leds;
+  long count, x = NUM2LONG(xv), y = NUM2LONG(yv);
+  pp_layout_t *layout = pp_leds_layout( self, &leds, &count );
+  uint32_t idx;
+
+  if (x < 0 || x >= layout->width || y < 0 || y >= layout->height) {
+    rb_raise( rb_eIndexError, "position (%ld, %ld) is outside of layout: %ldx%ld",
+              x, y, layout->width, layout->height );
+  }
+
+  idx = layout->map[y * layout->width + x];
+  if (idx < (uint32_t) count) leds[idx] = NUM2UINT(color);
+
+  return self;
+}
+
+/* call-seq:
+ *    get_xy( x, y )   #=> color or nil
+ *
+ * Returns the color of the LED at matrix position (x, y) or `nil` if there is
+ * no LED at that position. Raises an IndexError if the position is outside
+ * the matrix.
+ */
+static VALUE
+pp_leds_get_xy( VALUE self, VALUE xv, VALUE yv )
+{
+  ws2811_led_t *leds;
+  long count, x = NUM2LONG(xv), y = NUM2LONG(yv);
+  pp_layout_t *layout = pp_leds_layout( self, &leds, &count );
+  uint32_t idx;
+
+  if (x < 0 || x >= layout->width || y < 0 || y >= layout->height) {
+    rb_raise( rb_eIndexError, "position (%ld, %ld) is outside of layout: %ldx%ld",
+              x, y, layout->width, layout->height );
+  }
+
+  idx = layout->map[y * layout->width + x];
+  return idx < (uint32_t) count ? UINT2NUM(leds[idx]) : Qnil;
+}
+
+/* call-seq:
+ *    fill_rect( x, y, width, height, color )
+ *
+ * Set every LED of the rectangle with its top left corner at (x, y) to the
+ * given `color`. The parts of the rectangle outside the matrix are ignored.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_fill_rect( VALUE self, VALUE xv, VALUE yv, VALUE wv, VALUE hv, VALUE color )
+{
+  ws2811_led_t *leds;
+  long count, ii, jj, sx, sy;
+  long x = NUM2LONG(xv), y = NUM2LONG(yv), w = NUM2LONG(wv), h = NUM2LONG(hv);
+  pp_layout_t *layout = pp_leds_layout( self, &leds, &count );
+  ws2811_led_t c = NUM2UINT(color);
+
+  if (!pp_layout_clip( layout, &x, &y, &w, &h, &sx, &sy )) return self;
+
+  for (jj=0; jj<h; jj++) {
+    const uint32_t *row = layout->map + (y + jj) * layout->width + x;
+    for (ii=0; ii<w; ii++) {
+      if (row[ii] < (uint32_t) count) leds[row[ii]] = c;
+    }
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    blit( packed_rgb, width, height, x = 0, y = 0 )
+ *
+ * Copy a `width` by `height` image onto the matrix with its top left corner
+ * at (x, y). The `packed_rgb` String holds three bytes - red, green, and blue -
+ * for each pixel, row by row, as created by `ary.pack("C*")` or read from a
+ * raw RGB image. The parts of the image outside the matrix are ignored.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_blit( int argc, VALUE* argv, VALUE self )
+{
+  ws2811_led_t *leds;
+  pp_layout_t *layout;
+  const uint8_t *rgb;
+  VALUE str, wv, hv, xv, yv;
+  long count, ii, jj, sx, sy, iw, x = 0, y = 0, w, h;
+
+  rb_scan_args( argc, argv, "32", &str, &wv, &hv, &xv, &yv );
+  StringValue( str );
+  layout = pp_leds_layout( self, &leds, &count );
+
+  iw = w = NUM2LONG(wv);
+  h = NUM2LONG(hv);
+  if (w < 0 || h < 0) {
+    rb_raise( rb_eArgError, "image size cannot be negative: %ldx%ld", w, h );
+  }
+  if (RSTRING_LEN(str) != w * h * 3) {
+    rb_raise( rb_eArgError, "packed RGB String must be %ld bytes for a %ldx%ld image: %ld",
+              w * h * 3, w, h, RSTRING_LEN(str) );
+  }
+  if (!NIL_P(xv)) x = NUM2LONG(xv);
+  if (!NIL_P(yv)) y = NUM2LONG(yv);
+
+  if (!pp_layout_clip( layout, &x, &y, &w, &h, &sx, &sy )) return self;
+
+  for (jj=0; jj<h; jj++) {
+    const uint32_t *row = layout->map + (y + jj) * layout->width + x;
+    rgb = (const uint8_t*) RSTRING_PTR(str) + ((sy + jj) * iw + sx) * 3;
+    for (ii=0; ii<w; ii++, rgb+=3) {
+      if (row[ii] < (uint32_t) count) leds[row[ii]] = RGB2COLOR(rgb[0], rgb[1], rgb[2]);
+    }
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    scroll( dx, dy, color = 0 )
+ *
+ * Move the image on the matrix `dx` positions to the right and `dy`
+ * positions down; negative values move it left and up. The positions left
+ * uncovered are set to `color`.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_scroll( int argc, VALUE* argv, VALUE self )
+{
+  ws2811_led_t *leds;
+  pp_layout_t *layout;
+  VALUE dxv, dyv, color;
+  ws2811_led_t c = 0;
+  long count, w, h, dx, dy, x, y, xs, ys, xe, ye, xd, yd;
+
+  rb_scan_args( argc, argv, "21", &dxv, &dyv, &color );
+  layout = pp_leds_layout( self, &leds, &count );
+  dx = NUM2LONG(dxv);
+  dy = NUM2LONG(dyv);
+  if (!NIL_P(color)) c = NUM2UINT(color);
+
+  w = layout->width;
+  h = layout->height;
+
+  /* walk away from the direction of the move, like memmove, so every source
+   * position is read before it is overwritten */
+  if (dy > 0) { ys = h - 1; ye = -1; yd = -1; } else { ys = 0; ye = h; yd = 1; }
+  if (dx > 0) { xs = w - 1; xe = -1; xd = -1; } else { xs = 0; xe = w; xd = 1; }
+
+  for (y=ys; y!=ye; y+=yd) {
+    for (x=xs; x!=xe; x+=xd) {
+      uint32_t dst = layout->map[y * w + x];
+      long sx = x - dx, sy = y - dy;
+      ws2811_led_t v = c;
+
+      if (dst >= (uint32_t) count) continue;
+      if (sx >= 0 && sx < w && sy >= 0 && sy < h) {
+        uint32_t src = layout->map[sy * w + sx];
+        if (src < (uint32_t) count) v = leds[src];
+      }
+      leds[dst] = v;
+    }
+  }
+
+  return self;
+}
+
+void Init_layout( )
+{
+  id_layout = rb_intern( "@layout" );
+  sym_order = ID2SYM(rb_intern( "order" ));
+  sym_panel = ID2SYM(rb_intern( "panel" ));
+  sym_map   = ID2SYM(rb_intern( "map" ));
+
+  cLayout = rb_define_class_under( mPixelPi, "Layout", rb_cObject );
+  rb_define_alloc_func( cLayout, pp_layout_allocate );
+  rb_define_method( cLayout, "initialize", pp_layout_initialize, -1 );
+
+  rb_define_method( cLayout, "width",  pp_layout_width,  0 );
+  rb_define_method( cLayout, "height", pp_layout_height, 0 );
+  rb_define_method( cLayout, "index",  pp_layout_index,  2 );
+  rb_define_method( cLayout, "to_a",   pp_layout_to_a,   0 );
+
+  rb_define_method( cLeds, "layout=",   pp_leds_layout_set,  1 );
+  rb_define_method( cLeds, "layout",    pp_leds_layout_get,  0 );
+  rb_define_method( cLeds, "set_xy",    pp_leds_set_xy,      3 );
+  rb_define_method( cLeds, "get_xy",    pp_leds_get_xy,      2 );
+  rb_define_method( cLeds, "fill_rect", pp_leds_fill_rect,   5 );
+  rb_define_method( cLeds, "blit",      pp_leds_blit,       -1 );
+  rb_define_method( cLeds, "scroll",    pp_leds_scroll,     -1 );
+}
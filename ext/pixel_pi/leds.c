@@ -1,17 +1,26 @@
-#include <ruby.h>
-#include "ws2811.h"
-
-#define RGB2COLOR(r,g,b) ((((r) & 0xff) << 16) | (((g) & 0xff) << 8) | ((b) & 0xff))
-
-#ifndef MIN
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#endif
+#include "pixel_pi.h"
+#include <math.h>
 
 VALUE mPixelPi;
 VALUE cLeds;
 VALUE ePixelPiError;
 
 static VALUE sym_dma, sym_frequency, sym_invert, sym_brightness;
+static VALUE sym_gamma, sym_white_balance, sym_dither, sym_strip_type, sym_output, sym_refresh, sym_debug;
+static ID id_gamma, id_white_balance, id_output;
+
+/* Strip types by name; the name gives the order the colors are sent in */
+static const struct {
+  const char *name;
+  int strip_type;
+} pp_strip_types[] = {
+  { "rgb",  WS2811_STRIP_RGB  }, { "rbg",  WS2811_STRIP_RBG  },
+  { "grb",  WS2811_STRIP_GRB  }, { "gbr",  WS2811_STRIP_GBR  },
+  { "brg",  WS2811_STRIP_BRG  }, { "bgr",  WS2811_STRIP_BGR  },
+  { "rgbw", SK6812_STRIP_RGBW }, { "rbgw", SK6812_STRIP_RBGW },
+  { "grbw", SK6812_STRIP_GRBW }, { "gbrw", SK6812_STRIP_GBRW },
+  { "brgw", SK6812_STRIP_BRGW }, { "bgrw", SK6812_STRIP_BGRW },
+};
 
 /* ======================================================================= */
 
@@ -22,7 +31,13 @@ pp_leds_free( void *ptr )
   if (NULL == ptr) return;
 
   ledstring= (ws2811_t*) ptr;
-  if (ledstring->device) ws2811_fini( ledstring );
+  xfree( ledstring->channel[0].segments );
+  if (ledstring->device) {
+    ws2811_fini( ledstring );
+  } else {
+    xfree( ledstring->channel[0].leds );
+    xfree( ledstring->channel[0].leds16 );
+  }
   xfree( ledstring );
 }
 
@@ -42,17 +57,34 @@ pp_leds_allocate( VALUE klass )
   ledstring->device = NULL;
 
   for (ii=0; ii<RPI_PWM_CHANNELS; ii++) {
+    int jj;
     ledstring->channel[ii].gpionum    = 0;
     ledstring->channel[ii].count      = 0;
     ledstring->channel[ii].invert     = 0;
     ledstring->channel[ii].brightness = 255;
+    ledstring->channel[ii].strip_type = WS2811_STRIP_GRB;
     ledstring->channel[ii].leds       = NULL;
+    ledstring->channel[ii].origin     = 0;
+    ledstring->channel[ii].reverse    = 0;
+
+    /* correction tables are 8.8 fixed-point */
+    for (jj=0; jj<256; jj++) {
+      ledstring->channel[ii].correction[0][jj] = jj << 8;
+      ledstring->channel[ii].correction[1][jj] = jj << 8;
+      ledstring->channel[ii].correction[2][jj] = jj << 8;
+      ledstring->channel[ii].correction[3][jj] = jj << 8;
+    }
+
+    ledstring->channel[ii].dither = 0;
+    ledstring->channel[ii].leds16 = NULL;
+    ledstring->channel[ii].segments = NULL;
+    ledstring->channel[ii].segment_count = 0;
   }
 
   return Data_Wrap_Struct( klass, NULL, pp_leds_free, ledstring );
 }
 
-static ws2811_t*
+ws2811_t*
 pp_leds_struct( VALUE self )
 {
   ws2811_t *ledstring;
@@ -63,13 +95,222 @@ pp_leds_struct( VALUE self )
   }
   Data_Get_Struct( self, ws2811_t, ledstring );
 
-  if (!ledstring->device) {
+  /* LEDs shown through an output have a buffer but no device */
+  if (!ledstring->device && !ledstring->channel[0].leds) {
     rb_raise( ePixelPiError, "Leds are not initialized" );
   }
 
   return ledstring;
 }
 
+/* Show the LEDs through the output wrapped by `obj` instead of a DMA channel.
+ * The channel settings must already be filled in; the LED buffers are
+ * allocated here and belong to the PixelPi::Leds.
+ */
+void
+pp_leds_output( VALUE self, VALUE obj )
+{
+  ws2811_t *ledstring;
+  ws2811_channel_t *channel;
+
+  Data_Get_Struct( self, ws2811_t, ledstring );
+  channel = &ledstring->channel[0];
+
+  channel->leds = ALLOC_N( ws2811_led_t, channel->count + 1 );
+  memset( channel->leds, 0, (channel->count + 1) * sizeof(ws2811_led_t) );
+  if (channel->dither) {
+    channel->leds16 = ALLOC_N( uint16_t, channel->count * 3 + 1 );
+    memset( channel->leds16, 0, (channel->count * 3 + 1) * sizeof(uint16_t) );
+  }
+  rb_ivar_set( self, id_output, obj );
+}
+
+/* The free function of every output object, so the LEDs can tell an output
+ * from any other wrapped struct */
+void
+pp_output_free( void *ptr )
+{
+  pp_output_t *output = (pp_output_t*) ptr;
+
+  if (NULL == ptr) return;
+  output->free( output );
+}
+
+static pp_output_t*
+pp_leds_output_struct( VALUE self )
+{
+  VALUE obj = rb_ivar_get( self, id_output );
+
+  if (NIL_P(obj)) return NULL;
+  if (TYPE(obj) != T_DATA
+  ||  RDATA(obj)->dfree != (RUBY_DATA_FUNC) pp_output_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi output" );
+  }
+  return (pp_output_t*) DATA_PTR(obj);
+}
+
+/* Returns the buffer index of the LED at position `n`. The `rotate` and
+ * `reverse` methods only move the channel origin and flip its direction; the
+ * encoder reads the buffer in that order when the LEDs are shown.
+ */
+static inline long
+pp_leds_index( const ws2811_channel_t *channel, long n )
+{
+  long ii = channel->reverse ? channel->origin - n : channel->origin + n;
+  if (ii < 0) ii += channel->count;
+  else if (ii >= channel->count) ii -= channel->count;
+  return ii;
+}
+
+/* Reverse the LEDs from index `beg` through `end` along with their 16-bit
+ * colors when the LEDs are dithered.
+ */
+static void
+pp_leds_reverse_span( ws2811_channel_t *channel, long beg, long end )
+{
+  uint16_t *p1, *p2, tmp;
+  int jj;
+
+  if (end <= beg) return;
+  pp_leds_reverse( channel->leds + beg, channel->leds + end );
+
+  if (!channel->leds16) return;
+  p1 = channel->leds16 + beg * 3;
+  p2 = channel->leds16 + end * 3;
+  for (; p1 < p2; p1 += 3, p2 -= 3) {
+    for (jj=0; jj<3; jj++) { tmp = p1[jj]; p1[jj] = p2[jj]; p2[jj] = tmp; }
+  }
+}
+
+/* Move the LED colors so the buffer order matches the order set up by
+ * `rotate` and `reverse`, and reset the channel origin and direction.
+ */
+void
+pp_leds_normalize( ws2811_channel_t *channel )
+{
+  long len = channel->count;
+  long cnt = channel->origin;
+
+  if (cnt == 0 && !channel->reverse) return;
+
+  if (channel->reverse) {
+    pp_leds_reverse_span( channel, 0, len-1 );
+    cnt = len - 1 - cnt;
+  }
+  if (cnt > 0) {
+    pp_leds_reverse_span( channel, 0, cnt-1 );
+    pp_leds_reverse_span( channel, cnt, len-1 );
+    pp_leds_reverse_span( channel, 0, len-1 );
+  }
+
+  channel->origin  = 0;
+  channel->reverse = 0;
+}
+
+/* Returns the LED colors of a PixelPi::Leds or of a PixelPi::Slice view of the
+ * LEDs and stores the number of colors in `len`. The buffer methods shared by
+ * the LEDs and their slices use this in place of `pp_leds_struct`. Any pending
+ * `rotate` or `reverse` is applied first so the colors are in order.
+ */
+ws2811_led_t*
+pp_leds_buffer( VALUE self, long *len )
+{
+  ws2811_t *ledstring;
+  ws2811_led_t *ptr = pp_slice_buffer( self, len );
+
+  if (ptr) return ptr;
+
+  ledstring = pp_leds_struct( self );
+  pp_leds_normalize( &ledstring->channel[0] );
+  *len = ledstring->channel[0].count;
+  return ledstring->channel[0].leds;
+}
+
+/* Returns the LED colors of a PixelPi::Leds or a PixelPi::Slice like
+ * `pp_leds_buffer`, but leaves any pending `rotate` or `reverse` in place.
+ * Methods that write the colors in buffer order use this and call
+ * `pp_leds_write_range` once their arguments have been checked.
+ */
+ws2811_led_t*
+pp_leds_write_buffer( VALUE self, long *len )
+{
+  ws2811_channel_t *channel;
+  ws2811_led_t *ptr = pp_slice_buffer( self, len );
+
+  if (ptr) return ptr;
+
+  channel = &pp_leds_struct( self )->channel[0];
+  *len = channel->count;
+  return channel->leds;
+}
+
+/* Get the buffer returned by `pp_leds_write_buffer` ready for `len` colors to
+ * be written in order starting at `beg`. A write that covers every LED drops
+ * the pending `rotate` or `reverse` instead of moving colors that are about to
+ * be replaced; the 16-bit colors are cleared along with it since they no
+ * longer line up. The dither residual belongs to the strip position and is
+ * kept. Any other write applies the pending `rotate` or `reverse` first.
+ */
+void
+pp_leds_write_range( VALUE self, long beg, long len )
+{
+  ws2811_channel_t *channel;
+
+  if (TYPE(self) != T_DATA || RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_leds_free) return;
+  channel = &pp_leds_struct( self )->channel[0];
+
+  if (beg > 0 || len < channel->count) {
+    pp_leds_normalize( channel );
+    return;
+  }
+  if (channel->leds16 && (channel->origin != 0 || channel->reverse)) {
+    memset( channel->leds16, 0, channel->count * 3 * sizeof(uint16_t) );
+  }
+  channel->origin  = 0;
+  channel->reverse = 0;
+}
+
+/* Returns a pointer to the color of the LED at position `num` of a
+ * PixelPi::Leds or a PixelPi::Slice. The LEDs are not reordered; the position
+ * is looked up through the channel origin instead. Raises an IndexError if the
+ * position is outside the LED range.
+ */
+static ws2811_led_t*
+pp_leds_pixel( VALUE self, VALUE num )
+{
+  ws2811_channel_t *channel = NULL;
+  long count, n = FIX2LONG(num);
+  ws2811_led_t *leds = pp_slice_buffer( self, &count );
+
+  if (!leds) {
+    channel = &pp_leds_struct( self )->channel[0];
+    leds  = channel->leds;
+    count = channel->count;
+  }
+
+  if (n < 0 || n >= count) {
+    rb_raise( rb_eIndexError, "index %ld is outside of LED range: 0...%ld", n, count-1 );
+  }
+
+  return channel ? leds + pp_leds_index( channel, n ) : leds + n;
+}
+
+/* Returns the LED buffer of a PixelPi::Leds, a PixelPi::Slice, or the pixel
+ * buffer of a PixelPi::Layer and stores its length in `len`. Returns NULL for any other
+ * object.
+ */
+ws2811_led_t*
+pp_buffer( VALUE obj, long *len )
+{
+  ws2811_led_t *ptr;
+
+  if (TYPE(obj) == T_DATA && RDATA(obj)->dfree == (RUBY_DATA_FUNC) pp_leds_free) {
+    return pp_leds_buffer( obj, len );
+  }
+  if ((ptr = pp_slice_buffer( obj, len ))) return ptr;
+  return pp_layer_buffer( obj, len );
+}
+
 static int
 pp_rgb_to_color( VALUE red, VALUE green, VALUE blue )
 {
@@ -79,6 +320,156 @@ pp_rgb_to_color( VALUE red, VALUE green, VALUE blue )
   return RGB2COLOR(r, g, b);
 }
 
+/* Convert the given Array of Integers or packed String of native 32-bit
+ * unsigned values (`ary.pack("L*")`) into a C array of LED colors or indices.
+ * Packed Strings are used in place; Arrays are copied into a temporary buffer
+ * that must be released with `ALLOCV_END( store )` once the values are no
+ * longer needed.
+ *
+ * Returns a pointer to the values and sets `len` to the number of values.
+ */
+const uint32_t*
+pp_uint32_list( VALUE obj, long *len, VALUE *store )
+{
+  uint32_t *buf;
+  long ii;
+
+  *store = 0;
+
+  if (TYPE(obj) == T_STRING) {
+    if (RSTRING_LEN(obj) % sizeof(uint32_t)) {
+      rb_raise( rb_eArgError, "packed String length must be a multiple of 4: %ld", RSTRING_LEN(obj) );
+    }
+    *len = RSTRING_LEN(obj) / sizeof(uint32_t);
+    return (const uint32_t*) RSTRING_PTR(obj);
+  }
+
+  if (TYPE(obj) != T_ARRAY) {
+    rb_raise( rb_eTypeError, "expecting an Array or a packed String: %s", rb_obj_classname(obj) );
+  }
+
+  *len = RARRAY_LEN(obj);
+  buf  = (uint32_t*) rb_alloc_tmp_buffer( store, *len * sizeof(uint32_t) );
+  for (ii=0; ii<*len; ii++) {
+    buf[ii] = NUM2UINT(RARRAY_AREF( obj, ii ));
+  }
+
+  return buf;
+}
+
+/* Parse a gamma value - either a single Numeric applied to all three colors or
+ * an Array of red, green, and blue gamma values.
+ */
+void
+pp_parse_gamma( VALUE value, double gamma[3] )
+{
+  int ii;
+
+  if (NIL_P(value)) {
+    gamma[0] = gamma[1] = gamma[2] = 1.0;
+  } else if (TYPE(value) == T_ARRAY) {
+    if (RARRAY_LEN(value) != 3) {
+      rb_raise( rb_eArgError, "gamma must have 3 values (red, green, blue): %ld", RARRAY_LEN(value) );
+    }
+    for (ii=0; ii<3; ii++) gamma[ii] = NUM2DBL(rb_ary_entry( value, ii ));
+  } else {
+    gamma[0] = gamma[1] = gamma[2] = NUM2DBL(value);
+  }
+
+  for (ii=0; ii<3; ii++) {
+    if (!(gamma[ii] > 0.0)) {
+      rb_raise( rb_eArgError, "gamma must be positive: %f", gamma[ii] );
+    }
+  }
+}
+
+/* Look up the driver strip type for a strip type name such as `:grb` or
+ * `:rgbw`.
+ */
+int
+pp_parse_strip_type( VALUE value )
+{
+  const char *name;
+  size_t ii;
+
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "strip type must be a Symbol: %s", rb_obj_classname(value) );
+  }
+
+  name = rb_id2name( SYM2ID(value) );
+  for (ii=0; ii<sizeof(pp_strip_types)/sizeof(pp_strip_types[0]); ii++) {
+    if (strcmp( name, pp_strip_types[ii].name ) == 0) return pp_strip_types[ii].strip_type;
+  }
+
+  rb_raise( rb_eArgError, "unknown strip type: %s", name );
+  return 0;
+}
+
+/* Parse a white balance value - either a 24-bit RGB color or an Array of red,
+ * green, and blue values between 0 and 255. Each value is the output level
+ * used for a fully lit color.
+ */
+void
+pp_parse_white_balance( VALUE value, int wb[3] )
+{
+  int ii;
+
+  if (NIL_P(value)) {
+    wb[0] = wb[1] = wb[2] = 255;
+  } else if (TYPE(value) == T_ARRAY) {
+    if (RARRAY_LEN(value) != 3) {
+      rb_raise( rb_eArgError, "white balance must have 3 values (red, green, blue): %ld", RARRAY_LEN(value) );
+    }
+    for (ii=0; ii<3; ii++) wb[ii] = NUM2INT(rb_ary_entry( value, ii )) & 0xff;
+  } else {
+    uint32_t color = NUM2UINT(value);
+    wb[0] = (color >> 16) & 0xff;
+    wb[1] = (color >>  8) & 0xff;
+    wb[2] =  color        & 0xff;
+  }
+}
+
+/* Build color correction tables from a gamma and white balance as they are given
+ * to PixelPi::Leds.new. The tables are 8.8 fixed-point; the brightness is
+ * applied separately by the driver when it composes them into encoder symbols.
+ */
+void
+pp_build_correction( uint16_t correction[4][256], VALUE gamma_value, VALUE wb_value )
+{
+  double gamma[3], g;
+  int wb[3], ii, jj;
+
+  pp_parse_gamma( gamma_value, gamma );
+  pp_parse_white_balance( wb_value, wb );
+
+  for (ii=0; ii<3; ii++) {
+    for (jj=0; jj<256; jj++) {
+      correction[ii][jj] = (uint16_t) (pow( jj / 255.0, gamma[ii] ) * wb[ii] * 256.0 + 0.5);
+    }
+  }
+
+  /* the white LED of RGBW strips uses the average gamma and no white balance */
+  g = (gamma[0] + gamma[1] + gamma[2]) / 3.0;
+  for (jj=0; jj<256; jj++) {
+    correction[3][jj] = (uint16_t) (pow( jj / 255.0, g ) * 255.0 * 256.0 + 0.5);
+  }
+}
+
+/* Rebuild the color correction tables from the gamma and white balance stored
+ * on this PixelPi::Leds instance, along with those of any segments that use
+ * them.
+ */
+static void
+pp_leds_update_correction( VALUE self, ws2811_t *ledstring )
+{
+  pp_build_correction( ledstring->channel[0].correction,
+                       rb_ivar_get( self, id_gamma ),
+                       rb_ivar_get( self, id_white_balance ) );
+  pp_leds_update_segments( self, ledstring );
+
+  if (ledstring->device) ws2811_correction_changed( ledstring );
+}
+
 /* ======================================================================= */
 /* call-seq:
  *    PixelPi::Leds.new( length, gpio, options = {} )
@@ -91,16 +482,42 @@ pp_rgb_to_color( VALUE red, VALUE green, VALUE blue )
  * length  - the nubmer of leds in the string
  * gpio    - the GPIO pin number
  * options - Hash of arguments
- *   :dma        - DMA channel defaults to 5
- *   :frequency  - output frequency defaults to 800,000 Hz
- *   :invert     - defaults to `false`
- *   :brightness - defaults to 255
+ *   :dma           - DMA channel defaults to 5
+ *   :frequency     - output frequency defaults to 800,000 Hz
+ *   :invert        - defaults to `false`
+ *   :brightness    - defaults to 255
+ *   :gamma         - gamma correction defaults to 1.0; can be a single value
+ *                    or an Array of red, green, and blue values
+ *   :white_balance - the 24-bit RGB color shown for full white defaults to
+ *                    0xFFFFFF; can also be an Array of red, green, and blue
+ *   :dither        - keep a 16-bit per color buffer and temporally dither it
+ *                    down to 8 bits when encoding; defaults to `false`
+ *   :strip_type    - order the colors are sent in defaults to `:grb`; one of
+ *                    `:rgb`, `:rbg`, `:grb`, `:gbr`, `:brg`, `:bgr` or the
+ *                    RGBW variants `:rgbw`, `:grbw`, etc. For RGBW strips the
+ *                    white value is the top byte of each 32-bit color.
+ *   :output        - "udp://host:port" or "tcp://host:port" to send each
+ *                    frame to a PixelPi::Receiver using the `:pixel_pi`
+ *                    protocol instead of driving a DMA channel; the port
+ *                    defaults to 20560. Only the chunks of LEDs that changed
+ *                    are sent. The GPIO and DMA settings are not used, and
+ *                    the gamma and white balance are those of the receiving
+ *                    LEDs.
+ *   :refresh       - with `:output`, every chunk of LEDs is sent in full once
+ *                    every this many frames so a receiver recovers from lost
+ *                    packets; defaults to 60
+ *   :debug         - draw every frame in the terminal as it is shown; see
+ *                    `preview`; defaults to `false`
+ *
+ * Examples:
+ *    leds = PixelPi::Leds.new( 10_000, 18, :output => "udp://10.0.0.2" )
  */
 static VALUE
 pp_leds_initialize( int argc, VALUE* argv, VALUE self )
 {
   ws2811_t *ledstring;
   VALUE length, gpio, opts, tmp;
+  VALUE output = Qnil, refresh = Qnil, debug = Qnil;
   int resp;
 
   if (TYPE(self) != T_DATA
@@ -177,14 +594,47 @@ pp_leds_initialize( int argc, VALUE* argv, VALUE self )
       if (RTEST(tmp)) ledstring->channel[0].invert = 1;
       else            ledstring->channel[0].invert = 0;
     }
+
+    /* get the dither flag */
+    tmp = rb_hash_lookup( opts, sym_dither );
+    if (!NIL_P(tmp)) {
+      if (RTEST(tmp)) ledstring->channel[0].dither = 1;
+      else            ledstring->channel[0].dither = 0;
+    }
+
+    /* get the strip type */
+    tmp = rb_hash_lookup( opts, sym_strip_type );
+    if (!NIL_P(tmp)) {
+      ledstring->channel[0].strip_type = pp_parse_strip_type( tmp );
+    }
+
+    /* get the color correction */
+    rb_ivar_set( self, id_gamma, rb_hash_lookup( opts, sym_gamma ) );
+    rb_ivar_set( self, id_white_balance, rb_hash_lookup( opts, sym_white_balance ) );
+
+    /* get the network output */
+    output  = rb_hash_lookup( opts, sym_output );
+    refresh = rb_hash_lookup( opts, sym_refresh );
+
+    /* draw the frames in the terminal */
+    debug = rb_hash_lookup( opts, sym_debug );
   }
 
-  /* initialize the DMA and PWM cycle */
-  resp = ws2811_init( ledstring );
-  if (resp < 0) {
-    rb_raise( ePixelPiError, "Leds could not be initialized: %d", resp );
+  pp_leds_update_correction( self, ledstring );
+
+  if (!NIL_P(output)) {
+    pp_sender_open( self, output, refresh );
+  } else {
+    /* initialize the DMA and PWM cycle */
+    resp = ws2811_init( ledstring );
+    if (resp < 0) {
+      rb_raise( ePixelPiError, "Leds could not be initialized: %d", resp );
+    }
   }
 
+  /* the preview needs the LED buffer set up by the output or the driver */
+  if (RTEST(debug)) rb_funcall( self, rb_intern( "preview" ), 0 );
+
   return self;
 }
 
@@ -252,6 +702,43 @@ pp_leds_invert_get( VALUE self )
   }
 }
 
+/* call-seq:
+ *    strip_type
+ *
+ * Returns the strip type as a Symbol giving the order the colors are sent in,
+ * such as `:grb` or `:rgbw`.
+ */
+static VALUE
+pp_leds_strip_type_get( VALUE self )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  size_t ii;
+
+  for (ii=0; ii<sizeof(pp_strip_types)/sizeof(pp_strip_types[0]); ii++) {
+    if (pp_strip_types[ii].strip_type == ledstring->channel[0].strip_type) {
+      return ID2SYM(rb_intern( pp_strip_types[ii].name ));
+    }
+  }
+  return Qnil;
+}
+
+/* call-seq:
+ *    dither
+ *
+ * Returns `true` if the 16-bit buffer is dithered when encoding and `false` if
+ * it is not.
+ */
+static VALUE
+pp_leds_dither_get( VALUE self )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  if (ledstring->channel[0].dither) {
+    return Qtrue;
+  } else {
+    return Qfalse;
+  }
+}
+
 /* call-seq:
  *    brightness
  *
@@ -281,21 +768,175 @@ pp_leds_brightness_set( VALUE self, VALUE brightness )
   return brightness;
 }
 
+/* call-seq:
+ *    gamma
+ *
+ * Returns the gamma correction - either a single value or an Array of red,
+ * green, and blue values.
+ */
+static VALUE
+pp_leds_gamma_get( VALUE self )
+{
+  VALUE gamma;
+  pp_leds_struct( self );
+  gamma = rb_ivar_get( self, id_gamma );
+  return NIL_P(gamma) ? rb_float_new( 1.0 ) : gamma;
+}
+
+/* call-seq:
+ *    gamma = 2.2
+ *    gamma = [2.2, 2.0, 2.5]   # red, green, blue
+ *
+ * Set the gamma correction applied to the pixels. A single value is used for
+ * all three colors. The correction is built into lookup tables that the
+ * encoder already uses, so it adds no cost per pixel when calling `show`.
+ *
+ * Returns the new gamma.
+ */
+static VALUE
+pp_leds_gamma_set( VALUE self, VALUE gamma )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  double tmp[3];
+
+  pp_parse_gamma( gamma, tmp );
+  rb_ivar_set( self, id_gamma, gamma );
+  pp_leds_update_correction( self, ledstring );
+
+  return gamma;
+}
+
+/* call-seq:
+ *    white_balance
+ *
+ * Returns the white balance - either a 24-bit RGB color or an Array of red,
+ * green, and blue values.
+ */
+static VALUE
+pp_leds_white_balance_get( VALUE self )
+{
+  VALUE wb;
+  pp_leds_struct( self );
+  wb = rb_ivar_get( self, id_white_balance );
+  return NIL_P(wb) ? INT2FIX(0xFFFFFF) : wb;
+}
+
+/* call-seq:
+ *    white_balance = 0xFFE0C0
+ *    white_balance = [255, 224, 192]   # red, green, blue
+ *
+ * Set the white balance. This is the color shown when a pixel is set to full
+ * white; every color is scaled per channel by this value. Like the gamma, the
+ * white balance is built into the encoder lookup tables.
+ *
+ * Returns the new white balance.
+ */
+static VALUE
+pp_leds_white_balance_set( VALUE self, VALUE wb )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  int tmp[3];
+
+  pp_parse_white_balance( wb, tmp );
+  rb_ivar_set( self, id_white_balance, wb );
+  pp_leds_update_correction( self, ledstring );
+
+  return wb;
+}
+
+/* State of a `show` call, shared with the render step run under rb_ensure */
+typedef struct {
+  VALUE             self;
+  ws2811_t         *ledstring;
+  ws2811_channel_t *channel;
+  VALUE             layers;     /* composited over a copy of the buffer */
+  ws2811_led_t     *leds;       /* the LED buffer while a composite is shown */
+  VALUE             store;
+  pp_output_t      *output;
+  int               resp;
+  VALUE             preview;
+} pp_leds_show_t;
+
+/* Composite the layers, send the frame in `channel->leds` to the device or
+ * output, then hand it to the recorder and the preview. Any of those can raise.
+ */
+static VALUE
+pp_leds_show_render( VALUE arg )
+{
+  pp_leds_show_t *show = (pp_leds_show_t*) arg;
+  ws2811_channel_t *channel = show->channel;
+
+  if (!NIL_P(show->layers)) {
+    pp_layers_composite( show->layers, channel->leds, channel->count );
+  }
+
+  if (show->ledstring->device) {
+    show->resp = ws2811_render( show->ledstring );
+  } else {
+    show->resp = show->output->render( show->output, show->self, channel );
+  }
+  if (show->resp >= 0) {
+    pp_recorder_capture( show->self, channel );
+    show->preview = pp_preview_frame( show->self, channel );
+  }
+  return Qnil;
+}
+
+/* Point the channel back at the LED buffer and release the composite */
+static VALUE
+pp_leds_show_restore( VALUE arg )
+{
+  pp_leds_show_t *show = (pp_leds_show_t*) arg;
+
+  show->channel->leds = show->leds;
+  ALLOCV_END( show->store );
+  return Qnil;
+}
+
 /* call-seq:
  *    show
  *
- * Update the display with the data from the LED buffer.
+ * Update the display with the data from the LED buffer. Any attached layers
+ * are composited over the LED buffer first; the LED buffer itself is left
+ * unchanged. The frame is also queued for the recorder when `record` is on,
+ * and drawn in the terminal when `preview` is on.
  *
  * Returns this PixelPi::Leds instance.
  */
-static VALUE
+VALUE
 pp_leds_show( VALUE self )
 {
   ws2811_t *ledstring = pp_leds_struct( self );
-  int resp = ws2811_render( ledstring );
-  if (resp < 0) {
-    rb_raise( ePixelPiError, "PixelPi::Leds failed to render: %d", resp );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  VALUE layers = pp_leds_layers( self );
+  pp_leds_show_t show;
+
+  show.self      = self;
+  show.ledstring = ledstring;
+  show.channel   = channel;
+  show.layers    = Qnil;
+  show.leds      = channel->leds;
+  show.store     = 0;
+  show.output    = pp_leds_output_struct( self );
+  show.resp      = 0;
+  show.preview   = Qnil;
+
+  /* render the composited layers from a copy of the LED buffer */
+  if (!NIL_P(layers) && RARRAY_LEN(layers) > 0) {
+    pp_leds_normalize( channel );
+    channel->leds = ALLOCV_N( ws2811_led_t, show.store, channel->count + 1 );
+    memcpy( channel->leds, show.leds, channel->count * sizeof(ws2811_led_t) );
+    show.layers = layers;
+    rb_ensure( pp_leds_show_render, (VALUE) &show, pp_leds_show_restore, (VALUE) &show );
+  } else {
+    pp_leds_show_render( (VALUE) &show );
+  }
+
+  if (show.resp < 0) {
+    if (!ledstring->device) rb_syserr_fail( -show.resp, show.output->name );
+    rb_raise( ePixelPiError, "PixelPi::Leds failed to render: %d", show.resp );
   }
+  pp_preview_write( self, show.preview );
   return self;
 }
 
@@ -310,12 +951,13 @@ pp_leds_show( VALUE self )
 static VALUE
 pp_leds_clear( VALUE self )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
+  long count;
+  ws2811_led_t *leds = pp_leds_write_buffer( self, &count );
   int ii;
 
-  for (ii=0; ii<channel.count; ii++) {
-    channel.leds[ii] = 0;
+  pp_leds_write_range( self, 0, count );
+  for (ii=0; ii<count; ii++) {
+    leds[ii] = 0;
   }
 
   return self;
@@ -336,7 +978,19 @@ static VALUE
 pp_leds_close( VALUE self )
 {
   ws2811_t *ledstring = pp_leds_struct( self );
-  if (ledstring->device) ws2811_fini( ledstring );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  pp_output_t *output;
+
+  if (ledstring->device) {
+    ws2811_fini( ledstring );
+  } else {
+    output = pp_leds_output_struct( self );
+    if (output) output->close( output );
+    xfree( channel->leds );
+    xfree( channel->leds16 );
+    channel->leds   = NULL;
+    channel->leds16 = NULL;
+  }
   return Qnil;
 }
 
@@ -350,35 +1004,23 @@ pp_leds_close( VALUE self )
 static VALUE
 pp_leds_get_pixel_color( VALUE self, VALUE num )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
-
-  int n = FIX2INT(num);
-  if (n < 0 || n >= channel.count) {
-    rb_raise( rb_eIndexError, "index %d is outside of LED range: 0...%d", n, channel.count-1 );
-  }
-
-  return INT2FIX(channel.leds[n]);
+  return UINT2NUM(*pp_leds_pixel( self, num ));
 }
 
 /* call-seq:
  *    leds[num] = color
  *    leds[num] = PixelPi::Color( red, green, blue )
  *
- * Set the LED at position `num` to the provided 24-bit RGB color value.
+ * Set the LED at position `num` to the provided 24-bit RGB color value. An
+ * IndexError is raised if `num` is outside the LED range.
  *
  * Returns the 24-bit RGB color value.
  */
 static VALUE
 pp_leds_set_pixel_color( VALUE self, VALUE num, VALUE color )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
-
-  int n = FIX2INT(num);
-  if (n >= 0 && n < channel.count) {
-    channel.leds[n] = FIX2UINT(color);
-  }
+  ws2811_led_t *led = pp_leds_pixel( self, num );
+  *led = NUM2UINT(color);
   return self;
 }
 
@@ -430,14 +1072,14 @@ pp_leds_set_pixel_color2( int argc, VALUE* argv, VALUE self )
 static VALUE
 pp_leds_to_a( VALUE self )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
+  long count;
+  ws2811_led_t *leds = pp_leds_buffer( self, &count );
   int ii;
   VALUE ary;
 
-  ary = rb_ary_new2( channel.count );
-  for (ii=0; ii<channel.count; ii++) {
-    rb_ary_push( ary, INT2NUM(channel.leds[ii]) );
+  ary = rb_ary_new2( count );
+  for (ii=0; ii<count; ii++) {
+    rb_ary_push( ary, UINT2NUM(leds[ii]) );
   }
 
   return ary;
@@ -449,7 +1091,8 @@ pp_leds_to_a( VALUE self )
  * Replace the LED colors with the 24-bit RGB color values found in the `ary`.
  * If the `ary` is longer than the LED string then the extra color values will
  * be ignored. If the `ary` is shorter than the LED string then only the LEDS
- * up to `ary.length` will be changed.
+ * up to `ary.length` will be changed. No LED is changed when one of the color
+ * values is not an Integer.
  *
  * You must call `show` for the new colors to be displayed.
  *
@@ -458,21 +1101,29 @@ pp_leds_to_a( VALUE self )
 static VALUE
 pp_leds_replace( VALUE self, VALUE ary )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
+  long count;
+  ws2811_led_t *leds = pp_leds_write_buffer( self, &count );
+  ws2811_led_t *colors;
+  VALUE store;
   int ii, min;
 
   Check_Type( ary, T_ARRAY );
-  min = MIN(channel.count, RARRAY_LEN(ary));
+  min = MIN(count, RARRAY_LEN(ary));
 
+  /* the colors are converted before the LEDs are put in order for them */
+  colors = ALLOCV_N( ws2811_led_t, store, min + 1 );
   for (ii=0; ii<min; ii++) {
-    channel.leds[ii] = FIX2UINT(rb_ary_entry( ary, ii ));
+    colors[ii] = NUM2UINT(rb_ary_entry( ary, ii ));
   }
 
+  pp_leds_write_range( self, 0, min );
+  memcpy( leds, colors, min * sizeof(ws2811_led_t) );
+  ALLOCV_END( store );
+
   return self;
 }
 
-static void
+void
 pp_leds_reverse( ws2811_led_t *p1, ws2811_led_t *p2 )
 {
   while (p1 < p2) {
@@ -482,22 +1133,71 @@ pp_leds_reverse( ws2811_led_t *p1, ws2811_led_t *p2 )
   }
 }
 
+/* Rotate the `len` LED colors starting at `ptr` in place so that the color at
+ * `cnt` comes first. A negative `cnt` rotates in the opposite direction.
+ */
+void
+pp_leds_rotate_buffer( ws2811_led_t *ptr, int len, int cnt )
+{
+  if (cnt == 0 || len <= 0) return;
+
+  cnt = (cnt < 0) ? (len - (~cnt % len) - 1) : (cnt % len);
+
+  if (cnt > 0) {
+    --len;
+    if (cnt < len) pp_leds_reverse( ptr + cnt, ptr + len );
+    if (--cnt > 0) pp_leds_reverse( ptr, ptr + cnt );
+    if (len > 0) pp_leds_reverse( ptr, ptr + len );
+  }
+}
+
+/* Blend the `len` LED colors starting at `ptr` towards the given `color`. The
+ * `alpha` value is between 0 (leave the LEDs unchanged) and 255 (replace the
+ * LEDs with `color`). All four bytes of the color are blended, two bytes at a
+ * time, so the white channel of RGBW pixels is handled as well.
+ */
+void
+pp_leds_blend_range( ws2811_led_t *ptr, long len, ws2811_led_t color, int alpha )
+{
+  uint32_t w  = alpha + (alpha >> 7);
+  uint32_t iw = 256 - w;
+  uint32_t rb = (color & 0x00ff00ff) * w;
+  uint32_t ag = ((color >> 8) & 0x00ff00ff) * w;
+  long ii;
+
+  for (ii=0; ii<len; ii++) {
+    uint32_t c = ptr[ii];
+    ptr[ii] = ((((c & 0x00ff00ff) * iw + rb) >> 8) & 0x00ff00ff)
+            | ((((c >> 8) & 0x00ff00ff) * iw + ag) & 0xff00ff00);
+  }
+}
+
 /* call-seq:
  *    reverse
  *
- * Reverse the order of the LED colors.
+ * Reverse the order of the LED colors. The colors are not moved; the LEDs
+ * are simply sent from the other end when shown. Use `normalize!` if the
+ * buffer itself needs to be in order.
  *
  * Returns this PixelPi::Leds instance.
  */
 static VALUE
 pp_leds_reverse_m( VALUE self )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
-  ws2811_led_t *ptr = channel.leds;
-  int len = channel.count;
+  ws2811_channel_t *channel;
+  long count;
+  ws2811_led_t *ptr = pp_slice_buffer( self, &count );
 
-  if (--len > 0) pp_leds_reverse( ptr, ptr + len );
+  if (ptr) {
+    if (--count > 0) pp_leds_reverse( ptr, ptr + count );
+    return self;
+  }
+
+  channel = &pp_leds_struct( self )->channel[0];
+  if (channel->count > 0) {
+    channel->origin  = pp_leds_index( channel, channel->count - 1 );
+    channel->reverse = !channel->reverse;
+  }
 
   return self;
 }
@@ -507,15 +1207,18 @@ pp_leds_reverse_m( VALUE self )
  *
  * Rotates the LED colors in place so that the color at `count` comes first. If
  * `count` is negative then it rotates in the opposite direction, starting from
- * the end of the LEDs where -1 is the last LED.
+ * the end of the LEDs where -1 is the last LED. This only moves the position
+ * the LEDs are sent from, so it takes the same time regardless of the number
+ * of LEDs.
  *
  * Returns this PixelPi::Leds instance.
  */
 static VALUE
 pp_leds_rotate( int argc, VALUE* argv, VALUE self )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
+  ws2811_channel_t *channel;
+  long count;
+  ws2811_led_t *ptr = pp_slice_buffer( self, &count );
   int cnt = 1;
 
   switch (argc) {
@@ -524,22 +1227,39 @@ pp_leds_rotate( int argc, VALUE* argv, VALUE self )
     default: rb_scan_args( argc, argv, "01", NULL );
   }
 
-  if (cnt != 0) {
-    ws2811_led_t *ptr = channel.leds;
-    int len = channel.count;
-    cnt = (cnt < 0) ? (len - (~cnt % len) - 1) : (cnt % len);
+  if (ptr) {
+    pp_leds_rotate_buffer( ptr, count, cnt );
+    return self;
+  }
 
-    if (len > 0 && cnt > 0) {
-      --len;
-      if (cnt < len) pp_leds_reverse( ptr + cnt, ptr + len );
-      if (--cnt > 0) pp_leds_reverse( ptr, ptr + cnt );
-      if (len > 0) pp_leds_reverse( ptr, ptr + len );
-    }
+  channel = &pp_leds_struct( self )->channel[0];
+  if (channel->count > 0) {
+    count = channel->count;
+    cnt = (cnt < 0) ? (count - (~cnt % count) - 1) : (cnt % count);
+    channel->origin = pp_leds_index( channel, cnt );
   }
 
   return self;
 }
 
+/* call-seq:
+ *    normalize!
+ *
+ * Move the LED colors so the buffer is in the order set up by previous calls
+ * to `rotate` and `reverse`. The other buffer methods do this as needed, so
+ * there is rarely a reason to call it directly; it can be used to choose when
+ * the time is spent.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_normalize_m( VALUE self )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  pp_leds_normalize( &ledstring->channel[0] );
+  return self;
+}
+
 /* call-seq:
  *    fill( color )
  *    fill( color, start [, length] )
@@ -563,8 +1283,8 @@ pp_leds_rotate( int argc, VALUE* argv, VALUE self )
 static VALUE
 pp_leds_fill( int argc, VALUE* argv, VALUE self )
 {
-  ws2811_t *ledstring = pp_leds_struct( self );
-  ws2811_channel_t channel = ledstring->channel[0];
+  long count;
+  ws2811_led_t *leds = pp_leds_write_buffer( self, &count );
   ws2811_led_t color = 0;
 
   VALUE item, arg1, arg2, v;
@@ -577,40 +1297,178 @@ pp_leds_fill( int argc, VALUE* argv, VALUE self )
     argc += 1;
   } else {
     rb_scan_args( argc, argv, "12", &item, &arg1, &arg2 );
-    color = FIX2UINT(item);
+    color = NUM2UINT(item);
   }
 
   switch (argc) {
     case 1:
       beg = 0;
-      len = channel.count;
+      len = count;
       break;
     case 2:
-      if (rb_range_beg_len(arg1, &beg, &len, channel.count, 1)) {
+      if (rb_range_beg_len(arg1, &beg, &len, count, 1)) {
         break;
       }
       /* fall through */
     case 3:
       beg = NIL_P(arg1) ? 0 : NUM2LONG(arg1);
       if (beg < 0) {
-        beg = channel.count + beg;
+        beg = count + beg;
         if (beg < 0) beg = 0;
       }
-      len = NIL_P(arg2) ? channel.count - beg : NUM2LONG(arg2);
+      len = NIL_P(arg2) ? count - beg : NUM2LONG(arg2);
       break;
   }
 
   if (len < 0) return self;
 
   end = beg + len;
-  end = MIN((long) channel.count, end);
+  end = MIN(count, end);
+
+  /* the block may read the LEDs it is replacing, so they are put in order */
+  if (block_p) pp_leds_buffer( self, &count );
+  else pp_leds_write_range( self, beg, end - beg );
 
   for (ii=beg; ii<end; ii++) {
     if (block_p) {
       v = rb_yield(INT2NUM(ii));
-      color = FIX2UINT(v);
+      color = NUM2UINT(v);
+    }
+    leds[ii] = color;
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    set_pixels( indices, colors )
+ *
+ * Set the LEDs at each of the given `indices` to the matching 24-bit RGB value
+ * in `colors`. Both arguments can be an Array of Integers or a String of packed
+ * 32-bit unsigned values as created by `ary.pack("L*")`. The `indices` and
+ * `colors` must be the same length.
+ *
+ * An IndexError is raised if any index is outside the LED range. All indices
+ * are checked before any LED is changed, so the LED buffer is left untouched
+ * when an error is raised.
+ *
+ * Examples:
+ *    leds.set_pixels( [0, 2, 4], [0xFF0000, 0x00FF00, 0x0000FF] )
+ *    leds.set_pixels( idx.pack("L*"), colors.pack("L*") )
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_set_pixels( VALUE self, VALUE indices, VALUE colors )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_buffer( self, &count );
+  const uint32_t *idx, *clr;
+  VALUE idx_store, clr_store;
+  long ii, idx_len, clr_len;
+
+  idx = pp_uint32_list( indices, &idx_len, &idx_store );
+  clr = pp_uint32_list( colors,  &clr_len, &clr_store );
+
+  if (idx_len != clr_len) {
+    ALLOCV_END( idx_store );
+    ALLOCV_END( clr_store );
+    rb_raise( rb_eArgError, "indices and colors must be the same length: %ld != %ld", idx_len, clr_len );
+  }
+
+  for (ii=0; ii<idx_len; ii++) {
+    if (idx[ii] >= (uint32_t) count) {
+      long n = (int32_t) idx[ii];
+      ALLOCV_END( idx_store );
+      ALLOCV_END( clr_store );
+      rb_raise( rb_eIndexError, "index %ld is outside of LED range: 0...%ld", n, count-1 );
     }
-    channel.leds[ii] = color;
+  }
+
+  for (ii=0; ii<idx_len; ii++) {
+    leds[idx[ii]] = clr[ii];
+  }
+
+  ALLOCV_END( idx_store );
+  ALLOCV_END( clr_store );
+  return self;
+}
+
+/* call-seq:
+ *    set_range( start, colors )
+ *
+ * Copy the 24-bit RGB values in `colors` into the LED buffer beginning at
+ * position `start`. A negative `start` counts backwards from the end of the
+ * LEDs where -1 is the last LED. The `colors` can be an Array of Integers or a
+ * String of packed 32-bit unsigned values as created by `ary.pack("L*")`. Any
+ * colors that would extend past the end of the LED string are ignored.
+ *
+ * An IndexError is raised if `start` is outside the LED range.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_set_range( VALUE self, VALUE start, VALUE colors )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_buffer( self, &count );
+  const uint32_t *clr;
+  VALUE store;
+  long beg, len;
+
+  beg = NUM2LONG(start);
+  if (beg < 0) beg += count;
+  if (beg < 0 || beg >= count) {
+    rb_raise( rb_eIndexError, "index %ld is outside of LED range: 0...%ld", NUM2LONG(start), count-1 );
+  }
+
+  clr = pp_uint32_list( colors, &len, &store );
+  len = MIN(len, count - beg);
+  memcpy( leds + beg, clr, len * sizeof(ws2811_led_t) );
+
+  ALLOCV_END( store );
+  return self;
+}
+
+/* call-seq:
+ *    fill_pattern( colors )
+ *
+ * Repeat the sequence of 24-bit RGB values in `colors` across the entire LED
+ * string. The first color is placed in the first LED, the second color in the
+ * second LED, and so on; the pattern starts over once all the colors have been
+ * used. The `colors` can be an Array of Integers or a String of packed 32-bit
+ * unsigned values as created by `ary.pack("L*")`.
+ *
+ * Examples:
+ *    leds.fill_pattern( [0xFF0000, 0, 0] )
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_fill_pattern( VALUE self, VALUE colors )
+{
+  long count;
+  ws2811_led_t *leds = pp_leds_write_buffer( self, &count );
+  const uint32_t *clr;
+  VALUE store;
+  long len, done;
+
+  clr = pp_uint32_list( colors, &len, &store );
+  if (len == 0) {
+    ALLOCV_END( store );
+    rb_raise( rb_eArgError, "pattern cannot be empty" );
+  }
+  pp_leds_write_range( self, 0, count );
+
+  /* copy the pattern once and then keep doubling the filled region */
+  done = MIN(len, count);
+  memcpy( leds, clr, done * sizeof(ws2811_led_t) );
+  ALLOCV_END( store );
+
+  while (done < count) {
+    long n = MIN(done, count - done);
+    memcpy( leds + done, leds, n * sizeof(ws2811_led_t) );
+    done += n;
   }
 
   return self;
@@ -618,25 +1476,44 @@ pp_leds_fill( int argc, VALUE* argv, VALUE self )
 
 /* call-seq:
  *    PixelPi::Color(red, green, blue)  #=> 24-bit color
+ *    PixelPi::Color(red, green, blue, white)  #=> 32-bit color
  *
  * Given a set of RGB values return a single 24-bit color value. The RGB values
- * are nubmers in the range 0..255.
+ * are nubmers in the range 0..255. The optional `white` value is placed in the
+ * top byte for use with RGBW strips.
  *
  * Returns a 24-bit RGB color value.
  */
 static VALUE
-pp_color( VALUE klass, VALUE red, VALUE green, VALUE blue )
+pp_color( int argc, VALUE* argv, VALUE klass )
 {
-  int color = pp_rgb_to_color( red, green, blue );
-  return INT2FIX(color);
+  VALUE red, green, blue, white;
+  uint32_t color;
+
+  rb_scan_args( argc, argv, "31", &red, &green, &blue, &white );
+  color = (uint32_t) pp_rgb_to_color( red, green, blue );
+  if (!NIL_P(white)) color |= (uint32_t) (FIX2INT(white) & 0xff) << 24;
+
+  return UINT2NUM(color);
 }
 
 void Init_leds( )
 {
-  sym_dma        = ID2SYM(rb_intern( "dma" ));
-  sym_frequency  = ID2SYM(rb_intern( "frequency" ));
-  sym_invert     = ID2SYM(rb_intern( "invert" ));
-  sym_brightness = ID2SYM(rb_intern( "brightness" ));
+  sym_dma           = ID2SYM(rb_intern( "dma" ));
+  sym_frequency     = ID2SYM(rb_intern( "frequency" ));
+  sym_invert        = ID2SYM(rb_intern( "invert" ));
+  sym_brightness    = ID2SYM(rb_intern( "brightness" ));
+  sym_gamma         = ID2SYM(rb_intern( "gamma" ));
+  sym_white_balance = ID2SYM(rb_intern( "white_balance" ));
+  sym_dither        = ID2SYM(rb_intern( "dither" ));
+  sym_strip_type    = ID2SYM(rb_intern( "strip_type" ));
+  sym_output        = ID2SYM(rb_intern( "output" ));
+  sym_refresh       = ID2SYM(rb_intern( "refresh" ));
+  sym_debug         = ID2SYM(rb_intern( "debug" ));
+
+  id_gamma         = rb_intern( "@gamma" );
+  id_white_balance = rb_intern( "@white_balance" );
+  id_output        = rb_intern( "output" );  /* hidden from Ruby */
 
   mPixelPi = rb_define_module( "PixelPi" );
 
@@ -649,8 +1526,14 @@ void Init_leds( )
   rb_define_method( cLeds, "dma",         pp_leds_dma_get,           0 );
   rb_define_method( cLeds, "frequency",   pp_leds_frequency_get,     0 );
   rb_define_method( cLeds, "invert",      pp_leds_invert_get,        0 );
+  rb_define_method( cLeds, "dither",      pp_leds_dither_get,        0 );
+  rb_define_method( cLeds, "strip_type",  pp_leds_strip_type_get,    0 );
   rb_define_method( cLeds, "brightness",  pp_leds_brightness_get,    0 );
   rb_define_method( cLeds, "brightness=", pp_leds_brightness_set,    1 );
+  rb_define_method( cLeds, "gamma",       pp_leds_gamma_get,         0 );
+  rb_define_method( cLeds, "gamma=",      pp_leds_gamma_set,         1 );
+  rb_define_method( cLeds, "white_balance",  pp_leds_white_balance_get, 0 );
+  rb_define_method( cLeds, "white_balance=", pp_leds_white_balance_set, 1 );
   rb_define_method( cLeds, "show",        pp_leds_show,              0 );
   rb_define_method( cLeds, "clear",       pp_leds_clear,             0 );
   rb_define_method( cLeds, "close",       pp_leds_close,             0 );
@@ -661,10 +1544,46 @@ void Init_leds( )
   rb_define_method( cLeds, "replace",     pp_leds_replace,           1 );
   rb_define_method( cLeds, "reverse",     pp_leds_reverse_m,         0 );
   rb_define_method( cLeds, "rotate",      pp_leds_rotate,           -1 );
+  rb_define_method( cLeds, "normalize!",  pp_leds_normalize_m,       0 );
   rb_define_method( cLeds, "fill",        pp_leds_fill,             -1 );
+  rb_define_method( cLeds, "set_pixels",  pp_leds_set_pixels,        2 );
+  rb_define_method( cLeds, "set_range",   pp_leds_set_range,         2 );
+  rb_define_method( cLeds, "fill_pattern", pp_leds_fill_pattern,     1 );
 
-  rb_define_module_function( mPixelPi, "Color", pp_color, 3 );
+  rb_define_module_function( mPixelPi, "Color", pp_color, -1 );
 
   /* Define the PixelPi::Error class */
   ePixelPiError = rb_define_class_under( mPixelPi, "Error", rb_eStandardError );
+
+  /* PixelPi::Slice views share the buffer methods of the LEDs */
+  Init_slice();
+  rb_define_method( cSlice, "clear",       pp_leds_clear,             0 );
+  rb_define_method( cSlice, "[]",          pp_leds_get_pixel_color,   1 );
+  rb_define_method( cSlice, "[]=",         pp_leds_set_pixel_color,   2 );
+  rb_define_method( cSlice, "set_pixel",   pp_leds_set_pixel_color2, -1 );
+  rb_define_method( cSlice, "to_a",        pp_leds_to_a,              0 );
+  rb_define_method( cSlice, "replace",     pp_leds_replace,           1 );
+  rb_define_method( cSlice, "reverse",     pp_leds_reverse_m,         0 );
+  rb_define_method( cSlice, "rotate",      pp_leds_rotate,           -1 );
+  rb_define_method( cSlice, "fill",        pp_leds_fill,             -1 );
+  rb_define_method( cSlice, "set_pixels",  pp_leds_set_pixels,        2 );
+  rb_define_method( cSlice, "set_range",   pp_leds_set_range,         2 );
+  rb_define_method( cSlice, "fill_pattern", pp_leds_fill_pattern,     1 );
+
+  Init_batch();
+  Init_color();
+  Init_effects();
+  Init_dither();
+  Init_layer();
+  Init_layout();
+  Init_frame();
+  Init_animation();
+  Init_recorder();
+  Init_buffer();
+  Init_receiver();
+  Init_opc();
+  Init_ring();
+  Init_daemon();
+  Init_preview();
+  Init_segment();
 }
@@ -0,0 +1,555 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* accept4 */
+#endif
+#include "pixel_pi.h"
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <ruby/thread.h>
+
+/* An Open Pixel Control server. OPC clients stream messages over TCP, each a
+ * four byte header - channel, command, and a big-endian data length - followed
+ * by the data:
+ *
+ *   command 0    - set pixel colors; the data is red, green, blue bytes for
+ *                  each pixel starting from the first
+ *   command 255  - system exclusive; the data starts with a 16-bit system ID.
+ *                  The PixelPi system ID 0x5050 ("PP") takes a command byte;
+ *                  command 1 sets the brightness from the byte after it.
+ *
+ * Channel 0 is broadcast to every channel. Messages for channels other than 0
+ * and the channel of the server are skipped.
+ *
+ * Every client has a buffer that can hold two of the largest messages. Each
+ * read fills as much of the buffer as the socket has data for, and the
+ * complete messages in it are converted straight into the LED buffer; only a
+ * trailing partial message is moved to the front. One epoll set watches the
+ * listening socket and all the clients.
+ */
+
+#define PP_OPC_PORT        7890
+#define PP_OPC_HEADER      4
+#define PP_OPC_MESSAGE     (PP_OPC_HEADER + 65535)
+#define PP_OPC_BUFFER      (2 * PP_OPC_MESSAGE)
+#define PP_OPC_EVENTS      32
+
+#define PP_OPC_SET_PIXELS  0
+#define PP_OPC_SYSEX       255
+#define PP_OPC_SYSTEM_ID   0x5050
+#define PP_OPC_BRIGHTNESS  1
+
+typedef struct pp_opc_client {
+  struct pp_opc_client *next;
+  int      fd;
+  long     have;                    /* bytes waiting in the buffer */
+  uint8_t  buffer[PP_OPC_BUFFER];
+} pp_opc_client_t;
+
+typedef struct {
+  VALUE             leds;           /* PixelPi::Leds the pixels are written to */
+  int               fd;             /* listening socket, -1 once closed */
+  int               epfd;           /* epoll set of the server and its clients */
+  int               channel;        /* OPC channel of the LEDs */
+  int               show;           /* call show after each read with a frame */
+  pp_opc_client_t  *clients;
+  long              client_count;
+  uint64_t          connections;    /* clients accepted */
+  uint64_t          messages;       /* messages received */
+  uint64_t          bytes;          /* bytes received */
+  uint64_t          ignored;        /* messages for other channels or unknown commands */
+  uint64_t          shows;          /* times `show` was called */
+} pp_opc_t;
+
+typedef struct {
+  int                 epfd;
+  int                 timeout;      /* milliseconds, -1 to wait forever */
+  int                 result;
+  int                 error;
+  struct epoll_event  events[PP_OPC_EVENTS];
+} pp_opc_wait_t;
+
+VALUE cOpcServer;
+
+static VALUE sym_port, sym_bind, sym_channel, sym_show,
+             sym_connections, sym_clients, sym_messages, sym_bytes,
+             sym_ignored, sym_shows;
+
+/* ======================================================================= */
+
+static void
+pp_opc_disconnect( pp_opc_t *server, pp_opc_client_t *client )
+{
+  pp_opc_client_t **ptr;
+
+  for (ptr = &server->clients; *ptr; ptr = &(*ptr)->next) {
+    if (*ptr == client) {
+      *ptr = client->next;
+      break;
+    }
+  }
+  epoll_ctl( server->epfd, EPOLL_CTL_DEL, client->fd, NULL );
+  close( client->fd );
+  xfree( client );
+  server->client_count -= 1;
+}
+
+/* Returns 1 if the client is still connected to the server */
+static int
+pp_opc_connected( pp_opc_t *server, pp_opc_client_t *client )
+{
+  pp_opc_client_t *ptr;
+
+  for (ptr = server->clients; ptr; ptr = ptr->next) {
+    if (ptr == client) return 1;
+  }
+  return 0;
+}
+
+/* Close the listening socket, the clients, and the epoll set */
+static void
+pp_opc_shutdown( pp_opc_t *server )
+{
+  while (server->clients) pp_opc_disconnect( server, server->clients );
+  if (server->epfd >= 0) close( server->epfd );
+  if (server->fd >= 0)   close( server->fd );
+  server->epfd = -1;
+  server->fd   = -1;
+}
+
+static void
+pp_opc_mark( void *ptr )
+{
+  pp_opc_t *server = (pp_opc_t*) ptr;
+  rb_gc_mark( server->leds );
+}
+
+static void
+pp_opc_free( void *ptr )
+{
+  pp_opc_t *server;
+  if (NULL == ptr) return;
+
+  server = (pp_opc_t*) ptr;
+  pp_opc_shutdown( server );
+  xfree( server );
+}
+
+static VALUE
+pp_opc_allocate( VALUE klass )
+{
+  pp_opc_t *server;
+
+  server = ALLOC_N( pp_opc_t, 1 );
+  if (!server) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::OpcServer instance");
+  }
+  memset( server, 0, sizeof(pp_opc_t) );
+  server->leds = Qnil;
+  server->fd   = -1;
+  server->epfd = -1;
+
+  return Data_Wrap_Struct( klass, pp_opc_mark, pp_opc_free, server );
+}
+
+static pp_opc_t*
+pp_opc_struct( VALUE self )
+{
+  pp_opc_t *server;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_opc_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::OpcServer object" );
+  }
+  Data_Get_Struct( self, pp_opc_t, server );
+
+  if (server->fd < 0) {
+    rb_raise( ePixelPiError, "OpcServer is closed" );
+  }
+  return server;
+}
+
+/* Accept every pending connection */
+static void
+pp_opc_accept( pp_opc_t *server )
+{
+  for (;;) {
+    pp_opc_client_t *client;
+    struct epoll_event ev;
+    int fd = accept4( server->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      return;
+    }
+
+    client = ALLOC( pp_opc_client_t );
+    client->fd   = fd;
+    client->have = 0;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = client;
+    if (epoll_ctl( server->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0) {
+      close( fd );
+      xfree( client );
+      continue;
+    }
+
+    client->next    = server->clients;
+    server->clients = client;
+    server->client_count += 1;
+    server->connections  += 1;
+  }
+}
+
+/* Apply one message. Returns 1 if it set the pixel colors. */
+static int
+pp_opc_message( pp_opc_t *server, ws2811_led_t *leds, long count, const uint8_t *msg )
+{
+  const uint8_t *data = msg + PP_OPC_HEADER;
+  long len = (msg[2] << 8) | msg[3];
+  long ii, n;
+
+  server->messages += 1;
+
+  if (msg[0] != 0 && msg[0] != server->channel) {
+    server->ignored += 1;
+    return 0;
+  }
+
+  switch (msg[1]) {
+    case PP_OPC_SET_PIXELS:
+      n = MIN(len / 3, count);
+      for (ii=0; ii<n; ii++, data+=3) {
+        leds[ii] = ((ws2811_led_t) data[0] << 16) | (data[1] << 8) | data[2];
+      }
+      return 1;
+
+    case PP_OPC_SYSEX:
+      if (len >= 4 && ((data[0] << 8) | data[1]) == PP_OPC_SYSTEM_ID && data[2] == PP_OPC_BRIGHTNESS) {
+        pp_leds_struct( server->leds )->channel[0].brightness = data[3];
+        return 0;
+      }
+      /* fall through */
+
+    default:
+      server->ignored += 1;
+      return 0;
+  }
+}
+
+/* Read what the client has sent and apply the complete messages. The
+ * client is closed when it disconnects or the read fails.
+ *
+ * Returns the number of messages applied.
+ */
+static long
+pp_opc_read( pp_opc_t *server, pp_opc_client_t *client )
+{
+  ws2811_led_t *leds;
+  long count, pos = 0, messages = 0;
+  ssize_t n;
+  int frame = 0;
+
+  do {
+    n = read( client->fd, client->buffer + client->have, PP_OPC_BUFFER - client->have );
+  } while (n < 0 && errno == EINTR);
+
+  if (n <= 0) {
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    pp_opc_disconnect( server, client );
+    return 0;
+  }
+  client->have  += n;
+  server->bytes += n;
+
+  leds = pp_leds_buffer( server->leds, &count );
+
+  while (client->have - pos >= PP_OPC_HEADER) {
+    const uint8_t *msg = client->buffer + pos;
+    long len = PP_OPC_HEADER + ((msg[2] << 8) | msg[3]);
+
+    if (client->have - pos < len) break;
+    frame |= pp_opc_message( server, leds, count, msg );
+    messages += 1;
+    pos += len;
+  }
+
+  client->have -= pos;
+  if (pos && client->have) memmove( client->buffer, client->buffer + pos, client->have );
+
+  /* frames that arrived together are shown once */
+  if (frame && server->show) {
+    pp_leds_show( server->leds );
+    server->shows += 1;
+  }
+  return messages;
+}
+
+static void*
+pp_opc_wait( void *ptr )
+{
+  pp_opc_wait_t *wait = (pp_opc_wait_t*) ptr;
+
+  wait->result = epoll_wait( wait->epfd, wait->events, PP_OPC_EVENTS, wait->timeout );
+  wait->error  = errno;
+  return NULL;
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::OpcServer.new( leds, options = {} )
+ *
+ * Listen for Open Pixel Control clients that set the colors of the `leds`.
+ * Connections are accepted and messages applied each time `poll` is called;
+ * any number of clients can be connected at once.
+ *
+ * options - Hash of arguments
+ *   :port    - TCP port; defaults to 7890. Port 0 picks a free port.
+ *   :bind    - IPv4 address to bind to; defaults to "0.0.0.0"
+ *   :channel - OPC channel of the LEDs, 1 to 255; defaults to 1. Messages
+ *              for channel 0 are always used.
+ *   :show    - call `show` after set pixel color messages; defaults to
+ *              `true`. Frames that arrive in the same read are shown once.
+ *
+ * Examples:
+ *    server = PixelPi::OpcServer.new( leds, :port => 7890 )
+ *    loop { server.poll }
+ */
+static VALUE
+pp_opc_initialize( int argc, VALUE* argv, VALUE self )
+{
+  pp_opc_t *server;
+  VALUE leds, opts, tmp, host = Qnil;
+  struct sockaddr_in addr;
+  struct epoll_event ev;
+  long port = PP_OPC_PORT, channel = 1;
+  int one = 1, err;
+
+  rb_scan_args( argc, argv, "11", &leds, &opts );
+
+  Data_Get_Struct( self, pp_opc_t, server );
+  if (server->fd >= 0) rb_raise( ePixelPiError, "OpcServer is already initialized" );
+  pp_leds_struct( leds );
+
+  server->leds = leds;
+  server->show = 1;
+
+  if (!NIL_P(opts)) {
+    Check_Type( opts, T_HASH );
+
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_port )))    port = NUM2LONG(tmp);
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_channel ))) channel = NUM2LONG(tmp);
+    if ((tmp = rb_hash_lookup2( opts, sym_show, Qundef )) != Qundef) server->show = RTEST(tmp);
+    host = rb_hash_lookup( opts, sym_bind );
+  }
+
+  if (port < 0 || port > 65535) {
+    rb_raise( rb_eArgError, "port is outside the range 0..65535: %ld", port );
+  }
+  if (channel < 1 || channel > 255) {
+    rb_raise( rb_eArgError, "channel is outside the range 1..255: %ld", channel );
+  }
+  server->channel = (int) channel;
+
+  memset( &addr, 0, sizeof(addr) );
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons( (uint16_t) port );
+  if (NIL_P(host)) {
+    addr.sin_addr.s_addr = htonl( INADDR_ANY );
+  } else if (inet_pton( AF_INET, StringValueCStr(host), &addr.sin_addr ) != 1) {
+    rb_raise( rb_eArgError, "invalid bind address: %s", StringValueCStr(host) );
+  }
+
+  server->fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  if (server->fd < 0) rb_sys_fail( "socket" );
+  setsockopt( server->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+
+  if (bind( server->fd, (struct sockaddr*) &addr, sizeof(addr) ) < 0 || listen( server->fd, 16 ) < 0) {
+    err = errno;
+    pp_opc_shutdown( server );
+    rb_syserr_fail( err, "bind" );
+  }
+
+  server->epfd = epoll_create1( EPOLL_CLOEXEC );
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (server->epfd < 0 || epoll_ctl( server->epfd, EPOLL_CTL_ADD, server->fd, &ev ) < 0) {
+    err = errno;
+    pp_opc_shutdown( server );
+    rb_syserr_fail( err, "epoll" );
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    poll( timeout = nil )   #=> message count
+ *
+ * Wait up to `timeout` seconds for clients to connect or send data, then
+ * accept the new connections and apply the complete messages that have
+ * arrived. With a `nil` timeout this waits until something happens; a
+ * timeout of 0 never waits. Other Ruby threads run while waiting.
+ *
+ * Returns the number of messages received.
+ */
+static VALUE
+pp_opc_poll( int argc, VALUE* argv, VALUE self )
+{
+  pp_opc_t *server = pp_opc_struct( self );
+  pp_opc_wait_t wait;
+  VALUE timeout;
+  long total = 0;
+  int ii;
+
+  rb_scan_args( argc, argv, "01", &timeout );
+
+  wait.epfd    = server->epfd;
+  wait.timeout = -1;
+  if (!NIL_P(timeout)) {
+    double secs = NUM2DBL(timeout);
+    if (secs < 0.0) rb_raise( rb_eArgError, "timeout cannot be negative: %g", secs );
+    wait.timeout = secs > 2000000.0 ? 2000000000 : (int) (secs * 1000.0 + 0.5);
+  }
+
+  for (;;) {
+    rb_thread_call_without_gvl( pp_opc_wait, &wait, RUBY_UBF_IO, NULL );
+    if (wait.result >= 0) break;
+    if (wait.error != EINTR) rb_syserr_fail( wait.error, "epoll_wait" );
+    rb_thread_check_ints();
+    server = pp_opc_struct( self );
+  }
+
+  /* the listening socket is handled last so a client accepted now is not
+   * confused with one that was reported ready */
+  for (ii=0; ii<wait.result; ii++) {
+    pp_opc_client_t *client = (pp_opc_client_t*) wait.events[ii].data.ptr;
+    if (!client) continue;
+
+    /* `show` can run Ruby code, and another thread may have closed the
+     * server and freed its clients in the meantime */
+    if (server->fd < 0) return LONG2NUM(total);
+    if (pp_opc_connected( server, client )) total += pp_opc_read( server, client );
+  }
+  if (server->fd < 0) return LONG2NUM(total);
+  for (ii=0; ii<wait.result; ii++) {
+    if (!wait.events[ii].data.ptr) pp_opc_accept( server );
+  }
+
+  return LONG2NUM(total);
+}
+
+/* call-seq:
+ *    stats   #=> Hash
+ *
+ * Returns the counters of the server as a Hash:
+ *
+ *   :connections - clients accepted
+ *   :clients     - clients connected now
+ *   :messages    - messages received
+ *   :bytes       - bytes received
+ *   :ignored     - messages for other channels and unknown commands
+ *   :shows       - times `show` was called
+ */
+static VALUE
+pp_opc_stats( VALUE self )
+{
+  pp_opc_t *server = pp_opc_struct( self );
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset( hash, sym_connections, ULL2NUM(server->connections) );
+  rb_hash_aset( hash, sym_clients,     LONG2NUM(server->client_count) );
+  rb_hash_aset( hash, sym_messages,    ULL2NUM(server->messages) );
+  rb_hash_aset( hash, sym_bytes,       ULL2NUM(server->bytes) );
+  rb_hash_aset( hash, sym_ignored,     ULL2NUM(server->ignored) );
+  rb_hash_aset( hash, sym_shows,       ULL2NUM(server->shows) );
+
+  return hash;
+}
+
+/* call-seq:
+ *    port
+ *
+ * Returns the TCP port the server is listening on.
+ */
+static VALUE
+pp_opc_port( VALUE self )
+{
+  pp_opc_t *server = pp_opc_struct( self );
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+
+  if (getsockname( server->fd, (struct sockaddr*) &addr, &len ) < 0) rb_sys_fail( "getsockname" );
+  return INT2FIX(ntohs( addr.sin_port ));
+}
+
+/* call-seq:
+ *    channel
+ *
+ * Returns the OPC channel of the LEDs.
+ */
+static VALUE
+pp_opc_channel( VALUE self )
+{
+  pp_opc_t *server = pp_opc_struct( self );
+  return INT2FIX(server->channel);
+}
+
+/* call-seq:
+ *    close
+ *
+ * Disconnect all the clients and stop listening.
+ *
+ * Returns `nil`.
+ */
+static VALUE
+pp_opc_close( VALUE self )
+{
+  pp_opc_t *server;
+
+  Data_Get_Struct( self, pp_opc_t, server );
+  pp_opc_shutdown( server );
+  server->leds = Qnil;
+  return Qnil;
+}
+
+/* call-seq:
+ *    closed?
+ *
+ * Returns `true` if the server has been closed.
+ */
+static VALUE
+pp_opc_closed_p( VALUE self )
+{
+  pp_opc_t *server;
+
+  Data_Get_Struct( self, pp_opc_t, server );
+  return server->fd < 0 ? Qtrue : Qfalse;
+}
+
+void Init_opc( )
+{
+  sym_port        = ID2SYM(rb_intern( "port" ));
+  sym_bind        = ID2SYM(rb_intern( "bind" ));
+  sym_channel     = ID2SYM(rb_intern( "channel" ));
+  sym_show        = ID2SYM(rb_intern( "show" ));
+  sym_connections = ID2SYM(rb_intern( "connections" ));
+  sym_clients     = ID2SYM(rb_intern( "clients" ));
+  sym_messages    = ID2SYM(rb_intern( "messages" ));
+  sym_bytes       = ID2SYM(rb_intern( "bytes" ));
+  sym_ignored     = ID2SYM(rb_intern( "ignored" ));
+  sym_shows       = ID2SYM(rb_intern( "shows" ));
+
+  cOpcServer = rb_define_class_under( mPixelPi, "OpcServer", rb_cObject );
+  rb_define_alloc_func( cOpcServer, pp_opc_allocate );
+  rb_define_method( cOpcServer, "initialize", pp_opc_initialize, -1 );
+
+  rb_define_method( cOpcServer, "poll",    pp_opc_poll,     -1 );
+  rb_define_method( cOpcServer, "stats",   pp_opc_stats,     0 );
+  rb_define_method( cOpcServer, "port",    pp_opc_port,      0 );
+  rb_define_method( cOpcServer, "channel", pp_opc_channel,   0 );
+  rb_define_method( cOpcServer, "close",   pp_opc_close,     0 );
+  rb_define_method( cOpcServer, "closed?", pp_opc_closed_p,  0 );
+}
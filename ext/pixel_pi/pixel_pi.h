@@ -0,0 +1,212 @@
+#ifndef PIXEL_PI_H
+#define PIXEL_PI_H
+
+#include <ruby.h>
+#include <stdio.h>
+#include "ws2811.h"
+
+#define RGB2COLOR(r,g,b) ((((r) & 0xff) << 16) | (((g) & 0xff) << 8) | ((b) & 0xff))
+
+#ifndef MIN
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#endif
+
+/* Saturating add of all four bytes at once. The low seven bits of each byte
+ * are added without carrying into the next byte, and the bytes that overflow
+ * are then set to 0xff.
+ */
+static inline uint32_t
+pp_add_sat( uint32_t d, uint32_t s )
+{
+  uint32_t sum   = ((d & 0x7f7f7f7f) + (s & 0x7f7f7f7f)) ^ ((d ^ s) & 0x80808080);
+  uint32_t carry = ((d & s) | ((d | s) & ~sum)) & 0x80808080;
+  return sum | (carry - (carry >> 7)) | carry;
+}
+
+/* Saturating subtract of all four bytes at once; 255 - (d - s) is the
+ * saturating sum of the complement of `d` and `s`.
+ */
+static inline uint32_t
+pp_sub_sat( uint32_t d, uint32_t s )
+{
+  return ~pp_add_sat( ~d, s );
+}
+
+/* Mix the color `s` into `d` by the 0..256 weight `w`. Red and blue are
+ * weighted together in one multiply, green and white in another.
+ */
+static inline uint32_t
+pp_mix( uint32_t d, uint32_t s, uint32_t w )
+{
+  uint32_t iw = 256 - w;
+  return ((((d & 0x00ff00ff) * iw + (s & 0x00ff00ff) * w) >> 8) & 0x00ff00ff)
+       | ((((d >> 8) & 0x00ff00ff) * iw + ((s >> 8) & 0x00ff00ff) * w) & 0xff00ff00);
+}
+
+extern VALUE mPixelPi;
+extern VALUE cLeds;
+extern VALUE ePixelPiError;
+
+/* leds.c */
+
+/* An output that shows the frames of a PixelPi::Leds in place of the DMA
+ * channel. The struct wrapped by an output object starts with this header and
+ * is wrapped with `pp_output_free`, which calls `free`; `render` returns 0 or
+ * a negated errno value and must not raise.
+ */
+typedef struct pp_output {
+  const char  *name;       /* reported when `render` fails */
+  int        (*render)( struct pp_output *output, VALUE self, ws2811_channel_t *channel );
+  void       (*close)( struct pp_output *output );
+  void       (*free)( struct pp_output *output );
+} pp_output_t;
+
+ws2811_t* pp_leds_struct( VALUE self );
+ws2811_led_t* pp_leds_buffer( VALUE self, long *len );
+ws2811_led_t* pp_leds_write_buffer( VALUE self, long *len );
+void pp_leds_write_range( VALUE self, long beg, long len );
+void pp_leds_normalize( ws2811_channel_t *channel );
+const uint32_t* pp_uint32_list( VALUE obj, long *len, VALUE *store );
+void pp_leds_reverse( ws2811_led_t *p1, ws2811_led_t *p2 );
+void pp_leds_rotate_buffer( ws2811_led_t *ptr, int len, int cnt );
+void pp_leds_blend_range( ws2811_led_t *ptr, long len, ws2811_led_t color, int alpha );
+ws2811_led_t* pp_buffer( VALUE obj, long *len );
+VALUE pp_leds_show( VALUE self );
+void pp_parse_gamma( VALUE value, double gamma[3] );
+void pp_parse_white_balance( VALUE value, int wb[3] );
+void pp_build_correction( uint16_t correction[4][256], VALUE gamma, VALUE wb );
+int pp_parse_strip_type( VALUE value );
+void pp_leds_output( VALUE self, VALUE obj );
+void pp_output_free( void *ptr );
+
+/* animation.c */
+enum pp_anim_format {
+  PP_ANIM_RGB,
+  PP_ANIM_RGBW
+};
+
+enum pp_anim_codec {
+  PP_ANIM_CODEC_NONE,
+  PP_ANIM_CODEC_DELTA
+};
+
+/* State of an animation file while its frames are written */
+typedef struct {
+  FILE     *fd;
+  int       format;       /* pixel format of the frames */
+  int       codec;        /* how the frames are encoded */
+  long      keyframe;     /* keyframe interval of the delta codec */
+  long      led_count;    /* -1 until the first frame is written */
+  long      frame_count;
+  uint64_t  offset;       /* file offset of the next frame */
+  uint8_t  *index;        /* frame index built up as frames are written */
+  long      index_size;   /* capacity of the index in entries */
+  uint8_t  *frame;        /* scratch buffer for encoding one frame */
+  uint8_t  *prev;         /* previous frame for the delta codec */
+  uint8_t  *out;          /* delta coded frame */
+} pp_anim_writer_t;
+
+extern VALUE cAnimation;
+int pp_parse_anim_format( VALUE value );
+void pp_parse_anim_codec( VALUE opts, int *codec, long *keyframe );
+int pp_anim_writer_open( pp_anim_writer_t *writer, const char *path, int format, int codec, long keyframe );
+int pp_anim_writer_frame( pp_anim_writer_t *writer, const uint32_t *colors, long len, uint32_t time );
+int pp_anim_writer_close( pp_anim_writer_t *writer, uint32_t fps );
+void pp_anim_writer_abort( pp_anim_writer_t *writer );
+void Init_animation( void );
+
+/* batch.c */
+void Init_batch( void );
+
+/* buffer.c */
+void Init_buffer( void );
+
+/* codec.c */
+long pp_delta_bound( long len );
+long pp_delta_encode( const uint8_t *frame, uint8_t *prev, long len, uint8_t *out );
+int pp_delta_decode( const uint8_t *data, long size, ws2811_led_t *leds, long count, int bpp );
+
+/* color.c */
+void Init_color( void );
+
+/* daemon.c */
+extern VALUE cDaemon;
+void Init_daemon( void );
+
+/* dither.c */
+void Init_dither( void );
+
+/* effects.c */
+void Init_effects( void );
+
+/* layer.c */
+extern VALUE cLayer;
+ws2811_led_t* pp_layer_buffer( VALUE obj, long *len );
+VALUE pp_leds_layers( VALUE self );
+void pp_layers_composite( VALUE layers, ws2811_led_t *leds, long count );
+void Init_layer( void );
+
+/* layout.c */
+
+/* Marks a matrix position that has no LED */
+#define PP_NO_LED 0xffffffff
+
+typedef struct {
+  uint32_t *map;           /* LED index of each position, row by row */
+  long      width;
+  long      height;
+} pp_layout_t;
+
+extern VALUE cLayout;
+pp_layout_t* pp_leds_layout( VALUE self, ws2811_led_t **leds, long *count );
+pp_layout_t* pp_leds_find_layout( VALUE self );
+void Init_layout( void );
+
+/* frame.c */
+void Init_frame( void );
+
+/* recorder.c */
+void pp_recorder_capture( VALUE self, const ws2811_channel_t *channel );
+void Init_recorder( void );
+
+/* preview.c */
+VALUE pp_preview_frame( VALUE self, const ws2811_channel_t *channel );
+void pp_preview_write( VALUE self, VALUE str );
+void Init_preview( void );
+
+/* opc.c */
+extern VALUE cOpcServer;
+void Init_opc( void );
+
+/* receiver.c */
+extern VALUE cReceiver;
+void Init_receiver( void );
+
+/* ring.c */
+extern VALUE cFrameRing;
+void Init_ring( void );
+
+/* segment.c */
+void pp_leds_update_segments( VALUE self, ws2811_t *ledstring );
+void Init_segment( void );
+
+/* sender.c */
+
+/* The :pixel_pi protocol between the network output and PixelPi::Receiver;
+ * the packet layout is described in sender.c */
+#define PP_NET_PORT     20560
+#define PP_NET_VERSION  1
+#define PP_NET_HEADER   24
+#define PP_NET_CHUNK    256     /* LEDs per packet */
+#define PP_NET_KEY      0x01    /* flags */
+#define PP_NET_SHOW     0x02
+#define PP_NET_RGBW     0x04
+
+void pp_sender_open( VALUE self, VALUE url, VALUE refresh );
+
+/* slice.c */
+extern VALUE cSlice;
+ws2811_led_t* pp_slice_buffer( VALUE obj, long *len );
+void Init_slice( void );
+
+#endif /* PIXEL_PI_H */
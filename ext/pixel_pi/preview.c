@@ -0,0 +1,341 @@
+#include "pixel_pi.h"
+#include <sys/ioctl.h>
+#include <time.h>
+#include <ruby/encoding.h>
+
+/* The terminal preview draws the frames sent by `show` with truecolor ANSI
+ * escape sequences. Each character cell is a "▀" half block: the foreground
+ * color is the LED on top and the background color the LED below it, so one
+ * line of text holds two rows of LEDs. The colors of every cell on screen are
+ * kept, and a frame only moves the cursor to the cells that changed and
+ * redraws those. Frames arriving faster than the preview rate are skipped.
+ *
+ * Between frames the cursor rests at the start of the line below the preview.
+ */
+typedef struct {
+  VALUE     io;           /* written to with `write` */
+  int64_t   interval;     /* nanoseconds between drawn frames */
+  int64_t   last;         /* clock time of the last frame drawn */
+  long      width;        /* LEDs per row when there is no layout */
+  long      cols;         /* size of the drawn area in cells */
+  long      lines;
+  uint32_t *cells;        /* top and bottom color of each cell on screen */
+} pp_preview_t;
+
+/* Never a 24-bit color, so a cell holding it is always redrawn */
+#define PP_PREVIEW_UNKNOWN 0xffffffff
+
+static ID id_preview, id_write, id_flush, id_fileno;
+static VALUE sym_rate, sym_width;
+
+/* ======================================================================= */
+
+static int64_t
+pp_preview_clock( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+pp_preview_mark( void *ptr )
+{
+  pp_preview_t *pv = (pp_preview_t*) ptr;
+  rb_gc_mark( pv->io );
+}
+
+static void
+pp_preview_free( void *ptr )
+{
+  pp_preview_t *pv = (pp_preview_t*) ptr;
+  if (NULL == ptr) return;
+  if (pv->cells) xfree( pv->cells );
+  xfree( pv );
+}
+
+/* Returns the preview of the PixelPi::Leds or NULL if it is not previewing */
+static pp_preview_t*
+pp_leds_preview( VALUE self )
+{
+  VALUE obj = rb_ivar_get( self, id_preview );
+  pp_preview_t *pv;
+
+  if (NIL_P(obj)) return NULL;
+  Data_Get_Struct( obj, pp_preview_t, pv );
+  return pv;
+}
+
+/* Returns the width of the terminal `io` is attached to, or 80 when it is not
+ * a terminal.
+ */
+static long
+pp_preview_columns( VALUE io )
+{
+  struct winsize ws;
+  VALUE fd;
+
+  if (!rb_respond_to( io, id_fileno )) return 80;
+  fd = rb_funcall( io, id_fileno, 0 );
+  if (!FIXNUM_P(fd)) return 80;
+  if (ioctl( FIX2INT(fd), TIOCGWINSZ, &ws ) < 0 || ws.ws_col == 0) return 80;
+  return ws.ws_col;
+}
+
+/* Returns the 24-bit color shown for the LED at position `n`. The color is
+ * scaled by the brightness like a recorded frame, and the white of an RGBW
+ * strip is added to each color.
+ */
+static inline uint32_t
+pp_preview_color( const ws2811_channel_t *channel, long n )
+{
+  uint32_t scale = (channel->brightness & 0xff) + 1;
+  uint32_t r, g, b, w;
+  ws2811_led_t c;
+  long ii;
+
+  if (n < 0 || n >= channel->count) return 0;
+  ii = channel->reverse ? channel->origin - n : channel->origin + n;
+  if (ii < 0) ii += channel->count;
+  else if (ii >= channel->count) ii -= channel->count;
+
+  c = channel->leds[ii];
+  w = (((c >> 24) & 0xff) * scale) >> 8;
+  r = MIN(((((c >> 16) & 0xff) * scale) >> 8) + w, 255);
+  g = MIN(((((c >>  8) & 0xff) * scale) >> 8) + w, 255);
+  b = MIN(((( c        & 0xff) * scale) >> 8) + w, 255);
+  return (r << 16) | (g << 8) | b;
+}
+
+/* Returns the color of matrix position (x, y); positions past the last LED of
+ * the strip or without an LED in the layout are black.
+ */
+static inline uint32_t
+pp_preview_pixel( const ws2811_channel_t *channel, const pp_layout_t *layout, long cols, long x, long y )
+{
+  if (layout) {
+    uint32_t idx;
+    if (y >= layout->height) return 0;
+    idx = layout->map[y * layout->width + x];
+    return idx == PP_NO_LED ? 0 : pp_preview_color( channel, idx );
+  }
+  return pp_preview_color( channel, y * cols + x );
+}
+
+static void
+pp_preview_sgr( VALUE str, int layer, uint32_t c )
+{
+  rb_str_catf( str, "%d;2;%u;%u;%u", layer, (c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff );
+}
+
+/* Returns the escape sequences that draw the frame just sent by `show`, or
+ * `nil` when the frame comes too soon after the last one drawn or no cell has
+ * changed. They are written with `pp_preview_write` once `show` has put the
+ * LED buffer back, since the output may raise.
+ */
+VALUE
+pp_preview_frame( VALUE self, const ws2811_channel_t *channel )
+{
+  pp_preview_t *pv = pp_leds_preview( self );
+  const pp_layout_t *layout;
+  long cols, rows, lines, row, col, x, y;
+  uint32_t fg = PP_PREVIEW_UNKNOWN, bg = PP_PREVIEW_UNKNOWN;
+  int64_t now;
+  int drawn = 0;
+  VALUE str;
+
+  if (!pv) return Qnil;
+  now = pp_preview_clock();
+  if (pv->last && now - pv->last < pv->interval) return Qnil;
+  pv->last = now;
+
+  if ((layout = pp_leds_find_layout( self ))) {
+    cols = layout->width;
+    rows = layout->height;
+  } else {
+    cols = MIN(pv->width, channel->count);
+    if (cols < 1) cols = 1;
+    rows = (channel->count + cols - 1) / cols;
+  }
+  lines = (rows + 1) / 2;
+  if (cols == 0 || lines == 0) return Qnil;
+
+  str = rb_enc_str_new( NULL, 0, rb_utf8_encoding() );
+
+  /* a new area is scrolled into view below the cursor and fully drawn */
+  if (cols != pv->cols || lines != pv->lines) {
+    long ii;
+    REALLOC_N( pv->cells, uint32_t, cols * lines * 2 );
+    for (ii=0; ii<cols*lines*2; ii++) pv->cells[ii] = PP_PREVIEW_UNKNOWN;
+    pv->cols  = cols;
+    pv->lines = lines;
+    rb_str_cat( str, "\r", 1 );
+    for (ii=0; ii<lines; ii++) rb_str_cat( str, "\n", 1 );
+  }
+
+  row = lines;
+  col = 0;
+  for (y=0; y<lines; y++) {
+    uint32_t *cell = pv->cells + y * cols * 2;
+
+    for (x=0; x<cols; x++, cell+=2) {
+      uint32_t top    = pp_preview_pixel( channel, layout, cols, x, 2*y );
+      uint32_t bottom = 2*y+1 < rows ? pp_preview_pixel( channel, layout, cols, x, 2*y+1 ) : 0;
+
+      if (cell[0] == top && cell[1] == bottom) continue;
+      cell[0] = top;
+      cell[1] = bottom;
+
+      if (!drawn) {
+        rb_str_cat2( str, "\033[?25l" );
+        drawn = 1;
+      }
+      if (row != y) {
+        rb_str_catf( str, "\033[%ld%c", row > y ? row - y : y - row, row > y ? 'A' : 'B' );
+        row = y;
+      }
+      if (col != x) {
+        rb_str_catf( str, "\033[%ldG", x + 1 );
+        col = x;
+      }
+
+      if (top != fg || bottom != bg) {
+        rb_str_cat( str, "\033[", 2 );
+        if (top != fg) pp_preview_sgr( str, 38, top );
+        if (top != fg && bottom != bg) rb_str_cat( str, ";", 1 );
+        if (bottom != bg) pp_preview_sgr( str, 48, bottom );
+        rb_str_cat( str, "m", 1 );
+        fg = top;
+        bg = bottom;
+      }
+      rb_str_cat2( str, "\342\226\200" );  /* U+2580 upper half block */
+      col += 1;
+    }
+  }
+
+  if (!drawn) return Qnil;
+  rb_str_cat2( str, "\033[0m" );
+  if (row != lines) rb_str_catf( str, "\033[%ldB", lines - row );
+  rb_str_cat2( str, "\r\033[?25h" );
+
+  return str;
+}
+
+/* Write a frame returned by `pp_preview_frame` to the preview output */
+void
+pp_preview_write( VALUE self, VALUE str )
+{
+  pp_preview_t *pv = pp_leds_preview( self );
+
+  if (!pv || NIL_P(str)) return;
+  rb_funcall( pv->io, id_write, 1, str );
+  if (rb_respond_to( pv->io, id_flush )) rb_funcall( pv->io, id_flush, 0 );
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    preview( io = $stdout, options = {} )
+ *
+ * Draw the frames sent by `show` in the terminal, until `stop_preview` is
+ * called. Each LED is half a character cell in 24-bit color, so a terminal
+ * with truecolor support is needed. A strip is drawn as rows of LEDs, and the
+ * matrix is drawn when a layout has been set. Colors are scaled by the
+ * brightness; gamma and white balance are left out.
+ *
+ * Only the cells that changed since the last frame are redrawn, and frames
+ * sent faster than the preview rate are skipped, so the preview keeps up
+ * with long strips and slow connections.
+ *
+ * io      - where the escape sequences are written; anything with `write`
+ * options - Hash of arguments
+ *   :rate  - most frames drawn per second; defaults to 30, and `0` draws
+ *            every frame
+ *   :width - LEDs per row of a strip without a layout; defaults to the width
+ *            of the terminal
+ *
+ * Examples:
+ *    leds.preview( :rate => 10 )
+ *    256.times { |jj| leds.effect( :rainbow_cycle, :offset => jj ).show }
+ *    leds.stop_preview
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_preview_m( int argc, VALUE* argv, VALUE self )
+{
+  pp_preview_t *pv;
+  VALUE io, opts, obj;
+  double rate = 30.0;
+  long width;
+
+  pp_leds_struct( self );
+  rb_scan_args( argc, argv, "02", &io, &opts );
+  if (argc == 1 && RB_TYPE_P(io, T_HASH)) {
+    opts = io;
+    io   = Qnil;
+  }
+  if (NIL_P(io)) io = rb_stdout;
+  if (!rb_respond_to( io, id_write )) {
+    rb_raise( rb_eTypeError, "preview output must respond to write: %s", rb_obj_classname( io ) );
+  }
+  width = pp_preview_columns( io );
+
+  if (!NIL_P(opts)) {
+    VALUE value;
+    Check_Type( opts, T_HASH );
+    value = rb_hash_lookup( opts, sym_rate );
+    if (!NIL_P(value)) rate = NUM2DBL(value);
+    if (rate < 0) rb_raise( rb_eArgError, "rate cannot be negative: %g", rate );
+    value = rb_hash_lookup( opts, sym_width );
+    if (!NIL_P(value)) width = NUM2LONG(value);
+    if (width < 1) rb_raise( rb_eArgError, "width must be at least 1 LED: %ld", width );
+  }
+
+  obj = Data_Make_Struct( 0, pp_preview_t, pp_preview_mark, pp_preview_free, pv );
+  pv->io       = io;
+  pv->interval = rate > 0 ? (int64_t) (1e9 / rate) : 0;
+  pv->width    = width;
+
+  rb_ivar_set( self, id_preview, obj );
+  return self;
+}
+
+/* call-seq:
+ *    stop_preview
+ *
+ * Stop drawing the frames sent by `show`. The last frame drawn is left in
+ * the terminal.
+ *
+ * Returns `nil`.
+ */
+static VALUE
+pp_leds_stop_preview( VALUE self )
+{
+  rb_ivar_set( self, id_preview, Qnil );
+  return Qnil;
+}
+
+/* call-seq:
+ *    previewing?
+ *
+ * Returns `true` if the frames sent by `show` are drawn in the terminal.
+ */
+static VALUE
+pp_leds_previewing_p( VALUE self )
+{
+  return pp_leds_preview( self ) ? Qtrue : Qfalse;
+}
+
+void Init_preview( )
+{
+  id_preview = rb_intern( "preview" );  /* hidden from Ruby */
+  id_write   = rb_intern( "write" );
+  id_flush   = rb_intern( "flush" );
+  id_fileno  = rb_intern( "fileno" );
+  sym_rate   = ID2SYM(rb_intern( "rate" ));
+  sym_width  = ID2SYM(rb_intern( "width" ));
+
+  rb_define_method( cLeds, "preview",      pp_leds_preview_m,    -1 );
+  rb_define_method( cLeds, "stop_preview", pp_leds_stop_preview,  0 );
+  rb_define_method( cLeds, "previewing?",  pp_leds_previewing_p,  0 );
+}
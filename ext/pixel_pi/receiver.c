@@ -0,0 +1,1144 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* recvmmsg, accept4 */
+#endif
+#include "pixel_pi.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <ruby/thread.h>
+
+/* The receiver takes pixel data from lighting consoles and media servers
+ * straight off a UDP socket and into the LED buffer. Four protocols are
+ * understood:
+ *
+ *   sACN (E1.31) - one DMX universe of up to 512 channels per packet; can be
+ *                  shown on E1.31 synchronization packets
+ *   Art-Net      - ArtDmx packets of one universe each; can be shown on
+ *                  ArtSync
+ *   DDP          - a byte offset and length into the whole display; can be
+ *                  shown when a packet has the push flag set
+ *   PixelPi      - delta coded chunks of LEDs from the network output of
+ *                  another PixelPi::Leds, described in sender.c; shown on
+ *                  the last packet of each frame. It can also be received
+ *                  over TCP from one sender at a time.
+ *
+ * Most sACN and Art-Net sources never send sync packets, so those protocols
+ * and DDP show once per poll unless sync is asked for. The PixelPi sender
+ * always marks the end of a frame, so it is shown on that packet.
+ *
+ * Every protocol ends up as a run of bytes at some position in the stream of
+ * LED channels - red, green, blue, and optionally white for each LED. A
+ * universe covers `universe_size` LEDs; channels past the last whole LED of a
+ * universe are not used.
+ *
+ * Packets are read in batches with recvmmsg while the GVL is held only for
+ * parsing them; waiting for the socket releases it.
+ */
+
+enum pp_rx_protocol {
+  PP_RX_SACN,
+  PP_RX_ARTNET,
+  PP_RX_DDP,
+  PP_RX_PIXEL_PI
+};
+
+static const char *pp_protocol_names[] = { "sacn", "artnet", "ddp", "pixel_pi" };
+static const int   pp_protocol_ports[] = { 5568, 6454, 4048, PP_NET_PORT };
+
+enum pp_rx_show {
+  PP_RX_SHOW_NONE,     /* never call show */
+  PP_RX_SHOW_SYNC,     /* show on sync packets */
+  PP_RX_SHOW_FRAME     /* show after every poll that changed the LEDs */
+};
+
+/* what a packet did */
+#define PP_RX_DATA   1
+#define PP_RX_SYNC   2
+
+#define PP_RX_BATCH      32       /* packets read with one recvmmsg call */
+#define PP_RX_MAX_BATCHES 8       /* batches read by one poll */
+#define PP_RX_PACKET   2048       /* largest packet kept */
+#define PP_RX_CONTROL   128       /* room for the timestamp and drop count */
+#define PP_RX_RCVBUF   (1 << 20)  /* socket receive buffer asked for */
+#define PP_RX_STREAM   (PP_RX_BATCH * PP_RX_PACKET)  /* TCP stream buffer */
+#define PP_RX_LATE       64       /* PixelPi frames a late packet can be behind */
+
+typedef struct {
+  uint64_t packets;       /* packets received */
+  uint64_t bytes;         /* bytes received */
+  uint64_t invalid;       /* packets that could not be parsed */
+  uint64_t ignored;       /* packets for other universes or devices */
+  uint64_t lost;          /* packets missing from the sequence numbers */
+  uint64_t late;          /* packets that arrived out of order and were dropped */
+  uint64_t overflows;     /* packets dropped by the kernel when the socket was full */
+  uint64_t syncs;         /* sync packets received */
+  uint64_t shows;         /* times `show` was called */
+  double   pps;           /* packets per second over the last second */
+  double   latency;       /* seconds from the first packet of a frame to its show */
+  double   max_latency;
+} pp_rx_stats_t;
+
+typedef struct {
+  VALUE          leds;           /* PixelPi::Leds the packets are written to */
+  int            fd;             /* UDP or listening TCP socket, -1 once closed */
+  int            conn;           /* TCP connection of the sender, -1 if none */
+  int            stream;         /* received over TCP */
+  int            protocol;
+  int            show;           /* when to call show */
+  int            bpp;            /* channels per LED */
+  long           universe;       /* first universe */
+  long           universes;      /* number of universes mapped to the LEDs */
+  long           universe_size;  /* LEDs per universe */
+  int16_t       *sequence;       /* last sequence number of each universe, -1 if none */
+  uint32_t      *chunks;         /* PixelPi frame each chunk holds, 0 if none */
+  int            sync_address;   /* sACN sync universe named by the data packets */
+  int            dirty;          /* LEDs changed since the last show */
+  int64_t        frame_start;    /* arrival of the first packet since the last show */
+  int64_t        window_start;   /* start of the packet rate window */
+  uint64_t       window_packets;
+  pp_rx_stats_t  stats;
+  uint8_t       *buffer;         /* PP_RX_BATCH packets, or the TCP stream */
+  long           stream_len;     /* bytes of the TCP stream not yet applied */
+  uint8_t       *control;        /* PP_RX_BATCH control messages */
+} pp_receiver_t;
+
+typedef struct {
+  int fd;
+  int conn;           /* TCP connection, -1 if none */
+  int timeout;        /* milliseconds, -1 to wait forever */
+  int result;
+  int error;
+} pp_rx_wait_t;
+
+VALUE cReceiver;
+
+static VALUE sym_port, sym_bind, sym_universe, sym_universes, sym_universe_size,
+             sym_channels, sym_show, sym_multicast, sym_sync, sym_frame,
+             sym_transport, sym_udp, sym_tcp,
+             sym_packets, sym_bytes, sym_invalid, sym_ignored, sym_lost, sym_late,
+             sym_overflows, sym_syncs, sym_shows, sym_packets_per_second,
+             sym_latency, sym_max_latency;
+
+/* Byte shift within a color of each channel of an LED: red, green, blue, white */
+static const int pp_dmx_shift[] = { 16, 8, 0, 24 };
+
+static const uint8_t pp_acn_id[12] = { 'A','S','C','-','E','1','.','1','7',0,0,0 };
+
+/* ======================================================================= */
+
+static inline uint16_t pp_be16( const uint8_t *p ) { return (uint16_t) ((p[0] << 8) | p[1]); }
+static inline uint32_t pp_be32( const uint8_t *p ) { return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3]; }
+
+static int64_t
+pp_receiver_clock( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_REALTIME, &ts );
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+pp_receiver_mark( void *ptr )
+{
+  pp_receiver_t *rx = (pp_receiver_t*) ptr;
+  rb_gc_mark( rx->leds );
+}
+
+static void
+pp_receiver_free( void *ptr )
+{
+  pp_receiver_t *rx;
+  if (NULL == ptr) return;
+
+  rx = (pp_receiver_t*) ptr;
+  if (rx->fd >= 0) close( rx->fd );
+  if (rx->conn >= 0) close( rx->conn );
+  if (rx->sequence) xfree( rx->sequence );
+  if (rx->chunks)   xfree( rx->chunks );
+  if (rx->buffer)   xfree( rx->buffer );
+  if (rx->control)  xfree( rx->control );
+  xfree( rx );
+}
+
+static VALUE
+pp_receiver_allocate( VALUE klass )
+{
+  pp_receiver_t *rx;
+
+  rx = ALLOC_N( pp_receiver_t, 1 );
+  if (!rx) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::Receiver instance");
+  }
+  memset( rx, 0, sizeof(pp_receiver_t) );
+  rx->leds = Qnil;
+  rx->fd   = -1;
+  rx->conn = -1;
+
+  return Data_Wrap_Struct( klass, pp_receiver_mark, pp_receiver_free, rx );
+}
+
+static pp_receiver_t*
+pp_receiver_struct( VALUE self )
+{
+  pp_receiver_t *rx;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_receiver_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::Receiver object" );
+  }
+  Data_Get_Struct( self, pp_receiver_t, rx );
+
+  if (rx->fd < 0) {
+    rb_raise( ePixelPiError, "Receiver is closed" );
+  }
+  return rx;
+}
+
+static int
+pp_parse_protocol( VALUE value )
+{
+  const char *name;
+  int ii;
+
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "protocol must be a Symbol: %s", rb_obj_classname(value) );
+  }
+
+  name = rb_id2name( SYM2ID(value) );
+  for (ii=0; ii<=PP_RX_PIXEL_PI; ii++) {
+    if (strcmp( name, pp_protocol_names[ii] ) == 0) return ii;
+  }
+
+  rb_raise( rb_eArgError, "unknown protocol: %s", name );
+  return 0;
+}
+
+static int
+pp_parse_show( VALUE value )
+{
+  if (!RTEST(value))      return PP_RX_SHOW_NONE;
+  if (value == sym_sync)  return PP_RX_SHOW_SYNC;
+  if (value == sym_frame) return PP_RX_SHOW_FRAME;
+
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "show must be a Symbol: %s", rb_obj_classname(value) );
+  }
+  rb_raise( rb_eArgError, "unknown show mode: %s", rb_id2name( SYM2ID(value) ) );
+  return 0;
+}
+
+/* Returns 1 for TCP and 0 for UDP */
+static int
+pp_parse_transport( VALUE value )
+{
+  if (NIL_P(value) || value == sym_udp) return 0;
+  if (value == sym_tcp) return 1;
+
+  if (TYPE(value) != T_SYMBOL) {
+    rb_raise( rb_eTypeError, "transport must be a Symbol: %s", rb_obj_classname(value) );
+  }
+  rb_raise( rb_eArgError, "unknown transport: %s", rb_id2name( SYM2ID(value) ) );
+  return 0;
+}
+
+/* Copy `len` channel bytes to the LEDs, starting at channel `pos` */
+static void
+pp_receiver_store( const pp_receiver_t *rx, ws2811_led_t *leds, long count,
+                   uint64_t pos, const uint8_t *data, long len )
+{
+  uint64_t total = (uint64_t) count * rx->bpp;
+  ws2811_led_t *led;
+  int k;
+
+  if (pos >= total) return;
+  if ((uint64_t) len > total - pos) len = (long) (total - pos);
+
+  led = leds + pos / rx->bpp;
+  k   = pos % rx->bpp;
+
+  if (k == 0 && rx->bpp == 3) {
+    for (; len >= 3; len -= 3, data += 3, led++) {
+      *led = (*led & 0xff000000) | ((ws2811_led_t) data[0] << 16) | (data[1] << 8) | data[2];
+    }
+  }
+  while (len-- > 0) {
+    *led = (*led & ~((ws2811_led_t) 0xff << pp_dmx_shift[k])) | ((ws2811_led_t) *data++ << pp_dmx_shift[k]);
+    if (++k == rx->bpp) { k = 0; led++; }
+  }
+}
+
+/* Check the sequence number of a universe. Returns 0 if the packet is older
+ * than the last one seen and must be dropped. Lost packets are counted from
+ * the gaps in the sequence.
+ */
+static int
+pp_receiver_sequence( pp_receiver_t *rx, long index, uint8_t seq )
+{
+  int16_t last = rx->sequence[index];
+  int diff;
+
+  rx->sequence[index] = seq;
+  if (last < 0) return 1;
+
+  diff = (int8_t) (seq - (uint8_t) last);
+  if (diff <= 0 && diff > -20) {
+    rx->sequence[index] = last;
+    rx->stats.late += 1;
+    return 0;
+  }
+  if (diff > 1) rx->stats.lost += diff - 1;
+  return 1;
+}
+
+/* Store the DMX `data` of `universe`. Returns PP_RX_DATA, or 0 if the
+ * universe is not mapped to these LEDs or the packet is out of order.
+ */
+static int
+pp_receiver_universe( pp_receiver_t *rx, ws2811_led_t *leds, long count,
+                      long universe, int seq, const uint8_t *data, long len )
+{
+  long index = universe - rx->universe;
+  long size  = rx->universe_size * rx->bpp;
+
+  if (index < 0 || index >= rx->universes) {
+    rx->stats.ignored += 1;
+    return 0;
+  }
+  if (seq >= 0 && !pp_receiver_sequence( rx, index, (uint8_t) seq )) return 0;
+
+  pp_receiver_store( rx, leds, count, (uint64_t) index * size, data, MIN(len, size) );
+  return PP_RX_DATA;
+}
+
+/* E1.31: root layer, framing layer, and DMP layer of a data packet, or the
+ * root and framing layers of a synchronization packet.
+ */
+static int
+pp_receiver_sacn( pp_receiver_t *rx, ws2811_led_t *leds, long count, const uint8_t *p, long len )
+{
+  uint32_t root, framing;
+  long values;
+
+  if (len < 44 || pp_be16( p ) != 0x0010 || pp_be16( p + 2 ) != 0 || memcmp( p + 4, pp_acn_id, 12 )) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+  root    = pp_be32( p + 18 );
+  framing = pp_be32( p + 40 );
+
+  /* synchronization packet */
+  if (root == 0x00000008 && framing == 0x00000001) {
+    int address;
+    if (len < 47) {
+      rx->stats.invalid += 1;
+      return 0;
+    }
+    address = pp_be16( p + 45 );
+    if (rx->sync_address && address != rx->sync_address) {
+      rx->stats.ignored += 1;
+      return 0;
+    }
+    rx->stats.syncs += 1;
+    return PP_RX_SYNC;
+  }
+
+  if (root == 0x00000008) {   /* discovery and other extended packets */
+    rx->stats.ignored += 1;
+    return 0;
+  }
+  if (root != 0x00000004 || framing != 0x00000002 || len < 126 ||
+      p[117] != 0x02 || p[118] != 0xa1 || pp_be16( p + 119 ) != 0 || pp_be16( p + 121 ) != 1) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+
+  values = pp_be16( p + 123 );
+  if (values < 1 || values > 513 || 125 + values > len) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+
+  /* preview data, terminated streams, and alternate start codes */
+  if ((p[112] & 0x60) || p[125] != 0) {
+    rx->stats.ignored += 1;
+    return 0;
+  }
+
+  rx->sync_address = pp_be16( p + 109 );
+  return pp_receiver_universe( rx, leds, count, pp_be16( p + 113 ), p[111], p + 126, values - 1 );
+}
+
+/* Art-Net: ArtDmx and ArtSync; every other opcode is ignored */
+static int
+pp_receiver_artnet( pp_receiver_t *rx, ws2811_led_t *leds, long count, const uint8_t *p, long len )
+{
+  int opcode;
+  long size;
+
+  if (len < 10 || memcmp( p, "Art-Net", 8 )) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+  opcode = p[8] | (p[9] << 8);
+
+  if (opcode == 0x5200) {
+    rx->stats.syncs += 1;
+    return PP_RX_SYNC;
+  }
+  if (opcode != 0x5000) {
+    rx->stats.ignored += 1;
+    return 0;
+  }
+
+  if (len < 18 || (size = pp_be16( p + 16 )) > 512 || 18 + size > len) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+
+  /* a sequence of zero turns sequence checks off */
+  return pp_receiver_universe( rx, leds, count, ((p[15] & 0x7f) << 8) | p[14],
+                               p[12] ? p[12] : -1, p + 18, size );
+}
+
+/* DDP: data for the default output device at a byte offset into the display */
+static int
+pp_receiver_ddp( pp_receiver_t *rx, ws2811_led_t *leds, long count, const uint8_t *p, long len )
+{
+  int flags, seq, header, result;
+  long size;
+
+  if (len < 10 || (p[0] & 0xc0) != 0x40) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+  flags  = p[0];
+  header = (flags & 0x10) ? 14 : 10;
+  size   = pp_be16( p + 8 );
+  if (header + size > len) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+
+  /* queries, replies, storage, and other devices */
+  if ((flags & 0x0e) || p[3] != 1) {
+    rx->stats.ignored += 1;
+    return 0;
+  }
+
+  /* a 4-bit sequence that counts 1 to 15; zero when not used */
+  seq = p[1] & 0x0f;
+  if (seq) {
+    int16_t last = rx->sequence[0];
+    rx->sequence[0] = seq;
+    if (last > 0) {
+      int diff = (seq - last + 15) % 15;
+      if (diff == 0 || diff > 7) {
+        rx->sequence[0] = last;
+        rx->stats.late += 1;
+        return 0;
+      }
+      rx->stats.lost += diff - 1;
+    }
+  }
+
+  pp_receiver_store( rx, leds, count, pp_be32( p + 4 ), p + header, size );
+  result = size > 0 ? PP_RX_DATA : 0;
+  if (flags & 0x01) {
+    rx->stats.syncs += 1;
+    result |= PP_RX_SYNC;
+  }
+  return result;
+}
+
+/* PixelPi: one delta coded chunk of LEDs. A delta is applied only to a chunk
+ * that holds the frame it was coded against; keyframe chunks always apply.
+ * The packet that ends a frame carries the brightness of the sender.
+ */
+static int
+pp_receiver_pixel_pi( pp_receiver_t *rx, ws2811_led_t *leds, long count, const uint8_t *p, long len )
+{
+  ws2811_led_t chunk[PP_NET_CHUNK];
+  uint32_t seq, base, last;
+  long first, n, size, index, avail;
+  int flags, bpp, diff, result = 0;
+
+  if (len < PP_NET_HEADER || p[0] != 'P' || p[1] != 'X' || p[2] != PP_NET_VERSION) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+  flags = p[3];
+  seq   = pp_be32( p + 4 );
+  base  = pp_be32( p + 8 );
+  first = pp_be32( p + 12 );
+  n     = pp_be16( p + 16 );
+  size  = pp_be16( p + 18 );
+  bpp   = (flags & PP_NET_RGBW) ? 4 : 3;
+  if (PP_NET_HEADER + size > len || n > PP_NET_CHUNK || first % PP_NET_CHUNK || seq == 0) {
+    rx->stats.invalid += 1;
+    return 0;
+  }
+
+  if (n > 0) {
+    index = first / PP_NET_CHUNK;
+    last  = index < rx->universes ? rx->chunks[index] : 0;
+    diff  = (int32_t) (seq - last);
+
+    if (index >= rx->universes || first >= count) {
+      rx->stats.ignored += 1;
+    } else if (last && diff <= 0 && diff > -PP_RX_LATE) {
+      /* a sender that restarted is far behind and is let through */
+      rx->stats.late += 1;
+    } else if (!(flags & PP_NET_KEY) && last != base) {
+      /* the frame this delta builds on never arrived */
+      rx->stats.lost += 1;
+    } else {
+      avail = MIN(n, count - first);
+      memset( chunk, 0, sizeof(chunk) );
+      if (!(flags & PP_NET_KEY)) memcpy( chunk, leds + first, avail * sizeof(ws2811_led_t) );
+      if (pp_delta_decode( p + PP_NET_HEADER, size, chunk, n, bpp ) < 0) {
+        rx->stats.invalid += 1;
+        return 0;
+      }
+      memcpy( leds + first, chunk, avail * sizeof(ws2811_led_t) );
+      rx->chunks[index] = seq;
+      result = PP_RX_DATA;
+    }
+  }
+
+  if (flags & PP_NET_SHOW) {
+    pp_leds_struct( rx->leds )->channel[0].brightness = p[20];
+    rx->stats.syncs += 1;
+    result |= PP_RX_SYNC;
+  }
+  return result;
+}
+
+/* Call show on the LEDs and record how long the frame took to get there */
+static void
+pp_receiver_show( pp_receiver_t *rx )
+{
+  pp_leds_show( rx->leds );
+  rx->stats.shows += 1;
+
+  if (rx->frame_start) {
+    double latency = (pp_receiver_clock() - rx->frame_start) / 1e9;
+    rx->stats.latency = latency;
+    if (latency > rx->stats.max_latency) rx->stats.max_latency = latency;
+  }
+  rx->frame_start = 0;
+  rx->dirty = 0;
+}
+
+static void*
+pp_receiver_wait( void *ptr )
+{
+  pp_rx_wait_t *wait = (pp_rx_wait_t*) ptr;
+  struct pollfd pfd[2];
+
+  pfd[0].fd      = wait->fd;
+  pfd[0].events  = POLLIN;
+  pfd[0].revents = 0;
+  pfd[1].fd      = wait->conn;
+  pfd[1].events  = POLLIN;
+  pfd[1].revents = 0;
+
+  wait->result = poll( pfd, wait->conn >= 0 ? 2 : 1, wait->timeout );
+  wait->error  = errno;
+  return NULL;
+}
+
+/* Apply one packet that arrived at `arrival`. Packets cut short by the
+ * buffer are counted but not trusted. */
+static void
+pp_receiver_packet( pp_receiver_t *rx, ws2811_led_t *leds, long count,
+                    const uint8_t *packet, long len, int64_t arrival, int truncated )
+{
+  int result;
+
+  rx->stats.packets += 1;
+  rx->stats.bytes   += len;
+  rx->window_packets += 1;
+
+  if (truncated) {
+    rx->stats.invalid += 1;
+    return;
+  }
+
+  switch (rx->protocol) {
+    case PP_RX_SACN:   result = pp_receiver_sacn( rx, leds, count, packet, len );     break;
+    case PP_RX_ARTNET: result = pp_receiver_artnet( rx, leds, count, packet, len );   break;
+    case PP_RX_DDP:    result = pp_receiver_ddp( rx, leds, count, packet, len );      break;
+    default:           result = pp_receiver_pixel_pi( rx, leds, count, packet, len ); break;
+  }
+
+  if (result & PP_RX_DATA) {
+    rx->dirty = 1;
+    if (!rx->frame_start) rx->frame_start = arrival;
+  }
+  if ((result & PP_RX_SYNC) && rx->show == PP_RX_SHOW_SYNC) {
+    pp_receiver_show( rx );
+  }
+}
+
+/* Read and apply one batch of packets. Returns the number of packets read. */
+static int
+pp_receiver_batch( pp_receiver_t *rx )
+{
+  struct mmsghdr msgs[PP_RX_BATCH];
+  struct iovec iov[PP_RX_BATCH];
+  ws2811_led_t *leds;
+  long count;
+  int ii, n;
+
+  for (ii=0; ii<PP_RX_BATCH; ii++) {
+    iov[ii].iov_base = rx->buffer + ii * PP_RX_PACKET;
+    iov[ii].iov_len  = PP_RX_PACKET;
+    memset( &msgs[ii].msg_hdr, 0, sizeof(struct msghdr) );
+    msgs[ii].msg_hdr.msg_iov        = &iov[ii];
+    msgs[ii].msg_hdr.msg_iovlen     = 1;
+    msgs[ii].msg_hdr.msg_control    = rx->control + ii * PP_RX_CONTROL;
+    msgs[ii].msg_hdr.msg_controllen = PP_RX_CONTROL;
+  }
+
+  do {
+    n = recvmmsg( rx->fd, msgs, PP_RX_BATCH, MSG_DONTWAIT, NULL );
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    rb_sys_fail( "recvmmsg" );
+  }
+
+  leds = pp_leds_buffer( rx->leds, &count );
+
+  for (ii=0; ii<n; ii++) {
+    struct msghdr *hdr = &msgs[ii].msg_hdr;
+    const uint8_t *packet = rx->buffer + ii * PP_RX_PACKET;
+    long len = msgs[ii].msg_len;
+    int64_t arrival = 0;
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET) continue;
+      if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        struct timespec ts;
+        memcpy( &ts, CMSG_DATA(cmsg), sizeof(ts) );
+        arrival = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+      }
+#ifdef SO_RXQ_OVFL
+      else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+        uint32_t drops;
+        memcpy( &drops, CMSG_DATA(cmsg), sizeof(drops) );
+        rx->stats.overflows = drops;
+      }
+#endif
+    }
+    if (!arrival) arrival = pp_receiver_clock();
+
+    pp_receiver_packet( rx, leds, count, packet, len, arrival, hdr->msg_flags & MSG_TRUNC );
+  }
+
+  return n;
+}
+
+/* Drop the TCP connection of the sender */
+static void
+pp_receiver_disconnect( pp_receiver_t *rx )
+{
+  if (rx->conn >= 0) close( rx->conn );
+  rx->conn       = -1;
+  rx->stream_len = 0;
+}
+
+/* Take a new TCP sender, replacing the current one. The new sender starts
+ * with keyframes, so what the old one sent is forgotten. */
+static void
+pp_receiver_accept( pp_receiver_t *rx )
+{
+  int fd, one = 1;
+  long ii;
+
+  for (;;) {
+    fd = accept4( rx->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+
+    pp_receiver_disconnect( rx );
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    rx->conn = fd;
+    for (ii=0; ii<rx->universes; ii++) rx->chunks[ii] = 0;
+  }
+}
+
+/* Read what the TCP sender has written and apply every whole packet in the
+ * stream. Sets `more` when the read filled the buffer. Returns the number of
+ * packets applied.
+ */
+static int
+pp_receiver_stream( pp_receiver_t *rx, int *more )
+{
+  ws2811_led_t *leds;
+  int64_t arrival;
+  long count, pos = 0;
+  ssize_t n;
+  int packets = 0;
+
+  *more = 0;
+  do {
+    n = recv( rx->conn, rx->buffer + rx->stream_len, PP_RX_STREAM - rx->stream_len, MSG_DONTWAIT );
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  if (n <= 0) {
+    pp_receiver_disconnect( rx );
+    return 0;
+  }
+  *more = rx->stream_len + n == PP_RX_STREAM;
+  rx->stream_len += n;
+
+  arrival = pp_receiver_clock();
+  leds = pp_leds_buffer( rx->leds, &count );
+
+  while (rx->stream_len - pos >= PP_NET_HEADER) {
+    const uint8_t *packet = rx->buffer + pos;
+    long len = PP_NET_HEADER + pp_be16( packet + 18 );
+
+    /* a stream that lost its place cannot find it again */
+    if (packet[0] != 'P' || packet[1] != 'X' || len > PP_RX_STREAM) {
+      rx->stats.invalid += 1;
+      pp_receiver_disconnect( rx );
+      *more = 0;
+      return packets;
+    }
+    if (rx->stream_len - pos < len) break;
+
+    pp_receiver_packet( rx, leds, count, packet, len, arrival, 0 );
+    packets += 1;
+    pos += len;
+  }
+
+  memmove( rx->buffer, rx->buffer + pos, rx->stream_len - pos );
+  rx->stream_len -= pos;
+  return packets;
+}
+
+/* Update the packet rate once a second has passed */
+static void
+pp_receiver_rate( pp_receiver_t *rx )
+{
+  int64_t now = pp_receiver_clock();
+  int64_t elapsed = now - rx->window_start;
+
+  if (!rx->window_start) {
+    rx->window_start = now;
+  } else if (elapsed >= 1000000000 || elapsed < 0) {
+    rx->stats.pps = elapsed > 0 ? rx->window_packets * 1e9 / elapsed : 0.0;
+    rx->window_start   = now;
+    rx->window_packets = 0;
+  }
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::Receiver.new( leds, protocol, options = {} )
+ *
+ * Bind a UDP socket that receives pixel data for the `leds` over the network.
+ * The `protocol` is one of `:sacn` (E1.31), `:artnet`, `:ddp`, or `:pixel_pi`.
+ * Packets are read and written into the LED buffer each time `poll` is
+ * called.
+ *
+ * For sACN and Art-Net each universe carries `universe_size` LEDs. The first
+ * universe given by `:universe` starts at LED 0, the next at LED
+ * `universe_size`, and so on. DDP addresses the LEDs as one stream of bytes.
+ * PixelPi takes the frames of a PixelPi::Leds created with the `:output`
+ * option on another machine, along with its brightness.
+ *
+ * options - Hash of arguments
+ *   :port          - UDP port; defaults to 5568 for sACN, 6454 for Art-Net,
+ *                    4048 for DDP, and 20560 for PixelPi. Port 0 picks a
+ *                    free port.
+ *   :transport     - `:udp` (the default) or `:tcp` to listen for a PixelPi
+ *                    sender on a TCP port; a new connection replaces the
+ *                    current one
+ *   :bind          - IPv4 address to bind to; defaults to "0.0.0.0"
+ *   :universe      - first universe; defaults to 1 for sACN and 0 for Art-Net
+ *   :universes     - number of universes; defaults to enough for all the LEDs
+ *   :universe_size - LEDs per universe; defaults to as many as fit in 512
+ *                    channels - 170 RGB or 128 RGBW LEDs
+ *   :channels      - channels per LED, 3 for RGB or 4 for RGBW; defaults to 4
+ *                    for RGBW strips and 3 otherwise
+ *   :show          - when to call `show` on the LEDs: `:frame` after every
+ *                    `poll` that changed the LEDs; `:sync` on sACN sync,
+ *                    ArtSync, and DDP push packets, for sources that send
+ *                    them; or `nil` to leave it to the caller. Defaults to
+ *                    `:sync` for PixelPi and `:frame` otherwise.
+ *   :multicast     - join the sACN multicast group of each universe; the
+ *                    kernel allows 20 groups per socket by default
+ *
+ * Examples:
+ *    rx = PixelPi::Receiver.new( leds, :sacn, :universe => 1, :universes => 4 )
+ *    loop { rx.poll }
+ *
+ *    rx = PixelPi::Receiver.new( leds, :artnet, :show => :sync )
+ *
+ *    rx = PixelPi::Receiver.new( leds, :pixel_pi, :transport => :tcp )
+ */
+static VALUE
+pp_receiver_initialize( int argc, VALUE* argv, VALUE self )
+{
+  pp_receiver_t *rx;
+  ws2811_t *ledstring;
+  VALUE leds, protocol, opts, tmp;
+  VALUE host = Qnil;
+  struct sockaddr_in addr;
+  long port, count, min, max, ii;
+  int multicast = 0, one = 1, size = PP_RX_RCVBUF, err;
+
+  rb_scan_args( argc, argv, "21", &leds, &protocol, &opts );
+
+  Data_Get_Struct( self, pp_receiver_t, rx );
+  if (rx->fd >= 0) rb_raise( ePixelPiError, "Receiver is already initialized" );
+
+  ledstring = pp_leds_struct( leds );
+  count = ledstring->channel[0].count;
+
+  rx->leds          = leds;
+  rx->protocol      = pp_parse_protocol( protocol );
+  rx->show          = rx->protocol == PP_RX_PIXEL_PI ? PP_RX_SHOW_SYNC : PP_RX_SHOW_FRAME;
+  rx->bpp           = (ledstring->channel[0].strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+  rx->universe      = rx->protocol == PP_RX_SACN ? 1 : 0;
+  rx->universe_size = -1;
+  rx->universes     = -1;
+  port              = pp_protocol_ports[rx->protocol];
+
+  if (!NIL_P(opts)) {
+    Check_Type( opts, T_HASH );
+
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_port )))          port = NUM2LONG(tmp);
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_universe )))      rx->universe = NUM2LONG(tmp);
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_universes )))     rx->universes = NUM2LONG(tmp);
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_universe_size ))) rx->universe_size = NUM2LONG(tmp);
+    if (!NIL_P(tmp = rb_hash_lookup( opts, sym_channels )))      rx->bpp = NUM2INT(tmp);
+    if ((tmp = rb_hash_lookup2( opts, sym_show, Qundef )) != Qundef) rx->show = pp_parse_show( tmp );
+    host      = rb_hash_lookup( opts, sym_bind );
+    multicast = RTEST(rb_hash_lookup( opts, sym_multicast ));
+    rx->stream = pp_parse_transport( rb_hash_lookup( opts, sym_transport ) );
+  }
+
+  if (rx->stream && rx->protocol != PP_RX_PIXEL_PI) {
+    rb_raise( rb_eArgError, "only the pixel_pi protocol can be received over TCP" );
+  }
+
+  if (port < 0 || port > 65535) {
+    rb_raise( rb_eArgError, "port is outside the range 0..65535: %ld", port );
+  }
+  if (rx->bpp != 3 && rx->bpp != 4) {
+    rb_raise( rb_eArgError, "channels per LED must be 3 or 4: %d", rx->bpp );
+  }
+  if (rx->universe_size < 0) rx->universe_size = 512 / rx->bpp;
+  if (rx->universe_size < 1 || rx->universe_size > 512 / rx->bpp) {
+    rb_raise( rb_eArgError, "universe size must be between 1 and %d LEDs: %ld", 512 / rx->bpp, rx->universe_size );
+  }
+  if (rx->universes < 0) {
+    rx->universes = (count + rx->universe_size - 1) / rx->universe_size;
+    if (rx->universes < 1) rx->universes = 1;
+  }
+
+  min = rx->protocol == PP_RX_SACN ? 1 : 0;
+  max = rx->protocol == PP_RX_SACN ? 63999 : 32767;
+  if (rx->protocol == PP_RX_DDP) {
+    rx->universes = 1;
+  } else if (rx->protocol == PP_RX_PIXEL_PI) {
+    /* each chunk of LEDs is tracked like a universe */
+    rx->universe_size = PP_NET_CHUNK;
+    rx->universes = (count + PP_NET_CHUNK - 1) / PP_NET_CHUNK;
+    if (rx->universes < 1) rx->universes = 1;
+  } else {
+    if (rx->universe < min || rx->universe > max) {
+      rb_raise( rb_eArgError, "universe is outside the range %ld..%ld: %ld", min, max, rx->universe );
+    }
+    if (rx->universes < 1 || rx->universes > max - rx->universe + 1) {
+      rb_raise( rb_eArgError, "universes must be between 1 and %ld: %ld", max - rx->universe + 1, rx->universes );
+    }
+  }
+
+  memset( &addr, 0, sizeof(addr) );
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons( (uint16_t) port );
+  if (NIL_P(host)) {
+    addr.sin_addr.s_addr = htonl( INADDR_ANY );
+  } else if (inet_pton( AF_INET, StringValueCStr(host), &addr.sin_addr ) != 1) {
+    rb_raise( rb_eArgError, "invalid bind address: %s", StringValueCStr(host) );
+  }
+
+  rx->sequence = ALLOC_N( int16_t, rx->universes );
+  for (ii=0; ii<rx->universes; ii++) rx->sequence[ii] = -1;
+  rx->chunks = ALLOC_N( uint32_t, rx->universes );
+  memset( rx->chunks, 0, rx->universes * sizeof(uint32_t) );
+  rx->buffer  = ALLOC_N( uint8_t, PP_RX_BATCH * PP_RX_PACKET );
+  rx->control = ALLOC_N( uint8_t, PP_RX_BATCH * PP_RX_CONTROL );
+
+  if (rx->stream) {
+    rx->fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+  } else {
+    rx->fd = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+  }
+  if (rx->fd < 0) rb_sys_fail( "socket" );
+
+  setsockopt( rx->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+  if (!rx->stream) {
+    setsockopt( rx->fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one) );
+#ifdef SO_RXQ_OVFL
+    setsockopt( rx->fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one) );
+#endif
+  }
+  /* a frame of many universes arrives as one burst; the kernel caps this */
+  setsockopt( rx->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+
+  if (bind( rx->fd, (struct sockaddr*) &addr, sizeof(addr) ) < 0) {
+    err = errno;
+    close( rx->fd );
+    rx->fd = -1;
+    rb_syserr_fail( err, "bind" );
+  }
+  if (rx->stream && listen( rx->fd, 4 ) < 0) {
+    err = errno;
+    close( rx->fd );
+    rx->fd = -1;
+    rb_syserr_fail( err, "listen" );
+  }
+
+  if (multicast && rx->protocol == PP_RX_SACN) {
+    for (ii=0; ii<rx->universes; ii++) {
+      struct ip_mreq mreq;
+      long u = rx->universe + ii;
+
+      mreq.imr_multiaddr.s_addr = htonl( 0xefff0000 | (uint32_t) u );
+      mreq.imr_interface.s_addr = htonl( INADDR_ANY );
+      if (setsockopt( rx->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq) ) < 0) {
+        err = errno;
+        close( rx->fd );
+        rx->fd = -1;
+        rb_syserr_fail( err, "IP_ADD_MEMBERSHIP" );
+      }
+    }
+  }
+
+  return self;
+}
+
+/* call-seq:
+ *    poll( timeout = nil )   #=> packet count
+ *
+ * Wait up to `timeout` seconds for packets to arrive and write all the
+ * packets waiting on the socket into the LED buffer. With a `nil` timeout
+ * this waits until a packet arrives; a timeout of 0 never waits. Other Ruby
+ * threads run while waiting.
+ *
+ * Depending on the `:show` option, `show` is called on the LEDs for each sync
+ * packet or once after all the packets have been written.
+ *
+ * Returns the number of packets read.
+ */
+static VALUE
+pp_receiver_poll( int argc, VALUE* argv, VALUE self )
+{
+  pp_receiver_t *rx = pp_receiver_struct( self );
+  VALUE timeout;
+  pp_rx_wait_t wait;
+  long total = 0;
+  int n, more, batches = 0;
+
+  rb_scan_args( argc, argv, "01", &timeout );
+
+  wait.fd      = rx->fd;
+  wait.conn    = rx->conn;
+  wait.timeout = -1;
+  if (!NIL_P(timeout)) {
+    double secs = NUM2DBL(timeout);
+    if (secs < 0.0) rb_raise( rb_eArgError, "timeout cannot be negative: %g", secs );
+    wait.timeout = secs > 2000000.0 ? 2000000000 : (int) (secs * 1000.0 + 0.5);
+  }
+
+  for (;;) {
+    rb_thread_call_without_gvl( pp_receiver_wait, &wait, RUBY_UBF_IO, NULL );
+    if (wait.result >= 0) break;
+    if (wait.error != EINTR) rb_syserr_fail( wait.error, "poll" );
+    rb_thread_check_ints();
+    rx = pp_receiver_struct( self );
+  }
+
+  if (wait.result > 0 && rx->stream) {
+    pp_receiver_accept( rx );
+    while (rx->conn >= 0) {
+      total += pp_receiver_stream( rx, &more );
+      if (!more || ++batches >= PP_RX_MAX_BATCHES) break;
+    }
+  } else if (wait.result > 0) {
+    do {
+      n = pp_receiver_batch( rx );
+      total += n;
+    } while (n == PP_RX_BATCH && ++batches < PP_RX_MAX_BATCHES);
+  }
+
+  if (rx->dirty && rx->show == PP_RX_SHOW_FRAME) pp_receiver_show( rx );
+  pp_receiver_rate( rx );
+
+  return LONG2NUM(total);
+}
+
+/* call-seq:
+ *    stats   #=> Hash
+ *
+ * Returns the counters of the receiver as a Hash:
+ *
+ *   :packets            - packets received
+ *   :bytes              - bytes received
+ *   :invalid            - packets that were not valid for the protocol
+ *   :ignored            - packets for universes or devices not mapped to
+ *                         these LEDs, and packets the receiver does not use
+ *   :lost               - packets missing according to the sequence numbers;
+ *                         for PixelPi, chunks dropped because the frame they
+ *                         build on never arrived
+ *   :late               - packets that arrived out of order and were dropped
+ *   :overflows          - packets dropped by the kernel when the socket
+ *                         buffer was full
+ *   :syncs              - sync packets received; for PixelPi, the packets
+ *                         that end a frame
+ *   :shows              - times `show` was called
+ *   :packets_per_second - packet rate measured over about a second
+ *   :latency            - seconds from the arrival of the first packet of the
+ *                         last frame until it was shown
+ *   :max_latency        - the largest latency seen
+ */
+static VALUE
+pp_receiver_stats( VALUE self )
+{
+  pp_receiver_t *rx = pp_receiver_struct( self );
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset( hash, sym_packets,   ULL2NUM(rx->stats.packets) );
+  rb_hash_aset( hash, sym_bytes,     ULL2NUM(rx->stats.bytes) );
+  rb_hash_aset( hash, sym_invalid,   ULL2NUM(rx->stats.invalid) );
+  rb_hash_aset( hash, sym_ignored,   ULL2NUM(rx->stats.ignored) );
+  rb_hash_aset( hash, sym_lost,      ULL2NUM(rx->stats.lost) );
+  rb_hash_aset( hash, sym_late,      ULL2NUM(rx->stats.late) );
+  rb_hash_aset( hash, sym_overflows, ULL2NUM(rx->stats.overflows) );
+  rb_hash_aset( hash, sym_syncs,     ULL2NUM(rx->stats.syncs) );
+  rb_hash_aset( hash, sym_shows,     ULL2NUM(rx->stats.shows) );
+  rb_hash_aset( hash, sym_packets_per_second, rb_float_new( rx->stats.pps ) );
+  rb_hash_aset( hash, sym_latency,     rb_float_new( rx->stats.latency ) );
+  rb_hash_aset( hash, sym_max_latency, rb_float_new( rx->stats.max_latency ) );
+
+  return hash;
+}
+
+/* call-seq:
+ *    port
+ *
+ * Returns the UDP or TCP port the receiver is bound to.
+ */
+static VALUE
+pp_receiver_port( VALUE self )
+{
+  pp_receiver_t *rx = pp_receiver_struct( self );
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+
+  if (getsockname( rx->fd, (struct sockaddr*) &addr, &len ) < 0) rb_sys_fail( "getsockname" );
+  return INT2FIX(ntohs( addr.sin_port ));
+}
+
+/* call-seq:
+ *    protocol
+ *
+ * Returns the protocol of the receiver, `:sacn`, `:artnet`, `:ddp`, or
+ * `:pixel_pi`.
+ */
+static VALUE
+pp_receiver_protocol( VALUE self )
+{
+  pp_receiver_t *rx = pp_receiver_struct( self );
+  return ID2SYM(rb_intern( pp_protocol_names[rx->protocol] ));
+}
+
+/* call-seq:
+ *    close
+ *
+ * Close the socket of the receiver. It can no longer be polled.
+ *
+ * Returns `nil`.
+ */
+static VALUE
+pp_receiver_close( VALUE self )
+{
+  pp_receiver_t *rx;
+
+  Data_Get_Struct( self, pp_receiver_t, rx );
+  if (rx->fd >= 0) close( rx->fd );
+  rx->fd = -1;
+  pp_receiver_disconnect( rx );
+  rx->leds = Qnil;
+  return Qnil;
+}
+
+/* call-seq:
+ *    closed?
+ *
+ * Returns `true` if the receiver has been closed.
+ */
+static VALUE
+pp_receiver_closed_p( VALUE self )
+{
+  pp_receiver_t *rx;
+
+  Data_Get_Struct( self, pp_receiver_t, rx );
+  return rx->fd < 0 ? Qtrue : Qfalse;
+}
+
+void Init_receiver( )
+{
+  sym_port          = ID2SYM(rb_intern( "port" ));
+  sym_bind          = ID2SYM(rb_intern( "bind" ));
+  sym_universe      = ID2SYM(rb_intern( "universe" ));
+  sym_universes     = ID2SYM(rb_intern( "universes" ));
+  sym_universe_size = ID2SYM(rb_intern( "universe_size" ));
+  sym_channels      = ID2SYM(rb_intern( "channels" ));
+  sym_show          = ID2SYM(rb_intern( "show" ));
+  sym_multicast     = ID2SYM(rb_intern( "multicast" ));
+  sym_sync          = ID2SYM(rb_intern( "sync" ));
+  sym_frame         = ID2SYM(rb_intern( "frame" ));
+  sym_transport     = ID2SYM(rb_intern( "transport" ));
+  sym_udp           = ID2SYM(rb_intern( "udp" ));
+  sym_tcp           = ID2SYM(rb_intern( "tcp" ));
+  sym_packets       = ID2SYM(rb_intern( "packets" ));
+  sym_bytes         = ID2SYM(rb_intern( "bytes" ));
+  sym_invalid       = ID2SYM(rb_intern( "invalid" ));
+  sym_ignored       = ID2SYM(rb_intern( "ignored" ));
+  sym_lost          = ID2SYM(rb_intern( "lost" ));
+  sym_late          = ID2SYM(rb_intern( "late" ));
+  sym_overflows     = ID2SYM(rb_intern( "overflows" ));
+  sym_syncs         = ID2SYM(rb_intern( "syncs" ));
+  sym_shows         = ID2SYM(rb_intern( "shows" ));
+  sym_packets_per_second = ID2SYM(rb_intern( "packets_per_second" ));
+  sym_latency       = ID2SYM(rb_intern( "latency" ));
+  sym_max_latency   = ID2SYM(rb_intern( "max_latency" ));
+
+  cReceiver = rb_define_class_under( mPixelPi, "Receiver", rb_cObject );
+  rb_define_alloc_func( cReceiver, pp_receiver_allocate );
+  rb_define_method( cReceiver, "initialize", pp_receiver_initialize, -1 );
+
+  rb_define_method( cReceiver, "poll",     pp_receiver_poll,    -1 );
+  rb_define_method( cReceiver, "stats",    pp_receiver_stats,    0 );
+  rb_define_method( cReceiver, "port",     pp_receiver_port,     0 );
+  rb_define_method( cReceiver, "protocol", pp_receiver_protocol, 0 );
+  rb_define_method( cReceiver, "close",    pp_receiver_close,    0 );
+  rb_define_method( cReceiver, "closed?",  pp_receiver_closed_p, 0 );
+}
@@ -0,0 +1,364 @@
+#include "pixel_pi.h"
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <ruby/thread.h>
+
+/* The frame recorder captures every frame sent by `show` into an animation
+ * file. `show` only copies the frame into a free slot of a ring buffer; a
+ * background thread encodes the frames and writes them to disk. When the
+ * writer falls behind and the ring is full the frame is dropped rather than
+ * making `show` wait on the disk.
+ */
+typedef struct {
+  VALUE            path;         /* file being written */
+  pp_anim_writer_t writer;       /* only touched by the writer thread */
+  pthread_t        thread;
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;         /* signalled when a frame is queued */
+  long             led_count;    /* number of LEDs in each frame */
+  long             slots;        /* number of frames the ring can hold */
+  uint32_t        *frames;       /* ring of `slots` frames */
+  uint32_t        *times;        /* time of each frame in milliseconds */
+  long             head;         /* number of frames queued */
+  long             tail;         /* number of frames written */
+  long             dropped;      /* frames dropped because the ring was full */
+  int64_t          start;        /* clock time of the first frame */
+  int              stop;         /* tells the writer thread to finish */
+  int              discard;      /* tells it to drop the queued frames too */
+  int              error;        /* errno of the first failed write */
+  int              running;      /* the writer thread has been started */
+} pp_recorder_t;
+
+static ID id_recorder;
+static VALUE sym_buffer;
+
+/* ======================================================================= */
+
+static int64_t
+pp_recorder_clock( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Write queued frames until the recorder is stopped and the ring is empty */
+static void*
+pp_recorder_thread( void *ptr )
+{
+  pp_recorder_t *rec = (pp_recorder_t*) ptr;
+
+  pthread_mutex_lock( &rec->lock );
+  for (;;) {
+    long slot;
+
+    while (rec->tail == rec->head && !rec->stop) {
+      pthread_cond_wait( &rec->cond, &rec->lock );
+    }
+    if (rec->tail == rec->head || rec->discard) break;
+
+    /* the slot belongs to this thread until the tail moves past it */
+    slot = rec->tail % rec->slots;
+    pthread_mutex_unlock( &rec->lock );
+
+    if (!rec->error &&
+        pp_anim_writer_frame( &rec->writer, rec->frames + slot * rec->led_count,
+                              rec->led_count, rec->times[slot] ) < 0) {
+      rec->error = errno ? errno : EIO;
+    }
+
+    pthread_mutex_lock( &rec->lock );
+    rec->tail += 1;
+  }
+  pthread_mutex_unlock( &rec->lock );
+
+  return NULL;
+}
+
+static void*
+pp_recorder_join( void *ptr )
+{
+  pp_recorder_t *rec = (pp_recorder_t*) ptr;
+
+  pthread_mutex_lock( &rec->lock );
+  rec->stop = 1;
+  pthread_cond_signal( &rec->cond );
+  pthread_mutex_unlock( &rec->lock );
+
+  pthread_join( rec->thread, NULL );
+  rec->running = 0;
+  return NULL;
+}
+
+/* Stop the writer thread and finish the file. The frame rate stored in the
+ * header is the average rate the frames were shown at. Returns -1 with
+ * `errno` set if any part of the file could not be written.
+ */
+static int
+pp_recorder_finish( pp_recorder_t *rec )
+{
+  pp_anim_writer_t *writer = &rec->writer;
+  uint32_t fps = 30000, last;
+
+  if (rec->running) pp_recorder_join( rec );
+
+  if (rec->error) {
+    pp_anim_writer_abort( writer );
+    errno = rec->error;
+    return -1;
+  }
+
+  if (writer->frame_count > 1) {
+    last = rec->times[(rec->tail - 1) % rec->slots];
+    if (last > 0) fps = (uint32_t) ((uint64_t) (writer->frame_count - 1) * 1000000 / last);
+    if (fps == 0) fps = 1;
+  }
+  return pp_anim_writer_close( writer, fps );
+}
+
+static void
+pp_recorder_mark( void *ptr )
+{
+  pp_recorder_t *rec = (pp_recorder_t*) ptr;
+  rb_gc_mark( rec->path );
+}
+
+static void
+pp_recorder_free( void *ptr )
+{
+  pp_recorder_t *rec = (pp_recorder_t*) ptr;
+  if (NULL == ptr) return;
+
+  /* A recording that was never stopped is abandoned: the writer thread stops
+   * after the frame it is on and the file is left without its header. Nothing
+   * more is written from inside the GC, where errors could not be reported.
+   */
+  if (rec->running) {
+    rec->discard = 1;
+    pp_recorder_join( rec );
+  }
+  pp_anim_writer_abort( &rec->writer );
+
+  pthread_mutex_destroy( &rec->lock );
+  pthread_cond_destroy( &rec->cond );
+  if (rec->frames) xfree( rec->frames );
+  if (rec->times)  xfree( rec->times );
+  xfree( rec );
+}
+
+/* Returns the recorder of the PixelPi::Leds or NULL if it is not recording */
+static pp_recorder_t*
+pp_leds_recorder( VALUE self )
+{
+  VALUE obj = rb_ivar_get( self, id_recorder );
+  pp_recorder_t *rec;
+
+  if (NIL_P(obj)) return NULL;
+  Data_Get_Struct( obj, pp_recorder_t, rec );
+  return rec;
+}
+
+/* Queue the frame just sent by `show`. The colors are taken in strip order -
+ * following the channel origin and direction - and scaled by the brightness
+ * so the recording holds what the LEDs were asked to display. Gamma and white
+ * balance are left out; they belong to the strip the frame is played on.
+ */
+void
+pp_recorder_capture( VALUE self, const ws2811_channel_t *channel )
+{
+  pp_recorder_t *rec = pp_leds_recorder( self );
+  uint32_t scale = (channel->brightness & 0xff) + 1;
+  const ws2811_led_t *leds = channel->leds;
+  long ii, jj, count, slot;
+  int64_t now;
+  uint32_t *dst;
+
+  if (!rec) return;
+  now = pp_recorder_clock();
+  if (rec->head == 0) rec->start = now;
+
+  pthread_mutex_lock( &rec->lock );
+  if (rec->head - rec->tail >= rec->slots) {
+    rec->dropped += 1;
+    pthread_mutex_unlock( &rec->lock );
+    return;
+  }
+  slot = rec->head % rec->slots;
+  pthread_mutex_unlock( &rec->lock );
+
+  /* the slot is free until the head moves past it */
+  dst   = rec->frames + slot * rec->led_count;
+  count = MIN(rec->led_count, channel->count);
+  jj    = channel->origin;
+  for (ii=0; ii<count; ii++) {
+    ws2811_led_t c = leds[jj];
+    dst[ii] = ((((c & 0x00ff00ff) * scale) >> 8) & 0x00ff00ff)
+            | ((((c >> 8) & 0x00ff00ff) * scale) & 0xff00ff00);
+
+    if (channel->reverse) jj = jj == 0 ? channel->count - 1 : jj - 1;
+    else                  jj = jj == channel->count - 1 ? 0 : jj + 1;
+  }
+
+  pthread_mutex_lock( &rec->lock );
+  rec->times[slot] = (uint32_t) ((now - rec->start) / 1000000);
+  rec->head += 1;
+  pthread_cond_signal( &rec->cond );
+  pthread_mutex_unlock( &rec->lock );
+}
+
+/* ======================================================================= */
+/* call-seq:
+ *    stop_recording   #=> frame count or nil
+ *
+ * Stop recording, wait for the buffered frames to be written, and finish
+ * the animation file. A warning is given if any frames had to be dropped.
+ *
+ * Returns the number of frames recorded, or `nil` if these LEDs were not
+ * being recorded.
+ */
+static VALUE
+pp_leds_stop_recording( VALUE self )
+{
+  pp_recorder_t *rec = pp_leds_recorder( self );
+  long frames;
+
+  if (!rec) return Qnil;
+  rb_ivar_set( self, id_recorder, Qnil );
+
+  if (rec->running) {
+    rb_thread_call_without_gvl( pp_recorder_join, rec, NULL, NULL );
+  }
+  frames = rec->writer.frame_count;
+
+  if (pp_recorder_finish( rec ) < 0) {
+    rb_syserr_fail( errno, StringValueCStr(rec->path) );
+  }
+  if (rec->dropped) {
+    rb_warn( "%ld frames were dropped while recording %s", rec->dropped, StringValueCStr(rec->path) );
+  }
+
+  return LONG2NUM(frames);
+}
+
+/* Runs the block given to `record` and finishes the recording. The ensure step
+ * is then a noop; it only stops a recording the block raised out of.
+ */
+static VALUE
+pp_leds_record_yield( VALUE self )
+{
+  rb_yield( self );
+  return pp_leds_stop_recording( self );
+}
+
+/* call-seq:
+ *    record( path, options = {} )
+ *    record( path, options = {} ) { |leds| block }   #=> frame count
+ *
+ * Record every frame sent by `show` to the animation file at `path`, until
+ * `stop_recording` is called. When a block is given the recording is stopped
+ * when the block returns, and the number of frames recorded is returned.
+ * Each frame is stored as it was displayed - after compositing the layers and
+ * scaling by the brightness - along with the time it was shown. The file can
+ * be played back with `play` or read with PixelPi::Animation.
+ *
+ * Frames are handed to a background thread that writes them to disk, so
+ * recording does not slow down `show`. If the disk cannot keep up and the
+ * buffer fills, frames are dropped instead of delaying the LEDs.
+ *
+ * options - Hash of arguments
+ *   :buffer   - number of frames that can wait to be written; defaults to 64
+ *   :codec    - `:delta` to store only the changes between frames; see
+ *               PixelPi::Animation.write
+ *   :keyframe - keyframe interval of the `:delta` codec; defaults to 60
+ *
+ * Examples:
+ *    leds.record( "/var/log/show.pxa" )
+ *    run_show( leds )
+ *    leds.stop_recording
+ *
+ *    leds.record( "/var/log/show.pxa" ) { run_show( leds ) }
+ *
+ * A recording must be finished with `stop_recording` or the block form. One
+ * that is still running when the PixelPi::Leds is garbage collected is
+ * abandoned, and the file is left incomplete.
+ *
+ * Returns this PixelPi::Leds instance.
+ */
+static VALUE
+pp_leds_record( int argc, VALUE* argv, VALUE self )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  pp_recorder_t *rec;
+  VALUE path, opts, obj;
+  long slots = 64, keyframe;
+  int format, codec, err;
+
+  rb_scan_args( argc, argv, "11", &path, &opts );
+  FilePathValue( path );
+  path = rb_str_new_frozen( path );
+
+  if (!NIL_P(opts)) {
+    VALUE value;
+    Check_Type( opts, T_HASH );
+    value = rb_hash_lookup( opts, sym_buffer );
+    if (!NIL_P(value)) slots = NUM2LONG(value);
+    if (slots < 1) rb_raise( rb_eArgError, "buffer must hold at least one frame: %ld", slots );
+  }
+  pp_parse_anim_codec( opts, &codec, &keyframe );
+
+  if ((rec = pp_leds_recorder( self ))) {
+    rb_raise( ePixelPiError, "already recording to %s", StringValueCStr(rec->path) );
+  }
+
+  obj = Data_Make_Struct( 0, pp_recorder_t, pp_recorder_mark, pp_recorder_free, rec );
+  rec->path      = path;
+  rec->led_count = channel->count;
+  rec->slots     = slots;
+  rec->frames    = ALLOC_N( uint32_t, slots * rec->led_count + 1 );
+  rec->times     = ALLOC_N( uint32_t, slots );
+  pthread_mutex_init( &rec->lock, NULL );
+  pthread_cond_init( &rec->cond, NULL );
+
+  format = (channel->strip_type & SK6812_SHIFT_WMASK) ? PP_ANIM_RGBW : PP_ANIM_RGB;
+  if (pp_anim_writer_open( &rec->writer, StringValueCStr(path), format, codec, keyframe ) < 0) {
+    err = errno;
+    pp_anim_writer_abort( &rec->writer );
+    rb_syserr_fail( err, StringValueCStr(path) );
+  }
+
+  if ((err = pthread_create( &rec->thread, NULL, pp_recorder_thread, rec )) != 0) {
+    pp_anim_writer_abort( &rec->writer );
+    rb_syserr_fail( err, "could not start the recording thread" );
+  }
+  rec->running = 1;
+
+  rb_ivar_set( self, id_recorder, obj );
+
+  if (rb_block_given_p()) {
+    return rb_ensure( pp_leds_record_yield, self, pp_leds_stop_recording, self );
+  }
+  return self;
+}
+
+/* call-seq:
+ *    recording?
+ *
+ * Returns `true` if the frames sent by `show` are being recorded.
+ */
+static VALUE
+pp_leds_recording_p( VALUE self )
+{
+  return pp_leds_recorder( self ) ? Qtrue : Qfalse;
+}
+
+void Init_recorder( )
+{
+  id_recorder = rb_intern( "recorder" );  /* hidden from Ruby */
+  sym_buffer  = ID2SYM(rb_intern( "buffer" ));
+
+  rb_define_method( cLeds, "record",         pp_leds_record,         -1 );
+  rb_define_method( cLeds, "stop_recording", pp_leds_stop_recording,  0 );
+  rb_define_method( cLeds, "recording?",     pp_leds_recording_p,     0 );
+}
@@ -0,0 +1,781 @@
+#include "pixel_pi.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <ruby/thread.h>
+
+/* A PixelPi::FrameRing is a ring of frames in POSIX shared memory. One
+ * producer process writes frames into it and one consumer - usually the
+ * process driving the LEDs - takes the newest complete frame. Neither side
+ * ever blocks the other and a frame is never seen half written. Producers
+ * can be written in any language; this is the whole protocol.
+ *
+ * All values are native-endian. The shared memory object begins with a 64
+ * byte header:
+ *
+ *    offset  size  field
+ *         0     8  magic "PXPIRING"
+ *         8     2  version (1)
+ *        10     2  pixel format; 0 = rgb, 1 = rgbw
+ *        12     4  number of LEDs in each frame
+ *        16     4  number of slots
+ *        20     4  size of each slot in bytes
+ *        24     4  sequence number of the newest complete frame; 0 if none
+ *        28     4  number of consumers waiting on the futex at offset 24
+ *        32     4  sequence number of the last frame consumed
+ *        36    28  reserved, zero
+ *
+ * The slots follow the header. Each slot starts with a 4 byte slot sequence
+ * and 12 reserved bytes, followed by one 0xWWRRGGBB word per LED. Frames are
+ * numbered from 1 and frame `n` goes in slot `n % slots`.
+ *
+ * To write frame `n` the producer stores `2n - 1` to the slot sequence, then
+ * the colors, then `2n` to the slot sequence, and finally `n` as the newest
+ * frame. If any consumer is waiting it wakes them with FUTEX_WAKE on the
+ * newest frame word.
+ *
+ * To read, the consumer loads the newest frame number `n` and checks that the
+ * slot sequence is `2n`. It copies the colors and loads the slot sequence
+ * again; if it changed the producer lapped the ring during the copy and the
+ * consumer starts over with the newest frame.
+ */
+
+#define PP_RING_MAGIC        "PXPIRING"
+#define PP_RING_VERSION      1
+#define PP_RING_HEADER_SIZE  64
+#define PP_RING_SLOT_HEADER  16
+#define PP_RING_SLOTS        4
+
+/* Attempts to read a frame before giving up on a producer that keeps
+ * lapping the ring */
+#define PP_RING_RETRIES      64
+
+typedef struct {
+  char      magic[8];
+  uint16_t  version;
+  uint16_t  format;
+  uint32_t  led_count;
+  uint32_t  slots;
+  uint32_t  slot_size;
+  uint32_t  published;
+  uint32_t  waiters;
+  uint32_t  consumed;
+  uint8_t   reserved[28];
+} pp_ring_header_t;
+
+typedef struct {
+  pp_ring_header_t *header;     /* mapped ring, NULL once closed */
+  size_t            size;
+  VALUE             name;
+  uint32_t          last;       /* sequence number of the last frame taken */
+  uint32_t         *frame;      /* a frame is copied here before it is taken */
+  uint32_t          led_count;  /* geometry checked when the ring was mapped; */
+  uint32_t          slots;      /* the header is never trusted again since any */
+  uint32_t          slot_size;  /* process with the ring open can write to it */
+  uint32_t          format;
+} pp_ring_t;
+
+typedef struct {
+  pp_ring_t *ring;
+  int64_t    deadline;          /* CLOCK_MONOTONIC nanoseconds, 0 to wait forever */
+  int        result;            /* 1 if a new frame was published */
+} pp_ring_wait_t;
+
+VALUE cFrameRing;
+
+static VALUE sym_slots, sym_format;
+static const char *pp_ring_format_names[] = { "rgb", "rgbw" };
+
+/* ======================================================================= */
+
+static int64_t
+pp_ring_clock( void )
+{
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint8_t*
+pp_ring_slot( const pp_ring_t *ring, uint32_t n )
+{
+  return (uint8_t*) ring->header + PP_RING_HEADER_SIZE + (size_t) (n % ring->slots) * ring->slot_size;
+}
+
+static void
+pp_ring_unmap( pp_ring_t *ring )
+{
+  if (ring->header) munmap( ring->header, ring->size );
+  if (ring->frame)  xfree( ring->frame );
+  ring->header = NULL;
+  ring->frame  = NULL;
+}
+
+static void
+pp_ring_mark( void *ptr )
+{
+  pp_ring_t *ring = (pp_ring_t*) ptr;
+  rb_gc_mark( ring->name );
+}
+
+static void
+pp_ring_free( void *ptr )
+{
+  pp_ring_t *ring;
+  if (NULL == ptr) return;
+
+  ring = (pp_ring_t*) ptr;
+  pp_ring_unmap( ring );
+  xfree( ring );
+}
+
+static VALUE
+pp_ring_allocate( VALUE klass )
+{
+  pp_ring_t *ring;
+
+  ring = ALLOC_N( pp_ring_t, 1 );
+  if (!ring) {
+    rb_raise(rb_eNoMemError, "could not allocate PixelPi::FrameRing instance");
+  }
+
+  ring->header = NULL;
+  ring->size   = 0;
+  ring->name   = Qnil;
+  ring->last   = 0;
+  ring->frame  = NULL;
+  ring->led_count = ring->slots = ring->slot_size = ring->format = 0;
+
+  return Data_Wrap_Struct( klass, pp_ring_mark, pp_ring_free, ring );
+}
+
+/* Returns the ring struct; raises a PixelPi::Error if it has been closed */
+static pp_ring_t*
+pp_ring_struct( VALUE self )
+{
+  pp_ring_t *ring;
+
+  if (TYPE(self) != T_DATA
+  ||  RDATA(self)->dfree != (RUBY_DATA_FUNC) pp_ring_free) {
+    rb_raise( rb_eTypeError, "expecting a PixelPi::FrameRing object" );
+  }
+  Data_Get_Struct( self, pp_ring_t, ring );
+
+  if (!ring->header) {
+    rb_raise( ePixelPiError, "FrameRing is closed" );
+  }
+  return ring;
+}
+
+/* Shared memory names start with a slash; add one if it is missing */
+static VALUE
+pp_ring_name( VALUE name )
+{
+  StringValue( name );
+  if (RSTRING_LEN(name) == 0 || RSTRING_PTR(name)[0] != '/') {
+    name = rb_str_plus( rb_str_new_cstr( "/" ), name );
+  }
+  return rb_str_new_frozen( name );
+}
+
+/* Write a frame of `len` colors as the producer; LEDs past `len` are set to
+ * zero. Returns the sequence number of the frame.
+ */
+static uint32_t
+pp_ring_publish( pp_ring_t *ring, const uint32_t *colors, long len )
+{
+  pp_ring_header_t *header = ring->header;
+  uint32_t n = header->published + 1;
+  uint8_t *slot;
+  uint32_t *seq;
+
+  if (n == 0) n = 1;
+  slot = pp_ring_slot( ring, n );
+  seq  = (uint32_t*) slot;
+
+  __atomic_store_n( seq, n * 2 - 1, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+
+  memcpy( slot + PP_RING_SLOT_HEADER, colors, len * sizeof(uint32_t) );
+  if (len < ring->led_count) {
+    memset( slot + PP_RING_SLOT_HEADER + len * sizeof(uint32_t), 0, (ring->led_count - len) * sizeof(uint32_t) );
+  }
+
+  __atomic_store_n( seq, n * 2, __ATOMIC_RELEASE );
+  __atomic_store_n( &header->published, n, __ATOMIC_SEQ_CST );
+
+  if (__atomic_load_n( &header->waiters, __ATOMIC_SEQ_CST )) {
+    syscall( SYS_futex, &header->published, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+  }
+  return n;
+}
+
+/* Copy the newest frame into `leds` if it has not been taken yet. At most
+ * `count` colors are copied. The slot is read into the frame buffer of the
+ * ring first, and only a copy the producer did not write over during the read
+ * reaches `leds`.
+ *
+ * Returns the sequence number of the frame, or 0 if there is no new frame.
+ * When a producer laps the ring during every attempt 0 is returned as well,
+ * and `leds` is left as it was.
+ */
+static uint32_t
+pp_ring_take( pp_ring_t *ring, uint32_t *leds, long count )
+{
+  pp_ring_header_t *header = ring->header;
+  size_t size = MIN(count, (long) ring->led_count) * sizeof(uint32_t);
+  int tries;
+
+  if (!ring->frame) ring->frame = ALLOC_N( uint32_t, ring->led_count + 1 );
+
+  for (tries=0; tries<PP_RING_RETRIES; tries++) {
+    uint32_t n = __atomic_load_n( &header->published, __ATOMIC_ACQUIRE );
+    uint8_t *slot;
+    uint32_t s1, s2;
+
+    if (n == ring->last || n == 0) return 0;
+    slot = pp_ring_slot( ring, n );
+
+    s1 = __atomic_load_n( (uint32_t*) slot, __ATOMIC_ACQUIRE );
+    if (s1 != n * 2) continue;
+
+    memcpy( ring->frame, slot + PP_RING_SLOT_HEADER, size );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+    s2 = __atomic_load_n( (uint32_t*) slot, __ATOMIC_RELAXED );
+    if (s2 == s1) {
+      memcpy( leds, ring->frame, size );
+      ring->last = n;
+      __atomic_store_n( &header->consumed, n, __ATOMIC_RELEASE );
+      return n;
+    }
+  }
+  return 0;
+}
+
+/* Sleep on the futex until a frame newer than the last one taken is
+ * published or the deadline passes.
+ */
+static void*
+pp_ring_wait( void *ptr )
+{
+  pp_ring_wait_t *wait = (pp_ring_wait_t*) ptr;
+  pp_ring_header_t *header = wait->ring->header;
+  uint32_t last = wait->ring->last;
+
+  __atomic_add_fetch( &header->waiters, 1, __ATOMIC_SEQ_CST );
+  for (;;) {
+    struct timespec ts, *tsp = NULL;
+
+    if (__atomic_load_n( &header->published, __ATOMIC_SEQ_CST ) != last) {
+      wait->result = 1;
+      break;
+    }
+    if (wait->deadline) {
+      int64_t left = wait->deadline - pp_ring_clock();
+      if (left <= 0) break;
+      ts.tv_sec  = left / 1000000000;
+      ts.tv_nsec = left % 1000000000;
+      tsp = &ts;
+    }
+    if (syscall( SYS_futex, &header->published, FUTEX_WAIT, last, tsp, NULL, 0 ) < 0 && errno == EINTR) break;
+  }
+  __atomic_sub_fetch( &header->waiters, 1, __ATOMIC_SEQ_CST );
+
+  return NULL;
+}
+
+/* Wait up to `timeout` seconds for a new frame, releasing the GVL. A `nil`
+ * timeout waits forever. Returns 1 if there is a new frame.
+ */
+static int
+pp_ring_wait_for( VALUE self, VALUE timeout )
+{
+  pp_ring_t *ring = pp_ring_struct( self );
+  pp_ring_wait_t wait;
+  double secs = 0.0;
+
+  if (!NIL_P(timeout)) {
+    secs = NUM2DBL(timeout);
+    if (secs < 0.0) rb_raise( rb_eArgError, "timeout cannot be negative: %g", secs );
+  }
+  if (__atomic_load_n( &ring->header->published, __ATOMIC_ACQUIRE ) != ring->last) return 1;
+  if (!NIL_P(timeout) && secs == 0.0) return 0;
+
+  wait.ring     = ring;
+  wait.deadline = NIL_P(timeout) ? 0 : pp_ring_clock() + (int64_t) (secs * 1e9);
+  wait.result   = 0;
+
+  for (;;) {
+    rb_thread_call_without_gvl( pp_ring_wait, &wait, RUBY_UBF_IO, NULL );
+    if (wait.result) return 1;
+    if (wait.deadline && pp_ring_clock() >= wait.deadline) return 0;
+
+    /* interrupted; run any pending interrupts and then keep waiting */
+    rb_thread_check_ints();
+    ring = pp_ring_struct( self );
+  }
+}
+
+/* Check the header of a mapped ring and keep its geometry. Each field is read
+ * once, so what is checked is what gets used.
+ */
+static void
+pp_ring_check( pp_ring_t *ring )
+{
+  const pp_ring_header_t *header = ring->header;
+  const char *name = StringValueCStr(ring->name);
+  uint32_t version, format, led_count, slots, slot_size;
+  uint64_t size;
+
+  if (ring->size < PP_RING_HEADER_SIZE || memcmp( header->magic, PP_RING_MAGIC, 8 ) != 0) {
+    rb_raise( ePixelPiError, "not a PixelPi frame ring: %s", name );
+  }
+  version   = __atomic_load_n( &header->version,   __ATOMIC_RELAXED );
+  format    = __atomic_load_n( &header->format,    __ATOMIC_RELAXED );
+  led_count = __atomic_load_n( &header->led_count, __ATOMIC_RELAXED );
+  slots     = __atomic_load_n( &header->slots,     __ATOMIC_RELAXED );
+  slot_size = __atomic_load_n( &header->slot_size, __ATOMIC_RELAXED );
+
+  if (version != PP_RING_VERSION) {
+    rb_raise( ePixelPiError, "unsupported frame ring version: %d", version );
+  }
+  if (format > PP_ANIM_RGBW) {
+    rb_raise( ePixelPiError, "unsupported pixel format: %d", format );
+  }
+
+  size = (uint64_t) slots * slot_size + PP_RING_HEADER_SIZE;
+  if (slots < 2 || slot_size < PP_RING_SLOT_HEADER + (uint64_t) led_count * 4 ||
+      slot_size % 4 || size > ring->size) {
+    rb_raise( ePixelPiError, "frame ring is truncated: %s", name );
+  }
+
+  ring->format    = format;
+  ring->led_count = led_count;
+  ring->slots     = slots;
+  ring->slot_size = slot_size;
+}
+
+/* Map the shared memory object `fd` into the ring; the descriptor is closed */
+static void
+pp_ring_map( pp_ring_t *ring, int fd, size_t size )
+{
+  void *map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  int err = errno;
+
+  close( fd );
+  if (map == MAP_FAILED) rb_syserr_fail( err, StringValueCStr(ring->name) );
+
+  ring->header = (pp_ring_header_t*) map;
+  ring->size   = size;
+}
+
+static VALUE
+pp_ring_close( VALUE self );
+
+/* ======================================================================= */
+/* call-seq:
+ *    PixelPi::FrameRing.create( name, led_count, options = {} )
+ *
+ * Create the shared memory frame ring `name` holding frames of `led_count`
+ * LEDs, replacing any ring of the same name. Processes that have the old ring
+ * open keep using it; they see the new one once they open the name again.
+ * The ring lives in `/dev/shm` until it is removed with
+ * PixelPi::FrameRing.unlink. With a block the ring
+ * is passed to the block and closed when the block returns.
+ *
+ * options - Hash of arguments
+ *   :slots  - number of frames in the ring; defaults to 4. More slots give a
+ *             slow consumer more time to copy a frame before the producer
+ *             comes around again.
+ *   :format - `:rgb` (default) or `:rgbw`; tells producers whether the white
+ *             byte of each color is used
+ *
+ * Examples:
+ *    ring = PixelPi::FrameRing.create( "effects", leds.length )
+ *
+ * Returns the new PixelPi::FrameRing or the result of the block.
+ */
+static VALUE
+pp_ring_s_create( int argc, VALUE* argv, VALUE klass )
+{
+  VALUE self = pp_ring_allocate( klass );
+  VALUE name, led_count, opts;
+  pp_ring_header_t *header;
+  pp_ring_t *ring;
+  long count, slots = PP_RING_SLOTS;
+  uint64_t slot_size, size;
+  int format = PP_ANIM_RGB, fd;
+
+  rb_scan_args( argc, argv, "21", &name, &led_count, &opts );
+  Data_Get_Struct( self, pp_ring_t, ring );
+  ring->name = pp_ring_name( name );
+
+  count = NUM2LONG(led_count);
+  if (count < 0) rb_raise( rb_eArgError, "LED count cannot be negative: %ld", count );
+
+  if (!NIL_P(opts)) {
+    VALUE value;
+    Check_Type( opts, T_HASH );
+    format = pp_parse_anim_format( rb_hash_lookup( opts, sym_format ) );
+    value = rb_hash_lookup( opts, sym_slots );
+    if (!NIL_P(value)) slots = NUM2LONG(value);
+  }
+  if (slots < 2 || slots > 1024) {
+    rb_raise( rb_eArgError, "slots must be between 2 and 1024: %ld", slots );
+  }
+
+  slot_size = (PP_RING_SLOT_HEADER + (uint64_t) count * 4 + 63) & ~(uint64_t) 63;
+  size = PP_RING_HEADER_SIZE + slot_size * slots;
+  if (slot_size > UINT32_MAX || size > SIZE_MAX / 2) {
+    rb_raise( rb_eArgError, "frame ring is too large: %ld LEDs", count );
+  }
+
+  /* a new object, so consumers of the old ring keep their own mapping */
+  if (shm_unlink( StringValueCStr(ring->name) ) < 0 && errno != ENOENT) {
+    rb_sys_fail( StringValueCStr(ring->name) );
+  }
+  fd = shm_open( StringValueCStr(ring->name), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666 );
+  if (fd < 0) rb_sys_fail( StringValueCStr(ring->name) );
+  if (ftruncate( fd, size ) < 0) {
+    int err = errno;
+    close( fd );
+    rb_syserr_fail( err, StringValueCStr(ring->name) );
+  }
+  pp_ring_map( ring, fd, size );
+
+  /* the magic goes in last so an opener never sees a partial header */
+  header = ring->header;
+  memset( header, 0, size );
+  header->version   = PP_RING_VERSION;
+  header->format    = format;
+  header->led_count = (uint32_t) count;
+  header->slots     = (uint32_t) slots;
+  header->slot_size = (uint32_t) slot_size;
+  ring->format      = format;
+  ring->led_count   = (uint32_t) count;
+  ring->slots       = (uint32_t) slots;
+  ring->slot_size   = (uint32_t) slot_size;
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  memcpy( header->magic, PP_RING_MAGIC, 8 );
+
+  if (rb_block_given_p()) {
+    return rb_ensure( rb_yield, self, pp_ring_close, self );
+  }
+  return self;
+}
+
+/* call-seq:
+ *    PixelPi::FrameRing.open( name )                  #=> ring
+ *    PixelPi::FrameRing.open( name ) { |ring| block } #=> result of block
+ *
+ * Attach to the existing shared memory frame ring `name`. With a block the
+ * ring is passed to the block and closed when the block returns.
+ *
+ * Examples:
+ *    PixelPi::FrameRing.open( "effects" ) do |ring|
+ *      loop { leds.show_ring( ring ) }
+ *    end
+ *
+ * Returns the PixelPi::FrameRing or the result of the block.
+ */
+static VALUE
+pp_ring_s_open( VALUE klass, VALUE name )
+{
+  VALUE self = pp_ring_allocate( klass );
+  pp_ring_t *ring;
+  struct stat st;
+  int fd;
+
+  Data_Get_Struct( self, pp_ring_t, ring );
+  ring->name = pp_ring_name( name );
+
+  fd = shm_open( StringValueCStr(ring->name), O_RDWR | O_CLOEXEC, 0 );
+  if (fd < 0) rb_sys_fail( StringValueCStr(ring->name) );
+
+  if (fstat( fd, &st ) < 0) {
+    int err = errno;
+    close( fd );
+    rb_syserr_fail( err, StringValueCStr(ring->name) );
+  }
+  if (st.st_size < PP_RING_HEADER_SIZE) {
+    close( fd );
+    rb_raise( ePixelPiError, "not a PixelPi frame ring: %s", StringValueCStr(ring->name) );
+  }
+  pp_ring_map( ring, fd, st.st_size );
+
+  /* an invalid ring is unmapped when the instance is garbage collected */
+  pp_ring_check( ring );
+
+  /* frames written before the consumer attached are still new to it */
+  ring->last = __atomic_load_n( &ring->header->consumed, __ATOMIC_ACQUIRE );
+
+  if (rb_block_given_p()) {
+    return rb_ensure( rb_yield, self, pp_ring_close, self );
+  }
+  return self;
+}
+
+/* call-seq:
+ *    PixelPi::FrameRing.unlink( name )
+ *
+ * Remove the shared memory frame ring `name`. Processes that have it open
+ * keep using it until they close it.
+ *
+ * Returns `nil`.
+ */
+static VALUE
+pp_ring_s_unlink( VALUE klass, VALUE name )
+{
+  name = pp_ring_name( name );
+  if (shm_unlink( StringValueCStr(name) ) < 0) rb_sys_fail( StringValueCStr(name) );
+  return Qnil;
+}
+
+/* call-seq:
+ *    write( frame )   #=> sequence number
+ *
+ * Write a frame into the ring as its producer. The `frame` is an Array of
+ * colors or a packed String of 32-bit colors (`ary.pack("L*")`); LEDs past
+ * the end of a short frame are set to zero. Only one process may write to a
+ * ring.
+ *
+ * Returns the sequence number of the frame.
+ */
+static VALUE
+pp_ring_write( VALUE self, VALUE frame )
+{
+  pp_ring_t *ring = pp_ring_struct( self );
+  const uint32_t *colors;
+  uint32_t n;
+  VALUE store;
+  long len;
+
+  colors = pp_uint32_list( frame, &len, &store );
+  if (len > (long) ring->led_count) {
+    if (store) rb_free_tmp_buffer( &store );
+    rb_raise( rb_eArgError, "frame has %ld LEDs but the ring holds %ld", len, (long) ring->led_count );
+  }
+
+  n = pp_ring_publish( ring, colors, len );
+  if (store) rb_free_tmp_buffer( &store );
+
+  return ULONG2NUM(n);
+}
+
+/* call-seq:
+ *    read   #=> Array or nil
+ *
+ * Take the newest frame from the ring as its consumer. Frames published
+ * before it are skipped.
+ *
+ * Returns the colors of the frame as an Array, or `nil` if no frame has been
+ * published since the last one taken.
+ */
+static VALUE
+pp_ring_read( VALUE self )
+{
+  pp_ring_t *ring = pp_ring_struct( self );
+  long ii, count = ring->led_count;
+  uint32_t *colors;
+  VALUE ary = Qnil, store = 0;
+
+  colors = ALLOCV_N( uint32_t, store, count + 1 );
+  if (pp_ring_take( ring, colors, count )) {
+    ary = rb_ary_new2( count );
+    for (ii=0; ii<count; ii++) {
+      rb_ary_store( ary, ii, UINT2NUM(colors[ii]) );
+    }
+  }
+  ALLOCV_END( store );
+
+  return ary;
+}
+
+/* call-seq:
+ *    wait( timeout = nil )   #=> true or false
+ *
+ * Wait up to `timeout` seconds for a frame newer than the last one taken.
+ * With a `nil` timeout this waits until a frame is published. Other Ruby
+ * threads run while waiting.
+ *
+ * Returns `true` if a new frame is ready.
+ */
+static VALUE
+pp_ring_wait_m( int argc, VALUE* argv, VALUE self )
+{
+  VALUE timeout;
+
+  rb_scan_args( argc, argv, "01", &timeout );
+  return pp_ring_wait_for( self, timeout ) ? Qtrue : Qfalse;
+}
+
+/* call-seq:
+ *    sequence
+ *
+ * Returns the sequence number of the newest frame, or 0 if no frame has been
+ * written.
+ */
+static VALUE
+pp_ring_sequence( VALUE self )
+{
+  pp_ring_t *ring = pp_ring_struct( self );
+  return ULONG2NUM(__atomic_load_n( &ring->header->published, __ATOMIC_ACQUIRE ));
+}
+
+/* call-seq:
+ *    consumed
+ *
+ * Returns the sequence number of the last frame the consumer took. Frames
+ * between it and `sequence` were skipped or are still waiting.
+ */
+static VALUE
+pp_ring_consumed( VALUE self )
+{
+  pp_ring_t *ring = pp_ring_struct( self );
+  return ULONG2NUM(__atomic_load_n( &ring->header->consumed, __ATOMIC_ACQUIRE ));
+}
+
+/* call-seq:
+ *    led_count
+ *
+ * Returns the number of LEDs in each frame.
+ */
+static VALUE
+pp_ring_led_count( VALUE self )
+{
+  return ULONG2NUM(pp_ring_struct( self )->led_count);
+}
+
+/* call-seq:
+ *    slots
+ *
+ * Returns the number of frames the ring holds.
+ */
+static VALUE
+pp_ring_slots( VALUE self )
+{
+  return ULONG2NUM(pp_ring_struct( self )->slots);
+}
+
+/* call-seq:
+ *    format
+ *
+ * Returns the pixel format of the frames, `:rgb` or `:rgbw`.
+ */
+static VALUE
+pp_ring_format( VALUE self )
+{
+  return ID2SYM(rb_intern( pp_ring_format_names[pp_ring_struct( self )->format] ));
+}
+
+/* call-seq:
+ *    name
+ *
+ * Returns the name of the shared memory object.
+ */
+static VALUE
+pp_ring_name_m( VALUE self )
+{
+  return pp_ring_struct( self )->name;
+}
+
+/* call-seq:
+ *    close
+ *
+ * Unmap the ring. The shared memory object itself is left in place.
+ *
+ * Returns `nil`.
+ */
+static VALUE
+pp_ring_close( VALUE self )
+{
+  pp_ring_t *ring;
+
+  Data_Get_Struct( self, pp_ring_t, ring );
+  pp_ring_unmap( ring );
+  return Qnil;
+}
+
+/* call-seq:
+ *    closed?
+ *
+ * Returns `true` if the ring has been closed.
+ */
+static VALUE
+pp_ring_closed_p( VALUE self )
+{
+  pp_ring_t *ring;
+
+  Data_Get_Struct( self, pp_ring_t, ring );
+  return ring->header ? Qfalse : Qtrue;
+}
+
+/* call-seq:
+ *    show_ring( ring, timeout = nil )   #=> sequence number or nil
+ *
+ * Wait up to `timeout` seconds for a new frame in the PixelPi::FrameRing,
+ * copy the newest frame straight into the LED buffer, and show it. Frames
+ * the producer wrote in the meantime are skipped, so the LEDs always show
+ * the latest complete frame. With a `nil` timeout this waits until a frame
+ * is published; a timeout of 0 never waits.
+ *
+ * Examples:
+ *    ring = PixelPi::FrameRing.open( "effects" )
+ *    loop { leds.show_ring( ring ) }
+ *
+ * Returns the sequence number of the frame shown, or `nil` if there was no
+ * new frame.
+ */
+static VALUE
+pp_leds_show_ring( int argc, VALUE* argv, VALUE self )
+{
+  VALUE obj, timeout;
+  ws2811_led_t *leds;
+  long count;
+  uint32_t n;
+
+  rb_scan_args( argc, argv, "11", &obj, &timeout );
+  pp_leds_struct( self );
+
+  if (!pp_ring_wait_for( obj, timeout )) return Qnil;
+
+  leds = pp_leds_buffer( self, &count );
+  n = pp_ring_take( pp_ring_struct( obj ), leds, count );
+  if (!n) return Qnil;
+
+  pp_leds_show( self );
+  return ULONG2NUM(n);
+}
+
+void Init_ring( )
+{
+  sym_slots  = ID2SYM(rb_intern( "slots" ));
+  sym_format = ID2SYM(rb_intern( "format" ));
+
+  cFrameRing = rb_define_class_under( mPixelPi, "FrameRing", rb_cObject );
+  rb_undef_alloc_func( cFrameRing );
+  rb_define_singleton_method( cFrameRing, "create", pp_ring_s_create, -1 );
+  rb_define_singleton_method( cFrameRing, "open",   pp_ring_s_open,    1 );
+  rb_define_singleton_method( cFrameRing, "unlink", pp_ring_s_unlink,  1 );
+
+  rb_define_method( cFrameRing, "write",     pp_ring_write,      1 );
+  rb_define_method( cFrameRing, "read",      pp_ring_read,       0 );
+  rb_define_method( cFrameRing, "wait",      pp_ring_wait_m,    -1 );
+  rb_define_method( cFrameRing, "sequence",  pp_ring_sequence,   0 );
+  rb_define_method( cFrameRing, "consumed",  pp_ring_consumed,   0 );
+  rb_define_method( cFrameRing, "led_count", pp_ring_led_count,  0 );
+  rb_define_method( cFrameRing, "slots",     pp_ring_slots,      0 );
+  rb_define_method( cFrameRing, "format",    pp_ring_format,     0 );
+  rb_define_method( cFrameRing, "name",      pp_ring_name_m,     0 );
+  rb_define_method( cFrameRing, "close",     pp_ring_close,      0 );
+  rb_define_method( cFrameRing, "closed?",   pp_ring_closed_p,   0 );
+
+  rb_define_method( cLeds, "show_ring", pp_leds_show_ring, -1 );
+}
@@ -0,0 +1,176 @@
+#include "pixel_pi.h"
+
+/* Segments are runs of LEDs on the strip that need their own color order,
+ * brightness, gamma, or white balance -- a chain mixing two kinds of pixels, or
+ * a diffused run that should be dimmer than the rest. The settings are kept in
+ * @segments as they were given. The driver's segment descriptors are rebuilt
+ * from them whenever the segments change or the gamma and white balance of the
+ * Leds change, since a segment without its own falls back to those.
+ *
+ * The driver encodes each segment as one run with its own tables, so nothing
+ * is decided per LED when the frame is sent.
+ */
+static ID id_segments, id_gamma, id_white_balance;
+static VALUE sym_start, sym_length, sym_strip_type, sym_brightness, sym_gamma, sym_white_balance;
+
+/* ======================================================================= */
+
+/* Fill the driver descriptors of the first channel from @segments. */
+void
+pp_leds_update_segments( VALUE self, ws2811_t *ledstring )
+{
+  ws2811_channel_t *channel = &ledstring->channel[0];
+  VALUE list = rb_ivar_get( self, id_segments );
+  VALUE gamma, wb, seg_wb, tmp;
+  long ii, len = NIL_P(list) ? 0 : RARRAY_LEN(list);
+
+  if (len == 0) {
+    channel->segment_count = 0;
+    xfree( channel->segments );
+    channel->segments = NULL;
+    return;
+  }
+
+  gamma = rb_ivar_get( self, id_gamma );
+  wb    = rb_ivar_get( self, id_white_balance );
+
+  channel->segment_count = 0;
+  REALLOC_N( channel->segments, ws2811_segment_t, len );
+
+  for (ii=0; ii<len; ii++) {
+    VALUE hash = rb_ary_entry( list, ii );
+    ws2811_segment_t *segment = &channel->segments[ii];
+
+    segment->start = NUM2INT( rb_hash_lookup( hash, sym_start ) );
+    segment->count = NUM2INT( rb_hash_lookup( hash, sym_length ) );
+
+    tmp = rb_hash_lookup( hash, sym_strip_type );
+    segment->strip_type = NIL_P(tmp) ? 0 : pp_parse_strip_type( tmp );
+
+    tmp = rb_hash_lookup( hash, sym_brightness );
+    segment->brightness = NIL_P(tmp) ? -1 : (int) (NUM2UINT(tmp) & 0xff);
+
+    tmp = rb_hash_lookup( hash, sym_gamma );
+    seg_wb = rb_hash_lookup( hash, sym_white_balance );
+    pp_build_correction( segment->correction, NIL_P(tmp) ? gamma : tmp, NIL_P(seg_wb) ? wb : seg_wb );
+  }
+
+  channel->segment_count = (int) len;
+}
+
+/* call-seq:
+ *    segments = [ { start: 0, length: 30, strip_type: :rgb, brightness: 64 }, ... ]
+ *
+ * Give runs of LEDs their own settings. Each segment is a Hash with the index
+ * of its first LED in `:start` and its number of LEDs in `:length`; the
+ * remaining keys are optional and default to the settings of the Leds:
+ *
+ *   :strip_type    - order the colors of the segment are sent in; it must have
+ *                    as many colors as the strip type of the Leds
+ *   :brightness    - brightness of the segment from 0 to 255
+ *   :gamma         - gamma correction of the segment, as for `new`
+ *   :white_balance - white balance of the segment, as for `new`
+ *
+ * Segments must be given in order along the strip and must not overlap. LEDs
+ * outside of every segment use the settings of the Leds. Pass `nil` or an
+ * empty Array to remove the segments.
+ *
+ * Segments are applied when the frame is encoded for the strip; the network
+ * output of Leds created with `:output` sends the colors as they are.
+ */
+static VALUE
+pp_leds_segments_set( VALUE self, VALUE ary )
+{
+  ws2811_t *ledstring = pp_leds_struct( self );
+  VALUE list, hash, tmp;
+  double gamma[3];
+  int wb[3], colors;
+  long ii, len, count, start, length, end = 0;
+
+  pp_leds_buffer( self, &count );
+  colors = (ledstring->channel[0].strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+
+  if (NIL_P(ary)) ary = rb_ary_new();
+  Check_Type( ary, T_ARRAY );
+  len  = RARRAY_LEN(ary);
+  list = rb_ary_new2( len );
+
+  for (ii=0; ii<len; ii++) {
+    hash = rb_ary_entry( ary, ii );
+    Check_Type( hash, T_HASH );
+
+    tmp = rb_hash_lookup( hash, sym_start );
+    if (NIL_P(tmp)) rb_raise( rb_eArgError, "segment %ld has no start", ii );
+    start = NUM2LONG(tmp);
+
+    tmp = rb_hash_lookup( hash, sym_length );
+    if (NIL_P(tmp)) rb_raise( rb_eArgError, "segment %ld has no length", ii );
+    length = NUM2LONG(tmp);
+
+    if (length < 1) {
+      rb_raise( rb_eArgError, "segment length must be at least 1: %ld", length );
+    }
+    if (start < 0 || start >= count || length > count - start) {
+      rb_raise( rb_eArgError, "segment %ld...%ld is outside of LED range: 0...%ld", start, start+length, count-1 );
+    }
+    if (start < end) {
+      rb_raise( rb_eArgError, "segments overlap at LED %ld", start );
+    }
+    end = start + length;
+
+    tmp = rb_hash_lookup( hash, sym_strip_type );
+    if (!NIL_P(tmp)) {
+      int strip_type = pp_parse_strip_type( tmp );
+      if (((strip_type & SK6812_SHIFT_WMASK) ? 4 : 3) != colors) {
+        rb_raise( rb_eArgError, "segment strip type must have %d colors: %s", colors, rb_id2name( SYM2ID(tmp) ) );
+      }
+    }
+
+    tmp = rb_hash_lookup( hash, sym_brightness );
+    if (!NIL_P(tmp)) NUM2UINT(tmp);
+
+    tmp = rb_hash_lookup( hash, sym_gamma );
+    if (!NIL_P(tmp)) pp_parse_gamma( tmp, gamma );
+
+    tmp = rb_hash_lookup( hash, sym_white_balance );
+    if (!NIL_P(tmp)) pp_parse_white_balance( tmp, wb );
+
+    rb_ary_push( list, rb_obj_freeze( rb_hash_dup( hash ) ) );
+  }
+
+  rb_ivar_set( self, id_segments, len ? rb_obj_freeze( list ) : Qnil );
+  pp_leds_update_segments( self, ledstring );
+
+  if (ledstring->device) ws2811_correction_changed( ledstring );
+  return ary;
+}
+
+/* call-seq:
+ *    segments    #=> Array
+ *
+ * Returns the segments given to `segments=`, or an empty Array.
+ */
+static VALUE
+pp_leds_segments_get( VALUE self )
+{
+  VALUE list = rb_ivar_get( self, id_segments );
+  return NIL_P(list) ? rb_ary_new() : list;
+}
+
+/* ======================================================================= */
+
+void Init_segment( )
+{
+  id_segments       = rb_intern( "@segments" );
+  id_gamma          = rb_intern( "@gamma" );
+  id_white_balance  = rb_intern( "@white_balance" );
+  sym_start         = ID2SYM(rb_intern( "start" ));
+  sym_length        = ID2SYM(rb_intern( "length" ));
+  sym_strip_type    = ID2SYM(rb_intern( "strip_type" ));
+  sym_brightness    = ID2SYM(rb_intern( "brightness" ));
+  sym_gamma         = ID2SYM(rb_intern( "gamma" ));
+  sym_white_balance = ID2SYM(rb_intern( "white_balance" ));
+
+  rb_define_method( cLeds, "segments=", pp_leds_segments_set, 1 );
+  rb_define_method( cLeds, "segments",  pp_leds_segments_get, 0 );
+}
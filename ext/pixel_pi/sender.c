@@ -0,0 +1,403 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1   /* sendmmsg */
+#endif
+#include "pixel_pi.h"
+#include <errno.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <ruby/thread.h>
+#include <ruby/util.h>
+
+/* The network output sends the frames of a PixelPi::Leds to a
+ * PixelPi::Receiver on another machine using the `:pixel_pi` protocol, so a
+ * desktop or server can render the effects while a Pi only drives the strip.
+ *
+ * A frame is cut into chunks of PP_NET_CHUNK LEDs and each chunk goes out as
+ * one packet, coded with the delta codec against the last copy of the chunk
+ * that was sent. Chunks that have not changed are not sent at all. Every
+ * packet has a 24 byte header, all numbers big-endian:
+ *
+ *   0  "PX"
+ *   2  version (1)
+ *   3  flags - PP_NET_KEY: the chunk is coded against zeros rather than an
+ *              earlier frame; PP_NET_SHOW: last packet of the frame;
+ *              PP_NET_RGBW: four bytes per LED instead of three
+ *   4  frame sequence number, counting from 1 and skipping 0 when it wraps
+ *   8  sequence number of the frame the chunk is coded against
+ *  12  index of the first LED of the chunk
+ *  16  number of LEDs in the chunk
+ *  18  length of the coded data that follows the header
+ *  20  brightness
+ *  21  reserved
+ *
+ * The receiver applies a delta only to a chunk that holds the frame it was
+ * coded against, so a lost UDP packet leaves that chunk as it was until it is
+ * sent as a keyframe again. Every chunk is sent as a keyframe once every
+ * `refresh` frames; the refreshes are staggered so no single frame sends them
+ * all. A frame where nothing changed is sent as a packet with no chunk so the
+ * receiver still shows it.
+ *
+ * Over TCP the same packets are written to the stream back to back. A TCP
+ * sender that loses its connection reconnects on the next `show` and sends
+ * every chunk as a keyframe.
+ */
+
+#define PP_NET_REFRESH    60        /* default frames between keyframes of a chunk */
+#define PP_NET_SNDBUF     (1 << 20) /* socket send buffer asked for */
+#define PP_NET_TIMEOUT    2         /* seconds before a stalled send fails */
+#define PP_NET_BATCH      64        /* packets sent with one sendmmsg call */
+
+typedef struct {
+  pp_output_t               output;
+  int                       fd;         /* -1 while a TCP sender is disconnected */
+  int                       type;       /* SOCK_DGRAM or SOCK_STREAM */
+  int                       closed;
+  char                     *url;        /* named in errors */
+  struct sockaddr_storage   addr;
+  socklen_t                 addrlen;
+  long                      refresh;    /* frames between keyframes of a chunk */
+  long                      count;      /* LEDs in a frame */
+  int                       bpp;        /* bytes per LED */
+  long                      chunks;
+  int                       resync;     /* send every chunk as a keyframe */
+  uint32_t                  sequence;   /* of the last frame sent */
+  uint32_t                 *base;       /* frame each chunk was last sent in */
+  uint8_t                  *frame;      /* the frame being sent, as bytes */
+  uint8_t                  *prev;       /* the frame as the receiver has it */
+  uint8_t                  *packets;    /* room for one packet per chunk */
+  size_t                   *sizes;      /* size of each packet of the frame */
+  long                      packet_size;
+} pp_sender_t;
+
+/* The packets of one frame on their way out */
+typedef struct {
+  pp_sender_t  *tx;
+  long          n;
+  int           error;
+} pp_sender_io_t;
+
+static inline void
+pp_put_be16( uint8_t *p, uint16_t v )
+{
+  p[0] = v >> 8; p[1] = v;
+}
+
+static inline void
+pp_put_be32( uint8_t *p, uint32_t v )
+{
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void
+pp_sender_close( pp_output_t *output )
+{
+  pp_sender_t *tx = (pp_sender_t*) output;
+
+  if (tx->fd >= 0) close( tx->fd );
+  tx->fd     = -1;
+  tx->closed = 1;
+}
+
+static void
+pp_sender_free( pp_output_t *output )
+{
+  pp_sender_t *tx = (pp_sender_t*) output;
+
+  pp_sender_close( &tx->output );
+  if (tx->base)    xfree( tx->base );
+  if (tx->frame)   xfree( tx->frame );
+  if (tx->prev)    xfree( tx->prev );
+  if (tx->packets) xfree( tx->packets );
+  if (tx->sizes)   xfree( tx->sizes );
+  if (tx->url)     xfree( tx->url );
+  xfree( tx );
+}
+
+/* Open the socket of the sender, and connect it for TCP. Returns 0 or a
+ * negated errno value. */
+static int
+pp_sender_connect( pp_sender_t *tx )
+{
+  struct timeval tv;
+  int size = PP_NET_SNDBUF, one = 1, fd;
+
+  fd = socket( tx->addr.ss_family, tx->type | SOCK_CLOEXEC, 0 );
+  if (fd < 0) return -errno;
+
+  /* a receiver that stops reading makes `show` fail instead of hang */
+  tv.tv_sec  = PP_NET_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+  setsockopt( fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+
+  if (tx->type == SOCK_STREAM) {
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+    if (connect( fd, (struct sockaddr*) &tx->addr, tx->addrlen ) < 0) {
+      int err = errno;
+      close( fd );
+      return -(err == EINPROGRESS ? ETIMEDOUT : err);
+    }
+  }
+
+  tx->fd     = fd;
+  tx->resync = 1;
+  return 0;
+}
+
+static void*
+pp_sender_connect_io( void *ptr )
+{
+  pp_sender_io_t *io = (pp_sender_io_t*) ptr;
+  io->error = -pp_sender_connect( io->tx );
+  return NULL;
+}
+
+/* Send the `n` packets of a frame. UDP packets are sent in batches with
+ * sendmmsg and are not connected, so a receiver that is not running does not
+ * turn into errors here; TCP writes them to the stream.
+ */
+static void*
+pp_sender_send( void *ptr )
+{
+  pp_sender_io_t *io = (pp_sender_io_t*) ptr;
+  pp_sender_t *tx = io->tx;
+  long ii, sent = 0;
+
+  io->error = 0;
+
+  if (tx->type == SOCK_DGRAM) {
+    struct mmsghdr msgs[PP_NET_BATCH];
+    struct iovec iov[PP_NET_BATCH];
+
+    while (sent < io->n) {
+      long batch = MIN(io->n - sent, PP_NET_BATCH);
+      int rc;
+
+      for (ii=0; ii<batch; ii++) {
+        iov[ii].iov_base = tx->packets + (sent + ii) * tx->packet_size;
+        iov[ii].iov_len  = tx->sizes[sent + ii];
+        memset( &msgs[ii], 0, sizeof(msgs[ii]) );
+        msgs[ii].msg_hdr.msg_name    = &tx->addr;
+        msgs[ii].msg_hdr.msg_namelen = tx->addrlen;
+        msgs[ii].msg_hdr.msg_iov     = &iov[ii];
+        msgs[ii].msg_hdr.msg_iovlen  = 1;
+      }
+      rc = sendmmsg( tx->fd, msgs, (unsigned int) batch, 0 );
+      if (rc < 0) {
+        if (errno == EINTR) continue;
+        io->error = errno;
+        return NULL;
+      }
+      sent += rc;
+    }
+    return NULL;
+  }
+
+  for (ii=0; ii<io->n; ii++) {
+    const uint8_t *p = tx->packets + ii * tx->packet_size;
+    size_t left = tx->sizes[ii];
+
+    while (left > 0) {
+      ssize_t rc = send( tx->fd, p, left, MSG_NOSIGNAL );
+      if (rc < 0) {
+        if (errno == EINTR) continue;
+        io->error = errno;
+        return NULL;
+      }
+      p += rc;
+      left -= rc;
+    }
+  }
+  return NULL;
+}
+
+/* Write the header of a packet and return its total size */
+static size_t
+pp_sender_header( pp_sender_t *tx, uint8_t *p, int flags, uint32_t base,
+                  long first, long count, long size, int brightness )
+{
+  p[0] = 'P';
+  p[1] = 'X';
+  p[2] = PP_NET_VERSION;
+  p[3] = (uint8_t) (flags | (tx->bpp == 4 ? PP_NET_RGBW : 0));
+  pp_put_be32( p + 4, tx->sequence );
+  pp_put_be32( p + 8, base );
+  pp_put_be32( p + 12, (uint32_t) first );
+  pp_put_be16( p + 16, (uint16_t) count );
+  pp_put_be16( p + 18, (uint16_t) size );
+  p[20] = (uint8_t) brightness;
+  p[21] = p[22] = p[23] = 0;
+  return PP_NET_HEADER + size;
+}
+
+/* Send the LED buffer of a PixelPi::Leds to the receiver. Raises nothing, so
+ * `show` can restore its buffers first.
+ *
+ * Returns 0 on success or a negated errno value.
+ */
+static int
+pp_sender_render( pp_output_t *output, VALUE self, ws2811_channel_t *channel )
+{
+  pp_sender_t *tx = (pp_sender_t*) output;
+  pp_sender_io_t io;
+  const ws2811_led_t *leds = channel->leds;
+  uint8_t *p;
+  long ii, n = 0;
+
+  if (tx->closed) return -ENOTCONN;
+
+  io.tx = tx;
+  if (tx->fd < 0) {
+    rb_thread_call_without_gvl( pp_sender_connect_io, &io, RUBY_UBF_IO, NULL );
+    if (io.error) return -io.error;
+  }
+
+  pp_leds_normalize( channel );
+  p = tx->frame;
+  if (tx->bpp == 4) {
+    for (ii=0; ii<tx->count; ii++, p+=4) {
+      ws2811_led_t c = leds[ii];
+      p[0] = c; p[1] = c >> 8; p[2] = c >> 16; p[3] = c >> 24;
+    }
+  } else {
+    for (ii=0; ii<tx->count; ii++, p+=3) {
+      ws2811_led_t c = leds[ii];
+      p[0] = c >> 16; p[1] = c >> 8; p[2] = c;
+    }
+  }
+
+  if (++tx->sequence == 0) tx->sequence = 1;
+
+  for (ii=0; ii<tx->chunks; ii++) {
+    long first = ii * PP_NET_CHUNK;
+    long count = MIN(tx->count - first, PP_NET_CHUNK);
+    long offset = first * tx->bpp;
+    long bytes = count * tx->bpp;
+    int key = tx->resync || (tx->sequence + ii) % tx->refresh == 0;
+    long size;
+
+    if (!key && memcmp( tx->frame + offset, tx->prev + offset, bytes ) == 0) continue;
+    if (key) memset( tx->prev + offset, 0, bytes );
+
+    p = tx->packets + n * tx->packet_size;
+    size = pp_delta_encode( tx->frame + offset, tx->prev + offset, bytes, p + PP_NET_HEADER );
+    tx->sizes[n++] = pp_sender_header( tx, p, key ? PP_NET_KEY : 0, key ? 0 : tx->base[ii],
+                                       first, count, size, channel->brightness );
+    tx->base[ii] = tx->sequence;
+  }
+
+  /* the last packet shows the frame */
+  if (n == 0) {
+    tx->sizes[n++] = pp_sender_header( tx, tx->packets, 0, 0, 0, 0, 0, channel->brightness );
+  }
+  tx->packets[(n - 1) * tx->packet_size + 3] |= PP_NET_SHOW;
+  tx->resync = 0;
+
+  io.n = n;
+  rb_thread_call_without_gvl( pp_sender_send, &io, RUBY_UBF_IO, NULL );
+  if (io.error) {
+    if (tx->type == SOCK_STREAM) {
+      close( tx->fd );
+      tx->fd = -1;
+    }
+    return -(io.error == EAGAIN || io.error == EWOULDBLOCK ? ETIMEDOUT : io.error);
+  }
+  return 0;
+}
+
+/* Parse an output address of the form "udp://host:port" or "tcp://host:port";
+ * the port defaults to PP_NET_PORT. */
+static void
+pp_sender_address( pp_sender_t *tx, VALUE url )
+{
+  struct addrinfo hints, *res;
+  const char *str = StringValueCStr( url );
+  char *host, *port, *end;
+  long num = PP_NET_PORT;
+  char service[8];
+  int rc;
+
+  if      (strncmp( str, "udp://", 6 ) == 0) tx->type = SOCK_DGRAM;
+  else if (strncmp( str, "tcp://", 6 ) == 0) tx->type = SOCK_STREAM;
+  else rb_raise( rb_eArgError, "output must be a udp:// or tcp:// address: %s", str );
+
+  host = ALLOCA_N( char, strlen( str + 6 ) + 1 );
+  strcpy( host, str + 6 );
+  if ((port = strrchr( host, ':' )) != NULL) {
+    *port++ = '\0';
+    num = strtol( port, &end, 10 );
+    if (*port == '\0' || *end != '\0' || num < 1 || num > 65535) {
+      rb_raise( rb_eArgError, "invalid output address: %s", str );
+    }
+  }
+  if (*host == '\0') rb_raise( rb_eArgError, "invalid output address: %s", str );
+
+  /* the receiver listens on IPv4 only */
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = tx->type;
+  snprintf( service, sizeof(service), "%ld", num );
+
+  rc = getaddrinfo( host, service, &hints, &res );
+  if (rc != 0) {
+    rb_raise( ePixelPiError, "could not resolve %s: %s", host, gai_strerror( rc ) );
+  }
+  memcpy( &tx->addr, res->ai_addr, res->ai_addrlen );
+  tx->addrlen = res->ai_addrlen;
+  freeaddrinfo( res );
+}
+
+/* Make the PixelPi::Leds `self` send its frames to the receiver at `url`
+ * instead of driving a DMA channel. `refresh` is the number of frames between
+ * keyframes of each chunk, or nil for the default.
+ */
+void
+pp_sender_open( VALUE self, VALUE url, VALUE refresh )
+{
+  ws2811_t *ledstring;
+  ws2811_channel_t *channel;
+  pp_sender_t *tx;
+  pp_sender_io_t io;
+  VALUE obj;
+
+  Data_Get_Struct( self, ws2811_t, ledstring );
+  channel = &ledstring->channel[0];
+
+  obj = Data_Make_Struct( 0, pp_sender_t, NULL, pp_output_free, tx );
+  tx->url = ruby_strdup( StringValueCStr( url ) );
+  tx->output.name   = tx->url;
+  tx->output.render = pp_sender_render;
+  tx->output.close  = pp_sender_close;
+  tx->output.free   = pp_sender_free;
+  tx->fd      = -1;
+  tx->refresh = NIL_P(refresh) ? PP_NET_REFRESH : NUM2LONG(refresh);
+  if (tx->refresh < 1) {
+    rb_raise( rb_eArgError, "refresh must be at least 1 frame: %ld", tx->refresh );
+  }
+
+  pp_sender_address( tx, url );
+
+  tx->count  = channel->count;
+  tx->bpp    = (channel->strip_type & SK6812_SHIFT_WMASK) ? 4 : 3;
+  tx->chunks = (tx->count + PP_NET_CHUNK - 1) / PP_NET_CHUNK;
+  tx->packet_size = PP_NET_HEADER + pp_delta_bound( PP_NET_CHUNK * tx->bpp );
+
+  tx->base    = ALLOC_N( uint32_t, tx->chunks + 1 );
+  tx->frame   = ALLOC_N( uint8_t, tx->count * tx->bpp + 1 );
+  tx->prev    = ALLOC_N( uint8_t, tx->count * tx->bpp + 1 );
+  tx->packets = ALLOC_N( uint8_t, (tx->chunks + 1) * tx->packet_size );
+  tx->sizes   = ALLOC_N( size_t, tx->chunks + 1 );
+  memset( tx->base, 0, (tx->chunks + 1) * sizeof(uint32_t) );
+  memset( tx->prev, 0, tx->count * tx->bpp + 1 );
+
+  io.tx = tx;
+  rb_thread_call_without_gvl( pp_sender_connect_io, &io, RUBY_UBF_IO, NULL );
+  if (io.error) rb_syserr_fail_str( io.error, url );
+
+  pp_leds_output( self, obj );
+}
@@ -0,0 +1,162 @@
+#include "pixel_pi.h"
+
+/* A PixelPi::Slice is a view onto a contiguous run of LEDs. It keeps a
+ * reference to the PixelPi::Leds it was taken from and shares the LED buffer;
+ * nothing is copied. The buffer pointer is looked up on every call so closing
+ * the LEDs makes the slice raise a PixelPi::Error instead of touching freed
+ * memory.
+ */
+typedef struct {
+  VALUE leds;         /* the PixelPi::Leds that owns the buffer */
+  long  offset;       /* index of the first LED in the view */
+  long  count;        /* number of LEDs in the view */
+} pp_slice_t;
+
+VALUE cSlice;
+
+static void
+pp_slice_mark( void *ptr )
+{
+  pp_slice_t *slice = (pp_slice_t*) ptr;
+  rb_gc_mark( slice->leds );
+}
+
+static void
+pp_slice_free( void *ptr )
+{
+  xfree( ptr );
+}
+
+static pp_slice_t*
+pp_slice_struct( VALUE obj )
+{
+  pp_slice_t *slice;
+
+  if (TYPE(obj) != T_DATA || RDATA(obj)->dfree != (RUBY_DATA_FUNC) pp_slice_free) return NULL;
+  Data_Get_Struct( obj, pp_slice_t, slice );
+  return slice;
+}
+
+/* Returns the LED colors seen through the PixelPi::Slice `obj` and stores the
+ * number of colors in `len`. Returns NULL if `obj` is not a slice.
+ */
+ws2811_led_t*
+pp_slice_buffer( VALUE obj, long *len )
+{
+  pp_slice_t *slice = pp_slice_struct( obj );
+  ws2811_led_t *leds;
+  long count;
+
+  *len = 0;
+  if (!slice) return NULL;
+
+  leds = pp_leds_buffer( slice->leds, &count );
+  *len = slice->count;
+  return leds + slice->offset;
+}
+
+/* call-seq:
+ *    slice( start, length )   #=> PixelPi::Slice
+ *    slice( range )           #=> PixelPi::Slice
+ *
+ * Returns a view of `length` LEDs beginning at index `start`. The view shares
+ * the LED buffer, so changes made through the slice are changes to these LEDs
+ * and the other way round. A negative `start` counts back from the end. The
+ * `length` is cut short at the end of the LEDs.
+ *
+ * Indices given to the slice are relative to its own start, and all the
+ * buffer methods - `fill`, `rotate`, `reverse`, `[]=`, `replace`, `effect`,
+ * and friends - stay inside its range.
+ *
+ * Examples:
+ *    shelf = leds.slice( 8, 8 )
+ *    shelf.fill( 0x00FF00 )
+ *    shelf.rotate
+ *    leds.slice( 16..23 ).effect( :rainbow )
+ */
+static VALUE
+pp_slice_new( int argc, VALUE* argv, VALUE self )
+{
+  pp_slice_t *parent = pp_slice_struct( self );
+  pp_slice_t *slice;
+  VALUE arg1, arg2, obj;
+  long count, beg, len;
+
+  pp_leds_buffer( self, &count );
+  rb_scan_args( argc, argv, "11", &arg1, &arg2 );
+
+  if (NIL_P(arg2)) {
+    VALUE rv = rb_range_beg_len( arg1, &beg, &len, count, 0 );
+    if (rv == Qfalse) {
+      rb_raise( rb_eTypeError, "expecting a start and length or a Range: %s", rb_obj_classname(arg1) );
+    }
+    if (NIL_P(rv)) {
+      rb_raise( rb_eIndexError, "range is outside of LED range: 0...%ld", count-1 );
+    }
+  } else {
+    beg = NUM2LONG(arg1);
+    len = NUM2LONG(arg2);
+    if (beg < 0) beg += count;
+    if (beg < 0 || beg > count) {
+      rb_raise( rb_eIndexError, "index %ld is outside of LED range: 0...%ld", NUM2LONG(arg1), count-1 );
+    }
+    if (len < 0) {
+      rb_raise( rb_eArgError, "length cannot be negative: %ld", len );
+    }
+    len = MIN(len, count - beg);
+  }
+
+  obj = Data_Make_Struct( cSlice, pp_slice_t, pp_slice_mark, pp_slice_free, slice );
+  slice->leds   = parent ? parent->leds : self;
+  slice->offset = parent ? parent->offset + beg : beg;
+  slice->count  = len;
+
+  return obj;
+}
+
+/* call-seq:
+ *    length
+ *
+ * Returns the number of LEDs in this slice.
+ */
+static VALUE
+pp_slice_length( VALUE self )
+{
+  long count;
+  pp_slice_buffer( self, &count );
+  return LONG2NUM(count);
+}
+
+/* call-seq:
+ *    offset
+ *
+ * Returns the index of the first LED of this slice in the PixelPi::Leds.
+ */
+static VALUE
+pp_slice_offset( VALUE self )
+{
+  return LONG2NUM(pp_slice_struct( self )->offset);
+}
+
+/* call-seq:
+ *    leds
+ *
+ * Returns the PixelPi::Leds this slice is a view of.
+ */
+static VALUE
+pp_slice_leds( VALUE self )
+{
+  return pp_slice_struct( self )->leds;
+}
+
+void Init_slice( )
+{
+  cSlice = rb_define_class_under( mPixelPi, "Slice", rb_cObject );
+  rb_undef_alloc_func( cSlice );
+
+  rb_define_method( cLeds,  "slice",  pp_slice_new,    -1 );
+  rb_define_method( cSlice, "slice",  pp_slice_new,    -1 );
+  rb_define_method( cSlice, "length", pp_slice_length,  0 );
+  rb_define_method( cSlice, "offset", pp_slice_offset,  0 );
+  rb_define_method( cSlice, "leds",   pp_slice_leds,    0 );
+}
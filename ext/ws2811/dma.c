@@ -130,45 +130,82 @@ void dma_page_init(dma_page_t *page)
     page->prev = page;
 }
 
+/*
+ * Map the memory of a DMA buffer.  Huge pages are asked for first: each one is physically
+ * contiguous, so the DMA can run through it with a single control block.  Regular pages
+ * are used when no huge pages are available.  The huge pages are reserved up front, since
+ * one that cannot be faulted in later would kill the process.
+ */
+static void *dma_map(uint32_t size, uint32_t *len)
+{
+    void *vaddr;
+
+#ifdef MAP_HUGETLB
+    if (size > PAGE_SIZE)
+    {
+        *len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        vaddr = mmap(NULL, *len,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS | MAP_LOCKED | MAP_HUGETLB,
+                     -1, 0);
+        if (vaddr != MAP_FAILED)
+        {
+            return vaddr;
+        }
+    }
+#endif
+
+    *len = ((size / PAGE_SIZE) + 1) * PAGE_SIZE;
+    return mmap(NULL, *len,
+                PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE |
+                MAP_LOCKED, -1, 0);
+}
+
 void *dma_alloc(dma_page_t *head, uint32_t size)
 {
-    uint32_t pages = (size / PAGE_SIZE) + 1;
+    uint32_t pages, len;
     void *vaddr;
     int i;
 
-    vaddr = mmap(NULL, pages * PAGE_SIZE,
-                 PROT_READ | PROT_WRITE,
-                 MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE |
-                 MAP_LOCKED, -1, 0);
+    vaddr = dma_map(size, &len);
     if (vaddr == MAP_FAILED)
     {
         perror("dma_alloc() mmap() failed");
         return NULL;
     }
+    pages = len / PAGE_SIZE;
 
     for (i = 0; i < pages; i++)
     {
         if (!dma_page_add(head, &((uint8_t *)vaddr)[PAGE_SIZE * i]))
         {
             dma_page_remove_all(head);
-            munmap(vaddr, pages * PAGE_SIZE);
+            munmap(vaddr, len);
             return NULL;
         }
     }
+    head->len = len;
 
     return vaddr;
 }
 
+void dma_free(dma_page_t *head, void *buffer)
+{
+    munmap(buffer, head->len);
+    dma_page_remove_all(head);
+    head->len = 0;
+}
+
+/*
+ * The control blocks are spread over as many pages as needed.  Each block is chained to
+ * the next one by its bus address, so the pages do not have to be contiguous.
+ */
 dma_cb_t *dma_desc_alloc(uint32_t descriptors)
 {
-    uint32_t pages = ((descriptors * sizeof(dma_cb_t)) / PAGE_SIZE);
+    uint32_t pages = ((descriptors * sizeof(dma_cb_t)) / PAGE_SIZE) + 1;
     dma_cb_t *vaddr;
 
-    if (pages > 1)
-    {
-        return NULL;
-    }
-
     vaddr = mmap(NULL, pages * PAGE_SIZE,
                  PROT_READ | PROT_WRITE,
                  MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE |
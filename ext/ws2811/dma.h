@@ -95,8 +95,13 @@ typedef struct
 #define RPI_DMA_STRIDE_S_STRIDE(val)             ((val & 0xffff) << 0)
     uint32_t nextconbk;
     uint32_t debug;
+#define RPI_DMA_DEBUG_LITE                       (1 << 28)
 } __attribute__((packed)) dma_t;
 
+// Largest transfer of one control block; the lite engines only have a 16-bit length
+#define RPI_DMA_TXFR_LEN_MAX                     (0x3ffffffc)
+#define RPI_DMA_LITE_TXFR_LEN_MAX                (0xfffc)
+
 
 #define DMA0                                     (0x20007000)  // 0x7e007000
 #define DMA1                                     (0x20007100)
@@ -119,7 +124,7 @@ typedef struct
 #define PAGE_SIZE                                (1 << 12)
 #define PAGE_MASK                                (~(PAGE_SIZE - 1))
 #define PAGE_OFFSET(page)                        (page & (PAGE_SIZE - 1))
-#define MAX_PAGES                                (PAGE_SIZE / sizeof(dma_cb_t))
+#define HUGE_PAGE_SIZE                           (1 << 21)
 
 
 typedef struct dma_page
@@ -127,6 +132,7 @@ typedef struct dma_page
     struct dma_page *next;
     struct dma_page *prev;
     void *addr;
+    uint32_t len;                                // Bytes mapped by dma_alloc, kept in the list head
 } dma_page_t;
 
 
@@ -139,6 +145,7 @@ void dma_page_remove_all(dma_page_t *head);
 dma_page_t *dma_page_next(dma_page_t *head, dma_page_t *page);
 
 void *dma_alloc(dma_page_t *head, uint32_t size);
+void dma_free(dma_page_t *head, void *buffer);
 dma_cb_t *dma_desc_alloc(uint32_t descriptors);
 void dma_page_free(void *buffer, const uint32_t size);
 
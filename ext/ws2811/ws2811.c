@@ -49,20 +49,48 @@
 
 #define OSC_FREQ                                 19200000   // crystal frequency
 
-/* 3 colors, 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
+/* 3 or 4 colors, 8 bits per byte, 3 symbols per bit + 55uS low for reset signal */
 #define LED_RESET_uS                             55
-#define LED_BIT_COUNT(leds, freq)                ((leds * 3 * 8 * 3) + ((LED_RESET_uS * \
+#define LED_BIT_COUNT(leds, colors, freq)        ((leds * colors * 8 * 3) + ((LED_RESET_uS * \
                                                   (freq * 3)) / 1000000))
 
 // Pad out to the nearest uint32 + 32-bits for idle low/high times the number of channels
-#define PWM_BYTE_COUNT(leds, freq)               (((((LED_BIT_COUNT(leds, freq) >> 3) & ~0x7) + 4) + 4) * \
-                                                  RPI_PWM_CHANNELS)
+#define PWM_BYTE_COUNT(leds, colors, freq, chans) (((((LED_BIT_COUNT(leds, colors, freq) >> 3) & ~0x7) + 4) + 4) * \
+                                                  (chans))
 
 #define SYMBOL_HIGH                              0x6  // 1 1 0
 #define SYMBOL_LOW                               0x4  // 1 0 0
 
 #define ARRAY_SIZE(stuff)                        (sizeof(stuff) / sizeof(stuff[0]))
 
+#define STRIP_COLORS(strip_type)                 (((strip_type) & SK6812_SHIFT_WMASK) ? 4 : 3)
+
+
+typedef struct
+{
+    uint32_t *wordptr;                           // Next word of the channel in the PWM buffer
+    int stride;                                  // Words between two words of the channel
+    uint64_t bits;                               // Symbol bits not written out yet
+    int bitcount;                                // Number of symbol bits pending
+} encoder_state_t;
+
+typedef void (*strip_encoder_t)(encoder_state_t *state, const ws2811_led_t *leds, int count,
+                                int origin, int length, int step, uint32_t (*symbols)[256]);
+
+typedef struct
+{
+    uint32_t order;                              // Strip type without the white shift
+    int colors[3];                               // Red (0), green (1), blue (2) in the order sent
+    strip_encoder_t encode[2];                   // Encoders for 3 and 4 byte pixels
+} strip_layout_t;
+
+typedef struct
+{
+    const strip_layout_t *layout;                // Color order of the segment
+    uint32_t scale;                              // Brightness + 1 the symbols were built with
+    uint32_t symbols[4][256];                    // Encoded red, green, blue, white symbols
+} segment_symbols_t;
+
 
 typedef struct ws2811_device
 {
@@ -70,11 +98,22 @@ typedef struct ws2811_device
     volatile dma_t *dma;
     volatile pwm_t *pwm;
     volatile dma_cb_t *dma_cb;
+    uint32_t dma_cb_count;                       // Control blocks allocated, one per buffer page
     uint32_t dma_cb_addr;
     dma_page_t page_head;
     volatile gpio_t *gpio;
     volatile cm_pwm_t *cm_pwm;
     int max_count;
+    int channels;                                // Channels in the DMA buffer, 1 if the second is unused
+    const strip_layout_t *layout[RPI_PWM_CHANNELS]; // Color order of each channel
+    uint32_t symbols[RPI_PWM_CHANNELS][4][256];  // Encoded red, green, blue, white symbols per channel
+    int symbols_brightness[RPI_PWM_CHANNELS];    // Brightness the symbols were built with
+    int symbols_invert[RPI_PWM_CHANNELS];        // Invert flag the symbols were built with
+    int symbols_valid;
+    uint32_t raw_symbols[RPI_PWM_CHANNELS][256]; // Uncorrected symbols for dithered output
+    uint8_t *dither_error[RPI_PWM_CHANNELS];     // Per color residual carried to the next frame
+    segment_symbols_t *segment_symbols[RPI_PWM_CHANNELS]; // Layout and symbols of each segment
+    int segment_symbols_count[RPI_PWM_CHANNELS]; // Number of segments the tables were built for
 } ws2811_device_t;
 
 
@@ -104,6 +143,43 @@ static int max_channel_led_count(ws2811_t *ws2811)
     return max;
 }
 
+/**
+ * Iterate through the channels and find the largest number of colors per LED.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  3 if all channels are RGB strips, 4 if any channel with LEDs is an RGBW strip.
+ */
+static int max_channel_colors(ws2811_t *ws2811)
+{
+    int chan, max = 3;
+
+    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    {
+        if (ws2811->channel[chan].count &&
+            STRIP_COLORS(ws2811->channel[chan].strip_type) > max)
+        {
+            max = STRIP_COLORS(ws2811->channel[chan].strip_type);
+        }
+    }
+
+    return max;
+}
+
+/**
+ * Size of the DMA buffer.  The words of the channels sent are interleaved, so a single
+ * channel buffer holds only that channel's words.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  Number of bytes in the DMA buffer.
+ */
+static int pwm_byte_count(ws2811_t *ws2811)
+{
+    return PWM_BYTE_COUNT(max_channel_led_count(ws2811), max_channel_colors(ws2811),
+                          ws2811->freq, ws2811->device->channels);
+}
+
 /**
  * Map a physical address and length into userspace virtual memory.
  *
@@ -302,7 +378,9 @@ static void stop_pwm(ws2811_t *ws2811)
 }
 
 /**
- * Setup the PWM controller in serial mode on both channels using DMA to feed the PWM FIFO.
+ * Setup the PWM controller in serial mode using DMA to feed the PWM FIFO.  Both channels
+ * share the FIFO and take alternate words; with a single channel every word goes to
+ * channel 1.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
@@ -312,11 +390,13 @@ static int setup_pwm(ws2811_t *ws2811)
 {
     ws2811_device_t *device = ws2811->device;
     volatile dma_t *dma = device->dma;
-    volatile dma_cb_t *dma_cb = device->dma_cb;
+    volatile dma_cb_t *dma_cb = NULL;
     volatile pwm_t *pwm = device->pwm;
     volatile cm_pwm_t *cm_pwm = device->cm_pwm;
-    int maxcount = max_channel_led_count(ws2811);
     uint32_t freq = ws2811->freq;
+    uint32_t max_len = (dma->debug & RPI_DMA_DEBUG_LITE) ? RPI_DMA_LITE_TXFR_LEN_MAX :
+                                                           RPI_DMA_TXFR_LEN_MAX;
+    uint32_t bus_end = 0;
     dma_page_t *page;
     int32_t byte_count;
 
@@ -342,43 +422,65 @@ static int setup_pwm(ws2811_t *ws2811)
     usleep(10);
     pwm->dmac = RPI_PWM_DMAC_ENAB | RPI_PWM_DMAC_PANIC(7) | RPI_PWM_DMAC_DREQ(3);
     usleep(10);
-    pwm->ctl = RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1 |
-               RPI_PWM_CTL_USEF2 | RPI_PWM_CTL_MODE2;
-    usleep(10);
-    pwm->ctl |= RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2;
+    if (device->channels == 1)
+    {
+        pwm->ctl = RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1;
+        usleep(10);
+        pwm->ctl |= RPI_PWM_CTL_PWEN1;
+    }
+    else
+    {
+        pwm->ctl = RPI_PWM_CTL_USEF1 | RPI_PWM_CTL_MODE1 |
+                   RPI_PWM_CTL_USEF2 | RPI_PWM_CTL_MODE2;
+        usleep(10);
+        pwm->ctl |= RPI_PWM_CTL_PWEN1 | RPI_PWM_CTL_PWEN2;
+    }
 
-    // Initialize the DMA control blocks to chain together all the DMA pages
+    // Initialize the DMA control blocks to chain together all the DMA pages.  Pages that
+    // follow each other on the bus share a control block, so a huge page needs only one.
     page = &device->page_head;
-    byte_count = PWM_BYTE_COUNT(maxcount, freq);
+    byte_count = pwm_byte_count(ws2811);
     while ((page = dma_page_next(&device->page_head, page)) &&
-           byte_count)
+           byte_count > 0)
     {
         int32_t page_bytes = PAGE_SIZE < byte_count ? PAGE_SIZE : byte_count;
+        uint32_t bus = addr_to_bus(page->addr);
 
-        dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
-                     RPI_DMA_TI_WAIT_RESP |       // wait for write complete
-                     RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
-                     RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
-                     RPI_DMA_TI_SRC_INC;          // Increment src addr
-
-        dma_cb->source_ad = addr_to_bus(page->addr);
-        if (dma_cb->source_ad == ~0L)
+        if (bus == ~0L)
         {
             return -1;
         }
 
-        dma_cb->dest_ad = (uint32_t)&((pwm_t *)PWM_PERIPH)->fif1;
-        dma_cb->txfr_len = page_bytes;
-        dma_cb->stride = 0;
-        dma_cb->nextconbk = addr_to_bus(dma_cb + 1);
-
-        byte_count -= page_bytes;
-        if (!dma_page_next(&device->page_head, page))
+        if (dma_cb && bus == bus_end && dma_cb->txfr_len + page_bytes <= max_len)
+        {
+            dma_cb->txfr_len += page_bytes;
+        }
+        else
         {
-            break;
+            if (dma_cb)
+            {
+                dma_cb->nextconbk = addr_to_bus(dma_cb + 1);
+                dma_cb++;
+            }
+            else
+            {
+                dma_cb = device->dma_cb;
+            }
+
+            dma_cb->ti = RPI_DMA_TI_NO_WIDE_BURSTS |  // 32-bit transfers
+                         RPI_DMA_TI_WAIT_RESP |       // wait for write complete
+                         RPI_DMA_TI_DEST_DREQ |       // user peripheral flow control
+                         RPI_DMA_TI_PERMAP(5) |       // PWM peripheral
+                         RPI_DMA_TI_SRC_INC;          // Increment src addr
+
+            dma_cb->source_ad = bus;
+            dma_cb->dest_ad = (uint32_t)&((pwm_t *)PWM_PERIPH)->fif1;
+            dma_cb->txfr_len = page_bytes;
+            dma_cb->stride = 0;
         }
 
-        dma_cb++;
+        bus_end = bus + page_bytes;
+        byte_count -= page_bytes;
     }
 
     // Terminate the final control block to stop DMA
@@ -391,8 +493,8 @@ static int setup_pwm(ws2811_t *ws2811)
 }
 
 /**
- * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of both
- * PWM channels.
+ * Start the DMA feeding the PWM FIFO.  This will stream the entire DMA buffer out of the
+ * PWM channels in use.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
@@ -423,7 +525,7 @@ static int gpio_init(ws2811_t *ws2811)
     volatile gpio_t *gpio = ws2811->device->gpio;
     int chan;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    for (chan = 0; chan < ws2811->device->channels; chan++)
     {
         int pinnum = ws2811->channel[chan].gpionum;
 
@@ -455,12 +557,11 @@ static int gpio_init(ws2811_t *ws2811)
 void pwm_raw_init(ws2811_t *ws2811)
 {
     volatile uint32_t *pwm_raw = (uint32_t *)ws2811->device->pwm_raw;
-    int maxcount = max_channel_led_count(ws2811);
-    int wordcount = (PWM_BYTE_COUNT(maxcount, ws2811->freq) / sizeof(uint32_t)) /
-                    RPI_PWM_CHANNELS;
+    int channels = ws2811->device->channels;
+    int wordcount = (pwm_byte_count(ws2811) / sizeof(uint32_t)) / channels;
     int chan;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+    for (chan = 0; chan < channels; chan++)
     {
         ws2811_channel_t *channel = &ws2811->channel[chan];
         int i, wordpos = chan;
@@ -476,11 +577,379 @@ void pwm_raw_init(ws2811_t *ws2811)
                 pwm_raw[wordpos] = 0x0;
             }
 
-            wordpos += 2;
+            wordpos += channels;
+        }
+    }
+}
+
+/**
+ * Expand a data byte into the 24 symbol bits (3 symbols per data bit) sent for it.
+ *
+ * @param    value   Data byte.
+ * @param    invert  Invert the symbols.
+ *
+ * @returns  Symbol bits in the low 24 bits, first symbol in the most significant bit.
+ */
+static uint32_t byte_symbols(uint8_t value, int invert)
+{
+    uint32_t symbols = 0;
+    int k;
+
+    for (k = 7; k >= 0; k--)
+    {
+        uint32_t symbol = (value & (1 << k)) ? SYMBOL_HIGH : SYMBOL_LOW;
+
+        if (invert)
+        {
+            symbol = ~symbol & 0x7;
+        }
+
+        symbols = (symbols << 3) | symbol;
+    }
+
+    return symbols;
+}
+
+/**
+ * Fill a set of symbol lookup tables.  Each of the 256 values of a color byte is passed
+ * through the correction table, scaled by the brightness, and then expanded into the 24
+ * symbol bits sent for that byte.  The invert flag is applied to the symbols as well, so
+ * the encoder only needs one table lookup per color byte.
+ *
+ * @param    symbols     Red, green, blue, white symbol tables to fill.
+ * @param    correction  Red, green, blue, white 8.8 fixed-point correction tables.
+ * @param    brightness  Brightness value between 0 and 255.
+ * @param    invert      Invert the symbols.
+ *
+ * @returns  None
+ */
+static void fill_symbols(uint32_t (*symbols)[256], uint16_t (*correction)[256], int brightness,
+                         int invert)
+{
+    int scale = (brightness & 0xff) + 1;
+    int color, value;
+
+    for (color = 0; color < 4; color++)
+    {
+        for (value = 0; value < 256; value++)
+        {
+            uint8_t corrected = (correction[color][value] * scale) >> 16;
+
+            symbols[color][value] = byte_symbols(corrected, invert);
         }
     }
 }
 
+/**
+ * Build the symbol lookup tables for a channel from its correction tables, brightness
+ * and invert flag.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
+ *
+ * @returns  None
+ */
+static void build_symbols(ws2811_t *ws2811, int chan)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    int value;
+
+    fill_symbols(device->symbols[chan], channel->correction, channel->brightness,
+                 channel->invert);
+
+    for (value = 0; value < 256; value++)
+    {
+        device->raw_symbols[chan][value] = byte_symbols(value, channel->invert);
+    }
+
+    device->symbols_brightness[chan] = channel->brightness;
+    device->symbols_invert[chan] = channel->invert;
+}
+
+/**
+ * Convert a 16-bit color value into the data byte to send this frame.  The value is
+ * passed through the correction table, interpolating between entries with the low
+ * byte, and scaled by the brightness.  The fraction below one output step is carried
+ * in `error` and added to the next frame, so over several frames the average output
+ * matches the 16-bit value (temporal error diffusion).
+ *
+ * @param    table   Channel correction table for this color.
+ * @param    value   16-bit color value.
+ * @param    scale   Brightness + 1.
+ * @param    error   Residual from the previous frame, updated in place.
+ *
+ * @returns  Data byte.
+ */
+static inline uint8_t dither_byte(const uint16_t *table, uint32_t value, uint32_t scale,
+                                  uint8_t *error)
+{
+    uint32_t hi = value >> 8, lo = value & 0xff;
+    uint32_t t0 = table[hi];
+    uint32_t t1 = table[hi < 255 ? hi + 1 : 255];
+    uint32_t corrected = (t0 << 8) + (t1 - t0) * lo;         // 8.16 fixed-point
+
+    // 8.8 after brightness; at most 0xff00 so adding the error never overflows a byte
+    uint32_t out = ((corrected >> 8) * scale >> 8) + *error;
+
+    *error = out & 0xff;
+    return out >> 8;
+}
+
+/*
+ * Shift the 24 symbol bits of one color byte into the bit accumulator and write out a
+ * full 32-bit word once one is available.  At most 31 bits are pending before the shift
+ * so the accumulator never overflows.  The words of a channel are `stride` apart, one
+ * for each channel in the DMA buffer.
+ */
+#define SHIFT_SYMBOLS(sym)                                          \
+    do {                                                            \
+        bits = (bits << 24) | (sym);                                \
+        bitcount += 24;                                             \
+        if (bitcount >= 32)                                         \
+        {                                                           \
+            bitcount -= 32;                                         \
+            *wordptr = (uint32_t)(bits >> bitcount);                \
+            wordptr += stride;                                      \
+        }                                                           \
+    } while (0)
+
+/**
+ * Merge the remaining symbols into the top of the last word, keeping the idle bits.
+ *
+ * @param    wordptr   Next word of the channel in the PWM buffer.
+ * @param    bits      Bit accumulator.
+ * @param    bitcount  Number of symbol bits pending in the accumulator.
+ *
+ * @returns  None
+ */
+static inline void flush_symbols(uint32_t *wordptr, uint64_t bits, int bitcount)
+{
+    if (bitcount)
+    {
+        uint32_t mask = ~0U >> bitcount;
+        *wordptr = (*wordptr & mask) | ((uint32_t)bits << (32 - bitcount));
+    }
+}
+
+/*
+ * Byte of an LED value holding a color: red (0), green (1), blue (2) or white (3).  The
+ * color is a constant in the generated encoders so the shift is resolved at compile time.
+ */
+#define LED_BYTE(led, color)                     (((led) >> ((color) == 3 ? 24 : 16 - 8 * (color))) & 0xff)
+
+/*
+ * Step to the next LED in the buffer, wrapping around at either end.  Together with the
+ * channel origin this lets a rotated or reversed strip be sent without moving the LEDs.
+ */
+#define NEXT_LED(j, step, count)                                                        \
+    do {                                                                                \
+        (j) += (step);                                                                  \
+        if ((unsigned)(j) >= (unsigned)(count))                                         \
+        {                                                                               \
+            (j) = ((step) > 0) ? 0 : (count) - 1;                                       \
+        }                                                                               \
+    } while (0)
+
+/*
+ * Generate the encoder for one strip layout.  The colors c0, c1 and c2 are sent in that
+ * order followed by white for 4 byte pixels.  The invert flag is already applied to the
+ * symbol tables, so each encoder is a straight run of table lookups and shifts.  The
+ * `length` LEDs are read starting at origin and stepping by +1 or -1 through the `count`
+ * LEDs of the buffer.  The pending bits are left in the state for the next run.
+ */
+#define DEFINE_STRIP_ENCODER(name, c0, c1, c2, colors)                                  \
+    static void name(encoder_state_t *state, const ws2811_led_t *leds, int count,       \
+                     int origin, int length, int step, uint32_t (*symbols)[256])        \
+    {                                                                                   \
+        uint32_t *wordptr = state->wordptr;                                             \
+        int stride = state->stride;                                                     \
+        uint64_t bits = state->bits;                                                    \
+        int bitcount = state->bitcount;                                                 \
+        int i, j = origin;                                                              \
+                                                                                        \
+        for (i = 0; i < length; i++)                                                    \
+        {                                                                               \
+            ws2811_led_t led = leds[j];                                                 \
+                                                                                        \
+            NEXT_LED(j, step, count);                                                   \
+            SHIFT_SYMBOLS(symbols[c0][LED_BYTE(led, c0)]);                              \
+            SHIFT_SYMBOLS(symbols[c1][LED_BYTE(led, c1)]);                              \
+            SHIFT_SYMBOLS(symbols[c2][LED_BYTE(led, c2)]);                              \
+            if (colors == 4)                                                            \
+            {                                                                           \
+                SHIFT_SYMBOLS(symbols[3][LED_BYTE(led, 3)]);                            \
+            }                                                                           \
+        }                                                                               \
+                                                                                        \
+        state->wordptr = wordptr;                                                       \
+        state->bits = bits;                                                             \
+        state->bitcount = bitcount;                                                     \
+    }
+
+DEFINE_STRIP_ENCODER(encode_rgb,  0, 1, 2, 3)
+DEFINE_STRIP_ENCODER(encode_rbg,  0, 2, 1, 3)
+DEFINE_STRIP_ENCODER(encode_grb,  1, 0, 2, 3)
+DEFINE_STRIP_ENCODER(encode_gbr,  1, 2, 0, 3)
+DEFINE_STRIP_ENCODER(encode_brg,  2, 0, 1, 3)
+DEFINE_STRIP_ENCODER(encode_bgr,  2, 1, 0, 3)
+DEFINE_STRIP_ENCODER(encode_rgbw, 0, 1, 2, 4)
+DEFINE_STRIP_ENCODER(encode_rbgw, 0, 2, 1, 4)
+DEFINE_STRIP_ENCODER(encode_grbw, 1, 0, 2, 4)
+DEFINE_STRIP_ENCODER(encode_gbrw, 1, 2, 0, 4)
+DEFINE_STRIP_ENCODER(encode_brgw, 2, 0, 1, 4)
+DEFINE_STRIP_ENCODER(encode_bgrw, 2, 1, 0, 4)
+
+static const strip_layout_t strip_layouts[] =
+{
+    { WS2811_STRIP_RGB, { 0, 1, 2 }, { encode_rgb, encode_rgbw } },
+    { WS2811_STRIP_RBG, { 0, 2, 1 }, { encode_rbg, encode_rbgw } },
+    { WS2811_STRIP_GRB, { 1, 0, 2 }, { encode_grb, encode_grbw } },
+    { WS2811_STRIP_GBR, { 1, 2, 0 }, { encode_gbr, encode_gbrw } },
+    { WS2811_STRIP_BRG, { 2, 0, 1 }, { encode_brg, encode_brgw } },
+    { WS2811_STRIP_BGR, { 2, 1, 0 }, { encode_bgr, encode_bgrw } },
+};
+
+/**
+ * Find the color layout for a strip type.
+ *
+ * @param    strip_type  One of the WS2811_STRIP_xxx or SK6812_STRIP_xxx values, 0 for GRB.
+ *
+ * @returns  Layout pointer, NULL if the strip type is not supported.
+ */
+static const strip_layout_t *find_strip_layout(int strip_type)
+{
+    uint32_t order = (uint32_t)strip_type & 0x00ffffff;
+    int i;
+
+    if (!strip_type)
+    {
+        order = WS2811_STRIP_GRB;
+    }
+
+    for (i = 0; i < (int)ARRAY_SIZE(strip_layouts); i++)
+    {
+        if (strip_layouts[i].order == order)
+        {
+            return &strip_layouts[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Dither a run of LEDs from the 16-bit buffer.  The residual of each color belongs to
+ * the position on the strip, not to the LED value, so it is kept by position.
+ *
+ * @param    state       Encoder state, updated with the pending bits.
+ * @param    channel     Channel being encoded.
+ * @param    error       Residuals of the channel.
+ * @param    origin      Index into the LED buffers of the first LED of the run.
+ * @param    pos         Position on the strip of the first LED of the run.
+ * @param    length      Number of LEDs in the run.
+ * @param    order       Red (0), green (1), blue (2) in the order sent.
+ * @param    white       Send the white byte of 4 byte pixels.
+ * @param    raw         Uncorrected symbols.
+ * @param    symbols     Encoded symbols of the run, used for white.
+ * @param    correction  Correction tables of the run.
+ * @param    scale       Brightness + 1 of the run.
+ *
+ * @returns  None
+ */
+static void encode_dither(encoder_state_t *state, ws2811_channel_t *channel, uint8_t *error,
+                          int origin, int pos, int length, const int *order, int white,
+                          uint32_t *raw, uint32_t (*symbols)[256], uint16_t (*correction)[256],
+                          uint32_t scale)
+{
+    uint32_t *wordptr = state->wordptr;
+    int stride = state->stride;
+    uint64_t bits = state->bits;
+    int bitcount = state->bitcount;
+    int step = channel->reverse ? -1 : 1;
+    int i, j = origin;
+
+    for (i = pos; i < pos + length; i++)                    // Led
+    {
+        ws2811_led_t led = channel->leds[j];
+        uint16_t *led16 = &channel->leds16[j * 3];
+        uint32_t rgb[3] = { led16[0], led16[1], led16[2] };
+        int k;
+
+        NEXT_LED(j, step, channel->count);
+
+        // Pixels changed through the 8-bit buffer are dithered at 8-bit precision
+        if (((rgb[0] >> 8) << 16 | (rgb[1] & 0xff00) | (rgb[2] >> 8)) != (led & 0xffffff))
+        {
+            rgb[0] = (led >> 8) & 0xff00;
+            rgb[1] = led & 0xff00;
+            rgb[2] = (led << 8) & 0xff00;
+        }
+
+        for (k = 0; k < 3; k++)
+        {
+            int c = order[k];
+            SHIFT_SYMBOLS(raw[dither_byte(correction[c], rgb[c], scale, &error[i * 3 + c])]);
+        }
+
+        if (white)
+        {
+            SHIFT_SYMBOLS(symbols[3][LED_BYTE(led, 3)]);
+        }
+    }
+
+    state->wordptr = wordptr;
+    state->bits = bits;
+    state->bitcount = bitcount;
+}
+
+/**
+ * Build the layout and symbol lookup tables of each segment of a channel.  A segment
+ * without its own strip type or brightness uses the channel's.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ * @param    chan    Channel number.
+ *
+ * @returns  0 on success, -1 if the tables could not be allocated.
+ */
+static int build_segment_symbols(ws2811_t *ws2811, int chan)
+{
+    ws2811_device_t *device = ws2811->device;
+    ws2811_channel_t *channel = &ws2811->channel[chan];
+    int i;
+
+    if (channel->segment_count > device->segment_symbols_count[chan])
+    {
+        segment_symbols_t *tables = realloc(device->segment_symbols[chan],
+                                            sizeof(*tables) * channel->segment_count);
+        if (!tables)
+        {
+            return -1;
+        }
+
+        device->segment_symbols[chan] = tables;
+        device->segment_symbols_count[chan] = channel->segment_count;
+    }
+
+    for (i = 0; i < channel->segment_count; i++)
+    {
+        ws2811_segment_t *segment = &channel->segments[i];
+        segment_symbols_t *tables = &device->segment_symbols[chan][i];
+        int brightness = segment->brightness < 0 ? channel->brightness : segment->brightness;
+
+        tables->layout = segment->strip_type ? find_strip_layout(segment->strip_type) : NULL;
+        if (!tables->layout)
+        {
+            tables->layout = device->layout[chan];
+        }
+
+        tables->scale = (brightness & 0xff) + 1;
+        fill_symbols(tables->symbols, segment->correction, brightness, channel->invert);
+    }
+
+    return 0;
+}
+
 /**
  * Cleanup previously allocated device memory and buffers.
  *
@@ -498,22 +967,42 @@ void ws2811_cleanup(ws2811_t *ws2811)
             free(ws2811->channel[chan].leds);
         }
         ws2811->channel[chan].leds = NULL;
+
+        if (ws2811->channel[chan].leds16)
+        {
+            free(ws2811->channel[chan].leds16);
+        }
+        ws2811->channel[chan].leds16 = NULL;
     }
 
     ws2811_device_t *device = ws2811->device;
     if (device) {
 
+        for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
+        {
+            if (device->dither_error[chan])
+            {
+                free(device->dither_error[chan]);
+            }
+            device->dither_error[chan] = NULL;
+
+            if (device->segment_symbols[chan])
+            {
+                free(device->segment_symbols[chan]);
+            }
+            device->segment_symbols[chan] = NULL;
+            device->segment_symbols_count[chan] = 0;
+        }
+
         if (device->pwm_raw)
         {
-            dma_page_free((uint8_t *)device->pwm_raw,
-                          PWM_BYTE_COUNT(max_channel_led_count(ws2811),
-                                         ws2811->freq));
+            dma_free(&device->page_head, (uint8_t *)device->pwm_raw);
             device->pwm_raw = NULL;
         }
 
         if (device->dma_cb)
         {
-            dma_page_free((dma_cb_t *)device->dma_cb, sizeof(dma_cb_t));
+            dma_page_free((dma_cb_t *)device->dma_cb, device->dma_cb_count * sizeof(dma_cb_t));
             device->dma_cb = NULL;
         }
 
@@ -552,18 +1041,33 @@ int ws2811_init(ws2811_t *ws2811)
     // Initialize all pointers to NULL.  Any non-NULL pointers will be freed on cleanup.
     device->pwm_raw = NULL;
     device->dma_cb = NULL;
+    device->symbols_valid = 0;
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
         ws2811->channel[chan].leds = NULL;
+        ws2811->channel[chan].leds16 = NULL;
+        device->dither_error[chan] = NULL;
+        device->segment_symbols[chan] = NULL;
+        device->segment_symbols_count[chan] = 0;
     }
 
     dma_page_init(&device->page_head);
 
+    // Only send the second channel when it has LEDs; otherwise half of the DMA buffer
+    // and bandwidth would carry idle words
+    device->channels = ws2811->channel[1].count ? RPI_PWM_CHANNELS : 1;
+
     // Allocate the LED buffers
     for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)
     {
         ws2811_channel_t *channel = &ws2811->channel[chan];
 
+        device->layout[chan] = find_strip_layout(channel->strip_type);
+        if (!device->layout[chan])
+        {
+            goto err;
+        }
+
         channel->leds = malloc(sizeof(ws2811_led_t) * channel->count);
         if (!channel->leds)
         {
@@ -571,12 +1075,22 @@ int ws2811_init(ws2811_t *ws2811)
         }
 
         memset(channel->leds, 0, sizeof(ws2811_led_t) * channel->count);
+        channel->origin = 0;
+        channel->reverse = 0;
+
+        if (channel->dither)
+        {
+            channel->leds16 = calloc(channel->count * 3 + 1, sizeof(uint16_t));
+            device->dither_error[chan] = calloc(channel->count * 3 + 1, sizeof(uint8_t));
+            if (!channel->leds16 || !device->dither_error[chan])
+            {
+                goto err;
+            }
+        }
     }
 
     // Allocate the DMA buffer
-    device->pwm_raw = dma_alloc(&device->page_head,
-                                PWM_BYTE_COUNT(max_channel_led_count(ws2811),
-                                               ws2811->freq));
+    device->pwm_raw = dma_alloc(&device->page_head, pwm_byte_count(ws2811));
     if (!device->pwm_raw)
     {
         goto err;
@@ -584,8 +1098,9 @@ int ws2811_init(ws2811_t *ws2811)
 
     pwm_raw_init(ws2811);
 
-    // Allocate the DMA control block
-    device->dma_cb = dma_desc_alloc(MAX_PAGES);
+    // Allocate the DMA control blocks, enough for one per page of the DMA buffer
+    device->dma_cb_count = (pwm_byte_count(ws2811) / PAGE_SIZE) + 1;
+    device->dma_cb = dma_desc_alloc(device->dma_cb_count);
     if (!device->dma_cb)
     {
         goto err;
@@ -670,9 +1185,23 @@ int ws2811_wait(ws2811_t *ws2811)
     return 0;
 }
 
+/**
+ * Mark the encoder symbol tables as stale.  Call this after changing the correction
+ * tables of any channel; the tables are rebuilt on the next render.  Brightness and
+ * invert changes are detected automatically.
+ *
+ * @param    ws2811  ws2811 instance pointer.
+ *
+ * @returns  None
+ */
+void ws2811_correction_changed(ws2811_t *ws2811)
+{
+    ws2811->device->symbols_valid = 0;
+}
+
 /**
  * Render the PWM DMA buffer from the user supplied LED arrays and start the DMA
- * controller.  This will update all LEDs on both PWM channels.
+ * controller.  This will update all LEDs on the PWM channels in use.
  *
  * @param    ws2811  ws2811 instance pointer.
  *
@@ -680,69 +1209,105 @@ int ws2811_wait(ws2811_t *ws2811)
  */
 int ws2811_render(ws2811_t *ws2811)
 {
-    volatile uint8_t *pwm_raw = ws2811->device->pwm_raw;
-    int maxcount = max_channel_led_count(ws2811);
-    int bitpos = 31;
-    int i, j, k, l, chan;
+    ws2811_device_t *device = ws2811->device;
+    volatile uint8_t *pwm_raw = device->pwm_raw;
+    int stride = device->channels;
+    int chan;
 
-    for (chan = 0; chan < RPI_PWM_CHANNELS; chan++)         // Channel
+    for (chan = 0; chan < device->channels; chan++)         // Channel
     {
         ws2811_channel_t *channel = &ws2811->channel[chan];
-        int wordpos = chan;
-        int scale   = (channel->brightness & 0xff) + 1;
+        encoder_state_t state = { &((uint32_t *)pwm_raw)[chan], stride, 0, 0 };
+        int white = STRIP_COLORS(channel->strip_type) == 4;
+        int step = channel->reverse ? -1 : 1;
+        int pos = 0, seg = 0;
+
+        if (!device->symbols_valid ||
+            device->symbols_brightness[chan] != channel->brightness ||
+            device->symbols_invert[chan] != channel->invert ||
+            device->segment_symbols_count[chan] < channel->segment_count)
+        {
+            build_symbols(ws2811, chan);
+            if (build_segment_symbols(ws2811, chan))
+            {
+                return -1;
+            }
+        }
 
-        for (i = 0; i < channel->count; i++)                // Led
+        // Send the LEDs in runs: each segment with its own tables and encoder, and the
+        // LEDs between segments with the channel's.  Nothing is decided per LED.
+        while (pos < channel->count)
         {
-            uint8_t color[] =
+            const strip_layout_t *layout = device->layout[chan];
+            uint32_t (*symbols)[256] = device->symbols[chan];
+            uint16_t (*correction)[256] = channel->correction;
+            uint32_t scale = (channel->brightness & 0xff) + 1;
+            int end = channel->count;
+            int origin = channel->origin + step * pos;
+
+            if (origin < 0)
             {
-                (((channel->leds[i] >> 8)  & 0xff) * scale) >> 8, // green
-                (((channel->leds[i] >> 16) & 0xff) * scale) >> 8, // red
-                (((channel->leds[i] >> 0)  & 0xff) * scale) >> 8, // blue
-            };
+                origin += channel->count;
+            }
+            else if (origin >= channel->count)
+            {
+                origin -= channel->count;
+            }
+
+            while (seg < channel->segment_count &&
+                   channel->segments[seg].start + channel->segments[seg].count <= pos)
+            {
+                seg++;
+            }
 
-            for (j = 0; j < ARRAY_SIZE(color); j++)        // Color
+            if (seg < channel->segment_count)
             {
-                for (k = 7; k >= 0; k--)                   // Bit
+                ws2811_segment_t *segment = &channel->segments[seg];
+
+                if (segment->start <= pos)
                 {
-                    uint8_t symbol = SYMBOL_LOW;
-
-                    if (color[j] & (1 << k))
-                    {
-                        symbol = SYMBOL_HIGH;
-                    }
-
-                    if (channel->invert)
-                    {
-                        symbol = ~symbol & 0x7;
-                    }
-
-                    for (l = 2; l >= 0; l--)               // Symbol
-                    {
-                        uint32_t *wordptr = &((uint32_t *)pwm_raw)[wordpos];
-
-                        *wordptr &= ~(1 << bitpos);
-                        if (symbol & (1 << l))
-                        {
-                            *wordptr |= (1 << bitpos);
-                        }
-
-                        bitpos--;
-                        if (bitpos < 0)
-                        {
-                            // Every other word is on the same channel
-                            wordpos += 2;
-
-                            bitpos = 31;
-                        }
-                    }
+                    segment_symbols_t *tables = &device->segment_symbols[chan][seg];
+
+                    layout = tables->layout;
+                    symbols = tables->symbols;
+                    correction = segment->correction;
+                    scale = tables->scale;
+                    end = segment->start + segment->count;
                 }
+                else
+                {
+                    end = segment->start;
+                }
+
+                if (end > channel->count)
+                {
+                    end = channel->count;
+                }
+            }
+
+            if (channel->dither)
+            {
+                encode_dither(&state, channel, device->dither_error[chan], origin, pos,
+                              end - pos, layout->colors, white, device->raw_symbols[chan],
+                              symbols, correction, scale);
             }
+            else
+            {
+                layout->encode[white](&state, channel->leds, channel->count, origin,
+                                      end - pos, step, symbols);
+            }
+
+            pos = end;
         }
+
+        flush_symbols(state.wordptr, state.bits, state.bitcount);
     }
 
+    device->symbols_valid = 1;
+
     // Ensure the CPU data cache is flushed before the DMA is started.
     __clear_cache((char *)pwm_raw,
-                  (char *)&pwm_raw[PWM_BYTE_COUNT(maxcount, ws2811->freq)]);
+                  (char *)&pwm_raw[pwm_byte_count(ws2811)]);
 
     // Wait for any previous DMA operation to complete.
     if (ws2811_wait(ws2811))
@@ -754,4 +1319,3 @@ int ws2811_render(ws2811_t *ws2811)
 
     return 0;
 }
-
@@ -37,16 +37,55 @@
 
 #define WS2811_TARGET_FREQ                       800000   // Can go as low as 400000
 
+// 4 color R, G, B and W ordering
+#define SK6812_STRIP_RGBW                        0x18100800
+#define SK6812_STRIP_RBGW                        0x18100008
+#define SK6812_STRIP_GRBW                        0x18081000
+#define SK6812_STRIP_GBRW                        0x18080010
+#define SK6812_STRIP_BRGW                        0x18001008
+#define SK6812_STRIP_BGRW                        0x18000810
+#define SK6812_SHIFT_WMASK                       0xf0000000
+
+// 3 color R, G and B ordering
+#define WS2811_STRIP_RGB                         0x00100800
+#define WS2811_STRIP_RBG                         0x00100008
+#define WS2811_STRIP_GRB                         0x00081000
+#define WS2811_STRIP_GBR                         0x00080010
+#define WS2811_STRIP_BRG                         0x00001008
+#define WS2811_STRIP_BGR                         0x00000810
+
+// Predefined fixed LED types
+#define WS2812_STRIP                             WS2811_STRIP_GRB
+#define SK6812_STRIP                             WS2811_STRIP_GRB
+#define SK6812W_STRIP                            SK6812_STRIP_GRBW
+
 struct ws2811_device;
 
-typedef uint32_t ws2811_led_t;                   //< 0x00RRGGBB
+typedef uint32_t ws2811_led_t;                   //< 0xWWRRGGBB
+typedef struct
+{
+    int start;                                   //< Position on the strip of the first LED
+    int count;                                   //< Number of LEDs
+    int strip_type;                              //< Strip color layout, 0 for the channel's; must have as many colors
+    int brightness;                              //< Brightness value between 0 and 255, -1 for the channel's
+    uint16_t correction[4][256];                 //< Red, green, blue, white 8.8 fixed-point lookup tables
+} ws2811_segment_t;
+
 typedef struct
 {
     int gpionum;                                 //< GPIO Pin with PWM alternate function, 0 if unused
     int invert;                                  //< Invert output signal
     int count;                                   //< Number of LEDs, 0 if channel is unused
     int brightness;                              //< Brightness value between 0 and 255
+    int strip_type;                              //< Strip color layout, one of WS2811_STRIP_xxx or SK6812_STRIP_xxx; 0 is GRB
     ws2811_led_t *leds;                          //< LED buffers, allocated by driver based on count
+    int origin;                                  //< Index into leds of the first LED sent
+    int reverse;                                 //< Send the LEDs from origin towards index 0, wrapping around
+    uint16_t correction[4][256];                 //< Red, green, blue, white 8.8 fixed-point lookup tables applied before brightness
+    int dither;                                  //< Temporal dithering from the 16-bit LED buffers
+    uint16_t *leds16;                            //< 16-bit red, green, blue per LED, allocated by driver when dithering
+    ws2811_segment_t *segments;                  //< Runs of LEDs with their own settings, sorted by start without overlaps; owned by the caller
+    int segment_count;                           //< Number of segments, 0 to send every LED with the channel settings
 } ws2811_channel_t;
 
 typedef struct
@@ -62,6 +101,7 @@ int ws2811_init(ws2811_t *ws2811);               //< Initialize buffers/hardware
 void ws2811_fini(ws2811_t *ws2811);              //< Tear it all down
 int ws2811_render(ws2811_t *ws2811);             //< Send LEDs off to hardware
 int ws2811_wait(ws2811_t *ws2811);               //< Wait for DMA completion
+void ws2811_correction_changed(ws2811_t *ws2811); //< Rebuild encoder tables after a correction or segment change
 
 
 #endif /* __WS2811_H__ */
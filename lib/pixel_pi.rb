@@ -6,4 +6,14 @@ rescue LoadError
   $stderr.puts "C extension is not configured."
   $stderr.puts "Using fake LEDs instead."
   require "pixel_pi/fake_leds"
+  require "pixel_pi/fake_batch"
+  require "pixel_pi/fake_layer"
+  require "pixel_pi/fake_slice"
+  require "pixel_pi/fake_layout"
+  require "pixel_pi/fake_animation"
+  require "pixel_pi/fake_receiver"
+  require "pixel_pi/fake_opc"
+  require "pixel_pi/fake_ring"
+  require "pixel_pi/fake_daemon"
+  require "pixel_pi/fake_sender"
 end
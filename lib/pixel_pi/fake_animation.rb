@@ -0,0 +1,376 @@
+module PixelPi
+
+  # An animation is a pre-rendered show stored in a file. The native version
+  # memory-maps the file; the fake reads it into a String. The file format is
+  # described in `ext/pixel_pi/animation.c`.
+  #
+  # Examples:
+  #    PixelPi::Animation.write( "show.pxa", frames, :fps => 50 )
+  #    PixelPi::Animation.open( "show.pxa" ) do |anim|
+  #      leds.play( anim, :loop => true )
+  #    end
+  #
+  class Animation
+
+    MAGIC       = "PXPIANIM".b.freeze
+    VERSION     = 1
+    HEADER_SIZE = 64
+    ENTRY_SIZE  = 16
+    FORMATS     = %i[rgb rgbw].freeze
+    BYTES       = [3, 4].freeze
+    CODECS      = %i[none delta].freeze
+    KEYFRAME    = 60
+    MIN_SKIP    = 4
+
+    # Open the animation file at `path`. With a block the animation is passed
+    # to the block and closed when the block returns.
+    #
+    # Returns the new PixelPi::Animation or the result of the block.
+    def self.open( path )
+      anim = new(path)
+      return anim unless block_given?
+      begin
+        yield anim
+      ensure
+        anim.close
+      end
+    end
+
+    # Write an animation file at `path`. The `frames` can be any object that
+    # responds to `each`, and each frame is an Array of colors or a packed
+    # String of 32-bit colors. All the frames must have the same number of
+    # LEDs.
+    #
+    # options - Hash of arguments
+    #   :fps      - frames per second, defaults to 30
+    #   :format   - `:rgb` (default) or `:rgbw`
+    #   :codec    - `:none` (default) or `:delta` to store only the bytes that
+    #               changed from the previous frame, run-length encoded
+    #   :keyframe - with the `:delta` codec every this many frames are stored
+    #               whole; defaults to 60
+    #
+    # Returns the number of frames written.
+    def self.write( path, frames, options = {} )
+      options ||= {}
+      format = parse_format(options[:format])
+      fps = options[:fps].nil? ? 30000 : parse_fps(options[:fps])
+      writer = Writer.new(path, format, *parse_codec(options))
+
+      frames.each do |frame|
+        colors = to_list(frame)
+        if writer.led_count && colors.length != writer.led_count
+          raise ArgumentError, "frame #{writer.frame_count} has #{colors.length} LEDs but the first frame has #{writer.led_count}"
+        end
+        writer.frame(colors, writer.frame_count * 1000000 / fps)
+      end
+
+      writer.close(fps)
+      writer.frame_count
+    ensure
+      writer.abort if writer
+    end
+
+    def self.parse_format( value ) # :nodoc:
+      return 0 if value.nil?
+      raise TypeError, "pixel format must be a Symbol: #{value.class}" unless value.is_a?(Symbol)
+      FORMATS.index(value) or raise ArgumentError, "unknown pixel format: #{value}"
+    end
+
+    def self.parse_fps( value ) # :nodoc:
+      fps = Float(value)
+      raise ArgumentError, "fps must be greater than zero: %g" % fps unless fps > 0.0 && fps <= 1000000.0
+      (fps * 1000.0 + 0.5).to_i
+    end
+
+    def self.parse_codec( options ) # :nodoc:
+      options ||= {}
+      codec = options[:codec]
+      unless codec.nil?
+        raise TypeError, "codec must be a Symbol: #{codec.class}" unless codec.is_a?(Symbol)
+        raise ArgumentError, "unknown codec: #{codec}" unless CODECS.include?(codec)
+      end
+      keyframe = options[:keyframe].nil? ? KEYFRAME : Integer(options[:keyframe])
+      if keyframe < 1 || keyframe > 0x7fffffff
+        raise ArgumentError, "keyframe interval must be positive: #{keyframe}"
+      end
+      [CODECS.index(codec) || 0, keyframe]
+    end
+
+    # Encode the `frame` bytes as the XOR with the `prev` bytes, run-length
+    # encoded; see `ext/pixel_pi/codec.c`.
+    def self.delta_encode( frame, prev ) # :nodoc:
+      out = []
+      len = frame.length
+      pos = 0
+      while pos < len
+        zero = pos
+        zero += 1 while zero < len && frame[zero] == prev[zero]
+        break if zero == len
+        out.concat(varint((zero - pos) << 1)) if zero > pos
+        pos = zero
+
+        last = pos
+        loop do
+          last += 1 while last < len && frame[last] != prev[last]
+          zero = last
+          zero += 1 while zero < len && frame[zero] == prev[zero]
+          break if zero == len || zero - last >= MIN_SKIP
+          last = zero
+        end
+
+        out.concat(varint(((last - pos) << 1) | 1))
+        (pos...last).each { |ii| out << (frame[ii] ^ prev[ii]) }
+        pos = last
+      end
+      out.pack("C*")
+    end
+
+    # Apply the encoded `data` to the `ref` bytes in place. Returns `nil` if
+    # the data is corrupt.
+    def self.delta_decode( data, ref ) # :nodoc:
+      bytes = data.unpack("C*")
+      ii = 0
+      pos = 0
+      while ii < bytes.length
+        value = 0
+        bits = 0
+        loop do
+          return nil if ii == bytes.length || bits > 28
+          byte = bytes[ii]
+          ii += 1
+          value |= (byte & 0x7F) << bits
+          bits += 7
+          break if byte & 0x80 == 0
+        end
+
+        len = value >> 1
+        return nil if len > ref.length - pos
+        if value & 1 == 1
+          return nil if len > bytes.length - ii
+          len.times { |k| ref[pos + k] ^= bytes[ii + k] }
+          ii += len
+        end
+        pos += len
+      end
+      ref
+    end
+
+    def self.varint( value ) # :nodoc:
+      out = []
+      while value >= 0x80
+        out << ((value & 0x7F) | 0x80)
+        value >>= 7
+      end
+      out << value
+    end
+
+    def self.to_list( obj ) # :nodoc:
+      case obj
+      when String
+        if obj.bytesize % 4 != 0
+          raise ArgumentError, "packed String length must be a multiple of 4: #{obj.bytesize}"
+        end
+        obj.unpack("L*")
+      when Array
+        obj.map { |value| Integer(value) & 0xFFFFFFFF }
+      else
+        raise TypeError, "expecting an Array or a packed String: #{obj.class}"
+      end
+    end
+
+    def initialize( path ) # :nodoc:
+      path = path.to_path if path.respond_to?(:to_path)
+      @data = File.binread(path)
+      if @data.bytesize < HEADER_SIZE || @data[0, 8] != MAGIC
+        raise ::PixelPi::Error, "not a PixelPi animation: #{path}"
+      end
+
+      version, @format, @led_count, @length, @fps, index, @codec, _, @keyframe =
+        @data[8, 32].unpack("vvVVVQ<vvV")
+      raise ::PixelPi::Error, "unsupported animation version: #{version}" if version != VERSION
+      raise ::PixelPi::Error, "unsupported pixel format: #{@format}" if @format >= FORMATS.length
+      raise ::PixelPi::Error, "animation frame rate is zero" if @fps == 0
+      raise ::PixelPi::Error, "unsupported codec: #{@codec}" if @codec >= CODECS.length
+      if @codec == 1 && (@keyframe < 1 || @keyframe > 0x7fffffff)
+        raise ::PixelPi::Error, "animation keyframe interval is invalid: #{@keyframe}"
+      end
+      if index > @data.bytesize || (@data.bytesize - index) / ENTRY_SIZE < @length
+        raise ::PixelPi::Error, "animation frame index is truncated"
+      end
+
+      size = @led_count * BYTES[@format]
+      @offsets = Array.new(@length) do |ii|
+        offset, length, time = @data[index + ii * ENTRY_SIZE, 16].unpack("Q<VV")
+        if (@codec == 0 && length != size) || offset > @data.bytesize || @data.bytesize - offset < length
+          raise ::PixelPi::Error, "animation frame #{ii} is corrupt"
+        end
+        [offset, time, length]
+      end
+    end
+    private_class_method :new
+
+    # Returns the number of frames in the animation.
+    def length
+      closed!
+      @length
+    end
+
+    # Returns the number of LEDs in each frame.
+    def led_count
+      closed!
+      @led_count
+    end
+
+    # Returns the frame rate the animation was rendered for as a Float.
+    def fps
+      closed!
+      @fps / 1000.0
+    end
+
+    # Returns the pixel format of the frames, `:rgb` or `:rgbw`.
+    def format
+      closed!
+      FORMATS[@format]
+    end
+
+    # Returns how the frames are stored, `:none` or `:delta`.
+    def codec
+      closed!
+      CODECS[@codec]
+    end
+
+    # Returns the keyframe interval of a delta coded animation, or `nil` if
+    # the frames are not delta coded.
+    def keyframe
+      closed!
+      @codec == 1 ? @keyframe : nil
+    end
+
+    # Returns the colors of frame `num` as an Array. A negative `num` counts
+    # back from the last frame.
+    def []( num )
+      closed!
+      n = Integer(num)
+      n += @length if n < 0
+      if n < 0 || n >= @length
+        raise IndexError, "index #{num} is outside of frame range: 0...#{@length-1}"
+      end
+      frame(n)
+    end
+
+    # Returns the time frame `num` is shown, in seconds after the first frame.
+    # Recorded animations keep the time each frame was actually shown.
+    def time( num )
+      closed!
+      n = Integer(num)
+      n += @length if n < 0
+      if n < 0 || n >= @length
+        raise IndexError, "index #{num} is outside of frame range: 0...#{@length-1}"
+      end
+      @offsets[n][1] / 1000.0
+    end
+
+    # Close the animation. It can no longer be played.
+    def close
+      @data = nil
+    end
+
+    # Returns `true` if the animation has been closed.
+    def closed?
+      @data.nil?
+    end
+
+    # Returns the colors of frame `n`.
+    def frame( n ) # :nodoc:
+      data = @codec == 1 ? delta_frame(n) : @data[@offsets[n][0], @led_count * BYTES[@format]]
+      if @format == 1
+        data.unpack("V*")
+      else
+        data.unpack("C*").each_slice(3).map { |r, g, b| (r << 16) | (g << 8) | b }
+      end
+    end
+
+    # Returns the frame rate in thousandths of a frame per second.
+    def fps1000 # :nodoc:
+      @fps
+    end
+
+  private
+
+    def closed!
+      raise(::PixelPi::Error, "Animation is closed") if @data.nil?
+    end
+
+    # Decode frame `n`, starting from the keyframe before it unless `n` follows
+    # the frame decoded last.
+    def delta_frame( n )
+      ii = n
+      if n != @next || n % @keyframe == 0
+        ii = n - n % @keyframe
+        @ref = [0] * (@led_count * BYTES[@format])
+      end
+      ii.upto(n) do |jj|
+        offset, _, length = @offsets[jj]
+        unless Animation.delta_decode(@data[offset, length], @ref)
+          @next = nil
+          raise ::PixelPi::Error, "animation frame #{jj} is corrupt"
+        end
+      end
+      @next = n + 1
+      @ref.pack("C*")
+    end
+
+    # Writes the frames of an animation file one at a time. The header is
+    # written last so a partial file is never mistaken for a complete one.
+    class Writer # :nodoc:
+      attr_reader :led_count, :frame_count
+
+      def initialize( path, format, codec = 0, keyframe = KEYFRAME )
+        @format = format
+        @codec = codec
+        @keyframe = keyframe
+        @led_count = nil
+        @frame_count = 0
+        @index = []
+        @fd = File.open(path, "wb")
+        @fd.write("\0" * HEADER_SIZE)
+        @offset = HEADER_SIZE
+      end
+
+      # Append a frame shown `time` milliseconds after the first frame.
+      def frame( colors, time )
+        @led_count ||= colors.length
+        data = if @format == 1
+          colors.pack("V*")
+        else
+          colors.map { |c| [(c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF] }.flatten.pack("C*")
+        end
+        if @codec == 1
+          @prev = [0] * data.bytesize if @frame_count % @keyframe == 0
+          bytes = data.unpack("C*")
+          data = Animation.delta_encode(bytes, @prev)
+          @prev = bytes
+        end
+        @fd.write(data)
+        @index << [@offset, data.bytesize, time].pack("Q<VV")
+        @offset += data.bytesize
+        @frame_count += 1
+      end
+
+      def close( fps )
+        @fd.write(@index.join)
+        @fd.seek(0)
+        header = [MAGIC, VERSION, @format, @led_count || 0, @frame_count, fps, @offset]
+        header.concat(@codec == 1 ? [@codec, 0, @keyframe] : [0, 0, 0])
+        @fd.write(header.pack("a8vvVVVQ<vvV").ljust(HEADER_SIZE, "\0"))
+        @fd.close
+        @fd = nil
+      end
+
+      def abort
+        @fd.close if @fd
+        @fd = nil
+      end
+    end
+  end
+end
@@ -0,0 +1,94 @@
+module PixelPi
+
+  # A batch records a sequence of LED buffer operations. The whole list is
+  # executed with a single call to `PixelPi::Leds#apply`, and the same batch
+  # can be applied again on every frame.
+  #
+  # Examples:
+  #    batch = PixelPi::Batch.new
+  #    batch.clear.fill( 0x0000FF, 0, 10 ).set( 12, 0xFF0000 ).rotate( 1 )
+  #
+  #    loop { leds.apply( batch ).show }
+  #
+  class Batch
+
+    def initialize
+      @commands = []
+    end
+
+    # The Array of recorded commands used by the fake LEDs
+    attr_reader :commands
+
+    # Returns the number of recorded commands.
+    def length
+      @commands.length
+    end
+
+    # Remove all the recorded commands from this batch.
+    #
+    # Returns this PixelPi::Batch instance.
+    def reset
+      @commands.clear
+      self
+    end
+
+    # Record a command that sets all LEDs to zero.
+    #
+    # Returns this PixelPi::Batch instance.
+    def clear
+      @commands << [:clear]
+      self
+    end
+
+    # Record a command that sets the selected LEDs to the given 24-bit RGB
+    # `color`. The arguments have the same meaning as `PixelPi::Leds#fill`.
+    #
+    # Returns this PixelPi::Batch instance.
+    def fill( color, *args )
+      @commands << [:fill, Integer(color), *args]
+      self
+    end
+
+    # Record a command that sets the LED at position `num` to the given 24-bit RGB
+    # `color`. Applying the batch raises an IndexError if `num` is outside the LED
+    # range.
+    #
+    # Returns this PixelPi::Batch instance.
+    def set( num, color )
+      @commands << [:set, Integer(num), Integer(color)]
+      self
+    end
+
+    # Record a command that rotates the LED colors so that the color at `count`
+    # comes first. See `PixelPi::Leds#rotate`.
+    #
+    # Returns this PixelPi::Batch instance.
+    def rotate( count = 1 )
+      @commands << [:rotate, Integer(count)]
+      self
+    end
+
+    # Record a command that reverses the order of the LED colors.
+    #
+    # Returns this PixelPi::Batch instance.
+    def reverse
+      @commands << [:reverse]
+      self
+    end
+
+    # Record a command that blends the selected LEDs towards the given 24-bit RGB
+    # `color`. The `alpha` is a value between 0 (LEDs are unchanged) and 255 (LEDs
+    # are set to `color`). The selection arguments have the same meaning as
+    # `PixelPi::Leds#fill`.
+    #
+    # Returns this PixelPi::Batch instance.
+    def blend( color, alpha, *args )
+      alpha = Integer(alpha)
+      if alpha < 0 || alpha > 255
+        raise ArgumentError, "alpha must be between 0 and 255: #{alpha}"
+      end
+      @commands << [:blend, Integer(color), alpha, *args]
+      self
+    end
+  end
+end
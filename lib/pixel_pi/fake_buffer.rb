@@ -0,0 +1,129 @@
+module PixelPi
+
+  # Whole buffer operations shared by the fake PixelPi::Leds and PixelPi::Layer.
+  # Each color is treated as four independent bytes so the white value of RGBW
+  # strips is included. The including class provides the `buffer` Array.
+  module FakeBuffer
+
+    # Scale every color by `factor / 256`. The factor is a value between 0 and
+    # 255; a factor of 255 leaves the colors unchanged and 0 turns them off.
+    #
+    # Returns this instance.
+    def scale( factor )
+      f = byte_arg(factor) + 1
+      buffer.map! { |c| per_byte(c) { |x| (x * f) >> 8 } } unless f == 256
+      self
+    end
+
+    # Fade every color toward black by `amount`, a value between 0 (unchanged)
+    # and 255 (off). This is the same as `scale(255 - amount)`.
+    #
+    # Returns this instance.
+    def fade_by( amount )
+      scale(255 - byte_arg(amount))
+    end
+
+    # Add the colors of the `other` buffer to these colors. Each color component
+    # saturates at 255. The `other` buffer can be a PixelPi::Leds, a
+    # PixelPi::Layer, or a packed String of 32-bit colors; only the overlapping
+    # length is changed.
+    #
+    # Returns this instance.
+    def add( other )
+      combine(other) { |c, o| per_byte(c, o) { |x, y| [x + y, 255].min } }
+    end
+
+    # Subtract the colors of the `other` buffer from these colors. Each color
+    # component stops at 0.
+    #
+    # Returns this instance.
+    def subtract( other )
+      combine(other) { |c, o| per_byte(c, o) { |x, y| [x - y, 0].max } }
+    end
+
+    # Blend the colors of the `other` buffer into these colors. The `alpha` is a
+    # value between 0 (these colors are kept) and 255 (the other colors replace
+    # these colors).
+    #
+    # Returns this instance.
+    def blend( other, alpha )
+      w = byte_arg(alpha)
+      w += w >> 7
+      combine(other) { |c, o| per_byte(c, o) { |x, y| (x * (256 - w) + y * w) >> 8 } }
+    end
+
+    # Move each color component toward the matching component of the `other`
+    # buffer by at most `rate` steps. Unlike `blend` the colors reach the target
+    # after a fixed number of calls: at most `255 / rate` rounded up.
+    #
+    # Returns this instance.
+    def lerp_toward( other, rate )
+      r = byte_arg(rate)
+      combine(other) do |c, o|
+        per_byte(c, o) { |x, y| x < y ? [x + r, y].min : [x - r, y].max }
+      end
+    end
+
+    # Blur the colors along the buffer. Each unit of `radius` is one pass of a
+    # [1 2 1] smoothing filter, so larger values spread the colors further. The
+    # ends of the buffer are treated as repeating the first and last colors.
+    #
+    # Returns this instance.
+    def blur( radius = 1 )
+      radius = Integer(radius)
+      raise ArgumentError, "radius cannot be negative: #{radius}" if radius < 0
+
+      buf = buffer
+      return self if buf.length < 2
+
+      radius.times do
+        src = buf.dup
+        src.each_index do |ii|
+          prev = src[ii == 0 ? 0 : ii - 1]
+          nxt  = src[ii + 1 < src.length ? ii + 1 : ii]
+          buf[ii] = [24, 16, 8, 0].inject(0) do |color, shift|
+            sum = ((prev >> shift) & 0xFF) + 2 * ((src[ii] >> shift) & 0xFF) + ((nxt >> shift) & 0xFF)
+            color | (((sum + 2) >> 2) << shift)
+          end
+        end
+      end
+      self
+    end
+
+    private
+
+    def byte_arg( num )
+      n = Integer(num)
+      raise ArgumentError, "value must be between 0 and 255: #{n}" if n < 0 || n > 255
+      n
+    end
+
+    def other_colors( other )
+      case other
+      when PixelPi::Leds, PixelPi::Layer, PixelPi::Slice
+        other.to_a
+      when String
+        if other.bytesize % 4 != 0
+          raise ArgumentError, "packed String length must be a multiple of 4: #{other.bytesize}"
+        end
+        other.unpack("L*")
+      else
+        raise TypeError, "expecting a PixelPi::Leds, a PixelPi::Layer, or a packed String: #{other.class}"
+      end
+    end
+
+    def combine( other )
+      buf = buffer
+      other_colors(other).first(buf.length).each_with_index do |o, ii|
+        buf[ii] = yield(buf[ii], o)
+      end
+      self
+    end
+
+    def per_byte( c, o = 0 )
+      [24, 16, 8, 0].inject(0) do |color, shift|
+        color | (yield((c >> shift) & 0xFF, (o >> shift) & 0xFF) << shift)
+      end
+    end
+  end
+end
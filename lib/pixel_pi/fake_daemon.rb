@@ -0,0 +1,412 @@
+require "socket"
+
+module PixelPi
+
+  # An output daemon that serves a PixelPi::Leds instance to other processes
+  # over a Unix socket. Clients connect with `PixelPi::Leds.connect` and show
+  # their frames through the daemon. The protocol is described in
+  # `ext/pixel_pi/daemon.c`; the fake shares each frame through an unlinked
+  # file in `/dev/shm` instead of a sealed memfd.
+  #
+  # Examples:
+  #    daemon = PixelPi::Daemon.new( leds )
+  #    loop { daemon.poll }
+  #
+  class Daemon
+
+    PATH       = "/run/pixel_pi.sock".freeze
+    MAGIC      = "PXPIDMN\0".b.freeze
+    VERSION    = 1
+    MODE       = 0660
+    TIMEOUT    = 2
+    SHOW       = 1
+    CORRECTION = 1
+    HELLO      = "a8a8L8l3Ld3Q".freeze
+    HELLO_SIZE = 96
+    FRAME      = "L3l3d3".freeze
+    FRAME_SIZE = 48
+    PAGE       = 4096
+    SHM_DIR    = "/dev/shm".freeze
+
+    # Serve the `leds` to other processes over a Unix socket. The strip keeps
+    # showing the last frame when a client goes away. A client that changes
+    # the gamma or white balance changes them for these LEDs as well.
+    #
+    # options - Hash of arguments
+    #   :path - path of the socket; defaults to "/run/pixel_pi.sock". A stale
+    #           socket left behind by a daemon that exited is replaced.
+    #   :mode - permissions of the socket; defaults to 0660
+    #
+    def initialize( leds, options = {} )
+      raise TypeError, "expecting a PixelPi::Leds object" unless leds.is_a?(::PixelPi::Leds)
+      leds.length
+      raise ArgumentError, "LEDs without a DMA channel cannot be served" if leds.instance_variable_get(:@output)
+      options ||= {}
+
+      path = options[:path].nil? ? PATH : options[:path]
+      path = path.to_path if path.respond_to?(:to_path)
+      path = String.new(path.to_str).freeze
+      mode = options[:mode].nil? ? MODE : Integer(options[:mode])
+      self.class.address(path)
+
+      socket = Socket.new(:UNIX, :SEQPACKET)
+      begin
+        bind(socket, path)
+      rescue SystemCallError => err
+        socket.close
+        raise err.class, path
+      end
+
+      begin
+        socket.listen(16)
+        File.chmod(mode, path)
+      rescue SystemCallError => err
+        socket.close
+        File.unlink(path) rescue nil
+        raise err.class, path
+      end
+
+      @leds    = leds
+      @path    = path
+      @socket  = socket
+      @clients = {}
+      @count   = 0
+      @stats   = { :connections => 0, :clients => 0, :frames => 0, :ignored => 0 }
+    end
+
+    # Wait up to `timeout` seconds for clients to connect or send frames,
+    # then accept the new connections and show the frames that have arrived.
+    #
+    # Returns the number of frames shown.
+    def poll( timeout = nil )
+      closed!
+      unless timeout.nil?
+        timeout = Float(timeout)
+        raise ArgumentError, "timeout cannot be negative: %g" % timeout if timeout < 0.0
+      end
+
+      total = 0
+      ready, = IO.select([@socket] + @clients.keys, nil, nil, timeout)
+      return total if ready.nil?
+
+      ready.each do |io|
+        next if io == @socket
+        # `show` can run Ruby code that closes the daemon or the client
+        return total if @socket.nil?
+        total += read(io) if @clients.key?(io)
+      end
+      accept if @socket && ready.include?(@socket)
+      total
+    end
+
+    # Returns the counters of the daemon as a Hash; see
+    # `ext/pixel_pi/daemon.c` for their meaning.
+    def stats
+      closed!
+      @stats.merge(:clients => @clients.length)
+    end
+
+    # Returns the path of the socket.
+    def path
+      closed!
+      @path
+    end
+
+    # Disconnect all the clients, stop listening, and remove the socket. The
+    # LEDs keep showing the last frame.
+    def close
+      @clients.each { |io, shm| io.close; shm.close } if @clients
+      @clients = {}
+      if @socket
+        @socket.close
+        File.unlink(@path) rescue nil
+      end
+      @socket = nil
+      @leds = nil
+    end
+
+    # Returns `true` if the daemon has been closed.
+    def closed?
+      @socket.nil?
+    end
+
+    def self.address( path ) # :nodoc:
+      if path.empty? || path.bytesize >= 108
+        raise ArgumentError, "invalid socket path: #{path}"
+      end
+      Socket.sockaddr_un(path)
+    end
+
+    def self.shm_size( count, dither ) # :nodoc:
+      size = count * 4
+      size += count * 6 if dither
+      size > 0 ? (size + PAGE - 1) & ~(PAGE - 1) : PAGE
+    end
+
+    def self.gamma_value( gamma ) # :nodoc:
+      gamma.uniq.length == 1 ? gamma.first : gamma
+    end
+
+    def self.parse_gamma( value ) # :nodoc:
+      value.is_a?(Array) ? value.map { |v| Float(v) } : [Float(value)] * 3
+    end
+
+    def self.parse_white_balance( value ) # :nodoc:
+      return value.map { |v| Integer(v) & 0xFF } if value.is_a?(Array)
+      value = Integer(value)
+      [(value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF]
+    end
+
+  private
+
+    def closed!
+      raise(::PixelPi::Error, "Daemon is closed") if @socket.nil?
+    end
+
+    # Bind the socket, replacing a socket file left behind by a daemon that
+    # exited; nothing accepts connections on a stale socket.
+    def bind( socket, path )
+      addr = self.class.address(path)
+      socket.bind(addr)
+    rescue Errno::EADDRINUSE
+      probe = Socket.new(:UNIX, :SEQPACKET)
+      begin
+        probe.connect(addr)
+      rescue Errno::ECONNREFUSED
+        File.unlink(path)
+        return socket.bind(addr)
+      ensure
+        probe.close
+      end
+      raise Errno::EADDRINUSE
+    end
+
+    def accept
+      loop do
+        io, = @socket.accept_nonblock
+        shm = shared_memory
+        begin
+          io.sendmsg(hello(shm.size), 0, nil, Socket::AncillaryData.unix_rights(shm))
+        rescue SystemCallError
+          io.close
+          shm.close
+          next
+        end
+        @clients[io] = shm
+        @stats[:connections] += 1
+      end
+    rescue IO::WaitReadable, Errno::ECONNABORTED
+    end
+
+    def shared_memory
+      @count += 1
+      name = "#{SHM_DIR}/pixel_pi-#{Process.pid}-#{@count}"
+      shm = File.open(name, File::RDWR | File::CREAT | File::EXCL, 0600)
+      File.unlink(name)
+      shm.truncate(self.class.shm_size(@leds.length, @leds.dither))
+      shm
+    end
+
+    def hello( shm_size )
+      gamma = self.class.parse_gamma(@leds.gamma)
+      wb = self.class.parse_white_balance(@leds.white_balance)
+      [
+        MAGIC, @leds.strip_type.to_s, VERSION, @leds.length, @leds.gpio, @leds.dma,
+        @leds.frequency, @leds.invert ? 1 : 0, @leds.brightness, @leds.dither ? 1 : 0,
+        *wb, 0, *gamma, shm_size
+      ].pack(HELLO)
+    end
+
+    def read( io )
+      frames = 0
+      loop do
+        begin
+          data = io.recv_nonblock(FRAME_SIZE + 1)
+        rescue IO::WaitReadable
+          return frames
+        rescue SystemCallError
+          data = ""
+        end
+        if data.nil? || data.empty?
+          @clients.delete(io).close
+          io.close
+          return frames
+        end
+
+        status = 0
+        error = nil
+        begin
+          if data.bytesize != FRAME_SIZE || !frame(@clients[io], data.unpack(FRAME))
+            status = -Errno::EINVAL::Errno
+            @stats[:ignored] += 1
+          else
+            @stats[:frames] += 1
+            frames += 1
+          end
+        rescue Exception => error
+          status = -Errno::EIO::Errno
+        end
+
+        unless @clients.key?(io)
+          raise error if error
+          return frames
+        end
+
+        begin
+          io.sendmsg_nonblock([status].pack("l"))
+        rescue SystemCallError, IO::WaitWritable
+          raise error if error
+          @clients.delete(io).close
+          io.close
+          return frames
+        end
+        raise error if error
+      end
+    end
+
+    # Copy the frame of the client into the LEDs and show it.
+    def frame( shm, message )
+      type, brightness, flags, *rest = message
+      return false if type != SHOW
+      wb, gamma = rest[0, 3], rest[3, 3]
+
+      if flags & CORRECTION != 0
+        return false unless gamma.all? { |v| v > 0.0 } && wb.all? { |v| v >= 0 && v <= 255 }
+        begin
+          @leds.gamma = self.class.gamma_value(gamma)
+          @leds.white_balance = PixelPi::Color(*wb)
+        rescue StandardError
+          return false
+        end
+        # the daemon may have been closed by the Ruby code that ran
+        return false if @socket.nil?
+      end
+
+      count = @leds.length
+      return false if count * 4 > shm.size
+      @leds.replace16(shm.pread(count * 6, count * 4)) if @leds.dither && count * 10 <= shm.size
+      @leds.replace(shm.pread(count * 4, 0).unpack("L*"))
+      @leds.brightness = brightness & 0xFF
+      @leds.show
+      true
+    end
+
+    # The daemon connection of a PixelPi::Leds returned by `Leds.connect`.
+    class Client # :nodoc:
+
+      def self.connect( path )
+        addr = Daemon.address(path)
+        socket = Socket.new(:UNIX, :SEQPACKET)
+        begin
+          socket.connect(addr)
+        rescue SystemCallError => err
+          socket.close
+          raise err.class, path
+        end
+
+        timeout = [TIMEOUT, 0].pack("l!l!")
+        socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_RCVTIMEO, timeout)
+        socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_SNDTIMEO, timeout)
+
+        begin
+          data, _, _, *controls = socket.recvmsg(HELLO_SIZE + 1, 0, nil, :scm_rights => true)
+          shm = controls.map { |c| c.unix_rights rescue nil }.flatten.compact.first
+          raise Errno::ECONNRESET if data.nil? || data.empty?
+          if data.bytesize != HELLO_SIZE || shm.nil? || data.byteslice(0, 8) != MAGIC
+            raise ::PixelPi::Error, "not a PixelPi daemon: #{path}"
+          end
+
+          _, strip_type, version, count, gpio, dma, frequency, invert, brightness, dither, *rest = data.unpack(HELLO)
+          raise ::PixelPi::Error, "unsupported daemon version: #{version}" if version != VERSION
+          if rest.last < Daemon.shm_size(count, dither != 0)
+            raise ::PixelPi::Error, "daemon frame is truncated: #{path}"
+          end
+        rescue Exception => err
+          socket.close
+          shm.close if shm
+          raise Errno::ETIMEDOUT, path if err.is_a?(Errno::EAGAIN)
+          raise err.class, path if err.is_a?(SystemCallError)
+          raise
+        end
+
+        wb, gamma = rest[0, 3], rest[4, 3]
+        client = new(socket, shm, gamma, wb)
+        options = {
+          :dma => dma, :frequency => frequency, :invert => invert != 0, :brightness => brightness,
+          :dither => dither != 0, :strip_type => strip_type.delete("\0").to_sym,
+          :gamma => Daemon.gamma_value(gamma), :white_balance => PixelPi::Color(*wb)
+        }
+        [client, count, gpio, options]
+      end
+
+      def initialize( socket, shm, gamma, wb )
+        @socket = socket
+        @shm    = shm
+        @gamma  = gamma
+        @wb     = wb
+      end
+
+      # Copy the frame into the shared memory and ask the daemon to show it.
+      def render( leds, leds16, brightness, gamma, wb )
+        raise Errno::ENOTCONN, "PixelPi::Daemon" if @socket.nil?
+        gamma = Daemon.parse_gamma(gamma)
+        wb = Daemon.parse_white_balance(wb)
+        correction = gamma != @gamma || wb != @wb
+
+        @shm.pwrite(leds.pack("L*"), 0)
+        @shm.pwrite(leds16.pack("S*"), leds.length * 4) if leds16
+        message = [SHOW, brightness & 0xFF, correction ? CORRECTION : 0, *wb, *gamma].pack(FRAME)
+
+        # a reply that is late must not be read as the reply to the next frame
+        begin
+          @socket.sendmsg(message)
+          # Ruby waits out EAGAIN itself, so the receive timeout is kept here
+          raise Errno::EAGAIN if IO.select([@socket], nil, nil, TIMEOUT).nil?
+          reply = @socket.recv(5)
+        rescue Errno::EAGAIN
+          close
+          raise Errno::ETIMEDOUT, "PixelPi::Daemon"
+        rescue SystemCallError => err
+          close
+          raise err.class, "PixelPi::Daemon"
+        end
+        if reply.nil? || reply.bytesize != 4
+          close
+          raise(reply.nil? || reply.empty? ? Errno::ECONNRESET : Errno::EIO, "PixelPi::Daemon")
+        end
+        status = reply.unpack1("l")
+        raise SystemCallError.new("PixelPi::Daemon", status < 0 ? -status : Errno::EIO::Errno) if status != 0
+
+        @gamma, @wb = gamma, wb if correction
+        self
+      end
+
+      def close
+        @socket.close if @socket
+        @shm.close if @shm
+        @socket = @shm = nil
+      end
+    end
+  end
+
+  class Leds
+
+    # Connect to the PixelPi::Daemon listening on `path`. The PixelPi::Leds
+    # returned works like one created with `new`, but `show` hands the frame
+    # to the daemon instead of driving the DMA channel. The length, GPIO,
+    # strip type, and the other settings of the strip are those of the
+    # daemon. Calling `close` disconnects and leaves the last frame on the
+    # strip. A `show` that the daemon does not answer in time raises
+    # Errno::ETIMEDOUT and disconnects as well.
+    #
+    # Returns the new PixelPi::Leds.
+    def self.connect( path = nil )
+      path = Daemon::PATH if path.nil?
+      path = path.to_path if path.respond_to?(:to_path)
+      client, count, gpio, options = Daemon::Client.connect(String.new(path.to_str))
+      leds = new(count, gpio, options)
+      leds.instance_variable_set(:@output, client)
+      leds
+    end
+  end
+end
@@ -0,0 +1,175 @@
+require "pixel_pi/fake_buffer"
+
+module PixelPi
+
+  # A layer is a buffer of colors that is composited over the LED buffer every
+  # time `show` is called once it is attached to a PixelPi::Leds instance with
+  # `add_layer`. The LED buffer itself is not changed by the layers.
+  #
+  # Examples:
+  #    sprite = PixelPi::Layer.new( 5, :z => 1, :blend_mode => :add )
+  #    sprite.fill( 0xFF0000 )
+  #    leds.add_layer( sprite )
+  #    leds.length.times { |ii| sprite.offset = ii; leds.show }
+  #
+  class Layer
+    include FakeBuffer
+
+    BLEND_MODES = %i[normal add multiply screen max].freeze
+
+    # Create a new PixelPi::Layer with its own buffer of `length` colors.
+    #
+    # length  - the number of pixels in the layer
+    # options - Hash of arguments
+    #   :z          - z-order; higher layers are composited last defaults to 0
+    #   :opacity    - opacity between 0 and 255 defaults to 255
+    #   :blend_mode - blend mode defaults to `:normal`; one of `:normal`, `:add`,
+    #                 `:multiply`, `:screen`, or `:max`
+    #   :offset     - LED position of the first layer pixel defaults to 0
+    #
+    def initialize( length, options = {} )
+      length = Integer(length)
+      raise ArgumentError, "length cannot be negative: #{length}" if length < 0
+
+      @pixels         = [0] * length
+      self.z          = options.fetch(:z, 0)
+      self.opacity    = options.fetch(:opacity, 255)
+      self.blend_mode = options.fetch(:blend_mode, :normal)
+      self.offset     = options.fetch(:offset, 0)
+    end
+
+    attr_reader :z, :opacity, :blend_mode, :offset
+
+    # Returns the number of pixels in the layer.
+    def length
+      @pixels.length
+    end
+
+    # Set the z-order of the layer. Layers with a higher z-order are composited
+    # on top of layers with a lower z-order.
+    def z=( value )
+      @z = Integer(value)
+    end
+
+    # Set the opacity of the layer. This is a value between 0 (the layer is not
+    # shown) and 255 (the blended colors replace the colors below).
+    def opacity=( value )
+      @opacity = Integer(value) & 0xFF
+    end
+
+    # Set the blend mode of the layer - one of `:normal`, `:add`, `:multiply`,
+    # `:screen`, or `:max`.
+    def blend_mode=( value )
+      raise TypeError, "blend mode must be a Symbol: #{value.class}" unless value.is_a?(Symbol)
+      raise ArgumentError, "unknown blend mode: #{value}" unless BLEND_MODES.include?(value)
+      @blend_mode = value
+    end
+
+    # Set the LED position of the first layer pixel. Pixels outside the LED
+    # string are not shown.
+    def offset=( value )
+      @offset = Integer(value)
+    end
+
+    # Get the 24-bit RGB color value for the layer pixel at position `num`.
+    def []( num )
+      check_index(num)
+      @pixels[num]
+    end
+
+    # Set the layer pixel at position `num` to the provided 24-bit RGB color
+    # value. An IndexError is raised if `num` is outside the layer range.
+    def []=( num, color )
+      check_index(num)
+      @pixels[num] = Integer(color) & 0xFFFFFFFF
+    end
+
+    # Set all the layer pixels to the given 24-bit RGB `color`.
+    #
+    # Returns this PixelPi::Layer instance.
+    def fill( color )
+      @pixels.fill(Integer(color) & 0xFFFFFFFF)
+      self
+    end
+
+    # Set all the layer pixels to zero.
+    #
+    # Returns this PixelPi::Layer instance.
+    def clear
+      @pixels.fill(0)
+      self
+    end
+
+    # Replace the layer pixels with the 24-bit RGB color values found in
+    # `colors` - an Array of Integers or a packed String of native 32-bit
+    # unsigned values. Colors past the end of the layer are ignored.
+    #
+    # Returns this PixelPi::Layer instance.
+    def replace( colors )
+      list = case colors
+        when String
+          if colors.bytesize % 4 != 0
+            raise ArgumentError, "packed String length must be a multiple of 4: #{colors.bytesize}"
+          end
+          colors.unpack("L*")
+        when Array
+          colors.map { |value| Integer(value) & 0xFFFFFFFF }
+        else
+          raise TypeError, "expecting an Array or a packed String: #{colors.class}"
+        end
+      list.first(@pixels.length).each_with_index { |value, ii| @pixels[ii] = value }
+      self
+    end
+
+    # Returns an Array of the 24-bit RGB values of the layer pixels.
+    def to_a
+      @pixels.dup
+    end
+
+    # Composite this layer onto the `leds` Array of colors. This is used by
+    # the fake LEDs when showing the attached layers.
+    def composite( leds )
+      w = opacity + (opacity >> 7)
+      return leds if w == 0
+
+      @pixels.each_with_index do |s, ii|
+        pos = offset + ii
+        next if pos < 0 || pos >= leds.length
+
+        d = leds[pos]
+        b = case blend_mode
+          when :normal   then s
+          when :add      then per_byte(d, s) { |x, y| [x + y, 255].min }
+          when :multiply then per_byte(d, s) { |x, y| mul8(x, y) }
+          when :screen   then per_byte(d, s) { |x, y| 255 - mul8(255 - x, 255 - y) }
+          when :max      then per_byte(d, s) { |x, y| [x, y].max }
+          end
+        leds[pos] = (w == 256) ? b : mix(d, b, w)
+      end
+      leds
+    end
+
+    private
+
+    def buffer
+      @pixels
+    end
+
+    def check_index( num )
+      if (num < 0 || num >= @pixels.length)
+        raise IndexError, "index #{num} is outside of layer range: 0...#{@pixels.length-1}"
+      end
+    end
+
+    def mul8( a, b )
+      t = a * b + 128
+      (t + (t >> 8)) >> 8
+    end
+
+    def mix( d, s, w )
+      iw = 256 - w
+      ((((d & 0x00FF00FF) * iw + (s & 0x00FF00FF) * w) >> 8) & 0x00FF00FF) |
+        ((((d >> 8) & 0x00FF00FF) * iw + ((s >> 8) & 0x00FF00FF) * w) & 0xFF00FF00)
+    end
+  end
+end
@@ -0,0 +1,96 @@
+module PixelPi
+
+  # A layout maps the (x, y) positions of a matrix to LED indices. Attach it to
+  # a PixelPi::Leds instance with `layout=` to use the 2D methods `set_xy`,
+  # `get_xy`, `fill_rect`, `blit`, and `scroll`. Position (0, 0) is the top
+  # left.
+  #
+  # Examples:
+  #    leds.layout = PixelPi::Layout.new( 32, 8, :order => :serpentine )
+  #    leds.fill_rect( 0, 0, 4, 4, 0xFF0000 )
+  #
+  class Layout
+
+    ORDERS = %i[row_major serpentine column_major column_serpentine].freeze
+
+    # Create a mapping from the (x, y) positions of a `width` by `height`
+    # matrix to LED indices.
+    #
+    # options - Hash of arguments
+    #   :order - how the LEDs are wired defaults to `:row_major`; one of
+    #            `:row_major`, `:serpentine` (every other row runs right to
+    #            left), `:column_major`, or `:column_serpentine`
+    #   :panel - `[width, height]` of the panels when the matrix is tiled from
+    #            smaller panels; panels are chained left to right, then top to
+    #            bottom, and each is wired in the given `:order`
+    #   :map   - an Array or packed String of `width * height` LED indices
+    #            given row by row; -1 marks a position without an LED. The
+    #            other options are ignored.
+    #
+    def initialize( width, height, options = {} )
+      @width  = Integer(width)
+      @height = Integer(height)
+      if @width < 0 || @height < 0
+        raise ArgumentError, "layout size cannot be negative: #{@width}x#{@height}"
+      end
+
+      order = options.fetch(:order, :row_major)
+      raise TypeError, "layout order must be a Symbol: #{order.class}" unless order.is_a?(Symbol)
+      raise ArgumentError, "unknown layout order: #{order}" unless ORDERS.include?(order)
+
+      pw, ph = @width, @height
+      if (panel = options[:panel])
+        raise TypeError, "wrong argument type #{panel.class} (expected Array)" unless panel.is_a?(Array)
+        raise ArgumentError, "panel must be given as [width, height]" unless panel.length == 2
+        pw, ph = panel.map { |v| Integer(v) }
+        if pw <= 0 || ph <= 0 || @width % pw != 0 || @height % ph != 0
+          raise ArgumentError, "panel size #{pw}x#{ph} does not tile the #{@width}x#{@height} layout"
+        end
+      end
+
+      if (map = options[:map])
+        map = map.is_a?(String) ? map.unpack("L*") : map.map { |v| Integer(v) & 0xFFFFFFFF }
+        if map.length != @width * @height
+          raise ArgumentError, "map must have #{@width * @height} entries: #{map.length}"
+        end
+        @map = map.map { |v| v == 0xFFFFFFFF ? nil : v }
+      else
+        @map = Array.new(@width * @height) do |ii|
+          x, y = ii % @width, ii / @width
+          panel = (y / ph) * (@width / pw) + (x / pw)
+          panel * pw * ph + order_index(order, x % pw, y % ph, pw, ph)
+        end
+      end
+    end
+
+    attr_reader :width, :height
+
+    # Returns the LED index at position (x, y) or `nil` if there is no LED at
+    # that position. Raises an IndexError if the position is outside the
+    # matrix.
+    def index( x, y )
+      x, y = Integer(x), Integer(y)
+      if x < 0 || x >= @width || y < 0 || y >= @height
+        raise IndexError, "position (#{x}, #{y}) is outside of layout: #{@width}x#{@height}"
+      end
+      @map[y * @width + x]
+    end
+
+    # Returns an Array of the LED index of each position, row by row. Positions
+    # without an LED are `nil`.
+    def to_a
+      @map.dup
+    end
+
+  private
+
+    def order_index( order, x, y, w, h )
+      case order
+      when :serpentine;        y * w + (y.odd? ? w - 1 - x : x)
+      when :column_major;      x * h + y
+      when :column_serpentine; x * h + (x.odd? ? h - 1 - y : y)
+      else                     y * w + x
+      end
+    end
+  end
+end
@@ -1,13 +1,98 @@
 require "forwardable"
+require "pixel_pi/fake_buffer"
 
 module PixelPi
 
   # Given a set of RGB values return a single 24-bit color value. The RGB values
-  # are nubmers in the range 0..255.
+  # are nubmers in the range 0..255. The optional `white` value is placed in the
+  # top byte for use with RGBW strips.
   #
   # Returns a 24-bit RGB color value.
-  def self.Color( red, green, blue )
-    ((red & 0xFF) << 16) | ((green & 0xFF) << 8) | (blue & 0xFF)
+  def self.Color( red, green, blue, white = nil )
+    color = ((red & 0xFF) << 16) | ((green & 0xFF) << 8) | (blue & 0xFF)
+    color |= (white & 0xFF) << 24 unless white.nil?
+    color
+  end
+
+  # The strip types by name; the name gives the order the colors are sent in.
+  STRIP_TYPES = %i[rgb rbg grb gbr brg bgr rgbw rbgw grbw gbrw brgw bgrw].freeze
+
+  # Generate rainbow colors across 0-255 positions. The colors transition from
+  # red to green to blue and back to red.
+  #
+  # Returns a 24-bit RGB color value.
+  def self.Wheel( pos )
+    pos = Integer(pos) & 0xFF
+    if pos < 85
+      Color(pos * 3, 255 - pos * 3, 0)
+    elsif pos < 170
+      pos -= 85
+      Color(255 - pos * 3, 0, pos * 3)
+    else
+      pos -= 170
+      Color(0, pos * 3, 255 - pos * 3)
+    end
+  end
+
+  # Given a set of HSV values return a single 24-bit color value. The HSV values
+  # are numbers in the range 0..255. The `:mode` option selects the `:rainbow`
+  # (default) or `:spectrum` hue mapping.
+  #
+  # Returns a 24-bit RGB color value.
+  def self.HSV( hue, sat, val, options = {} )
+    table = hue_table(options)
+    hsv_scale(table[Integer(hue) & 0xFF], hsv_factor(sat), hsv_factor(val))
+  end
+
+  # Returns the Array of fully saturated hue colors for the given `:mode`.
+  def self.hue_table( options = nil )
+    mode = (options || {}).fetch(:mode, :rainbow) || :rainbow
+    case mode
+    when :rainbow;  @rainbow_table  ||= Array.new(256) { |hue| rainbow_color(hue) }
+    when :spectrum; @spectrum_table ||= Array.new(256) { |hue| spectrum_color(hue) }
+    else
+      raise ArgumentError, "unknown HSV mode: #{mode.inspect}"
+    end
+  end
+
+  def self.rainbow_color( hue )
+    offset8   = (hue & 0x1F) << 3
+    third     = (offset8 * 86) >> 8
+    twothirds = (offset8 * 171) >> 8
+    case hue >> 5
+    when 0; Color(255 - third, third, 0)
+    when 1; Color(171, 85 + third, 0)
+    when 2; Color(171 - twothirds, 170 + third, 0)
+    when 3; Color(0, 255 - third, third)
+    when 4; Color(0, 171 - twothirds, 85 + twothirds)
+    when 5; Color(third, 0, 255 - third)
+    when 6; Color(85 + third, 0, 171 - third)
+    else    Color(170 + third, 0, 85 - third)
+    end
+  end
+
+  def self.spectrum_color( hue )
+    h      = (hue * 192) >> 8
+    rampup = ((h & 0x3F) * 255) / 63
+    rampdn = 255 - rampup
+    case h >> 6
+    when 0; Color(rampdn, rampup, 0)
+    when 1; Color(0, rampdn, rampup)
+    else    Color(rampup, 0, rampdn)
+    end
+  end
+
+  def self.hsv_factor( num )
+    n = Integer(num) & 0xFF
+    n + (n >> 7)
+  end
+
+  def self.hsv_scale( color, sat, val )
+    base = 256 - sat
+    [16, 8, 0].inject(0) do |out, shift|
+      c = (((((color >> shift) & 0xFF) * sat + 0xFF * base) >> 8) * val) >> 8
+      out | (c << shift)
+    end
   end
 
   # PixelPi::Error class
@@ -15,6 +100,7 @@ module PixelPi
 
   class Leds
     extend Forwardable
+    include FakeBuffer
 
     # call-seq:
     #    PixelPi::Leds.new( length, gpio, options = {} )
@@ -27,10 +113,27 @@ module PixelPi
     # length  - the nubmer of leds in the string
     # gpio    - the GPIO pin number
     # options - Hash of arguments
-    #   :dma        - DMA channel defaults to 5
-    #   :frequency  - output frequency defaults to 800,000 Hz
-    #   :invert     - defaults to `false`
-    #   :brightness - defaults to 255
+    #   :dma           - DMA channel defaults to 5
+    #   :frequency     - output frequency defaults to 800,000 Hz
+    #   :invert        - defaults to `false`
+    #   :brightness    - defaults to 255
+    #   :gamma         - gamma correction defaults to 1.0; can be a single value
+    #                    or an Array of red, green, and blue values
+    #   :white_balance - the 24-bit RGB color shown for full white defaults to
+    #                    0xFFFFFF; can also be an Array of red, green, and blue
+    #   :dither        - keep a 16-bit per color buffer and temporally dither it
+    #                    down to 8 bits when encoding; defaults to `false`
+    #   :strip_type    - order the colors are sent in defaults to `:grb`; one of
+    #                    `:rgb`, `:rbg`, `:grb`, `:gbr`, `:brg`, `:bgr` or the
+    #                    RGBW variants `:rgbw`, `:grbw`, etc. For RGBW strips the
+    #                    white value is the top byte of each 32-bit color.
+    #   :output        - "udp://host:port" or "tcp://host:port" to send each
+    #                    frame to a PixelPi::Receiver using the `:pixel_pi`
+    #                    protocol; the port defaults to 20560
+    #   :refresh       - with `:output`, every chunk of LEDs is sent in full
+    #                    once every this many frames; defaults to 60
+    #   :debug         - draw every frame in the terminal as it is shown; see
+    #                    `preview`; defaults to `false`
     #
     def initialize( length, gpio, options = {} )
       @leds       = [0] * length
@@ -39,15 +142,28 @@ module PixelPi
       @frequency  = options.fetch(:frequency, 800_000)
       @invert     = options.fetch(:invert, false)
       @brightness = options.fetch(:brightness, 255)
-      @debug      = options.fetch(:debug, false)
+      @dither     = options.fetch(:dither, false) ? true : false
+      @leds16     = [0] * (length * 3) if @dither
+      @strip_type = options.fetch(:strip_type, :grb)
 
-      if @debug
-        require "rainbow"
-        @debug = "◉ " unless @debug.is_a?(String) && !@debug.empty?
+      unless @strip_type.is_a?(Symbol)
+        raise TypeError, "strip type must be a Symbol: #{@strip_type.class}"
+      end
+      unless STRIP_TYPES.include?(@strip_type)
+        raise ArgumentError, "unknown strip type: #{@strip_type}"
       end
+
+      self.gamma         = options.fetch(:gamma, 1.0)
+      self.white_balance = options.fetch(:white_balance, 0xFFFFFF)
+
+      unless options[:output].nil?
+        @output = Sender.new(options[:output], length, @strip_type, options[:refresh])
+      end
+
+      preview if options.fetch(:debug, false)
     end
 
-    attr_reader :gpio, :dma, :frequency, :invert, :brightness
+    attr_reader :gpio, :dma, :frequency, :invert, :brightness, :gamma, :white_balance, :dither, :strip_type
 
     def_delegators :@leds, :length, :[]
 
@@ -60,17 +176,172 @@ module PixelPi
       @brightness = Integer(value) & 0xFF;
     end
 
-    # Update the display with the data from the LED buffer. This is a noop method
-    # for the fake LEDs.
+    # Set the gamma correction applied to the pixels. A single value is used for
+    # all three colors, or an Array of red, green, and blue values can be given.
+    #
+    # Returns the new gamma.
+    def gamma=( value )
+      gamma = value.is_a?(Array) ? value.map { |v| Float(v) } : [Float(value)] * 3
+      if gamma.length != 3
+        raise ArgumentError, "gamma must have 3 values (red, green, blue): #{gamma.length}"
+      end
+      gamma.each { |v| raise ArgumentError, "gamma must be positive: #{v}" unless v > 0.0 }
+
+      @gamma = value
+      build_correction
+      value
+    end
+
+    # Set the white balance. This is the color shown when a pixel is set to full
+    # white; every color is scaled per channel by this value. It can be a 24-bit
+    # RGB color or an Array of red, green, and blue values.
+    #
+    # Returns the new white balance.
+    def white_balance=( value )
+      if value.is_a?(Array) && value.length != 3
+        raise ArgumentError, "white balance must have 3 values (red, green, blue): #{value.length}"
+      end
+
+      @white_balance = value
+      build_correction
+      value
+    end
+
+    # Update the display with the data from the LED buffer. Any attached layers
+    # are composited over the LED buffer first; the LED buffer itself is left
+    # unchanged. The frame is also queued for the recorder when `record` is on,
+    # and drawn in the terminal when `preview` is on.
+    # This is a noop method for the fake LEDs.
     def show
       closed!
-      if @debug
-        ary = @leds.map { |value| Rainbow(@debug).color(*to_rgb(value)) }
-        $stdout.print "\r#{ary.join}"
+      if @preview || @recording || @output
+        leds = layers.each_with_index.sort_by { |layer, ii| [layer.z, ii] }.
+          inject(@leds.dup) { |buf, (layer, _)| layer.composite(buf) }
+        @output.render(leds, @leds16, @brightness, @gamma, @white_balance) if @output
+        capture(leds) if @recording
+        draw_preview(leds) if @preview
+      end
+      self
+    end
+
+    # Record every frame sent by `show` to the animation file at `path`, until
+    # `stop_recording` is called. When a block is given the recording is
+    # stopped when the block returns, and the number of frames recorded is
+    # returned. Each frame is stored after compositing the layers and scaling
+    # by the brightness, along with the time it was shown. A background thread
+    # writes the frames; if it falls behind and the buffer fills, frames are
+    # dropped.
+    #
+    # options - Hash of arguments
+    #   :buffer   - number of frames that can wait to be written; defaults to 64
+    #   :codec    - `:delta` to store only the changes between frames
+    #   :keyframe - keyframe interval of the `:delta` codec; defaults to 60
+    #
+    # A recording must be finished with `stop_recording` or the block form.
+    #
+    # Returns this PixelPi::Leds instance.
+    def record( path, options = {} )
+      closed!
+      path = path.to_path if path.respond_to?(:to_path)
+      slots = Integer((options || {}).fetch(:buffer, nil) || 64)
+      raise ArgumentError, "buffer must hold at least one frame: #{slots}" if slots < 1
+      codec = PixelPi::Animation.parse_codec(options)
+      raise ::PixelPi::Error, "already recording to #{@recording[:path]}" if @recording
+
+      format = @strip_type.to_s.end_with?("w") ? 1 : 0
+      writer = PixelPi::Animation.const_get(:Writer).new(path, format, *codec)
+      queue  = SizedQueue.new(slots)
+      thread = Thread.new do
+        while (item = queue.pop)
+          writer.frame(*item)
+        end
+      end
+
+      @recording = { :path => path, :writer => writer, :queue => queue, :thread => thread, :dropped => 0 }
+      return self unless block_given?
+
+      begin
+        yield self
+        stop_recording
+      ensure
+        stop_recording
+      end
+    end
+
+    # Stop recording, wait for the buffered frames to be written, and finish
+    # the animation file.
+    #
+    # Returns the number of frames recorded, or `nil` if these LEDs were not
+    # being recorded.
+    def stop_recording
+      return nil unless (rec = @recording)
+      @recording = nil
+
+      rec[:queue].close
+      rec[:thread].join
+      writer = rec[:writer]
+      fps = 30000
+      if writer.frame_count > 1 && rec[:last] > 0
+        fps = [(writer.frame_count - 1) * 1000000 / rec[:last], 1].max
+      end
+      writer.close(fps)
+      if rec[:dropped] > 0
+        warn "#{rec[:dropped]} frames were dropped while recording #{rec[:path]}"
+      end
+      writer.frame_count
+    end
+
+    # Returns `true` if the frames sent by `show` are being recorded.
+    def recording?
+      !@recording.nil?
+    end
+
+    # Draw the frames sent by `show` in the terminal, until `stop_preview` is
+    # called. Each LED is half a character cell in 24-bit color; a strip is
+    # drawn as rows of LEDs and the matrix is drawn when a layout has been set.
+    # Only the cells that changed since the last frame are redrawn, and frames
+    # sent faster than the preview rate are skipped.
+    #
+    # io      - where the escape sequences are written; anything with `write`
+    # options - Hash of arguments
+    #   :rate  - most frames drawn per second; defaults to 30, and `0` draws
+    #            every frame
+    #   :width - LEDs per row of a strip without a layout; defaults to the
+    #            width of the terminal
+    #
+    # Returns this PixelPi::Leds instance.
+    def preview( io = nil, options = nil )
+      closed!
+      io, options = nil, io if options.nil? && io.is_a?(Hash)
+      io ||= $stdout
+      unless io.respond_to?(:write)
+        raise TypeError, "preview output must respond to write: #{io.class}"
       end
+      width = terminal_width(io)
+
+      options ||= {}
+      rate = Float(options.fetch(:rate, nil) || 30)
+      raise ArgumentError, "rate cannot be negative: %g" % rate if rate < 0
+      width = Integer(options[:width]) unless options[:width].nil?
+      raise ArgumentError, "width must be at least 1 LED: #{width}" if width < 1
+
+      @preview = { :io => io, :interval => rate > 0 ? (1e9 / rate).to_i : 0, :width => width }
       self
     end
 
+    # Stop drawing the frames sent by `show`. The last frame drawn is left in
+    # the terminal.
+    #
+    # Returns `nil`.
+    def stop_preview
+      @preview = nil
+    end
+
+    # Returns `true` if the frames sent by `show` are drawn in the terminal.
+    def previewing?
+      !@preview.nil?
+    end
+
     # Clear the display. This will set all values in the LED buffer to zero, and
     # then update the display. All pixels will be turned off by this method.
     def clear
@@ -87,11 +358,12 @@ module PixelPi
     #
     # Returns `nil`.
     def close
-      $stdout.puts if @debug
+      @output.close if @output
       @leds = nil
     end
 
-    # Set the LED at position `num` to the provided 24-bit RGB color value.
+    # Set the LED at position `num` to the provided 24-bit RGB color value. An
+    # IndexError is raised if `num` is outside the LED range.
     #
     # Returns the 24-bit RGB color value.
     def []=( num, value )
@@ -125,16 +397,16 @@ module PixelPi
     # Replace the LED colors with the 24-bit RGB color values found in the `ary`.
     # If the `ary` is longer than the LED string then the extra color values will
     # be ignored. If the `ary` is shorter than the LED string then only the LEDS
-    # up to `ary.length` will be changed.
+    # up to `ary.length` will be changed. No LED is changed when one of the
+    # color values is not an Integer.
     #
     # You must call `show` for the new colors to be displayed.
     #
     # Returns this PixelPi::Leds instance.
     def replace( ary )
       closed!
-      @leds.length.times do |ii|
-        @leds[ii] = Integer(ary[ii])
-      end
+      colors = Array.new(@leds.length) { |ii| Integer(ary[ii]) }
+      @leds[0, colors.length] = colors
       self
     end
 
@@ -158,6 +430,16 @@ module PixelPi
       self
     end
 
+    # Move the LED colors so the buffer is in the order set up by `rotate` and
+    # `reverse`. The C extension only records the rotation and direction and
+    # applies them when the LEDs are shown; the fake buffer is always in order.
+    #
+    # Returns this PixelPi::Leds instance.
+    def normalize!
+      closed!
+      self
+    end
+
     # Set the selected LEDs to the given `color`. The `color` msut be given as a
     # 24-bit RGB value. You can also supply a block that receives an LED index and
     # returns a 24-bit RGB color.
@@ -183,24 +465,947 @@ module PixelPi
       self
     end
 
+    # Set the LEDs at each of the given `indices` to the matching 24-bit RGB value
+    # in `colors`. Both arguments can be an Array of Integers or a String of packed
+    # 32-bit unsigned values as created by `ary.pack("L*")`. The `indices` and
+    # `colors` must be the same length.
+    #
+    # An IndexError is raised if any index is outside the LED range. All indices
+    # are checked before any LED is changed, so the LED buffer is left untouched
+    # when an error is raised.
+    #
+    # Examples:
+    #    leds.set_pixels( [0, 2, 4], [0xFF0000, 0x00FF00, 0x0000FF] )
+    #    leds.set_pixels( idx.pack("L*"), colors.pack("L*") )
+    #
+    # Returns this PixelPi::Leds instance.
+    def set_pixels( indices, colors )
+      closed!
+      indices = to_list(indices)
+      colors  = to_list(colors)
+
+      if indices.length != colors.length
+        raise ArgumentError, "indices and colors must be the same length: #{indices.length} != #{colors.length}"
+      end
+
+      indices.each do |num|
+        if (num < 0 || num >= @leds.length)
+          raise IndexError, "index #{num} is outside of LED range: 0...#{@leds.length-1}"
+        end
+      end
+
+      indices.each_with_index { |num, ii| @leds[num] = colors[ii] }
+      self
+    end
+
+    # Copy the 24-bit RGB values in `colors` into the LED buffer beginning at
+    # position `start`. A negative `start` counts backwards from the end of the
+    # LEDs where -1 is the last LED. The `colors` can be an Array of Integers or a
+    # String of packed 32-bit unsigned values as created by `ary.pack("L*")`. Any
+    # colors that would extend past the end of the LED string are ignored.
+    #
+    # An IndexError is raised if `start` is outside the LED range.
+    #
+    # Returns this PixelPi::Leds instance.
+    def set_range( start, colors )
+      closed!
+      beg = Integer(start)
+      beg += @leds.length if beg < 0
+      if (beg < 0 || beg >= @leds.length)
+        raise IndexError, "index #{start} is outside of LED range: 0...#{@leds.length-1}"
+      end
+
+      colors = to_list(colors).first(@leds.length - beg)
+      @leds[beg, colors.length] = colors
+      self
+    end
+
+    # Repeat the sequence of 24-bit RGB values in `colors` across the entire LED
+    # string. The first color is placed in the first LED, the second color in the
+    # second LED, and so on; the pattern starts over once all the colors have been
+    # used. The `colors` can be an Array of Integers or a String of packed 32-bit
+    # unsigned values as created by `ary.pack("L*")`.
+    #
+    # Examples:
+    #    leds.fill_pattern( [0xFF0000, 0, 0] )
+    #
+    # Returns this PixelPi::Leds instance.
+    def fill_pattern( colors )
+      closed!
+      colors = to_list(colors)
+      raise ArgumentError, "pattern cannot be empty" if colors.empty?
+
+      @leds.fill { |ii| colors[ii % colors.length] }
+      self
+    end
+
+    # Execute all the commands recorded in the PixelPi::Batch in a single call.
+    # The batch is not modified and can be applied again. All `set` indices are
+    # checked before any command is executed; an IndexError is raised and the LED
+    # buffer is left untouched if any index is outside the LED range.
+    #
+    # You must call `show` for the new colors to be displayed.
+    #
+    # Returns this PixelPi::Leds instance.
+    def apply( batch )
+      closed!
+      batch.commands.each do |op, num, _|
+        next unless op == :set
+        if (num < 0 || num >= @leds.length)
+          raise IndexError, "index #{num} is outside of LED range: 0...#{@leds.length-1}"
+        end
+      end
+
+      batch.commands.each do |op, *args|
+        case op
+        when :clear;   @leds.fill 0
+        when :fill;    batch_span(*args.drop(1)).each { |ii| @leds[ii] = args.first }
+        when :set;     @leds[args[0]] = args[1]
+        when :rotate;  @leds.rotate!(args.first)
+        when :reverse; @leds.reverse!
+        when :blend
+          color, alpha, *rest = args
+          batch_span(*rest).each { |ii| @leds[ii] = blend_color(@leds[ii], color, alpha) }
+        end
+      end
+      self
+    end
+
+    # Set all the LEDs to the color given by `hue`, `saturation` and `value`. Each
+    # component is a value between 0 and 255.
+    #
+    # options - Hash of arguments
+    #   :mode - `:rainbow` (default) or `:spectrum` hue mapping
+    #
+    # Returns this PixelPi::Leds instance.
+    def fill_hsv( hue, sat, val, options = {} )
+      closed!
+      @leds.fill PixelPi::HSV(hue, sat, val, options)
+      self
+    end
+
+    # Fill the LEDs with a gradient that runs from `start_hue` on the first LED to
+    # `end_hue` on the last LED. Hues are between 0 and 255 and wrap around, so an
+    # `end_hue` of 256 draws one complete rainbow and an `end_hue` smaller than the
+    # `start_hue` runs the gradient backwards.
+    #
+    # options - Hash of arguments
+    #   :mode - `:rainbow` (default) or `:spectrum` hue mapping
+    #
+    # Returns this PixelPi::Leds instance.
+    def fill_hue_gradient( start_hue, end_hue, *args )
+      closed!
+      options = args.last.is_a?(Hash) ? args.pop : {}
+      table = PixelPi.hue_table(options)
+      sat = PixelPi.hsv_factor(args.fetch(0, 255))
+      val = PixelPi.hsv_factor(args.fetch(1, 255))
+
+      hue  = Integer(start_hue) * 65536
+      step = 0
+      if @leds.length > 1
+        span = (Integer(end_hue) - Integer(start_hue)) * 65536
+        step = span.abs / (@leds.length - 1) * (span <=> 0)
+      end
+
+      @leds.fill do |ii|
+        PixelPi.hsv_scale(table[((hue + step * ii) >> 16) & 0xFF], sat, val)
+      end
+      self
+    end
+
+    # Convert packed HSV colors into the LED buffer. The `packed_hsv` String holds
+    # three bytes - hue, saturation, and value - for each LED as created by
+    # `ary.pack("C*")`. Colors that would extend past the end of the LED string
+    # are ignored.
+    #
+    # options - Hash of arguments
+    #   :start - the first LED to set defaults to 0
+    #   :mode  - `:rainbow` (default) or `:spectrum` hue mapping
+    #
+    # Returns this PixelPi::Leds instance.
+    def set_hsv_pixels( packed_hsv, options = {} )
+      closed!
+      table = PixelPi.hue_table(options)
+      beg = Integer(options.fetch(:start, 0))
+      beg += @leds.length if beg < 0
+      if (beg < 0 || beg > @leds.length)
+        raise IndexError, "index #{options[:start]} is outside of LED range: 0...#{@leds.length-1}"
+      end
+      if packed_hsv.bytesize % 3 != 0
+        raise ArgumentError, "packed HSV String length must be a multiple of 3: #{packed_hsv.bytesize}"
+      end
+
+      packed_hsv.unpack("C*").each_slice(3).first(@leds.length - beg).each_with_index do |(h, s, v), ii|
+        @leds[beg+ii] = PixelPi.hsv_scale(table[h], PixelPi.hsv_factor(s), PixelPi.hsv_factor(v))
+      end
+      self
+    end
+
+    # Set the LED at position `num` to the given 16-bit color values. Each color
+    # is a value between 0 and 65535. The LEDs must have been created with the
+    # `:dither` option.
+    #
+    # Returns this PixelPi::Leds instance.
+    def set_pixel16( num, red, green, blue )
+      closed!
+      leds16!
+      if (num < 0 || num >= @leds.length)
+        raise IndexError, "index #{num} is outside of LED range: 0...#{@leds.length-1}"
+      end
+      store16(num, red, green, blue)
+      self
+    end
+
+    # Get the 16-bit color values for the LED at position `num`. If the LED was
+    # last changed with one of the 8-bit methods then the 8-bit color is returned
+    # scaled up to 16 bits.
+    #
+    # Returns an Array of red, green, and blue values.
+    def get_pixel16( num )
+      closed!
+      leds16!
+      if (num < 0 || num >= @leds.length)
+        raise IndexError, "index #{num} is outside of LED range: 0...#{@leds.length-1}"
+      end
+
+      rgb = @leds16[num*3, 3]
+      led = @leds[num] & 0xFFFFFF
+      if PixelPi::Color(*rgb.map { |v| v >> 8 }) != led
+        return [(led >> 8) & 0xFF00, led & 0xFF00, (led << 8) & 0xFF00]
+      end
+      rgb
+    end
+
+    # Set all the LEDs to the given 16-bit color values. Each color is a value
+    # between 0 and 65535.
+    #
+    # Returns this PixelPi::Leds instance.
+    def fill16( red, green, blue )
+      closed!
+      leds16!
+      rgb = [red, green, blue].map { |v| color16(v) }
+      @leds.length.times { |ii| store16(ii, *rgb) }
+      self
+    end
+
+    # Replace the LED colors with the 16-bit color values in the `packed` String.
+    # The String holds red, green, and blue native 16-bit unsigned values for
+    # each LED as created by `ary.pack("S*")`.
+    #
+    # Returns this PixelPi::Leds instance.
+    def replace16( packed )
+      closed!
+      leds16!
+      if packed.bytesize % 6 != 0
+        raise ArgumentError, "packed String length must be a multiple of 6: #{packed.bytesize}"
+      end
+
+      packed.unpack("S*").each_slice(3).first(@leds.length).each_with_index do |(r, g, b), ii|
+        store16(ii, r, g, b)
+      end
+      self
+    end
+
+    # Returns a view of `length` LEDs beginning at index `start`, or of the LEDs
+    # selected by the `range`. The PixelPi::Slice shares the LED buffer, so
+    # changes made through the slice are changes to these LEDs. A negative
+    # `start` counts back from the end and the `length` is cut short at the end
+    # of the LEDs.
+    #
+    # Returns a PixelPi::Slice.
+    def slice( *args )
+      closed!
+      PixelPi::Slice.select(self, 0, @leds.length, *args)
+    end
+
+    # Attach the PixelPi::Layer to these LEDs. Attached layers are composited
+    # over the LED buffer by their z-order every time `show` is called. Adding a
+    # layer that is already attached does nothing.
+    #
+    # Returns this PixelPi::Leds instance.
+    def add_layer( layer )
+      closed!
+      raise TypeError, "expecting a PixelPi::Layer object" unless layer.is_a?(PixelPi::Layer)
+      @layers ||= []
+      @layers << layer unless @layers.include?(layer)
+      self
+    end
+
+    # Detach the PixelPi::Layer from these LEDs.
+    #
+    # Returns this PixelPi::Leds instance.
+    def remove_layer( layer )
+      closed!
+      @layers.delete(layer) if @layers
+      self
+    end
+
+    # Returns an Array of the layers attached to these LEDs in the order they
+    # were added.
+    def layers
+      closed!
+      @layers ? @layers.dup : []
+    end
+
+    # Attach the PixelPi::Layout used by `set_xy`, `get_xy`, `fill_rect`, `blit`,
+    # and `scroll`. Every LED index of the layout must be inside the LED range.
+    # Pass `nil` to remove the layout.
+    def layout=( layout )
+      closed!
+      unless layout.nil?
+        raise TypeError, "expecting a PixelPi::Layout object" unless layout.is_a?(PixelPi::Layout)
+        if (idx = layout.to_a.compact.find { |ii| ii >= @leds.length })
+          raise ArgumentError, "layout index #{idx} is outside of LED range: 0...#{@leds.length-1}"
+        end
+      end
+      @layout = layout
+    end
+
+    # Returns the PixelPi::Layout attached to these LEDs or `nil`.
+    def layout
+      closed!
+      @layout
+    end
+
+    # Give runs of LEDs their own settings. Each segment is a Hash with the
+    # index of its first LED in `:start` and its number of LEDs in `:length`;
+    # `:strip_type`, `:brightness`, `:gamma`, and `:white_balance` are optional
+    # and default to the settings of the Leds. A segment strip type must have as
+    # many colors as the strip type of the Leds. Segments must be given in order
+    # along the strip and must not overlap. Pass `nil` or an empty Array to
+    # remove the segments.
+    def segments=( ary )
+      closed!
+      ary = [] if ary.nil?
+      raise TypeError, "wrong argument type #{ary.class} (expected Array)" unless ary.is_a?(Array)
+
+      colors = @strip_type.to_s.end_with?("w") ? 4 : 3
+      last = 0
+      list = ary.each_with_index.map do |hash, ii|
+        raise TypeError, "wrong argument type #{hash.class} (expected Hash)" unless hash.is_a?(Hash)
+        raise ArgumentError, "segment #{ii} has no start" if hash[:start].nil?
+        raise ArgumentError, "segment #{ii} has no length" if hash[:length].nil?
+        start, length = Integer(hash[:start]), Integer(hash[:length])
+
+        raise ArgumentError, "segment length must be at least 1: #{length}" if length < 1
+        if start < 0 || start >= @leds.length || length > @leds.length - start
+          raise ArgumentError, "segment #{start}...#{start+length} is outside of LED range: 0...#{@leds.length-1}"
+        end
+        raise ArgumentError, "segments overlap at LED #{start}" if start < last
+        last = start + length
+
+        if (type = hash[:strip_type])
+          raise TypeError, "strip type must be a Symbol: #{type.class}" unless type.is_a?(Symbol)
+          raise ArgumentError, "unknown strip type: #{type}" unless STRIP_TYPES.include?(type)
+          unless (type.to_s.end_with?("w") ? 4 : 3) == colors
+            raise ArgumentError, "segment strip type must have #{colors} colors: #{type}"
+          end
+        end
+
+        Integer(hash[:brightness]) unless hash[:brightness].nil?
+
+        unless (value = hash[:gamma]).nil?
+          gamma = value.is_a?(Array) ? value.map { |v| Float(v) } : [Float(value)] * 3
+          if gamma.length != 3
+            raise ArgumentError, "gamma must have 3 values (red, green, blue): #{gamma.length}"
+          end
+          gamma.each { |v| raise ArgumentError, "gamma must be positive: %f" % v unless v > 0.0 }
+        end
+
+        value = hash[:white_balance]
+        if value.is_a?(Array) && value.length != 3
+          raise ArgumentError, "white balance must have 3 values (red, green, blue): #{value.length}"
+        end
+
+        hash.dup.freeze
+      end
+
+      @segments = list.empty? ? nil : list.freeze
+      ary
+    end
+
+    # Returns the segments given to `segments=`, or an empty Array.
+    def segments
+      closed!
+      @segments || []
+    end
+
+    # Set the LED at matrix position (x, y) to the given `color`. Positions
+    # without an LED are ignored. Raises an IndexError if the position is
+    # outside the matrix.
+    #
+    # Returns this PixelPi::Leds instance.
+    def set_xy( x, y, color )
+      idx = layout!.index(x, y)
+      @leds[idx] = Integer(color) & 0xFFFFFFFF if idx
+      self
+    end
+
+    # Returns the color of the LED at matrix position (x, y) or `nil` if there
+    # is no LED at that position.
+    def get_xy( x, y )
+      idx = layout!.index(x, y)
+      idx && @leds[idx]
+    end
+
+    # Set every LED of the rectangle with its top left corner at (x, y) to the
+    # given `color`. The parts of the rectangle outside the matrix are ignored.
+    #
+    # Returns this PixelPi::Leds instance.
+    def fill_rect( x, y, width, height, color )
+      layout = layout!
+      color = Integer(color) & 0xFFFFFFFF
+      each_xy(layout, x, y, width, height) { |idx, _, _| @leds[idx] = color }
+      self
+    end
+
+    # Copy a `width` by `height` image onto the matrix with its top left corner
+    # at (x, y). The `packed_rgb` String holds three bytes - red, green, and
+    # blue - for each pixel, row by row. The parts of the image outside the
+    # matrix are ignored.
+    #
+    # Returns this PixelPi::Leds instance.
+    def blit( packed_rgb, width, height, x = 0, y = 0 )
+      layout = layout!
+      width, height = Integer(width), Integer(height)
+      if width < 0 || height < 0
+        raise ArgumentError, "image size cannot be negative: #{width}x#{height}"
+      end
+      if packed_rgb.bytesize != width * height * 3
+        raise ArgumentError, "packed RGB String must be #{width * height * 3} bytes for a #{width}x#{height} image: #{packed_rgb.bytesize}"
+      end
+
+      rgb = packed_rgb.unpack("C*")
+      each_xy(layout, Integer(x), Integer(y), width, height) do |idx, ix, iy|
+        @leds[idx] = PixelPi::Color(*rgb[(iy * width + ix) * 3, 3])
+      end
+      self
+    end
+
+    # Move the image on the matrix `dx` positions to the right and `dy`
+    # positions down; negative values move it left and up. The positions left
+    # uncovered are set to `color`.
+    #
+    # Returns this PixelPi::Leds instance.
+    def scroll( dx, dy, color = 0 )
+      layout = layout!
+      dx, dy = Integer(dx), Integer(dy)
+      color = Integer(color) & 0xFFFFFFFF
+      w, h = layout.width, layout.height
+      src = @leds.dup
+
+      h.times do |y|
+        w.times do |x|
+          next unless (dst = layout.index(x, y))
+          sx, sy = x - dx, y - dy
+          idx = (sx >= 0 && sx < w && sy >= 0 && sy < h) ? layout.index(sx, sy) : nil
+          @leds[dst] = idx ? src[idx] : color
+        end
+      end
+      self
+    end
+
+    # Scale a `width` by `height` image to the size of the matrix and store it
+    # in the LEDs. The `packed_rgb` String holds three bytes - red, green, and
+    # blue - for each pixel, row by row. A PixelPi::Layout must be attached to
+    # the LEDs.
+    #
+    # options - Hash of arguments
+    #   :filter - `:nearest` (default), `:box` to average all the image pixels
+    #             covered by each LED, or `:bilinear`
+    #
+    # Returns this PixelPi::Leds instance.
+    def draw_frame( packed_rgb, width, height, options = {} )
+      filter = frame_filter(options)
+      layout = layout!
+      width, height = frame_size(width, height)
+      if packed_rgb.bytesize != width * height * 3
+        raise ArgumentError, "packed RGB String must be #{width * height * 3} bytes for a #{width}x#{height} image: #{packed_rgb.bytesize}"
+      end
+      resample(layout, packed_rgb.unpack("C*"), width, height, filter)
+      self
+    end
+
+    # Scale a binary PPM (P6) image of any size to the size of the matrix and
+    # store it in the LEDs. Takes the same options as `draw_frame`.
+    #
+    # Returns this PixelPi::Leds instance.
+    def draw_ppm( ppm, options = {} )
+      filter = frame_filter(options)
+      layout = layout!
+      bytes = ppm.unpack("C*")
+      pos = 0
+      width, height = ppm_header { bytes[(pos += 1) - 1] }
+      raise ArgumentError, "not a binary PPM image" if width.nil?
+      if bytes.length - pos < width * height * 3
+        raise ArgumentError, "PPM image data is too short: #{bytes.length - pos} bytes for a #{width}x#{height} image"
+      end
+      resample(layout, bytes[pos, width * height * 3], width, height, filter)
+      self
+    end
+
+    # Read the next frame from the `io` and store it in the LEDs like
+    # `draw_frame`. Without a size the stream is read as a sequence of binary
+    # PPM images; with `:width` and `:height` it is read as raw frames of
+    # packed RGB pixels.
+    #
+    # Returns this PixelPi::Leds instance or `nil` at the end of the stream.
+    def read_frame( io, options = {} )
+      filter = frame_filter(options)
+      layout!
+      width, height = options[:width], options[:height]
+      if width.nil? != height.nil?
+        raise ArgumentError, "raw frames need both a :width and a :height"
+      end
+      if width.nil?
+        width, height = ppm_header { io.getbyte }
+        return nil if width.nil?
+      else
+        width, height = frame_size(width, height)
+      end
+
+      data = io.read(width * height * 3)
+      return nil if data.nil? || data.bytesize < width * height * 3
+      resample(layout!, data.unpack("C*"), width, height, filter)
+      self
+    end
+
+    # Play the PixelPi::Animation at its frame rate. Each frame is copied into
+    # the LED buffer and shown. With a block, the block is called with the
+    # frame number after the frame is copied and before it is shown.
+    #
+    # options - Hash of arguments
+    #   :loop - `true` to play the animation over and over
+    #   :fps  - play at this frame rate instead of the recorded one
+    #
+    # Returns this PixelPi::Leds instance.
+    def play( animation, options = {} )
+      raise TypeError, "expecting a PixelPi::Animation object" unless animation.is_a?(PixelPi::Animation)
+      frames = animation.length
+      closed!
+      options ||= {}
+      fps = options[:fps].nil? ? animation.fps1000 : PixelPi::Animation.parse_fps(options[:fps])
+      return self if frames == 0
+
+      period = 1000000000000 / fps
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      played = 0
+      n = 0
+      loop do
+        if n == frames
+          break unless options[:loop]
+          n = 0
+        end
+
+        animation.length
+        closed!
+        colors = animation.frame(n)
+        [colors.length, @leds.length].min.times { |ii| @leds[ii] = colors[ii] }
+
+        yield n if block_given?
+        show
+
+        wait = start + (played + 1) * period - Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+        if wait < -period
+          start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+          played = -1
+        elsif wait > 0
+          sleep(wait / 1e9)
+        end
+        n += 1
+        played += 1
+      end
+      self
+    end
+
+    # Wait up to `timeout` seconds for a new frame in the PixelPi::FrameRing,
+    # copy the newest frame into the LED buffer, and show it. With a `nil`
+    # timeout this waits until a frame is published; a timeout of 0 never
+    # waits.
+    #
+    # Returns the sequence number of the frame shown, or `nil` if there was
+    # no new frame.
+    def show_ring( ring, timeout = nil )
+      closed!
+      raise TypeError, "expecting a PixelPi::FrameRing object" unless ring.is_a?(::PixelPi::FrameRing)
+      return nil unless ring.wait(timeout)
+      n, data = ring.take(@leds.length)
+      return nil if n.nil?
+      colors = data.unpack("L*")
+      @leds[0, colors.length] = colors
+      show
+      n
+    end
+
+    # Render a single frame of the named effect into the LED buffer. Animate the
+    # effects by changing the `:offset` or `:step` on each frame and calling
+    # `show`.
+    #
+    # name    - the effect name as a Symbol
+    #   :color_wipe            - sets the first `:count` LEDs to `:color`
+    #   :theater_chase         - clears the LEDs and lights every `:spacing` LED
+    #                            with `:color` starting at `:step`
+    #   :rainbow               - rainbow colors across the LEDs starting at the
+    #                            wheel position `:offset`
+    #   :rainbow_cycle         - rainbow uniformly distributed across all the LEDs
+    #                            starting at the wheel position `:offset`
+    #   :theater_chase_rainbow - theater chase using rainbow colors
+    # options - Hash of arguments
+    #   :color   - 24-bit RGB color value defaults to 0
+    #   :offset  - wheel position offset defaults to 0
+    #   :count   - number of LEDs to wipe defaults to all LEDs
+    #   :spacing - spacing between lights defaults to 3
+    #   :step    - chase position defaults to 0
+    #
+    # Examples:
+    #    256.times { |jj| leds.effect( :rainbow_cycle, :offset => jj ).show }
+    #    3.times { |sp| leds.effect( :theater_chase, :color => 0xFF0000, :step => sp ).show }
+    #
+    # Returns this PixelPi::Leds instance.
+    def effect( name, options = {} )
+      closed!
+      raise TypeError, "wrong argument type #{name.class} (expected Symbol)" unless name.is_a?(Symbol)
+
+      color   = Integer(options.fetch(:color, 0))
+      offset  = Integer(options.fetch(:offset, 0)) % 65280
+      count   = Integer(options.fetch(:count, @leds.length))
+      spacing = Integer(options.fetch(:spacing, 3))
+      step    = Integer(options.fetch(:step, 0))
+      raise ArgumentError, "spacing must be positive: #{spacing}" if spacing <= 0
+
+      return self if @leds.empty?
+      length = @leds.length
+
+      case name
+      when :color_wipe
+        [count, length].min.times { |ii| @leds[ii] = color }
+      when :theater_chase
+        @leds.fill 0
+        (step % spacing).step(length-1, spacing) { |ii| @leds[ii] = color }
+      when :rainbow
+        @leds.fill { |ii| PixelPi::Wheel(ii + offset) }
+      when :rainbow_cycle
+        @leds.fill { |ii| PixelPi::Wheel((ii * 256 / length) + offset) }
+      when :theater_chase_rainbow
+        @leds.fill 0
+        (step % spacing).step(length-1, spacing) { |ii| @leds[ii] = PixelPi::Wheel((ii + offset) % 255) }
+      else
+        raise ArgumentError, "unknown effect: #{name}"
+      end
+      self
+    end
+
   private
 
+    def buffer
+      closed!
+      @leds
+    end
+
+    # Resolve the `start, length` or `range` arguments of a batch command into a
+    # Range of LED indices; the selection is clipped to the LED string.
+    def batch_span( *args )
+      count = @leds.length
+      if args.first.is_a?(Range)
+        range = args.first
+        beg = range.begin || 0
+        beg += count if beg < 0
+        last = range.end.nil? ? count : range.end
+        last += count if last < 0
+        last += 1 unless range.end.nil? || range.exclude_end?
+      else
+        beg = args[0] || 0
+        beg += count if beg < 0
+        return [] if !args[1].nil? && args[1] < 0
+        last = args[1].nil? ? count : beg + args[1]
+      end
+      beg = [[beg, 0].max, count].min
+      (beg...[last, count].min)
+    end
+
+    def blend_color( c1, c2, alpha )
+      w  = alpha + (alpha >> 7)
+      rb = ((((c1 & 0x00FF00FF) * (256 - w)) + ((c2 & 0x00FF00FF) * w)) >> 8) & 0x00FF00FF
+      ag = (((((c1 >> 8) & 0x00FF00FF) * (256 - w)) + (((c2 >> 8) & 0x00FF00FF) * w))) & 0xFF00FF00
+      rb | ag
+    end
+
+    def to_list( obj )
+      case obj
+      when String
+        if obj.bytesize % 4 != 0
+          raise ArgumentError, "packed String length must be a multiple of 4: #{obj.bytesize}"
+        end
+        obj.unpack("L*")
+      when Array
+        obj.map { |value| Integer(value) }
+      else
+        raise TypeError, "expecting an Array or a packed String: #{obj.class}"
+      end
+    end
+
     def to_color( *args )
       case args.length
-      when 1; Integer(args.first) & 0xFFFFFF
+      when 1; Integer(args.first) & 0xFFFFFFFF
       when 3; PixelPi::Color(*args)
       else
         raise ArgumentError, "expecting either 1 or 3 arguments: #{args.length}"
       end
     end
 
-    def to_rgb( color )
+    # Build the red, green, and blue color correction tables from the current
+    # gamma and white balance.
+    def build_correction
+      return unless defined?(@gamma) && defined?(@white_balance)
+
+      gamma = @gamma.is_a?(Array) ? @gamma.map { |v| Float(v) } : [Float(@gamma)] * 3
+      wb = if @white_balance.is_a?(Array)
+        @white_balance.map { |v| Integer(v) & 0xFF }
+      else
+        value = Integer(@white_balance)
+        [(value >> 16) & 0xFF, (value >> 8) & 0xFF, value & 0xFF]
+      end
+
+      @correction = Array.new(3) do |ii|
+        Array.new(256) { |jj| ((jj / 255.0) ** gamma[ii] * wb[ii] + 0.5).to_i }
+      end
+    end
+
+    def color16( value )
+      value = Integer(value)
+      if value < 0 || value > 0xFFFF
+        raise ArgumentError, "16-bit color value must be between 0 and 65535: #{value}"
+      end
+      value
+    end
+
+    def store16( num, red, green, blue )
+      rgb = [red, green, blue].map { |v| color16(v) }
+      @leds16[num*3, 3] = rgb
+      @leds[num] = PixelPi::Color(*rgb.map { |v| v >> 8 })
+    end
+
+    def leds16!
+      raise(::PixelPi::Error, "16-bit LEDs are not enabled; use the :dither option") if @leds16.nil?
+    end
+
+    def layout!
+      closed!
+      @layout or raise(::PixelPi::Error, "no layout has been set for these LEDs")
+    end
+
+    # Yield the LED index along with the position inside the rectangle for
+    # every LED of the rectangle at (x, y) that is on the matrix.
+    def each_xy( layout, x, y, width, height )
+      x, y = Integer(x), Integer(y)
+      Integer(height).times do |iy|
+        next if y + iy < 0 || y + iy >= layout.height
+        Integer(width).times do |ix|
+          next if x + ix < 0 || x + ix >= layout.width
+          idx = layout.index(x + ix, y + iy)
+          yield idx, ix, iy if idx
+        end
+      end
+    end
+
+    FILTERS = %i[nearest box bilinear].freeze
+
+    def frame_filter( options )
+      filter = (options || {}).fetch(:filter, nil) || :nearest
+      raise TypeError, "filter must be a Symbol: #{filter.class}" unless filter.is_a?(Symbol)
+      raise ArgumentError, "unknown filter: #{filter}" unless FILTERS.include?(filter)
+      filter
+    end
+
+    def frame_size( width, height )
+      width, height = Integer(width), Integer(height)
+      if width <= 0 || height <= 0
+        raise ArgumentError, "image size must be positive: #{width}x#{height}"
+      end
+      [width, height]
+    end
+
+    # Parse the header of a binary PPM image from the bytes returned by the
+    # block. Returns the width and height, or `nil` if the input is empty.
+    def ppm_header
+      c = yield
+      return nil if c.nil?
+      raise ArgumentError, "not a binary PPM image" unless c == 80 && yield == 54
+
+      width, height, maxval = Array.new(3) do
+        c = yield
+        loop do
+          if c == 35 then c = yield until c == 10 || c.nil?
+          elsif [32, 9, 10, 13].include?(c) then c = yield
+          else break
+          end
+        end
+        raise ArgumentError, "malformed PPM header" unless c && c.between?(48, 57)
+        num = 0
+        while c && c.between?(48, 57)
+          num = num * 10 + (c - 48)
+          raise ArgumentError, "malformed PPM header" if num > 0xffff
+          c = yield
+        end
+        raise ArgumentError, "malformed PPM header" unless [32, 9, 10, 13].include?(c)
+        num
+      end
+
+      if maxval != 255
+        raise ArgumentError, "only 8-bit PPM images with a maxval of 255 are supported: #{maxval}"
+      end
+      frame_size(width, height)
+    end
+
+    # The first and last source pixel of each of the `out` output pixels along
+    # an axis of `len` source pixels, and the bilinear weight of the last one.
+    def frame_spans( out, len, filter )
+      Array.new(out) do |ii|
+        case filter
+        when :box
+          p0 = ii * len / out
+          [p0, [(ii + 1) * len / out - 1, p0].max, 0]
+        when :bilinear
+          pos = [(2 * ii + 1) * len * 128 / out - 128, 0].max
+          p0 = pos >> 8
+          [p0, [p0 + 1, len - 1].min, pos & 0xff]
+        else
+          p0 = (2 * ii + 1) * len / (2 * out)
+          [p0, p0, 0]
+        end
+      end
+    end
+
+    def resample( layout, rgb, width, height, filter )
+      xs = frame_spans(layout.width, width, filter)
+      ys = frame_spans(layout.height, height, filter)
+      pixel = lambda { |x, y| rgb[(y * width + x) * 3, 3] }
+
+      layout.height.times do |y|
+        y0, y1, fy = ys[y]
+        layout.width.times do |x|
+          next unless (idx = layout.index(x, y))
+          x0, x1, fx = xs[x]
+          @leds[idx] = PixelPi::Color(*case filter
+            when :bilinear
+              (0..2).map do |k|
+                top = pixel[x0, y0][k] * (256 - fx) + pixel[x1, y0][k] * fx
+                bot = pixel[x0, y1][k] * (256 - fx) + pixel[x1, y1][k] * fx
+                (top * (256 - fy) + bot * fy + 32768) >> 16
+              end
+            when :box
+              n = (x1 - x0 + 1) * (y1 - y0 + 1)
+              sums = [0, 0, 0]
+              (y0..y1).each { |yy| (x0..x1).each { |xx| pixel[xx, yy].each_with_index { |v, k| sums[k] += v } } }
+              sums.map { |v| (v + n / 2) / n }
+            else
+              pixel[x0, y0]
+            end)
+        end
+      end
+    end
+
+    # Queue a composited frame for the recorder, scaled by the brightness.
+    def capture( leds )
       scale = (brightness & 0xFF) + 1
-      [
-        (((color >> 16) & 0xFF) * scale) >> 8,
-        (((color >>  8) & 0xFF) * scale) >> 8,
-        (( color        & 0xFF) * scale) >> 8
-      ]
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      @recording[:start] ||= now
+      time = (now - @recording[:start]) / 1000000
+      frame = leds.map do |c|
+        ((((c & 0x00FF00FF) * scale) >> 8) & 0x00FF00FF) | ((((c >> 8) & 0x00FF00FF) * scale) & 0xFF00FF00)
+      end
+      @recording[:queue].push([frame, time], true)
+      @recording[:last] = time
+    rescue ThreadError
+      @recording[:dropped] += 1
+    end
+
+    # Returns the 24-bit color shown in the preview for `color`: scaled by the
+    # brightness with the white added to each color.
+    def preview_color( color )
+      scale = (brightness & 0xFF) + 1
+      white = (((color >> 24) & 0xFF) * scale) >> 8
+      [16, 8, 0].inject(0) do |rgb, shift|
+        (rgb << 8) | [((((color >> shift) & 0xFF) * scale) >> 8) + white, 255].min
+      end
+    end
+
+    def terminal_width( io )
+      return 80 unless io.is_a?(IO)
+      require "io/console"
+      cols = io.winsize[1]
+      cols > 0 ? cols : 80
+    rescue SystemCallError, NoMethodError
+      80
+    end
+
+    # Draw the frame in the terminal, only the cells that changed. Two rows
+    # of LEDs share a line of "▀" cells: the foreground is the top LED and the
+    # background the LED below it. Between frames the cursor rests at the
+    # start of the line below the preview.
+    def draw_preview( leds )
+      pv  = @preview
+      now = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      return if pv[:last] && now - pv[:last] < pv[:interval]
+      pv[:last] = now
+
+      if @layout
+        cols, rows, map = @layout.width, @layout.height, @layout.to_a
+        pixel = lambda { |x, y| (idx = map[y * cols + x]) ? preview_color(leds[idx]) : 0 }
+      else
+        cols = [[pv[:width], leds.length].min, 1].max
+        rows = (leds.length + cols - 1) / cols
+        pixel = lambda { |x, y| (idx = y * cols + x) < leds.length ? preview_color(leds[idx]) : 0 }
+      end
+      lines = (rows + 1) / 2
+      return if cols == 0 || lines == 0
+
+      str = String.new
+      if pv[:cols] != cols || pv[:lines] != lines
+        pv[:cols], pv[:lines] = cols, lines
+        pv[:cells] = Array.new(cols * lines * 2)
+        str << "\r" << "\n" * lines
+      end
+
+      cells, drawn = pv[:cells], false
+      row, col, fg, bg = lines, 0, nil, nil
+      lines.times do |y|
+        cols.times do |x|
+          top    = pixel.call(x, 2*y)
+          bottom = 2*y+1 < rows ? pixel.call(x, 2*y+1) : 0
+          ii = (y * cols + x) * 2
+          next if cells[ii] == top && cells[ii+1] == bottom
+          cells[ii], cells[ii+1] = top, bottom
+
+          str << "\e[?25l" unless drawn
+          drawn = true
+          if row != y
+            str << (row > y ? "\e[#{row - y}A" : "\e[#{y - row}B")
+            row = y
+          end
+          if col != x
+            str << "\e[#{x + 1}G"
+            col = x
+          end
+
+          if top != fg || bottom != bg
+            sgr = []
+            sgr << "38;2;#{(top >> 16) & 0xFF};#{(top >> 8) & 0xFF};#{top & 0xFF}" if top != fg
+            sgr << "48;2;#{(bottom >> 16) & 0xFF};#{(bottom >> 8) & 0xFF};#{bottom & 0xFF}" if bottom != bg
+            str << "\e[#{sgr.join(";")}m"
+            fg, bg = top, bottom
+          end
+          str << "\u2580"
+          col += 1
+        end
+      end
+      return unless drawn
+
+      str << "\e[0m"
+      str << "\e[#{lines - row}B" if row != lines
+      str << "\r\e[?25h"
+      pv[:io].write(str)
+      pv[:io].flush if pv[:io].respond_to?(:flush)
     end
 
     def closed!
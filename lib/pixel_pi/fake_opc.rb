@@ -0,0 +1,186 @@
+require "socket"
+
+module PixelPi
+
+  # An Open Pixel Control server that sets the colors of a PixelPi::Leds
+  # instance. The messages understood are described in `ext/pixel_pi/opc.c`;
+  # the native version watches all the clients with one epoll set.
+  #
+  # Examples:
+  #    server = PixelPi::OpcServer.new( leds, :port => 7890 )
+  #    loop { server.poll }
+  #
+  class OpcServer
+
+    PORT        = 7890
+    HEADER      = 4
+    BUFFER      = 2 * (HEADER + 65535)
+    SYSTEM_ID   = 0x5050
+    BRIGHTNESS  = 1
+
+    # Listen for Open Pixel Control clients that set the colors of the
+    # `leds`.
+    #
+    # options - Hash of arguments
+    #   :port    - TCP port; defaults to 7890. Port 0 picks a free port.
+    #   :bind    - IPv4 address to bind to; defaults to "0.0.0.0"
+    #   :channel - OPC channel of the LEDs, 1 to 255; defaults to 1
+    #   :show    - call `show` after set pixel color messages; defaults to
+    #              `true`
+    #
+    def initialize( leds, options = {} )
+      raise TypeError, "expecting a PixelPi::Leds object" unless leds.is_a?(::PixelPi::Leds)
+      leds.length
+      options ||= {}
+
+      @leds    = leds
+      @show    = options.key?(:show) ? !!options[:show] : true
+      port     = options[:port].nil? ? PORT : Integer(options[:port])
+      @channel = options[:channel].nil? ? 1 : Integer(options[:channel])
+
+      if port < 0 || port > 65535
+        raise ArgumentError, "port is outside the range 0..65535: #{port}"
+      end
+      if @channel < 1 || @channel > 255
+        raise ArgumentError, "channel is outside the range 1..255: #{@channel}"
+      end
+
+      host = options[:bind]
+      if host && (host !~ /\A\d+\.\d+\.\d+\.\d+\z/ || host.split(".").any? { |n| n.to_i > 255 })
+        raise ArgumentError, "invalid bind address: #{host}"
+      end
+
+      @clients = {}
+      @stats = { :connections => 0, :clients => 0, :messages => 0, :bytes => 0, :ignored => 0, :shows => 0 }
+      @server = TCPServer.new(host || "0.0.0.0", port)
+    end
+
+    # Wait up to `timeout` seconds for clients to connect or send data, then
+    # accept the new connections and apply the complete messages that have
+    # arrived.
+    #
+    # Returns the number of messages received.
+    def poll( timeout = nil )
+      closed!
+      unless timeout.nil?
+        timeout = Float(timeout)
+        raise ArgumentError, "timeout cannot be negative: %g" % timeout if timeout < 0.0
+      end
+
+      total = 0
+      ready, = IO.select([@server] + @clients.keys, nil, nil, timeout)
+      return total if ready.nil?
+
+      # `show` can run Ruby code that closes the server or its clients
+      ready.each do |io|
+        return total if @server.nil?
+        total += read(io) if @clients.key?(io)
+      end
+      accept if @server && ready.include?(@server)
+      total
+    end
+
+    # Returns the counters of the server as a Hash; see `ext/pixel_pi/opc.c`
+    # for their meaning.
+    def stats
+      closed!
+      @stats.merge(:clients => @clients.length)
+    end
+
+    # Returns the TCP port the server is listening on.
+    def port
+      closed!
+      @server.local_address.ip_port
+    end
+
+    # Returns the OPC channel of the LEDs.
+    def channel
+      closed!
+      @channel
+    end
+
+    # Disconnect all the clients and stop listening.
+    def close
+      @clients.each_key(&:close) if @clients
+      @clients = {}
+      @server.close if @server
+      @server = nil
+      @leds = nil
+    end
+
+    # Returns `true` if the server has been closed.
+    def closed?
+      @server.nil?
+    end
+
+  private
+
+    def closed!
+      raise(::PixelPi::Error, "OpcServer is closed") if @server.nil?
+    end
+
+    def accept
+      loop do
+        @clients[@server.accept_nonblock] = "".b
+        @stats[:connections] += 1
+      end
+    rescue IO::WaitReadable, Errno::ECONNABORTED
+    end
+
+    def read( io )
+      buffer = @clients[io]
+      begin
+        data = io.read_nonblock(BUFFER - buffer.bytesize)
+      rescue IO::WaitReadable
+        return 0
+      rescue EOFError, SystemCallError
+        @clients.delete(io)
+        io.close
+        return 0
+      end
+      buffer << data
+      @stats[:bytes] += data.bytesize
+
+      pos = 0
+      messages = 0
+      frame = false
+      while buffer.bytesize - pos >= HEADER
+        channel, command, len = buffer.byteslice(pos, HEADER).unpack("CCn")
+        break if buffer.bytesize - pos < HEADER + len
+        frame = true if message(channel, command, buffer.byteslice(pos + HEADER, len))
+        messages += 1
+        pos += HEADER + len
+      end
+      @clients[io] = buffer.byteslice(pos..-1)
+
+      if frame && @show
+        @leds.show
+        @stats[:shows] += 1
+      end
+      messages
+    end
+
+    def message( channel, command, data )
+      @stats[:messages] += 1
+      if channel != 0 && channel != @channel
+        @stats[:ignored] += 1
+        return false
+      end
+
+      case command
+      when 0
+        colors = data.unpack("C*").each_slice(3).take([data.bytesize / 3, @leds.length].min)
+        colors.each_with_index { |(r, g, b), ii| @leds[ii] = (r << 16) | (g << 8) | b }
+        return true
+      when 255
+        id, cmd, value = data.unpack("nCC")
+        if data.bytesize >= 4 && id == SYSTEM_ID && cmd == BRIGHTNESS
+          @leds.brightness = value
+          return false
+        end
+      end
+      @stats[:ignored] += 1
+      false
+    end
+  end
+end
@@ -0,0 +1,511 @@
+require "socket"
+
+module PixelPi
+
+  # A receiver takes sACN (E1.31), Art-Net, DDP, or PixelPi pixel data off a
+  # UDP socket and writes it into the LED buffer. The packet formats are
+  # described in `ext/pixel_pi/receiver.c` and `ext/pixel_pi/sender.c`; the
+  # native version reads the packets in batches with `recvmmsg`.
+  #
+  # Examples:
+  #    rx = PixelPi::Receiver.new( leds, :sacn, :universe => 1, :universes => 4 )
+  #    loop { rx.poll }
+  #
+  class Receiver
+
+    PROTOCOLS   = %i[sacn artnet ddp pixel_pi].freeze
+    PORTS       = [5568, 6454, 4048, 20560].freeze
+    SHOW_MODES  = %i[sync frame].freeze
+    TRANSPORTS  = %i[udp tcp].freeze
+    SHIFT       = [16, 8, 0, 24].freeze
+    ACN_ID      = "ASC-E1.17\0\0\0".b.freeze
+    BATCH       = 32
+    MAX_BATCHES = 8
+    PACKET      = 2048
+    RCVBUF      = 1 << 20
+    STREAM      = BATCH * PACKET
+    HEADER      = 24
+    CHUNK       = 256
+    LATE        = 64
+
+    # Bind a UDP socket that receives pixel data for the `leds` over the
+    # network. The `protocol` is one of `:sacn`, `:artnet`, `:ddp`, or
+    # `:pixel_pi`.
+    #
+    # options - Hash of arguments
+    #   :port          - UDP port; defaults to 5568 for sACN, 6454 for
+    #                    Art-Net, 4048 for DDP, and 20560 for PixelPi. Port 0
+    #                    picks a free port.
+    #   :transport     - `:udp` (the default) or `:tcp` to listen for a
+    #                    PixelPi sender on a TCP port
+    #   :bind          - IPv4 address to bind to; defaults to "0.0.0.0"
+    #   :universe      - first universe; defaults to 1 for sACN and 0 for
+    #                    Art-Net
+    #   :universes     - number of universes; defaults to enough for all the
+    #                    LEDs
+    #   :universe_size - LEDs per universe; defaults to as many as fit in 512
+    #                    channels
+    #   :channels      - channels per LED, 3 for RGB or 4 for RGBW
+    #   :show          - `:frame`, `:sync`, or `nil`; defaults to `:sync` for
+    #                    PixelPi and `:frame` otherwise
+    #   :multicast     - join the sACN multicast group of each universe
+    #
+    def initialize( leds, protocol, options = {} )
+      raise TypeError, "expecting a PixelPi::Leds object" unless leds.is_a?(::PixelPi::Leds)
+      leds.length
+      raise TypeError, "protocol must be a Symbol: #{protocol.class}" unless protocol.is_a?(Symbol)
+      @protocol = PROTOCOLS.index(protocol) or raise ArgumentError, "unknown protocol: #{protocol}"
+      options ||= {}
+
+      @leds     = leds
+      @show     = options.key?(:show) ? parse_show(options[:show]) : (@protocol == 3 ? :sync : :frame)
+      @bpp      = options[:channels].nil? ? (leds.strip_type.to_s.end_with?("w") ? 4 : 3) : Integer(options[:channels])
+      @universe = options[:universe].nil? ? (@protocol == 0 ? 1 : 0) : Integer(options[:universe])
+      port      = options[:port].nil? ? PORTS[@protocol] : Integer(options[:port])
+      @stream   = parse_transport(options[:transport])
+
+      if @stream && @protocol != 3
+        raise ArgumentError, "only the pixel_pi protocol can be received over TCP"
+      end
+
+      if port < 0 || port > 65535
+        raise ArgumentError, "port is outside the range 0..65535: #{port}"
+      end
+      raise ArgumentError, "channels per LED must be 3 or 4: #{@bpp}" unless @bpp == 3 || @bpp == 4
+
+      @universe_size = options[:universe_size].nil? ? 512 / @bpp : Integer(options[:universe_size])
+      if @universe_size < 1 || @universe_size > 512 / @bpp
+        raise ArgumentError, "universe size must be between 1 and #{512 / @bpp} LEDs: #{@universe_size}"
+      end
+      @universes = options[:universes].nil? ? [(leds.length + @universe_size - 1) / @universe_size, 1].max : Integer(options[:universes])
+
+      if @protocol == 2
+        @universes = 1
+      elsif @protocol == 3
+        @universe_size = CHUNK
+        @universes = [(leds.length + CHUNK - 1) / CHUNK, 1].max
+      else
+        min, max = @protocol == 0 ? [1, 63999] : [0, 32767]
+        if @universe < min || @universe > max
+          raise ArgumentError, "universe is outside the range #{min}..#{max}: #{@universe}"
+        end
+        if @universes < 1 || @universes > max - @universe + 1
+          raise ArgumentError, "universes must be between 1 and #{max - @universe + 1}: #{@universes}"
+        end
+      end
+
+      host = options[:bind]
+      if host && (host !~ /\A\d+\.\d+\.\d+\.\d+\z/ || host.split(".").any? { |n| n.to_i > 255 })
+        raise ArgumentError, "invalid bind address: #{host}"
+      end
+
+      @sequence = [nil] * @universes
+      @chunks = [0] * @universes
+      @buffer = String.new
+      @sync_address = 0
+      @dirty = false
+      @frame_start = nil
+      @window_start = nil
+      @window_packets = 0
+      @stats = {
+        :packets => 0, :bytes => 0, :invalid => 0, :ignored => 0, :lost => 0, :late => 0,
+        :overflows => 0, :syncs => 0, :shows => 0, :packets_per_second => 0.0,
+        :latency => 0.0, :max_latency => 0.0
+      }
+
+      @socket = @stream ? Socket.new(:INET, :STREAM) : UDPSocket.new
+      @socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_REUSEADDR, true)
+      begin
+        @socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_RCVBUF, RCVBUF)
+      rescue SystemCallError
+      end
+      if @stream
+        @socket.bind(Addrinfo.tcp(host || "0.0.0.0", port))
+        @socket.listen(4)
+      else
+        @socket.bind(host || "0.0.0.0", port)
+      end
+
+      if options[:multicast] && @protocol == 0
+        @universes.times do |ii|
+          u = @universe + ii
+          mreq = [239, 255, u >> 8, u & 0xFF, 0, 0, 0, 0].pack("C*")
+          @socket.setsockopt(Socket::IPPROTO_IP, Socket::IP_ADD_MEMBERSHIP, mreq)
+        end
+      end
+    rescue
+      @socket.close if @socket
+      @socket = nil
+      raise
+    end
+
+    # Wait up to `timeout` seconds for packets to arrive and write all the
+    # packets waiting on the socket into the LED buffer. With a `nil` timeout
+    # this waits until a packet arrives; a timeout of 0 never waits.
+    #
+    # Returns the number of packets read.
+    def poll( timeout = nil )
+      closed!
+      unless timeout.nil?
+        timeout = Float(timeout)
+        raise ArgumentError, "timeout cannot be negative: %g" % timeout if timeout < 0.0
+      end
+
+      total = 0
+      ready = IO.select([@socket, @conn].compact, nil, nil, timeout)
+      if ready && @stream
+        accept
+        MAX_BATCHES.times do
+          break if @conn.nil?
+          n, more = stream
+          total += n
+          break unless more
+        end
+      elsif ready
+        (BATCH * MAX_BATCHES).times do
+          begin
+            packet = @socket.recvfrom_nonblock(PACKET + 1).first
+          rescue IO::WaitReadable
+            break
+          end
+          total += 1
+          receive(packet.byteslice(0, PACKET), Process.clock_gettime(Process::CLOCK_REALTIME, :nanosecond),
+                  packet.bytesize > PACKET)
+        end
+      end
+
+      show if @dirty && @show == :frame
+      rate
+      total
+    end
+
+    # Returns the counters of the receiver as a Hash; see
+    # `ext/pixel_pi/receiver.c` for their meaning. The fake receiver cannot
+    # see kernel drops, so `:overflows` is always zero.
+    def stats
+      closed!
+      @stats.dup
+    end
+
+    # Returns the UDP or TCP port the receiver is bound to.
+    def port
+      closed!
+      @socket.local_address.ip_port
+    end
+
+    # Returns the protocol of the receiver, `:sacn`, `:artnet`, `:ddp`, or
+    # `:pixel_pi`.
+    def protocol
+      closed!
+      PROTOCOLS[@protocol]
+    end
+
+    # Close the socket of the receiver. It can no longer be polled.
+    def close
+      @socket.close if @socket
+      @socket = nil
+      disconnect
+      @leds = nil
+    end
+
+    # Returns `true` if the receiver has been closed.
+    def closed?
+      @socket.nil?
+    end
+
+  private
+
+    def closed!
+      raise(::PixelPi::Error, "Receiver is closed") if @socket.nil?
+    end
+
+    def parse_show( value )
+      return nil unless value
+      return value if SHOW_MODES.include?(value)
+      raise TypeError, "show must be a Symbol: #{value.class}" unless value.is_a?(Symbol)
+      raise ArgumentError, "unknown show mode: #{value}"
+    end
+
+    def parse_transport( value )
+      return false if value.nil? || value == :udp
+      return true if value == :tcp
+      raise TypeError, "transport must be a Symbol: #{value.class}" unless value.is_a?(Symbol)
+      raise ArgumentError, "unknown transport: #{value}"
+    end
+
+    def disconnect
+      @conn.close if @conn
+      @conn = nil
+      @buffer = String.new
+    end
+
+    # Take a new TCP sender, replacing the current one.
+    def accept
+      loop do
+        begin
+          conn, _ = @socket.accept_nonblock
+        rescue IO::WaitReadable, Errno::EINTR
+          return
+        end
+        disconnect
+        conn.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, true)
+        @conn = conn
+        @chunks.fill(0)
+      end
+    end
+
+    # Read what the TCP sender has written and apply every whole packet.
+    # Returns the number of packets and whether the read filled the buffer.
+    def stream
+      begin
+        data = @conn.read_nonblock(STREAM - @buffer.bytesize)
+      rescue IO::WaitReadable
+        return [0, false]
+      rescue EOFError, SystemCallError
+        disconnect
+        return [0, false]
+      end
+      more = @buffer.bytesize + data.bytesize == STREAM
+      @buffer << data
+
+      arrival = Process.clock_gettime(Process::CLOCK_REALTIME, :nanosecond)
+      pos = packets = 0
+      while @buffer.bytesize - pos >= HEADER
+        len = HEADER + @buffer.byteslice(pos + 18, 2).unpack1("n")
+        if @buffer.byteslice(pos, 2) != "PX" || len > STREAM
+          @stats[:invalid] += 1
+          disconnect
+          return [packets, false]
+        end
+        break if @buffer.bytesize - pos < len
+
+        receive(@buffer.byteslice(pos, len), arrival)
+        packets += 1
+        pos += len
+      end
+      @buffer = @buffer.byteslice(pos..-1)
+      [packets, more]
+    end
+
+    def receive( packet, arrival, truncated = false )
+      @stats[:packets] += 1
+      @stats[:bytes] += packet.bytesize
+      @window_packets += 1
+      if truncated
+        @stats[:invalid] += 1
+        return
+      end
+
+      p = packet.unpack("C*")
+      result = case @protocol
+        when 0 then sacn(packet, p)
+        when 1 then artnet(packet, p)
+        when 2 then ddp(p)
+        else        pixel_pi(packet, p)
+      end
+
+      if result & 1 != 0
+        @dirty = true
+        @frame_start ||= arrival
+      end
+      show if result & 2 != 0 && @show == :sync
+    end
+
+    def be16( p, ii ) (p[ii] << 8) | p[ii+1] end
+    def be32( p, ii ) (be16(p, ii) << 16) | be16(p, ii + 2) end
+
+    def invalid
+      @stats[:invalid] += 1
+      0
+    end
+
+    def ignored
+      @stats[:ignored] += 1
+      0
+    end
+
+    def sacn( packet, p )
+      len = p.length
+      return invalid if len < 44 || be16(p, 0) != 0x0010 || be16(p, 2) != 0 || packet.byteslice(4, 12) != ACN_ID
+      root = be32(p, 18)
+      framing = be32(p, 40)
+
+      if root == 8 && framing == 1
+        return invalid if len < 47
+        return ignored if @sync_address != 0 && be16(p, 45) != @sync_address
+        @stats[:syncs] += 1
+        return 2
+      end
+
+      return ignored if root == 8
+      if root != 4 || framing != 2 || len < 126 || p[117] != 0x02 || p[118] != 0xA1 || be16(p, 119) != 0 || be16(p, 121) != 1
+        return invalid
+      end
+
+      values = be16(p, 123)
+      return invalid if values < 1 || values > 513 || 125 + values > len
+      return ignored if p[112] & 0x60 != 0 || p[125] != 0
+
+      @sync_address = be16(p, 109)
+      universe(be16(p, 113), p[111], p[126, values - 1])
+    end
+
+    def artnet( packet, p )
+      len = p.length
+      return invalid if len < 10 || packet.byteslice(0, 8) != "Art-Net\0"
+      opcode = p[8] | (p[9] << 8)
+
+      if opcode == 0x5200
+        @stats[:syncs] += 1
+        return 2
+      end
+      return ignored if opcode != 0x5000
+      return invalid if len < 18 || (size = be16(p, 16)) > 512 || 18 + size > len
+
+      universe(((p[15] & 0x7F) << 8) | p[14], p[12] == 0 ? nil : p[12], p[18, size])
+    end
+
+    def ddp( p )
+      len = p.length
+      return invalid if len < 10 || p[0] & 0xC0 != 0x40
+      flags = p[0]
+      header = flags & 0x10 != 0 ? 14 : 10
+      size = be16(p, 8)
+      return invalid if header + size > len
+      return ignored if flags & 0x0E != 0 || p[3] != 1
+
+      seq = p[1] & 0x0F
+      if seq != 0
+        last = @sequence[0]
+        @sequence[0] = seq
+        if last
+          diff = (seq - last + 15) % 15
+          if diff == 0 || diff > 7
+            @sequence[0] = last
+            @stats[:late] += 1
+            return 0
+          end
+          @stats[:lost] += diff - 1
+        end
+      end
+
+      store(be32(p, 4), p[header, size])
+      result = size > 0 ? 1 : 0
+      if flags & 0x01 != 0
+        @stats[:syncs] += 1
+        result |= 2
+      end
+      result
+    end
+
+    def pixel_pi( packet, p )
+      len = p.length
+      return invalid if len < HEADER || packet.byteslice(0, 2) != "PX" || p[2] != 1
+      flags = p[3]
+      seq   = be32(p, 4)
+      base  = be32(p, 8)
+      first = be32(p, 12)
+      n     = be16(p, 16)
+      size  = be16(p, 18)
+      bpp   = flags & 0x04 != 0 ? 4 : 3
+      return invalid if HEADER + size > len || n > CHUNK || first % CHUNK != 0 || seq == 0
+
+      result = 0
+      if n > 0
+        index = first / CHUNK
+        last  = index < @universes ? @chunks[index] : 0
+        diff  = (seq - last) & 0xFFFFFFFF
+        diff -= 1 << 32 if diff >= 1 << 31
+        key   = flags & 0x01 != 0
+
+        if index >= @universes || first >= @leds.length
+          @stats[:ignored] += 1
+        elsif last != 0 && diff <= 0 && diff > -LATE
+          @stats[:late] += 1
+        elsif !key && last != base
+          @stats[:lost] += 1
+        else
+          avail  = [n, @leds.length - first].min
+          colors = Array.new(n) { |ii| key || ii >= avail ? 0 : @leds[first + ii] }
+          ref = bpp == 4 ? colors.pack("V*").unpack("C*") :
+                           colors.flat_map { |c| [(c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF] }
+          return invalid unless PixelPi::Animation.delta_decode(packet.byteslice(HEADER, size), ref)
+
+          avail.times do |ii|
+            @leds[first + ii] = bpp == 4 ? ref[ii * 4, 4].pack("C*").unpack1("V") :
+              (colors[ii] & 0xFF000000) | (ref[ii * 3] << 16) | (ref[ii * 3 + 1] << 8) | ref[ii * 3 + 2]
+          end
+          @chunks[index] = seq
+          result = 1
+        end
+      end
+
+      if flags & 0x02 != 0
+        @leds.brightness = p[20]
+        @stats[:syncs] += 1
+        result |= 2
+      end
+      result
+    end
+
+    def universe( universe, seq, data )
+      index = universe - @universe
+      return ignored if index < 0 || index >= @universes
+
+      if seq
+        last = @sequence[index]
+        @sequence[index] = seq
+        if last
+          diff = (seq - last) & 0xFF
+          diff -= 256 if diff > 127
+          if diff <= 0 && diff > -20
+            @sequence[index] = last
+            @stats[:late] += 1
+            return 0
+          end
+          @stats[:lost] += diff - 1 if diff > 1
+        end
+      end
+
+      size = @universe_size * @bpp
+      store(index * size, data.first(size))
+      1
+    end
+
+    # Copy the channel `bytes` to the LEDs, starting at channel `pos`.
+    def store( pos, bytes )
+      total = @leds.length * @bpp
+      return if pos >= total
+      bytes = bytes.first(total - pos)
+      bytes.each_with_index do |byte, ii|
+        n, k = (pos + ii).divmod(@bpp)
+        shift = SHIFT[k]
+        @leds[n] = (@leds[n] & ~(0xFF << shift) & 0xFFFFFFFF) | (byte << shift)
+      end
+    end
+
+    def show
+      @leds.show
+      @stats[:shows] += 1
+      if @frame_start
+        latency = (Process.clock_gettime(Process::CLOCK_REALTIME, :nanosecond) - @frame_start) / 1e9
+        @stats[:latency] = latency
+        @stats[:max_latency] = latency if latency > @stats[:max_latency]
+      end
+      @frame_start = nil
+      @dirty = false
+    end
+
+    def rate
+      now = Process.clock_gettime(Process::CLOCK_REALTIME, :nanosecond)
+      if @window_start.nil?
+        @window_start = now
+      elsif now - @window_start >= 1000000000 || now < @window_start
+        elapsed = now - @window_start
+        @stats[:packets_per_second] = elapsed > 0 ? @window_packets * 1e9 / elapsed : 0.0
+        @window_start = now
+        @window_packets = 0
+      end
+    end
+  end
+end
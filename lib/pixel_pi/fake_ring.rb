@@ -0,0 +1,254 @@
+module PixelPi
+
+  # A ring of frames in POSIX shared memory, written by one producer process
+  # and read by one consumer. The layout and the protocol are described in
+  # `ext/pixel_pi/ring.c`. The fake reads and writes the shared memory file in
+  # `/dev/shm` and polls for new frames instead of waiting on a futex.
+  #
+  # Examples:
+  #    ring = PixelPi::FrameRing.create( "effects", leds.length )
+  #    loop { leds.show_ring( ring ) }
+  #
+  class FrameRing
+
+    MAGIC       = "PXPIRING".b.freeze
+    VERSION     = 1
+    HEADER_SIZE = 64
+    SLOT_HEADER = 16
+    SLOTS       = 4
+    RETRIES     = 64
+    FORMATS     = %i[rgb rgbw].freeze
+    SHM_DIR     = "/dev/shm".freeze
+
+    # Create the shared memory frame ring `name` holding frames of
+    # `led_count` LEDs, replacing any ring of the same name.
+    #
+    # options - Hash of arguments
+    #   :slots  - number of frames in the ring; defaults to 4
+    #   :format - `:rgb` (default) or `:rgbw`
+    #
+    # Returns the new PixelPi::FrameRing or the result of the block.
+    def self.create( name, led_count, options = {}, &block )
+      name = shm_name(name)
+      count = Integer(led_count)
+      raise ArgumentError, "LED count cannot be negative: #{count}" if count < 0
+      options ||= {}
+      format = PixelPi::Animation.parse_format(options[:format])
+      slots = options[:slots].nil? ? SLOTS : Integer(options[:slots])
+      raise ArgumentError, "slots must be between 2 and 1024: #{slots}" if slots < 2 || slots > 1024
+
+      slot_size = (SLOT_HEADER + count * 4 + 63) & ~63
+      # a new object, so consumers of the old ring keep their own
+      begin
+        File.unlink(SHM_DIR + name)
+      rescue Errno::ENOENT
+      rescue SystemCallError => err
+        raise err.class, name
+      end
+      File.open(SHM_DIR + name, File::RDWR | File::CREAT | File::EXCL, 0666) do |fd|
+        fd.write("\0" * (HEADER_SIZE + slot_size * slots))
+        fd.flush
+        fd.pwrite([VERSION, format, count, slots, slot_size].pack("SSLLL"), 8)
+        fd.pwrite(MAGIC, 0)
+      end
+
+      ring = new(name)
+      ring.check!
+      with_ring(ring, &block)
+    end
+
+    # Attach to the existing shared memory frame ring `name`.
+    #
+    # Returns the PixelPi::FrameRing or the result of the block.
+    def self.open( name )
+      ring = new(shm_name(name))
+      ring.check!
+      ring.attach
+      block_given? ? with_ring(ring) { |r| yield r } : ring
+    end
+
+    # Remove the shared memory frame ring `name`.
+    def self.unlink( name )
+      name = shm_name(name)
+      File.unlink(SHM_DIR + name)
+      nil
+    rescue SystemCallError => err
+      raise err.class, name
+    end
+
+    def self.shm_name( name ) # :nodoc:
+      name = String.new(name.to_str)
+      name = "/" + name unless name.start_with?("/")
+      name.freeze
+    end
+
+    def self.with_ring( ring ) # :nodoc:
+      return ring unless block_given?
+      begin
+        yield ring
+      ensure
+        ring.close
+      end
+    end
+
+    def initialize( name ) # :nodoc:
+      @name = name
+      @fd = File.open(SHM_DIR + name, File::RDWR)
+      @last = 0
+    rescue SystemCallError => err
+      raise err.class, name
+    end
+    private_class_method :new
+
+    # Write a frame into the ring as its producer. The `frame` is an Array of
+    # colors or a packed String of 32-bit colors.
+    #
+    # Returns the sequence number of the frame.
+    def write( frame )
+      closed!
+      colors = PixelPi::Animation.to_list(frame)
+      if colors.length > led_count
+        raise ArgumentError, "frame has #{colors.length} LEDs but the ring holds #{led_count}"
+      end
+
+      n = (header(24) + 1) & 0xFFFFFFFF
+      n = 1 if n == 0
+      slot = slot_offset(n)
+      @fd.pwrite([(n * 2 - 1) & 0xFFFFFFFF].pack("L"), slot)
+      @fd.pwrite(colors.pack("L*").ljust(led_count * 4, "\0"), slot + SLOT_HEADER)
+      @fd.pwrite([(n * 2) & 0xFFFFFFFF].pack("L"), slot)
+      @fd.pwrite([n].pack("L"), 24)
+      n
+    end
+
+    # Take the newest frame from the ring as its consumer.
+    #
+    # Returns the colors of the frame as an Array, or `nil` if no frame has
+    # been published since the last one taken.
+    def read
+      closed!
+      _, data = take(led_count)
+      data && data.unpack("L*")
+    end
+
+    # Wait up to `timeout` seconds for a frame newer than the last one taken.
+    #
+    # Returns `true` if a new frame is ready.
+    def wait( timeout = nil )
+      closed!
+      unless timeout.nil?
+        timeout = Float(timeout)
+        raise ArgumentError, "timeout cannot be negative: %g" % timeout if timeout < 0.0
+      end
+      deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+      loop do
+        return true if header(24) != @last
+        return false if deadline && Process.clock_gettime(Process::CLOCK_MONOTONIC) >= deadline
+        sleep 0.001
+      end
+    end
+
+    # Returns the sequence number of the newest frame.
+    def sequence
+      closed!
+      header(24)
+    end
+
+    # Returns the sequence number of the last frame the consumer took.
+    def consumed
+      closed!
+      header(32)
+    end
+
+    # Returns the number of LEDs in each frame.
+    def led_count
+      closed!
+      @led_count
+    end
+
+    # Returns the number of frames the ring holds.
+    def slots
+      closed!
+      @slots
+    end
+
+    # Returns the pixel format of the frames, `:rgb` or `:rgbw`.
+    def format
+      closed!
+      FORMATS[@format]
+    end
+
+    # Returns the name of the shared memory object.
+    def name
+      closed!
+      @name
+    end
+
+    # Unmap the ring. The shared memory object itself is left in place.
+    def close
+      @fd.close if @fd
+      @fd = nil
+    end
+
+    # Returns `true` if the ring has been closed.
+    def closed?
+      @fd.nil?
+    end
+
+    # Copy the newest frame if it has not been taken yet, following the
+    # consumer protocol. Returns the sequence number and the packed colors of
+    # up to `count` LEDs, or `nil` if there is no new frame.
+    def take( count ) # :nodoc:
+      size = [count, led_count].min * 4
+      RETRIES.times do
+        n = header(24)
+        return nil if n == @last || n == 0
+        slot = slot_offset(n)
+        s1 = @fd.pread(4, slot).unpack1("L")
+        next if s1 != (n * 2) & 0xFFFFFFFF
+        data = @fd.pread(size, slot + SLOT_HEADER)
+        if @fd.pread(4, slot).unpack1("L") == s1
+          @last = n
+          @fd.pwrite([n].pack("L"), 32)
+          return [n, data]
+        end
+      end
+      nil
+    end
+
+    def check! # :nodoc:
+      size = @fd.size
+      if size < HEADER_SIZE || @fd.pread(8, 0) != MAGIC
+        close
+        raise ::PixelPi::Error, "not a PixelPi frame ring: #{@name}"
+      end
+      version, format = @fd.pread(4, 8).unpack("SS")
+      raise ::PixelPi::Error, "unsupported frame ring version: #{version}" if version != VERSION
+      raise ::PixelPi::Error, "unsupported pixel format: #{format}" if format >= FORMATS.length
+      count, slots, slot_size = @fd.pread(12, 12).unpack("LLL")
+      if slots < 2 || slot_size < SLOT_HEADER + count * 4 || slot_size % 4 != 0 || HEADER_SIZE + slots * slot_size > size
+        raise ::PixelPi::Error, "frame ring is truncated: #{@name}"
+      end
+      # the header is not read again; any process can write to it
+      @format, @led_count, @slots, @slot_size = format, count, slots, slot_size
+    end
+
+    def attach # :nodoc:
+      @last = header(32)
+    end
+
+  private
+
+    def closed!
+      raise(::PixelPi::Error, "FrameRing is closed") if @fd.nil?
+    end
+
+    def header( offset )
+      @fd.pread(4, offset).unpack1("L")
+    end
+
+    def slot_offset( n )
+      HEADER_SIZE + (n % @slots) * @slot_size
+    end
+  end
+end
@@ -0,0 +1,155 @@
+require "socket"
+
+module PixelPi
+  class Leds
+
+    # The network output of a PixelPi::Leds created with the `:output`
+    # option. Each frame is cut into chunks that are delta coded against the
+    # copy the receiver has; the packets are described in
+    # `ext/pixel_pi/sender.c`.
+    class Sender # :nodoc:
+
+      PORT    = 20560
+      VERSION = 1
+      CHUNK   = 256
+      KEY     = 0x01
+      SHOW    = 0x02
+      RGBW    = 0x04
+      REFRESH = 60
+      SNDBUF  = 1 << 20
+      TIMEOUT = 2
+
+      def initialize( url, count, strip_type, refresh )
+        @url = String.new(url.to_str)
+        @refresh = refresh.nil? ? REFRESH : Integer(refresh)
+        raise ArgumentError, "refresh must be at least 1 frame: #{@refresh}" if @refresh < 1
+
+        @type, @addr = address(@url)
+        @count    = count
+        @bpp      = strip_type.to_s.end_with?("w") ? 4 : 3
+        @chunks   = (count + CHUNK - 1) / CHUNK
+        @base     = [0] * @chunks
+        @prev     = [0] * (count * @bpp)
+        @sequence = 0
+        @closed   = false
+        connect
+      end
+
+      # Send the frame to the receiver, only the chunks that changed.
+      def render( leds, leds16, brightness, gamma, wb )
+        raise Errno::ENOTCONN, @url if @closed
+        connect if @socket.nil?
+
+        frame = @bpp == 4 ? leds.pack("V*").unpack("C*") :
+                            leds.flat_map { |c| [(c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF] }
+
+        @sequence = (@sequence + 1) & 0xFFFFFFFF
+        @sequence = 1 if @sequence == 0
+
+        packets = []
+        @chunks.times do |ii|
+          first  = ii * CHUNK
+          count  = [@count - first, CHUNK].min
+          offset = first * @bpp
+          bytes  = count * @bpp
+          key    = @resync || (@sequence + ii) % @refresh == 0
+          chunk  = frame[offset, bytes]
+
+          next if !key && chunk == @prev[offset, bytes]
+          ref  = key ? [0] * bytes : @prev[offset, bytes]
+          data = PixelPi::Animation.delta_encode(chunk, ref)
+          @prev[offset, bytes] = chunk
+
+          packets << header(key ? KEY : 0, key ? 0 : @base[ii], first, count, data.bytesize, brightness) + data
+          @base[ii] = @sequence
+        end
+
+        packets << header(0, 0, 0, 0, 0, brightness) if packets.empty?
+        packets.last.setbyte(3, packets.last.getbyte(3) | SHOW)
+        @resync = false
+
+        begin
+          if @type == :udp
+            packets.each { |packet| @socket.send(packet, 0, @addr) }
+          else
+            @socket.write(packets.join)
+          end
+        rescue Errno::EAGAIN
+          disconnect
+          raise Errno::ETIMEDOUT, @url
+        rescue SystemCallError => err
+          disconnect
+          raise err.class, @url
+        end
+        self
+      end
+
+      def close
+        @socket.close if @socket
+        @socket = nil
+        @closed = true
+      end
+
+    private
+
+      def address( url )
+        type = if url.start_with?("udp://") then :udp
+               elsif url.start_with?("tcp://") then :tcp
+               else raise ArgumentError, "output must be a udp:// or tcp:// address: #{url}"
+               end
+
+        host, port = url[6..-1], PORT
+        if (ii = host.rindex(":"))
+          port = host[ii + 1..-1]
+          host = host[0, ii]
+          unless port =~ /\A\d+\z/ && port.to_i >= 1 && port.to_i <= 65535
+            raise ArgumentError, "invalid output address: #{url}"
+          end
+          port = port.to_i
+        end
+        raise ArgumentError, "invalid output address: #{url}" if host.empty?
+
+        begin
+          addr = Addrinfo.getaddrinfo(host, port, :INET, type == :udp ? :DGRAM : :STREAM).first
+        rescue SocketError => err
+          raise ::PixelPi::Error, "could not resolve #{host}: #{err.message.sub(/\Agetaddrinfo(\(3\))?: /, '')}"
+        end
+        [type, addr]
+      end
+
+      def connect
+        socket = Socket.new(:INET, @type == :udp ? :DGRAM : :STREAM)
+        socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_SNDTIMEO, [TIMEOUT, 0].pack("l!l!"))
+        begin
+          socket.setsockopt(Socket::SOL_SOCKET, Socket::SO_SNDBUF, SNDBUF)
+        rescue SystemCallError
+        end
+
+        if @type == :tcp
+          socket.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, true)
+          begin
+            socket.connect(@addr)
+          rescue SystemCallError => err
+            socket.close
+            raise err.class, @url
+          end
+        end
+
+        @socket = socket
+        @resync = true
+      end
+
+      # a TCP sender reconnects on the next frame
+      def disconnect
+        return if @type == :udp
+        @socket.close
+        @socket = nil
+      end
+
+      def header( flags, base, first, count, size, brightness )
+        flags |= RGBW if @bpp == 4
+        ["PX", VERSION, flags, @sequence, base, first, count, size, brightness & 0xFF].pack("a2CCNNNnnCx3")
+      end
+    end
+  end
+end
@@ -0,0 +1,104 @@
+module PixelPi
+
+  # A slice is a view onto a contiguous run of LEDs returned by
+  # `PixelPi::Leds#slice`. Changes made through the slice are changes to the
+  # LEDs; indices given to the slice are relative to its own start and the
+  # buffer methods stay inside its range.
+  #
+  # Examples:
+  #    shelf = leds.slice( 8, 8 )
+  #    shelf.fill( 0x00FF00 )
+  #    shelf.rotate
+  #    leds.slice( 16..23 ).effect( :rainbow )
+  #
+  class Slice
+
+    # The methods shared with PixelPi::Leds. The fake runs each one against a
+    # copy of the selected colors and writes them back to the LEDs afterwards.
+    BUFFER_METHODS = %i[
+      clear [] []= set_pixel to_a replace reverse rotate fill set_pixels
+      set_range fill_pattern fill_hsv fill_hue_gradient set_hsv_pixels effect
+      scale fade_by add subtract blend lerp_toward blur
+    ].freeze
+
+    # Returns a new PixelPi::Slice of the `leds` for the `args` given to `slice`,
+    # selected from the `count` LEDs beginning at index `base`.
+    def self.select( leds, base, count, *args ) # :nodoc:
+      case args.length
+      when 1
+        range = args.first
+        unless range.is_a?(Range)
+          raise TypeError, "expecting a start and length or a Range: #{range.class}"
+        end
+        beg = range.begin.nil? ? 0 : Integer(range.begin)
+        fin = range.end.nil? ? count : Integer(range.end)
+        beg += count if beg < 0
+        fin += count if fin < 0
+        fin += 1 unless range.exclude_end? || range.end.nil?
+        if beg < 0 || beg > count
+          raise IndexError, "range is outside of LED range: 0...#{count-1}"
+        end
+        len = [[fin, count].min - beg, 0].max
+      when 2
+        beg = Integer(args[0])
+        len = Integer(args[1])
+        beg += count if beg < 0
+        if beg < 0 || beg > count
+          raise IndexError, "index #{args[0]} is outside of LED range: 0...#{count-1}"
+        end
+        raise ArgumentError, "length cannot be negative: #{len}" if len < 0
+        len = [len, count - beg].min
+      else
+        raise ArgumentError, "wrong number of arguments (given #{args.length}, expected 1..2)"
+      end
+
+      new(leds, base + beg, len)
+    end
+
+    def initialize( leds, offset, length ) # :nodoc:
+      @leds   = leds
+      @offset = offset
+      @length = length
+    end
+    private_class_method :new
+
+    # The PixelPi::Leds this slice is a view of.
+    attr_reader :leds
+
+    # Returns the index of the first LED of this slice in the PixelPi::Leds.
+    attr_reader :offset
+
+    # Returns the number of LEDs in this slice.
+    def length
+      @leds.send(:buffer)
+      @length
+    end
+
+    # Returns a view of `length` LEDs beginning at index `start` of this slice.
+    # See `PixelPi::Leds#slice` for the details.
+    def slice( *args )
+      Slice.select(@leds, @offset, length, *args)
+    end
+
+    BUFFER_METHODS.each do |name|
+      define_method(name) do |*args, &block|
+        segment { |view| view.__send__(name, *args, &block) }
+      end
+    end
+
+  private
+
+    # Run the block against a scratch PixelPi::Leds holding a copy of the
+    # selected colors and copy them back afterwards. Methods returning the
+    # scratch LEDs return this slice instead.
+    def segment
+      colors = @leds.send(:buffer)
+      view = Leds.allocate
+      view.instance_variable_set(:@leds, colors[@offset, @length])
+      result = yield view
+      result.equal?(view) ? self : result
+    ensure
+      colors[@offset, @length] = view.send(:buffer).first(@length) if view
+    end
+  end
+end